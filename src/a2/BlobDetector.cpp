@@ -1,6 +1,8 @@
 #include "BlobDetector.hpp"
-#include "Matrix.hpp"
-#include "CoordinateConverter.hpp"
+#include "common/workerpool.h"
+#include <pthread.h>
+#include <algorithm>
+#include <string.h>
 
 using namespace BlobDetector;
 
@@ -8,100 +10,422 @@ using namespace BlobDetector;
 // "PRIVATE" FUNCTIONS
 ///////////////////////////
 /**
- * @brief takes an image and turns it into a matrix of BlobCells
- * that can be processed later
+ * @brief a horizontal run of pixels of one type in one row
+ * @details runs are the nodes of the union-find in findBlobsFromLabels
  */
-Matrix<BlobCell> imageToMatrix(image_u32_t* im, const CalibrationInfo& calib);
+struct Run {
+	int row;
+	int start, end; // inclusive
+	OBJECT type;
+	int parent; // index of parent run, itself if it is a root
+};
+
+/**
+ * @brief per component sums, accumulated run by run
+ */
+struct BlobStats {
+	int64_t count, sumX, sumY;
+	int minX, maxX, minY, maxY;
+};
+
 /**
- * @brief return vector of all (x, y) coordinates related to a blob
- * @details will modify mat
- * 
- * @param mat Matrix containing info for blobs
- * @param (x,y) location to start expanding the blob. it will determine blob type
+ * @brief appends the runs of non NONE labels in one row
+ *
+ * @param row labels of the row
+ * @param y image row, recorded in the runs
+ * @param x0 image column of row[0]
  */
-std::vector<std::array<int, 2>> findAndMarkBlob(Matrix<BlobCell>& mat, int x, int y);
+void extractRuns(const uint8_t* row, int width, int y, int x0,
+	std::vector<Run>& runs);
 /**
- * @brief finds centroid of vector (x, y) points
+ * @brief finds the root of a run, halving the path on the way
  */
-std::array<int, 2> findCentroid(std::vector<std::array<int, 2>>& points);
+int findRoot(std::vector<Run>& runs, int i);
+/**
+ * @brief merges two components, the lower index stays the root
+ * @details so roots are visited in the same order a raster scan
+ * would first touch their components
+ */
+void unionRuns(std::vector<Run>& runs, int a, int b);
 
 
-std::vector<Blob> BlobDetector::findBlobs(image_u32_t* im, const CalibrationInfo& calib, size_t minPixels) {
-	// turn image into matrix of BlobCells
-	Matrix<BlobCell> mat = imageToMatrix(im, calib);
+/**
+ * @brief unions the runs of the current row with the touching runs
+ * of the previous row (8-connected, same type)
+ * @details previous row runs are [prevBegin, currBegin), current row
+ * runs are [currBegin, currEnd)
+ */
+void linkRows(std::vector<Run>& runs, size_t prevBegin, size_t currBegin,
+	size_t currEnd);
 
-	return findBlobsFromMatrix(mat, calib, minPixels);
-}
+/**
+ * @brief what the labels are classified from, either an rgba image
+ * or the raw bytes of a YUYV frame
+ */
+struct LabelSource {
+	const image_u32_t* im;
+	const uint8_t* yuyv;
+	int width, height;
 
-std::vector<Blob> BlobDetector::findBlobsFromMatrix(Matrix<BlobCell>& mat, const CalibrationInfo& calib, size_t minPixels) {
-	std::vector<Blob> ret;
-	for (int row = calib.maskYRange[0]; row < calib.maskYRange[1]; ++row) {
-		for (int col = calib.maskXRange[0]; col < calib.maskXRange[1]; ++col) {
-			BlobCell cell = mat(row, col);
-			if (cell.type != NONE && !cell.partOfBlob) {
-				std::vector<std::array<int, 2>> currBlob = findAndMarkBlob(mat, col, row);
-				if (currBlob.size() < minPixels) {
-					continue;
-				}
-				std::array<int, 2> center = findCentroid(currBlob);
-				ret.push_back({center[0], center[1], (int)currBlob.size(), cell.type});
-			}
+	LabelSource(const image_u32_t* im) :
+		im(im), yuyv(NULL), width(im->width), height(im->height) {}
+	LabelSource(const image_source_data_t* frame) :
+		im(NULL), yuyv((const uint8_t*) frame->data),
+		width(frame->ifmt.width), height(frame->ifmt.height) {}
+
+	/**
+	 * @brief classifies n pixels of row y starting at column x
+	 */
+	void labelRow(const ColorTable& table, int x, int y, uint8_t* labels,
+		int n) const {
+		if (im != NULL) {
+			table.labelRow(&im->buf[y * im->stride + x], labels, n);
+		} else {
+			table.labelRowYUYV(&yuyv[y * width * 2], x, labels, n);
 		}
 	}
+};
+
+/**
+ * @brief a horizontal band of the mask, labeled independently
+ */
+struct Strip {
+	const LabelImage* labels;
+	int row0, row1; // rows of labels, [row0, row1)
+
+	// labeling input, output is NULL if labels are already filled in
+	const LabelSource* source;
+	const ColorTable* table;
+	LabelImage* output;
+
+	// runs with parents local to this strip
+	std::vector<Run> runs;
+	size_t firstRowEnd;  // runs of row0 are [0, firstRowEnd)
+	size_t lastRowBegin; // runs of row1 - 1 are [lastRowBegin, runs.size())
+};
+
+/**
+ * @brief labels one strip and finds its runs, a workerpool task
+ */
+void processStrip(void* arg);
+
+/**
+ * @brief stitches strips together along their boundaries and turns
+ * the components into blobs
+ */
+std::vector<Blob> mergeStrips(std::vector<Strip>& strips, size_t count,
+	size_t minPixels);
+
+/**
+ * @brief splits the rows of labels into the first count strips
+ * @details pass source and table to have the strips label themselves
+ */
+void makeStrips(std::vector<Strip>& strips, size_t count,
+	const LabelImage& labels, const LabelSource* source,
+	const ColorTable* table, LabelImage* output);
+
+/**
+ * @brief fits labels to the mask of calib clipped to the source
+ */
+void resizeLabels(const LabelSource& source, const CalibrationInfo& calib,
+	LabelImage& labels);
+
+/**
+ * @brief labels and finds the blobs of source, on the worker pool if
+ * there is one
+ */
+std::vector<Blob> findBlobsInSource(const LabelSource& source,
+	const CalibrationInfo& calib, const ColorTable& table,
+	size_t minPixels, LabelImage& labels);
+
+// shared by every findBlobs call, guarded by poolMutex
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static workerpool_t* pool = NULL;
+static std::vector<Strip> poolStrips;
+
+
+void BlobDetector::setNumWorkers(int n) {
+	n = std::max(n, 1);
+	pthread_mutex_lock(&poolMutex);
+	workerpool_destroy(pool);
+	pool = NULL;
+	if (n > 1) {
+		pool = workerpool_create(n);
+	}
+	pthread_mutex_unlock(&poolMutex);
+}
+
+int BlobDetector::getNumWorkers() {
+	pthread_mutex_lock(&poolMutex);
+	int ret = pool == NULL ? 1 : workerpool_get_nthreads(pool);
+	pthread_mutex_unlock(&poolMutex);
+	return ret;
+}
+
+std::vector<Blob> BlobDetector::findBlobs(image_u32_t* im, const CalibrationInfo& calib,
+	const ColorTable& table, size_t minPixels) {
+	static thread_local LabelImage labels;
+	return findBlobs(im, calib, table, minPixels, labels);
+}
+
+std::vector<Blob> BlobDetector::findBlobs(image_u32_t* im, const CalibrationInfo& calib,
+	const ColorTable& table, size_t minPixels, LabelImage& labels) {
+	return findBlobsInSource(LabelSource(im), calib, table, minPixels, labels);
+}
+
+std::vector<Blob> BlobDetector::findBlobs(const image_source_data_t* frame,
+	const CalibrationInfo& calib, const ColorTable& table, size_t minPixels) {
+	static thread_local LabelImage labels;
+	return findBlobs(frame, calib, table, minPixels, labels);
+}
+
+std::vector<Blob> BlobDetector::findBlobs(const image_source_data_t* frame,
+	const CalibrationInfo& calib, const ColorTable& table, size_t minPixels,
+	LabelImage& labels) {
+	if (!canLabelFrame(frame)) {
+		return std::vector<Blob>();
+	}
+	return findBlobsInSource(LabelSource(frame), calib, table, minPixels, labels);
+}
+
+bool BlobDetector::canLabelFrame(const image_source_data_t* frame) {
+	return !strcmp(frame->ifmt.format, "YUYV") &&
+		frame->datalen >= frame->ifmt.width * frame->ifmt.height * 2;
+}
+
+std::vector<Blob> findBlobsInSource(const LabelSource& source,
+	const CalibrationInfo& calib, const ColorTable& table,
+	size_t minPixels, LabelImage& labels) {
+	resizeLabels(source, calib, labels);
+
+	pthread_mutex_lock(&poolMutex);
+	if (pool == NULL) {
+		pthread_mutex_unlock(&poolMutex);
+		static thread_local std::vector<Strip> strips(1);
+		makeStrips(strips, 1, labels, &source, &table, &labels);
+		processStrip(&strips[0]);
+		return mergeStrips(strips, 1, minPixels);
+	}
+
+	// a couple of strips per worker keeps them busy when the colored
+	// pixels are bunched up in one part of the mask
+	size_t count = std::min(2 * workerpool_get_nthreads(pool),
+		std::max(labels.height, 1));
+	makeStrips(poolStrips, count, labels, &source, &table, &labels);
+	for (size_t i = 0; i < count; ++i) {
+		workerpool_add_task(pool, processStrip, &poolStrips[i]);
+	}
+	workerpool_run(pool);
+	std::vector<Blob> ret = mergeStrips(poolStrips, count, minPixels);
+	pthread_mutex_unlock(&poolMutex);
 	return ret;
 }
 
-Matrix<BlobCell> imageToMatrix(image_u32_t* im, const CalibrationInfo& calib) {
-	Matrix<BlobCell> ret(im->height, im->width, BlobCell());
+void resizeLabels(const LabelSource& source, const CalibrationInfo& calib,
+	LabelImage& labels) {
+	int x0 = std::max(calib.maskXRange[0], 0);
+	int x1 = std::min(calib.maskXRange[1], source.width);
+	int y0 = std::max(calib.maskYRange[0], 0);
+	int y1 = std::min(calib.maskYRange[1], source.height);
+
+	labels.x0 = x0;
+	labels.y0 = y0;
+	labels.width = std::max(x1 - x0, 0);
+	labels.height = std::max(y1 - y0, 0);
+	// never shrinks, so a steady mask allocates nothing
+	size_t size = labels.width * labels.height;
+	if (labels.labels.size() < size) {
+		labels.labels.resize(size);
+	}
+}
+
+void BlobDetector::labelImage(image_u32_t* im, const CalibrationInfo& calib,
+	const ColorTable& table, LabelImage& labels) {
+	LabelSource source(im);
+	resizeLabels(source, calib, labels);
+	for (int row = 0; row < labels.height; ++row) {
+		source.labelRow(table, labels.x0, labels.y0 + row, labels.row(row),
+			labels.width);
+	}
+}
+
+void BlobDetector::labelImage(const image_source_data_t* frame,
+	const CalibrationInfo& calib, const ColorTable& table, LabelImage& labels) {
+	if (!canLabelFrame(frame)) {
+		labels.width = labels.height = 0;
+		return;
+	}
+	LabelSource source(frame);
+	resizeLabels(source, calib, labels);
+	for (int row = 0; row < labels.height; ++row) {
+		source.labelRow(table, labels.x0, labels.y0 + row, labels.row(row),
+			labels.width);
+	}
+}
 
-	for (int row = calib.maskYRange[0]; row < calib.maskYRange[1]; ++row) {
-		for (int col = calib.maskXRange[0]; col < calib.maskXRange[1]; ++col) {
-			uint32_t val = im->buf[row * im->stride + col];
-			std::array<uint8_t, 3> rgb = CoordinateConverter::imageValToRgb(val);
-			std::array<float, 3> hsv = CoordinateConverter::rgbToHsv(rgb);
-			OBJECT type = determineObjectHSV(hsv, calib);
-			ret(row, col) = {type, false};
+std::vector<Blob> BlobDetector::findBlobsFromLabels(const LabelImage& labels, size_t minPixels) {
+	std::vector<Strip> strips(1);
+	makeStrips(strips, 1, labels, NULL, NULL, NULL);
+	processStrip(&strips[0]);
+	return mergeStrips(strips, 1, minPixels);
+}
+
+void makeStrips(std::vector<Strip>& strips, size_t count,
+	const LabelImage& labels, const LabelSource* source,
+	const ColorTable* table, LabelImage* output) {
+	if (strips.size() < count) {
+		strips.resize(count);
+	}
+	for (size_t i = 0; i < count; ++i) {
+		Strip& strip = strips[i];
+		strip.labels = &labels;
+		strip.row0 = labels.height * i / count;
+		strip.row1 = labels.height * (i + 1) / count;
+		strip.source = source;
+		strip.table = table;
+		strip.output = output;
+	}
+}
+
+void processStrip(void* arg) {
+	Strip& strip = *(Strip*) arg;
+	const LabelImage& labels = *strip.labels;
+
+	if (strip.output != NULL) {
+		for (int row = strip.row0; row < strip.row1; ++row) {
+			strip.source->labelRow(*strip.table, labels.x0, labels.y0 + row,
+				strip.output->row(row), labels.width);
 		}
 	}
 
+	std::vector<Run>& runs = strip.runs;
+	runs.clear();
+	strip.firstRowEnd = 0;
+	strip.lastRowBegin = 0;
+	size_t prevBegin = 0;
+	for (int row = strip.row0; row < strip.row1; ++row) {
+		size_t currBegin = runs.size();
+		extractRuns(labels.row(row), labels.width, labels.y0 + row,
+			labels.x0, runs);
+		linkRows(runs, prevBegin, currBegin, runs.size());
+		if (row == strip.row0) {
+			strip.firstRowEnd = runs.size();
+		}
+		strip.lastRowBegin = currBegin;
+		prevBegin = currBegin;
+	}
+}
+
+std::vector<Blob> mergeStrips(std::vector<Strip>& strips, size_t count,
+	size_t minPixels) {
+	size_t total = 0;
+	for (size_t i = 0; i < count; ++i) {
+		total += strips[i].runs.size();
+	}
+
+	// concatenating the strips in order keeps runs in raster order,
+	// so the last row of one strip sits right before the first row
+	// of the next and linkRows can stitch them
+	static thread_local std::vector<Run> runs;
+	runs.clear();
+	runs.reserve(total);
+	size_t prevBegin = 0;
+	for (size_t i = 0; i < count; ++i) {
+		const Strip& strip = strips[i];
+		if (strip.row0 == strip.row1) {
+			continue;
+		}
+		size_t offset = runs.size();
+		for (const Run& run : strip.runs) {
+			runs.push_back(run);
+			runs.back().parent += offset;
+		}
+		if (offset != 0) {
+			linkRows(runs, prevBegin, offset, offset + strip.firstRowEnd);
+		}
+		prevBegin = offset + strip.lastRowBegin;
+	}
+
+	// accumulate each run into its root
+	static thread_local std::vector<BlobStats> stats;
+	stats.assign(runs.size(), BlobStats());
+	for (size_t i = 0; i < runs.size(); ++i) {
+		const Run& run = runs[i];
+		BlobStats& s = stats[findRoot(runs, i)];
+		int64_t len = run.end - run.start + 1;
+		if (s.count == 0) {
+			s.minX = run.start;
+			s.maxX = run.end;
+			s.minY = run.row;
+		}
+		s.count += len;
+		s.sumX += (int64_t)(run.start + run.end) * len / 2;
+		s.sumY += (int64_t)run.row * len;
+		s.minX = std::min(s.minX, run.start);
+		s.maxX = std::max(s.maxX, run.end);
+		s.maxY = run.row;
+	}
+
+	std::vector<Blob> ret;
+	for (size_t i = 0; i < runs.size(); ++i) {
+		const BlobStats& s = stats[i];
+		if (runs[i].parent != (int)i || s.count < (int64_t)minPixels) {
+			continue;
+		}
+		ret.push_back({(int)(s.sumX / s.count), (int)(s.sumY / s.count),
+			(int)s.count, runs[i].type,
+			s.minX, s.minY, s.maxX, s.maxY});
+	}
 	return ret;
 }
 
-std::vector<std::array<int, 2>> findAndMarkBlob(Matrix<BlobCell>& mat, int x, int y) {
-	std::vector<std::array<int, 2>> ret;
-	std::vector<std::array<int, 2>> toBeProcessed;
-	OBJECT blobType = mat(y, x).type;
-	mat(y, x).partOfBlob = true;
-	toBeProcessed.push_back({{x, y}});
-
-	while (!toBeProcessed.empty()) {
-		std::array<int, 2> curr = toBeProcessed.back();
-		toBeProcessed.pop_back();
-		ret.push_back(curr);
-
-		for (int row = -1; row <= 1; ++row) {
-			for (int col = -1; col <= 1; ++col) {
-				if (mat.validIndex(curr[1] + row, curr[0] + col)) {
-					BlobCell& currCell = mat(curr[1] + row, curr[0] + col);
-					if (currCell.type == blobType && currCell.partOfBlob == false) {
-						currCell.partOfBlob = true;
-						toBeProcessed.push_back({{curr[0] + col, curr[1] + row}});
-					}
-				}
+void linkRows(std::vector<Run>& runs, size_t prevBegin, size_t currBegin,
+	size_t currEnd) {
+	size_t p = prevBegin;
+	for (size_t c = currBegin; c < currEnd; ++c) {
+		// skip runs of the previous row that end left of this one
+		while (p < currBegin && runs[p].end + 1 < runs[c].start) {
+			++p;
+		}
+		for (size_t q = p; q < currBegin && runs[q].start <= runs[c].end + 1; ++q) {
+			if (runs[q].type == runs[c].type) {
+				unionRuns(runs, q, c);
 			}
 		}
 	}
-	return ret;
 }
 
-std::array<int, 2> findCentroid(std::vector<std::array<int, 2>>& points) {
-	std::array<int, 2> ret{{0, 0}};
-	for (const auto& point : points) {
-		ret[0] += point[0];
-		ret[1] += point[1];
+void extractRuns(const uint8_t* row, int width, int y, int x0,
+	std::vector<Run>& runs) {
+	int col = 0;
+	while (col < width) {
+		OBJECT type = (OBJECT) row[col];
+		if (type == NONE) {
+			++col;
+			continue;
+		}
+		int start = col;
+		while (col < width && row[col] == type) {
+			++col;
+		}
+		runs.push_back({y, x0 + start, x0 + col - 1, type, (int)runs.size()});
+	}
+}
+
+int findRoot(std::vector<Run>& runs, int i) {
+	while (runs[i].parent != i) {
+		runs[i].parent = runs[runs[i].parent].parent;
+		i = runs[i].parent;
 	}
-	ret[0] /= points.size();
-	ret[1] /= points.size();
+	return i;
+}
 
-	return ret;
+void unionRuns(std::vector<Run>& runs, int a, int b) {
+	a = findRoot(runs, a);
+	b = findRoot(runs, b);
+	if (a < b) {
+		runs[b].parent = a;
+	} else if (b < a) {
+		runs[a].parent = b;
+	}
 }
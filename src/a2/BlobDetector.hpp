@@ -5,8 +5,9 @@
 #include <iostream>
 #include <stdint.h>
 #include "imagesource/image_u32.h"
+#include "imagesource/image_source.h"
 #include "ColorRecognizer.hpp"
-#include "Matrix.hpp"
+#include "ColorTable.hpp"
 
 
 namespace BlobDetector {
@@ -15,28 +16,87 @@ struct Blob {
 	int x, y;
 	int size; // number of pixels
 	OBJECT type;
+	int minX, minY, maxX, maxY; // bounding box, inclusive
 };
 
-// for use in findBlobs
-struct BlobCell {
-	OBJECT type;
-	bool partOfBlob;
+// one OBJECT byte per pixel, covering only the calibrated mask
+// keep one around between frames, the buffer is only reallocated
+// when the mask grows
+struct LabelImage {
+	int x0, y0; // image coordinates of the first label
+	int width, height;
+	std::vector<uint8_t> labels;
+
+	LabelImage() : x0(0), y0(0), width(0), height(0) {}
+
+	uint8_t* row(int r) { return &labels[r * width]; }
+	const uint8_t* row(int r) const { return &labels[r * width]; }
 };
 
 
 /**
  * @brief finds blobs in an image
- * @details uses ColorRecognizer to find colors of objects
+ * @details uses a ColorTable to find colors of objects. labels
+ * go into a per thread LabelImage that is reused between calls
  * 
  * @param im image to process
- * @param calib calibration info to determine what pixels are what colors
+ * @param calib calibration info, only the mask ranges are used
+ * @param table lookup table built from calib's colors
  * @param minPixels, the minimum number of pixels required to be considered a blob
  * @return vector of blobs
  */
-std::vector<Blob> findBlobs(image_u32_t* im, const CalibrationInfo& calib, size_t minPixels);
+std::vector<Blob> findBlobs(image_u32_t* im, const CalibrationInfo& calib,
+	const ColorTable& table, size_t minPixels);
+
+/**
+ * @brief same as above but labels into the given buffer
+ */
+std::vector<Blob> findBlobs(image_u32_t* im, const CalibrationInfo& calib,
+	const ColorTable& table, size_t minPixels, LabelImage& labels);
+
+/**
+ * @brief finds blobs straight from a YUYV camera frame
+ * @details classifies with the table's yuv lookup, so the frame never
+ * has to be converted to rgb. frames in other formats return no blobs,
+ * convert those and use the image_u32_t version
+ */
+std::vector<Blob> findBlobs(const image_source_data_t* frame,
+	const CalibrationInfo& calib, const ColorTable& table, size_t minPixels);
+
+std::vector<Blob> findBlobs(const image_source_data_t* frame,
+	const CalibrationInfo& calib, const ColorTable& table, size_t minPixels,
+	LabelImage& labels);
+
+/**
+ * @brief true if findBlobs can take frame without converting it
+ */
+bool canLabelFrame(const image_source_data_t* frame);
+
+/**
+ * @brief classifies the pixels of im inside the calibrated mask into labels
+ * @details the mask is clipped to the image
+ */
+void labelImage(image_u32_t* im, const CalibrationInfo& calib,
+	const ColorTable& table, LabelImage& labels);
+
+/**
+ * @brief same as above for a YUYV frame
+ */
+void labelImage(const image_source_data_t* frame, const CalibrationInfo& calib,
+	const ColorTable& table, LabelImage& labels);
+
+/**
+ * @brief sets how many threads findBlobs splits the mask over
+ * @details the mask is cut into horizontal strips that are labeled
+ * on a worker pool, components crossing strip boundaries are merged
+ * afterwards. 1 (the default) runs everything on the calling thread
+ */
+void setNumWorkers(int n);
+
+int getNumWorkers();
 
 // for use in findBlobs
-std::vector<Blob> findBlobsFromMatrix(Matrix<BlobCell>& mat, const CalibrationInfo& calib, size_t minPixels);
+std::vector<Blob> findBlobsFromLabels(const LabelImage& labels, size_t minPixels);
 
 
 }
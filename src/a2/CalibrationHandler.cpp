@@ -22,6 +22,7 @@ CalibrationHandler::CalibrationHandler() : _state(IDLE),
 		exit(1);
 	}
 	readCalibrationDataFromFile();
+	updateColorTable();
 }
 
 CalibrationHandler* CalibrationHandler::instance() {
@@ -114,6 +115,7 @@ void CalibrationHandler::handleMouseEvent(double x, double y, image_u32_t* im) {
 			if (!putCalibrationToFile()) {
 				printf("Couldn't save calibration to file\n");
 			}
+			updateColorTable();
 
 			_state = IDLE;
 			break; }
@@ -164,6 +166,7 @@ void CalibrationHandler::handleMouseEvent(double x, double y, image_u32_t* im) {
 			std::vector<BlobDetector::Blob> blobs =
 				BlobDetector::findBlobs(im, 
 					_calibrationInfo,
+					*_colorTable,
 					blobMinPixels);
 
 			// only get blue blobs
@@ -235,6 +238,13 @@ CalibrationInfo CalibrationHandler::getCalibration() {
 	return ret;
 }
 
+std::shared_ptr<const ColorTable> CalibrationHandler::getColorTable() {
+	pthread_mutex_lock(&_calibMutex);
+	std::shared_ptr<const ColorTable> ret = _colorTable;
+	pthread_mutex_unlock(&_calibMutex);
+	return ret;
+}
+
 int CalibrationHandler::imageWidth() {
 	pthread_mutex_lock(&_calibMutex);
 	int ret = _imageWidth;
@@ -402,6 +412,11 @@ Point<int> CalibrationHandler::getBlobClosestToClick(Point<int> click,
 	return ret;
 }
 
+void CalibrationHandler::updateColorTable() {
+	// only called with _calibMutex held or from the constructor
+	_colorTable = std::make_shared<const ColorTable>(_calibrationInfo);
+}
+
 bool CalibrationHandler::readCalibrationDataFromFile(){
 	std::string line;
 	std::ifstream inputFile (colorCalibrationFileName.c_str());
@@ -6,9 +6,11 @@
 #include <string>
 #include <vector>
 #include <algorithm> 
+#include <memory>
 #include "imagesource/image_u32.h"
 #include "Matrix.hpp"
 #include "CalibrationInfo.hpp"
+#include "ColorTable.hpp"
 #include "BlobDetector.hpp"
 #include "math/point.hpp"
 
@@ -24,6 +26,8 @@ private:
 	// mask corners are bottom left and top right of screen
 	// however it is actually (low, high) and (high, low) of image coordinates
 	CalibrationInfo _calibrationInfo;
+	// rebuilt whenever the hsv bands in _calibrationInfo change
+	std::shared_ptr<const ColorTable> _colorTable;
 
 	int _imageHeight, _imageWidth; // in pixels
 
@@ -89,6 +93,13 @@ public:
 
 	CalibrationInfo getCalibration();
 
+	/**
+	 * @brief gets the lookup table for the current color calibration
+	 * @details the table is immutable, a new one is swapped in
+	 * when the colors are recalibrated
+	 */
+	std::shared_ptr<const ColorTable> getColorTable();
+
 	int imageWidth();
 
 	int imageHeight();
@@ -116,6 +127,8 @@ private:
 	static Point<int> getBlobClosestToClick(Point<int> click,
 		std::vector<BlobDetector::Blob> blobs);
 
+	void updateColorTable();
+
 	bool putCalibrationToFile();
 
 	bool readCalibrationDataFromFile();
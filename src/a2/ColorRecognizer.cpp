@@ -1,8 +1,16 @@
 #include "ColorRecognizer.hpp"
 #include "CoordinateConverter.hpp"
+#include "ColorTable.hpp"
 #include "Constants.hpp"
 #include "math/angle_functions.hpp"
 #include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 
 OBJECT determineObjectHSV(std::array<float, 3> hsv, const CalibrationInfo &c) {
@@ -22,40 +30,190 @@ OBJECT determineObjectHSV(std::array<float, 3> hsv, const CalibrationInfo &c) {
 	return NONE;
 }
 
-void maskWithColors(image_u32_t* im, const CalibrationInfo& c) {
+void labelRowHSVScalar(const uint32_t* src, uint8_t* labels, int n, const CalibrationInfo& c) {
+	for (int i = 0; i < n; ++i) {
+		std::array<uint8_t, 3> rgb = CoordinateConverter::imageValToRgb(src[i]);
+		labels[i] = determineObjectHSV(CoordinateConverter::rgbToHsv(rgb), c);
+	}
+}
+
+#if defined(__SSE2__)
+// the vector kernels do the same float operations in the same order as
+// rgbToHsv + determineObjectHSV so they give bit-identical labels,
+// including the NaN hue rgbToHsv produces for gray pixels
+
+static inline __m128 hueBandSSE2(__m128 h, const std::array<float, 2>& band) {
+	__m128 lo = _mm_set1_ps(band[0]);
+	__m128 hi = _mm_set1_ps(band[1]);
+	if (band[1] >= band[0]) {
+		return _mm_and_ps(_mm_cmpgt_ps(h, lo), _mm_cmplt_ps(h, hi));
+	}
+	__m128 out = _mm_and_ps(_mm_cmpgt_ps(h, hi), _mm_cmplt_ps(h, lo));
+	return _mm_andnot_ps(out, _mm_castsi128_ps(_mm_set1_epi32(-1)));
+}
+
+static int labelRowHSVSSE2(const uint32_t* src, uint8_t* labels, int n, const CalibrationInfo& c) {
+	const __m128i byteMask = _mm_set1_epi32(0xFF);
+	const __m128 k255 = _mm_set1_ps(255);
+	const __m128 zero = _mm_setzero_ps();
+
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i px = _mm_loadu_si128((const __m128i*)(src + i));
+		__m128 r = _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(px, byteMask)), k255);
+		__m128 g = _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 8), byteMask)), k255);
+		__m128 b = _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(px, 16), byteMask)), k255);
+
+		__m128 mx = _mm_max_ps(_mm_max_ps(r, g), b);
+		__m128 mn = _mm_min_ps(_mm_min_ps(r, g), b);
+		__m128 delta = _mm_sub_ps(mx, mn);
+		__m128 black = _mm_cmpeq_ps(mx, zero);
+
+		__m128 s = _mm_andnot_ps(black, _mm_div_ps(delta, mx));
+
+		__m128 hr = _mm_div_ps(_mm_sub_ps(g, b), delta);
+		__m128 hg = _mm_add_ps(_mm_set1_ps(2), _mm_div_ps(_mm_sub_ps(b, r), delta));
+		__m128 hb = _mm_add_ps(_mm_set1_ps(4), _mm_div_ps(_mm_sub_ps(r, g), delta));
+		__m128 isR = _mm_cmpeq_ps(r, mx);
+		__m128 isG = _mm_andnot_ps(isR, _mm_cmpeq_ps(g, mx));
+		__m128 isB = _mm_andnot_ps(_mm_or_ps(isR, isG), _mm_castsi128_ps(_mm_set1_epi32(-1)));
+		__m128 h = _mm_or_ps(_mm_or_ps(_mm_and_ps(isR, hr), _mm_and_ps(isG, hg)),
+			_mm_and_ps(isB, hb));
+		h = _mm_mul_ps(h, _mm_set1_ps(60));
+		h = _mm_add_ps(h, _mm_and_ps(_mm_cmplt_ps(h, zero), _mm_set1_ps(360)));
+		h = _mm_or_ps(_mm_andnot_ps(black, h), _mm_and_ps(black, _mm_set1_ps(-1)));
+
+		__m128 reject = _mm_or_ps(
+			_mm_or_ps(_mm_cmplt_ps(s, _mm_set1_ps(c.sat[0])), _mm_cmpgt_ps(s, _mm_set1_ps(c.sat[1]))),
+			_mm_or_ps(_mm_cmplt_ps(mx, _mm_set1_ps(c.val[0])), _mm_cmpgt_ps(mx, _mm_set1_ps(c.val[1]))));
+		__m128i remain = _mm_castps_si128(_mm_andnot_ps(reject, _mm_castsi128_ps(_mm_set1_epi32(-1))));
+
+		__m128i red = _mm_and_si128(remain, _mm_castps_si128(hueBandSSE2(h, c.redBallHue)));
+		remain = _mm_andnot_si128(red, remain);
+		__m128i green = _mm_and_si128(remain, _mm_castps_si128(hueBandSSE2(h, c.greenBallHue)));
+		remain = _mm_andnot_si128(green, remain);
+		__m128i blue = _mm_and_si128(remain, _mm_castps_si128(hueBandSSE2(h, c.blueSquareHue)));
+
+		__m128i label = _mm_or_si128(_mm_or_si128(
+			_mm_and_si128(red, _mm_set1_epi32(REDBALL)),
+			_mm_and_si128(green, _mm_set1_epi32(GREENBALL))),
+			_mm_and_si128(blue, _mm_set1_epi32(BLUESQUARE)));
+		label = _mm_packs_epi32(label, label);
+		label = _mm_packus_epi16(label, label);
+		int32_t packed = _mm_cvtsi128_si32(label);
+		memcpy(labels + i, &packed, sizeof(packed));
+	}
+	return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_AVX2_KERNEL
+
+__attribute__((target("avx2")))
+static inline __m256 hueBandAVX2(__m256 h, const std::array<float, 2>& band) {
+	__m256 lo = _mm256_set1_ps(band[0]);
+	__m256 hi = _mm256_set1_ps(band[1]);
+	if (band[1] >= band[0]) {
+		return _mm256_and_ps(_mm256_cmp_ps(h, lo, _CMP_GT_OQ), _mm256_cmp_ps(h, hi, _CMP_LT_OQ));
+	}
+	__m256 out = _mm256_and_ps(_mm256_cmp_ps(h, hi, _CMP_GT_OQ), _mm256_cmp_ps(h, lo, _CMP_LT_OQ));
+	return _mm256_andnot_ps(out, _mm256_castsi256_ps(_mm256_set1_epi32(-1)));
+}
+
+__attribute__((target("avx2")))
+static int labelRowHSVAVX2(const uint32_t* src, uint8_t* labels, int n, const CalibrationInfo& c) {
+	const __m256i byteMask = _mm256_set1_epi32(0xFF);
+	const __m256 k255 = _mm256_set1_ps(255);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 ones = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i px = _mm256_loadu_si256((const __m256i*)(src + i));
+		__m256 r = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(px, byteMask)), k255);
+		__m256 g = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(px, 8), byteMask)), k255);
+		__m256 b = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(px, 16), byteMask)), k255);
+
+		__m256 mx = _mm256_max_ps(_mm256_max_ps(r, g), b);
+		__m256 mn = _mm256_min_ps(_mm256_min_ps(r, g), b);
+		__m256 delta = _mm256_sub_ps(mx, mn);
+		__m256 black = _mm256_cmp_ps(mx, zero, _CMP_EQ_OQ);
+
+		__m256 s = _mm256_andnot_ps(black, _mm256_div_ps(delta, mx));
+
+		__m256 hr = _mm256_div_ps(_mm256_sub_ps(g, b), delta);
+		__m256 hg = _mm256_add_ps(_mm256_set1_ps(2), _mm256_div_ps(_mm256_sub_ps(b, r), delta));
+		__m256 hb = _mm256_add_ps(_mm256_set1_ps(4), _mm256_div_ps(_mm256_sub_ps(r, g), delta));
+		__m256 isR = _mm256_cmp_ps(r, mx, _CMP_EQ_OQ);
+		__m256 isG = _mm256_andnot_ps(isR, _mm256_cmp_ps(g, mx, _CMP_EQ_OQ));
+		__m256 h = _mm256_blendv_ps(_mm256_blendv_ps(hb, hg, isG), hr, isR);
+		h = _mm256_mul_ps(h, _mm256_set1_ps(60));
+		h = _mm256_add_ps(h, _mm256_and_ps(_mm256_cmp_ps(h, zero, _CMP_LT_OQ), _mm256_set1_ps(360)));
+		h = _mm256_blendv_ps(h, _mm256_set1_ps(-1), black);
+
+		__m256 reject = _mm256_or_ps(
+			_mm256_or_ps(_mm256_cmp_ps(s, _mm256_set1_ps(c.sat[0]), _CMP_LT_OQ),
+				_mm256_cmp_ps(s, _mm256_set1_ps(c.sat[1]), _CMP_GT_OQ)),
+			_mm256_or_ps(_mm256_cmp_ps(mx, _mm256_set1_ps(c.val[0]), _CMP_LT_OQ),
+				_mm256_cmp_ps(mx, _mm256_set1_ps(c.val[1]), _CMP_GT_OQ)));
+		__m256i remain = _mm256_castps_si256(_mm256_andnot_ps(reject, ones));
+
+		__m256i red = _mm256_and_si256(remain, _mm256_castps_si256(hueBandAVX2(h, c.redBallHue)));
+		remain = _mm256_andnot_si256(red, remain);
+		__m256i green = _mm256_and_si256(remain, _mm256_castps_si256(hueBandAVX2(h, c.greenBallHue)));
+		remain = _mm256_andnot_si256(green, remain);
+		__m256i blue = _mm256_and_si256(remain, _mm256_castps_si256(hueBandAVX2(h, c.blueSquareHue)));
+
+		__m256i label = _mm256_or_si256(_mm256_or_si256(
+			_mm256_and_si256(red, _mm256_set1_epi32(REDBALL)),
+			_mm256_and_si256(green, _mm256_set1_epi32(GREENBALL))),
+			_mm256_and_si256(blue, _mm256_set1_epi32(BLUESQUARE)));
+		__m128i packed = _mm_packs_epi32(_mm256_castsi256_si128(label),
+			_mm256_extracti128_si256(label, 1));
+		packed = _mm_packus_epi16(packed, packed);
+		_mm_storel_epi64((__m128i*)(labels + i), packed);
+	}
+	return i;
+}
+#endif /* x86 */
+#endif /* __SSE2__ */
+
+void labelRowHSV(const uint32_t* src, uint8_t* labels, int n, const CalibrationInfo& c) {
+	int done = 0;
+#if defined(HAVE_AVX2_KERNEL)
+	static const bool haveAVX2 = __builtin_cpu_supports("avx2");
+	if (haveAVX2) {
+		done = labelRowHSVAVX2(src, labels, n, c);
+	} else {
+		done = labelRowHSVSSE2(src, labels, n, c);
+	}
+#elif defined(__SSE2__)
+	done = labelRowHSVSSE2(src, labels, n, c);
+#endif
+	labelRowHSVScalar(src + done, labels + done, n - done, c);
+}
+
+void maskWithColors(image_u32_t* im, const CalibrationInfo& c, const ColorTable& table) {
+	// indexed by OBJECT
+	static const uint32_t colors[] = { 0x00, 0xFF0000FF, 0xFF00FF00, 0xFFFF0000 };
+
+	// the mask is inclusive on both ends
+	int x0 = std::max(c.maskXRange[0], 0);
+	int x1 = std::min(c.maskXRange[1], im->width - 1);
+	std::vector<uint8_t> labels(std::max(x1 - x0 + 1, 0));
+
 	for (int row = 0; row < im->height; row++) {
-		for (int col = 0; col < im->width; col++) {
-			if (row < c.maskYRange[0] || row > c.maskYRange[1] ||
-				col < c.maskXRange[0] || col > c.maskXRange[1]) {
-				im->buf[row * im->stride + col] = 0x00;
-				continue;
-			}
-
-			uint32_t val = im->buf[row * im->stride + col];
-			std::array<uint8_t, 3> rgbVals;
-			rgbVals[0] = val & 0xFF;
-			rgbVals[1] = (val >> 8) & 0xFF;
-			rgbVals[2] = (val >> 16) & 0xFF;
-
-			OBJECT outcome = determineObjectHSV(CoordinateConverter::rgbToHsv(rgbVals), c);
-
-			// printf("outcome: %d\n", outcome);
-
-			switch (outcome) {
-				case REDBALL:
-					im->buf[row * im->stride + col] = 0xFF0000FF;
-					break;
-				case GREENBALL:
-					im->buf[row * im->stride + col] = 0xFF00FF00;
-					break;
-				case BLUESQUARE:
-					im->buf[row * im->stride + col] = 0xFFFF0000;
-					break;
-				default:
-					im->buf[row * im->stride + col] = 0x00;
-					break;
-			}
+		uint32_t* buf = &im->buf[row * im->stride];
+		if (row < c.maskYRange[0] || row > c.maskYRange[1] || x1 < x0) {
+			memset(buf, 0, im->width * sizeof(uint32_t));
+			continue;
 		}
+
+		table.labelRow(buf + x0, labels.data(), labels.size());
+		memset(buf, 0, x0 * sizeof(uint32_t));
+		for (size_t col = 0; col < labels.size(); ++col) {
+			buf[x0 + col] = colors[labels[col]];
+		}
+		memset(buf + x1 + 1, 0, (im->width - x1 - 1) * sizeof(uint32_t));
 	}
 }
-
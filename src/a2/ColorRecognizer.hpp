@@ -16,6 +16,30 @@ OBJECT determineObjectRGB2(std::array<uint8_t, 3> rgb, const CalibrationInfo& c)
 
 OBJECT determineObjectHSV(std::array<float, 3> hsv, const CalibrationInfo &c);
 
-void maskWithColors(image_u32_t* im, const CalibrationInfo& c);
+/**
+ * @brief classifies a row of image_u32_t pixels into OBJECT labels
+ * @details gives exactly the same labels as rgbToHsv + determineObjectHSV
+ * but converts and thresholds 4 (SSE2) or 8 (AVX2, picked at runtime)
+ * pixels at a time
+ *
+ * @param src n pixels in ABGR order
+ * @param labels output, one OBJECT per pixel
+ */
+void labelRowHSV(const uint32_t* src, uint8_t* labels, int n, const CalibrationInfo& c);
+
+/**
+ * @brief one pixel at a time version of labelRowHSV, for reference
+ */
+void labelRowHSVScalar(const uint32_t* src, uint8_t* labels, int n, const CalibrationInfo& c);
+
+class ColorTable;
+
+/**
+ * @brief paints every pixel with the color of the object it belongs to
+ * @details pixels outside the mask and pixels that aren't an object are zeroed
+ *
+ * @param table lookup table built from c's colors
+ */
+void maskWithColors(image_u32_t* im, const CalibrationInfo& c, const ColorTable& table);
 
 #endif /* COLOR_RECOGNIZER_HPP */
@@ -0,0 +1,45 @@
+#include "ColorTable.hpp"
+
+#include <algorithm>
+
+// the fixed point YUYV conversion from imagesource/image_convert.c
+static uint32_t yuvToImageVal(int y, int u, int v) {
+	int cb = ((u - 128) * 454) >> 8;
+	int cr = ((v - 128) * 359) >> 8;
+	int cg = ((v - 128) * 183 + (u - 128) * 88) >> 8;
+	uint32_t r = std::min(std::max(y + cr, 0), 255);
+	uint32_t g = std::min(std::max(y - cg, 0), 255);
+	uint32_t b = std::min(std::max(y + cb, 0), 255);
+	return 0xFF000000 | (b << 16) | (g << 8) | r;
+}
+
+ColorTable::ColorTable(const CalibrationInfo& calib) :
+	_table(SIZE), _yuvTable(SIZE) {
+	const uint32_t half = 1 << (7 - BITS);
+	uint32_t row[MASK + 1];
+	// r is the fastest changing part of the index, so each (g, b)
+	// pair is one contiguous row of the table
+	for (uint32_t b = 0; b <= MASK; ++b) {
+		for (uint32_t g = 0; g <= MASK; ++g) {
+			for (uint32_t r = 0; r <= MASK; ++r) {
+				row[r] = ((r << (8 - BITS)) + half) |
+					(((g << (8 - BITS)) + half) << 8) |
+					(((b << (8 - BITS)) + half) << 16);
+			}
+			labelRowHSV(row, &_table[(g << BITS) | (b << (2 * BITS))],
+				MASK + 1, calib);
+		}
+	}
+
+	// same layout with y, u, v in place of r, g, b
+	for (uint32_t v = 0; v <= MASK; ++v) {
+		for (uint32_t u = 0; u <= MASK; ++u) {
+			for (uint32_t y = 0; y <= MASK; ++y) {
+				row[y] = yuvToImageVal((y << (8 - BITS)) + half,
+					(u << (8 - BITS)) + half, (v << (8 - BITS)) + half);
+			}
+			labelRowHSV(row, &_yuvTable[(u << BITS) | (v << (2 * BITS))],
+				MASK + 1, calib);
+		}
+	}
+}
@@ -0,0 +1,102 @@
+#ifndef COLOR_TABLE_HPP
+#define COLOR_TABLE_HPP
+
+#include <stdint.h>
+#include <vector>
+#include "ColorRecognizer.hpp"
+
+// quantized rgb -> OBJECT lookup table baked from a CalibrationInfo
+// so classifying a pixel is a shift and a load instead of an
+// hsv conversion and three angle tests. a second table does the same
+// for yuv so YUYV camera frames can be classified without converting
+// them to rgb first
+
+class ColorTable {
+public:
+	// bits kept per color channel
+	static const int BITS = 6;
+	static const int SIZE = 1 << (3 * BITS);
+	static const uint32_t MASK = (1 << BITS) - 1;
+
+	/**
+	 * @brief builds the tables from the hsv bands in calib
+	 * @details each entry is classified at the center of its
+	 * quantization bin with labelRowHSV. yuv bins are converted to
+	 * rgb the same way image_convert does for YUYV frames
+	 */
+	ColorTable(const CalibrationInfo& calib);
+
+	/**
+	 * @brief classifies a pixel straight out of an image_u32_t
+	 *
+	 * @param val pixel in ABGR order (red in the low byte)
+	 */
+	OBJECT lookup(uint32_t val) const {
+		return (OBJECT) _table[index(val)];
+	}
+
+	/**
+	 * @brief classifies n pixels of an image row into labels
+	 */
+	void labelRow(const uint32_t* src, uint8_t* labels, int n) const {
+		const uint8_t* table = _table.data();
+		for (int i = 0; i < n; ++i) {
+			labels[i] = table[index(src[i])];
+		}
+	}
+
+	/**
+	 * @brief classifies a pixel given in yuv
+	 */
+	OBJECT lookupYUV(uint8_t y, uint8_t u, uint8_t v) const {
+		return (OBJECT) _yuvTable[indexYUV(y, u, v)];
+	}
+
+	/**
+	 * @brief classifies n pixels of a YUYV row into labels
+	 *
+	 * @param yuyv start of the row, two bytes per pixel
+	 * @param x first pixel to classify, may be odd
+	 */
+	void labelRowYUYV(const uint8_t* yuyv, int x, uint8_t* labels, int n) const {
+		const uint8_t* table = _yuvTable.data();
+		int end = x + n;
+		if (x & 1) {
+			const uint8_t* pair = yuyv + 2 * (x - 1);
+			*labels++ = table[indexYUV(pair[2], pair[1], pair[3])];
+			++x;
+		}
+		// u and v are shared by each pair of pixels
+		for (; x + 2 <= end; x += 2) {
+			const uint8_t* pair = yuyv + 2 * x;
+			uint32_t uv = indexYUV(0, pair[1], pair[3]);
+			labels[0] = table[uv | (pair[0] >> (8 - BITS))];
+			labels[1] = table[uv | (pair[2] >> (8 - BITS))];
+			labels += 2;
+		}
+		if (x < end) {
+			const uint8_t* pair = yuyv + 2 * x;
+			*labels = table[indexYUV(pair[0], pair[1], pair[3])];
+		}
+	}
+
+	/**
+	 * @brief packs the top BITS of r, g, b into a table index
+	 */
+	static uint32_t index(uint32_t val) {
+		return ((val >> (8 - BITS)) & MASK) |
+			((val >> (16 - 2 * BITS)) & (MASK << BITS)) |
+			((val >> (24 - 3 * BITS)) & (MASK << (2 * BITS)));
+	}
+
+	static uint32_t indexYUV(uint8_t y, uint8_t u, uint8_t v) {
+		return (y >> (8 - BITS)) | ((u >> (8 - BITS)) << BITS) |
+			((v >> (8 - BITS)) << (2 * BITS));
+	}
+
+private:
+	std::vector<uint8_t> _table;
+	std::vector<uint8_t> _yuvTable;
+};
+
+#endif /* COLOR_TABLE_HPP */
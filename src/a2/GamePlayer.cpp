@@ -88,17 +88,19 @@ void* GamePlayer::gameThread(void* args) {
 		printf("Turn: %d\n", state->our_turn);
 		state->go = false;
     
-		RenderInfo renderInfo = GlobalState::instance()->getData();
+		std::shared_ptr<const RenderInfo> renderInfo =
+			GlobalState::instance()->getData();
 
 
-        if (renderInfo.im == nullptr) {
+        if (!renderInfo || renderInfo->im == nullptr) {
             pthread_mutex_unlock(&state->_GamePlayerMutex);
 			continue;
         }
 		// take in board state and blobs or w/e
 		std::vector<BlobDetector::Blob> blobs = 
-			BlobDetector::findBlobs(renderInfo.im,
+			BlobDetector::findBlobs(renderInfo->im,
 			CalibrationHandler::instance()->getCalibration(),
+			*CalibrationHandler::instance()->getColorTable(),
 			blobMinPixels);
 
 		// separate out blobs
@@ -2,38 +2,31 @@
 #define GLOBAL_STATE_HPP
 
 
-#include <vector>
-#include <array>
+#include <memory>
 #include <pthread.h>
-#include "imagesource/image_u32.h"
-
-struct RenderInfo {
-	image_u32_t* im;
-	std::vector<std::array<float, 2>> redBlobs;
-	std::vector<std::array<float, 2>> greenBlobs;
-	std::vector<std::array<float, 2>> blueBlobs;
-	bool start;
-
-	RenderInfo();
-	~RenderInfo();
-	void copy(const RenderInfo& info);
-	void operator=(const RenderInfo& info);
-};
-
+#include "RenderInfo.hpp"
 
 class GlobalState {
 private:
 	pthread_mutex_t _dataMutex;
-	RenderInfo _data;
+	std::shared_ptr<const RenderInfo> _data;
+	bool _start;
 	GlobalState();
 	static GlobalState* _instance;
 
 public:
 	static GlobalState* instance();
 
-	void setData(const RenderInfo& data);
+	/**
+	 * @brief publishes a new snapshot, readers that still hold the
+	 * old one keep it until they let go
+	 */
+	void setData(std::shared_ptr<const RenderInfo> data);
 
-	RenderInfo getData();
+	/**
+	 * @brief the latest snapshot, may be null before the first setData
+	 */
+	std::shared_ptr<const RenderInfo> getData();
 
 	void setStart(bool startIn);
 
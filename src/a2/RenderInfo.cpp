@@ -0,0 +1,7 @@
+#include "RenderInfo.hpp"
+
+RenderInfo::RenderInfo() : im(nullptr) {}
+
+RenderInfo::~RenderInfo() {
+	image_u32_destroy(im);
+}
@@ -0,0 +1,26 @@
+#ifndef RENDER_INFO_HPP
+#define RENDER_INFO_HPP
+
+#include <vector>
+#include <array>
+#include "imagesource/image_u32.h"
+
+/**
+ * @brief one frame's image and detection results, as drawn on screen
+ * @details snapshots are handed around as std::shared_ptr<const RenderInfo>.
+ * once published they are never changed, so readers hold a reference
+ * instead of copying the image. the image is freed with the last reference
+ */
+struct RenderInfo {
+	image_u32_t* im; // owned
+	std::vector<std::array<float, 2>> redBlobs;
+	std::vector<std::array<float, 2>> greenBlobs;
+	std::vector<std::array<float, 2>> blueBlobs;
+
+	RenderInfo();
+	~RenderInfo();
+	RenderInfo(const RenderInfo&) = delete;
+	RenderInfo& operator=(const RenderInfo&) = delete;
+};
+
+#endif /* RENDER_INFO_HPP */
@@ -0,0 +1,130 @@
+#include "CameraHandler.hpp"
+#include "a2/BlobDetector.hpp"
+
+#include "common/timestamp.h"
+#include "imagesource/image_convert.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// static images are handed out at this rate
+static const int64_t staticFramePeriod = 33333;
+
+CameraFrame::CameraFrame() : im(nullptr), converted(false), utime(0) {
+	memset(&raw, 0, sizeof(raw));
+}
+
+CameraFrame::~CameraFrame() {
+	image_u32_destroy(im);
+}
+
+image_u32_t* CameraFrame::image() {
+	if (!converted) {
+		resizeImage(raw.ifmt.width, raw.ifmt.height);
+		image_convert_u32_into(&raw, im);
+		converted = true;
+	}
+	return im;
+}
+
+image_u32_t* CameraFrame::releaseImage() {
+	image_u32_t* ret = image();
+	im = nullptr;
+	converted = false;
+	return ret;
+}
+
+void CameraFrame::resizeImage(int width, int height) {
+	if (im == nullptr || im->width != width || im->height != height) {
+		image_u32_destroy(im);
+		im = image_u32_create(width, height);
+	}
+}
+
+CameraHandler::CameraHandler() {
+	zarray_t* urls = image_source_enumerate();
+
+	bool gotCamera = false;
+	for (int i = 0; i < zarray_size(urls); ++i) {
+		char* url;
+		zarray_get(urls, i, &url);
+		_isrc = image_source_open(url);
+		if (_isrc != NULL) {
+			printf("connected to camera %s\n", url);
+			gotCamera = true;
+			free(url);
+			break;
+		}
+	}
+	zarray_destroy(urls);
+	if (!gotCamera) {
+		printf("couldn't find a camera\n");
+		exit(1);
+	}
+
+	_staticIm = nullptr;
+	_lastStaticFrame = 0;
+	_isrc->start(_isrc);
+}
+
+CameraHandler::~CameraHandler() {
+	image_u32_destroy(_staticIm);
+	_isrc->close(_isrc);
+}
+
+bool CameraHandler::grabFrame(CameraFrame& frame) {
+	if (_staticIm != nullptr) {
+		int64_t wait = _lastStaticFrame + staticFramePeriod - utime_now();
+		if (wait > 0) {
+			usleep(wait);
+		}
+		_lastStaticFrame = utime_now();
+
+		frame.resizeImage(_staticIm->width, _staticIm->height);
+		for (int row = 0; row < frame.im->height; ++row) {
+			memcpy(&frame.im->buf[row * frame.im->stride],
+				&_staticIm->buf[row * _staticIm->stride],
+				frame.im->width * sizeof(uint32_t));
+		}
+		memset(&frame.raw, 0, sizeof(frame.raw));
+		frame.converted = true;
+		frame.utime = _lastStaticFrame;
+		return true;
+	}
+
+	image_source_data_t isData;
+	int res = _isrc->get_frame(_isrc, &isData);
+	bool ok = false;
+	if (!res) {
+		frame.utime = utime_now();
+		frame.raw.ifmt = isData.ifmt;
+		if (BlobDetector::canLabelFrame(&isData)) {
+			// copying the raw frame is half the bytes of converting
+			// it, and detection reads it directly
+			const uint8_t* bytes = (const uint8_t*) isData.data;
+			frame.data.assign(bytes, bytes + isData.datalen);
+			frame.raw.data = frame.data.data();
+			frame.raw.datalen = isData.datalen;
+			frame.converted = false;
+			ok = true;
+		} else {
+			frame.raw.data = NULL;
+			frame.raw.datalen = 0;
+			frame.resizeImage(isData.ifmt.width, isData.ifmt.height);
+			ok = !image_convert_u32_into(&isData, frame.im);
+			frame.converted = true;
+		}
+	}
+	_isrc->release_frame(_isrc, &isData);
+	return ok;
+}
+
+void CameraHandler::setStaticImage(const char* fileName) {
+	_staticIm = image_u32_create_from_pnm(fileName);
+	if (_staticIm == nullptr) {
+		printf("couldn't read %s\n", fileName);
+		exit(1);
+	}
+}
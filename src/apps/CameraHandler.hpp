@@ -0,0 +1,65 @@
+#ifndef CAMERA_HANDLER_HPP
+#define CAMERA_HANDLER_HPP
+
+#include <stdint.h>
+#include <vector>
+
+#include "imagesource/image_u32.h"
+#include "imagesource/image_source.h"
+
+/**
+ * @brief one frame from the camera
+ * @details YUYV frames keep their raw bytes so blob detection can
+ * classify them without converting, the rgba image is only made when
+ * image() is first called. frames are reused, so nothing is allocated
+ * once the sizes settle
+ */
+struct CameraFrame {
+	image_source_data_t raw; // raw.data points into data
+	std::vector<uint8_t> data;
+	image_u32_t* im;
+	bool converted;
+	int64_t utime; // when the frame was captured
+
+	CameraFrame();
+	~CameraFrame();
+	CameraFrame(const CameraFrame&) = delete;
+	CameraFrame& operator=(const CameraFrame&) = delete;
+
+	/**
+	 * @brief the frame as rgba, converted on the first call
+	 */
+	image_u32_t* image();
+
+	/**
+	 * @brief hands the rgba image over to the caller, who then owns it
+	 * @details the frame makes a new one the next time it's converted,
+	 * which the image pool recycles, so this saves a copy of the image
+	 */
+	image_u32_t* releaseImage();
+
+	void resizeImage(int width, int height);
+};
+
+class CameraHandler {
+private:
+	image_source_t* _isrc;
+	image_u32_t* _staticIm;
+	int64_t _lastStaticFrame;
+
+public:
+	CameraHandler();
+	~CameraHandler();
+
+	/**
+	 * @brief waits for the next camera frame and stores it in frame
+	 * @details with a static image this hands out a copy of it at
+	 * about 30 fps, since callers draw on their frames
+	 * @return false if the camera didn't give a usable frame
+	 */
+	bool grabFrame(CameraFrame& frame);
+
+	void setStaticImage(const char* fileName);
+};
+
+#endif /* CAMERA_HANDLER_HPP */
@@ -0,0 +1,138 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <deque>
+#include <algorithm>
+
+// pieces for running the camera -> display path as separate stages,
+// each on its own thread, connected by small queues
+
+/**
+ * @brief fixed size queue between two pipeline stages
+ * @details push never blocks: when the queue is full the oldest
+ * item is pushed out and handed back, so a stalled stage makes the
+ * pipeline skip frames instead of falling further and further behind.
+ * pop blocks until there is something to take
+ */
+template<typename T>
+class FrameQueue {
+private:
+	std::deque<T> _items;
+	size_t _capacity;
+	int64_t _dropped;
+	pthread_mutex_t _mutex;
+	pthread_cond_t _cond;
+
+public:
+	FrameQueue(size_t capacity) : _capacity(std::max(capacity, (size_t) 1)),
+		_dropped(0) {
+		pthread_mutex_init(&_mutex, NULL);
+		pthread_cond_init(&_cond, NULL);
+	}
+
+	~FrameQueue() {
+		pthread_cond_destroy(&_cond);
+		pthread_mutex_destroy(&_mutex);
+	}
+
+	/**
+	 * @brief adds item to the back of the queue
+	 * @return true if the oldest item was dropped to make room,
+	 * it is stored in dropped so the caller can recycle it
+	 */
+	bool push(const T& item, T& dropped) {
+		pthread_mutex_lock(&_mutex);
+		bool full = _items.size() >= _capacity;
+		if (full) {
+			dropped = _items.front();
+			_items.pop_front();
+			++_dropped;
+		}
+		_items.push_back(item);
+		pthread_cond_signal(&_cond);
+		pthread_mutex_unlock(&_mutex);
+		return full;
+	}
+
+	T pop() {
+		pthread_mutex_lock(&_mutex);
+		while (_items.empty()) {
+			pthread_cond_wait(&_cond, &_mutex);
+		}
+		T ret = _items.front();
+		_items.pop_front();
+		pthread_mutex_unlock(&_mutex);
+		return ret;
+	}
+
+	int64_t getDropped() {
+		pthread_mutex_lock(&_mutex);
+		int64_t ret = _dropped;
+		pthread_mutex_unlock(&_mutex);
+		return ret;
+	}
+};
+
+/**
+ * @brief latency counters for one stage
+ * @details wait is the time an item sat in the stage's input queue,
+ * work is the time the stage spent on it. updated by the stage's
+ * thread, read by whoever prints them
+ */
+class StageStats {
+private:
+	const char* _name;
+	int64_t _count;
+	int64_t _waitTotal, _waitMax;
+	int64_t _workTotal, _workMax;
+	pthread_mutex_t _mutex;
+
+public:
+	StageStats(const char* name) : _name(name) {
+		pthread_mutex_init(&_mutex, NULL);
+		reset();
+	}
+
+	~StageStats() {
+		pthread_mutex_destroy(&_mutex);
+	}
+
+	void record(int64_t waitUs, int64_t workUs) {
+		pthread_mutex_lock(&_mutex);
+		++_count;
+		_waitTotal += waitUs;
+		_waitMax = std::max(_waitMax, waitUs);
+		_workTotal += workUs;
+		_workMax = std::max(_workMax, workUs);
+		pthread_mutex_unlock(&_mutex);
+	}
+
+	/**
+	 * @brief prints averages and maxima since the last print, in ms
+	 *
+	 * @param dropped frames dropped from the stage's input queue so far
+	 */
+	void print(int64_t dropped) {
+		pthread_mutex_lock(&_mutex);
+		int64_t n = std::max(_count, (int64_t) 1);
+		printf("%-8s %6lld frames %6lld dropped total   wait %7.2f avg %7.2f max"
+			"   work %7.2f avg %7.2f max\n", _name, (long long) _count,
+			(long long) dropped, _waitTotal / 1000.0 / n, _waitMax / 1000.0,
+			_workTotal / 1000.0 / n, _workMax / 1000.0);
+		reset();
+		pthread_mutex_unlock(&_mutex);
+	}
+
+private:
+	// _mutex must be held, unless the stats aren't shared yet
+	void reset() {
+		_count = 0;
+		_waitTotal = _waitMax = 0;
+		_workTotal = _workMax = 0;
+	}
+};
+
+#endif /* PIPELINE_HPP */
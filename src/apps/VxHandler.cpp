@@ -2,37 +2,22 @@
 #include "a2/CoordinateConverter.hpp"
 #include "a2/Arm.hpp"
 
+#include "common/timestamp.h"
+
 #include <string>
 #include <iostream>
+#include <errno.h>
 
 VxHandlerState globalState;
 VxButtonStates buttonStates;
 const std::string imageFileName = "data/image.ppm";
 
-RenderInfo::RenderInfo() : im(nullptr) {}
-
-RenderInfo::~RenderInfo() {
-	image_u32_destroy(im);
-}
-
-void RenderInfo::operator=(const RenderInfo& info) {
-	if (im == nullptr) {
-		im = image_u32_create(info.im->width, info.im->height);
-	}
-	if (info.im->stride * info.im->height != im->stride * im->height) {
-		image_u32_destroy(im);
-		im = image_u32_create(info.im->width, info.im->height);
-	}
-	int size = im->stride * im->height;
-	memcpy(im->buf, info.im->buf, size * sizeof(uint32_t));
-
-	redBlobs = info.redBlobs;
-	greenBlobs = info.greenBlobs;
-	blueBlobs = info.blueBlobs;
-}
+// with no new frames, the display is still rebuilt this often so
+// calibration messages show up
+static const int64_t idleRenderInterval = 250000;
 
 VxHandler::VxHandler(int width, int height) :
-	windowWidth(width), windowHeight(height) {
+	windowWidth(width), windowHeight(height), minRenderInterval(0) {
 	eecs467_init(0, NULL);
 	vxWorld = vx_world_create();
 	vxeh = (vx_event_handler_t*) calloc(1, sizeof(vx_event_handler_t));
@@ -50,6 +35,10 @@ VxHandler::VxHandler(int width, int height) :
 		printf("renderMutex not initialized\n");
 		exit(1);
 	}
+	if (pthread_cond_init(&globalState.renderCond, NULL)) {
+		printf("renderCond not initialized\n");
+		exit(1);
+	}
 
 	buttonStates.colorMask = false;
 	buttonStates.blobDetect = false;
@@ -77,10 +66,23 @@ VxHandler::~VxHandler() {
 	free(vxeh);
 }
 
-void VxHandler::changeRenderInfo(const RenderInfo& info) {
+void VxHandler::changeRenderInfo(std::shared_ptr<const RenderInfo> info) {
 	pthread_mutex_lock(&globalState.renderMutex);
-	globalState.data = info;
+	globalState.data.swap(info);
+	++globalState.frame;
+	requestRedraw();
 	pthread_mutex_unlock(&globalState.renderMutex);
+	// the old snapshot (now in info) is released outside the lock
+}
+
+void VxHandler::setMaxDisplayRate(double hz) {
+	minRenderInterval = hz > 0 ? (int64_t) (1e6 / hz) : 0;
+}
+
+// caller holds renderMutex
+void VxHandler::requestRedraw() {
+	globalState.redraw = true;
+	pthread_cond_signal(&globalState.renderCond);
 }
 
 void VxHandler::launchThreads() {
@@ -98,31 +100,83 @@ VxButtonStates VxHandler::getButtonStates() {
 void* VxHandler::renderThread(void* args) {
 	VxHandler* state = (VxHandler*) args;
 
+	// the camera image is sent as a streaming resource, so the display
+	// keeps one texture and only uploads into it when a new frame arrives
+	vx_resc_stream_t* imageStream = vx_resc_stream_create();
+	int64_t imageFrame = -1;
+
+	// the image and text objects are kept and added again until they
+	// change, so the world doesn't have to serialize them again
+	vx_object_t* imageObj = nullptr;
+	vx_object_t* textObj = nullptr;
+	std::string textMessage;
+	int64_t lastSwap = 0;
+
 	while (1) {
+		// don't redraw faster than the max display rate, anything that
+		// changes while we sleep is picked up by the next rebuild
+		int64_t wait = lastSwap + state->minRenderInterval - utime_now();
+		if (wait > 0) {
+			usleep(wait);
+		}
+
 		pthread_mutex_lock(&globalState.renderMutex);
-		if (globalState.data.im == nullptr) {
-			pthread_mutex_unlock(&globalState.renderMutex);
-			continue;
+		int64_t idleUntil = utime_now() + idleRenderInterval;
+		while (!globalState.redraw || !globalState.data) {
+			struct timespec deadline;
+			deadline.tv_sec = idleUntil / 1000000;
+			deadline.tv_nsec = (idleUntil % 1000000) * 1000;
+			if (pthread_cond_timedwait(&globalState.renderCond,
+				&globalState.renderMutex, &deadline) == ETIMEDOUT) {
+				if (globalState.data) {
+					break;
+				}
+				idleUntil = utime_now() + idleRenderInterval;
+			}
 		}
+		globalState.redraw = false;
+		// hold on to the snapshot so the rest can be built without the lock
+		std::shared_ptr<const RenderInfo> info = globalState.data;
+		int64_t frame = globalState.frame;
+		bool blobDetect = buttonStates.blobDetect;
+		pthread_mutex_unlock(&globalState.renderMutex);
 
-		vx_object_t* vim = vxo_chain(
-			vxo_mat_translate3(-0.5, 
-				-0.5 * ((float)globalState.data.im->height / globalState.data.im->width), 0),
-			vxo_mat_scale(1.0 / globalState.data.im->width),
-			vxo_image_from_u32(globalState.data.im, VXO_IMAGE_FLIPY, 0));
-		vx_buffer_add_back(vx_world_get_buffer(state->vxWorld, "state"), vim);
+		if (imageFrame != frame) {
+			image_u32_t* im = info->im;
+			vx_resc_t* imageResc = vx_resc_stream_copyui(imageStream,
+				im->buf, im->stride * im->height);
+			if (imageObj != nullptr) {
+				vx_object_dec_destroy(imageObj);
+			}
+			imageObj = vxo_chain(
+				vxo_mat_translate3(-0.5, -0.5 * ((float)im->height / im->width), 0),
+				vxo_mat_scale(1.0 / im->width),
+				vxo_image_texflags(imageResc, im->width, im->height, im->stride,
+					GL_RGBA, VXO_IMAGE_FLIPY, 0));
+			vx_object_inc_ref(imageObj);
+			imageFrame = frame;
+		}
+		vx_buffer_add_back(vx_world_get_buffer(state->vxWorld, "state"), imageObj);
 
 
 		std::string message = CalibrationHandler::instance()->getMessage();
 		message = "<<right,#ff00ff,serif>>" + message;
-		vx_object_t* vtext = vxo_chain(
-			vxo_mat_translate3(400, 40, 0),
-			vxo_text_create(VXO_TEXT_ANCHOR_CENTER, message.c_str()));
-		vx_buffer_add_back(vx_world_get_buffer(state->vxWorld, "state"), vxo_pix_coords(VX_ORIGIN_BOTTOM_LEFT, vtext));
+		if (textObj == nullptr || message != textMessage) {
+			if (textObj != nullptr) {
+				vx_object_dec_destroy(textObj);
+			}
+			vx_object_t* vtext = vxo_chain(
+				vxo_mat_translate3(400, 40, 0),
+				vxo_text_create(VXO_TEXT_ANCHOR_CENTER, message.c_str()));
+			textObj = vxo_pix_coords(VX_ORIGIN_BOTTOM_LEFT, vtext);
+			vx_object_inc_ref(textObj);
+			textMessage = message;
+		}
+		vx_buffer_add_back(vx_world_get_buffer(state->vxWorld, "state"), textObj);
 
-		if (buttonStates.blobDetect) {
+		if (blobDetect) {
 			std::vector<float> redPoints;
-			for (auto& blob : globalState.data.redBlobs) {
+			for (auto& blob : info->redBlobs) {
 				redPoints.push_back(blob[0]);
 				redPoints.push_back(blob[1]);
 				redPoints.push_back(0);
@@ -132,7 +186,7 @@ void* VxHandler::renderThread(void* args) {
 
 
 			std::vector<float> greenPoints;
-			for (auto& blob : globalState.data.greenBlobs) {
+			for (auto& blob : info->greenBlobs) {
 				greenPoints.push_back(blob[0]);
 				greenPoints.push_back(blob[1]);
 				greenPoints.push_back(0);
@@ -141,7 +195,7 @@ void* VxHandler::renderThread(void* args) {
 			vx_buffer_add_back(vx_world_get_buffer(state->vxWorld, "state"), vxo_points(verts, greenPoints.size() / 3, vxo_points_style(vx_green, 5.0f)));	
 
 			std::vector<float> bluePoints;
-			for (auto& blob : globalState.data.blueBlobs) {
+			for (auto& blob : info->blueBlobs) {
 				bluePoints.push_back(blob[0]);
 				bluePoints.push_back(blob[1]);
 				bluePoints.push_back(0);
@@ -150,11 +204,8 @@ void* VxHandler::renderThread(void* args) {
 			vx_buffer_add_back(vx_world_get_buffer(state->vxWorld, "state"), vxo_points(verts, bluePoints.size() / 3, vxo_points_style(vx_blue, 5.0f)));
 		}
 
-		// std::cout << "render blobs end" << std::endl;
-		pthread_mutex_unlock(&globalState.renderMutex);
-
 		vx_buffer_swap(vx_world_get_buffer(state->vxWorld, "state"));
-		usleep(1e3);
+		lastSwap = utime_now();
 	}
 
 	return NULL;
@@ -183,8 +234,11 @@ int VxHandler::mouse_event(vx_event_handler_t *vxeh, vx_layer_t *vl,
 		double ground[3];
 		vx_ray3_intersect_xy (&ray, 0, ground);
 
+		pthread_mutex_lock(&globalState.renderMutex);
+		std::shared_ptr<const RenderInfo> info = globalState.data;
+		pthread_mutex_unlock(&globalState.renderMutex);
 		CalibrationHandler::instance()->handleMouseEvent(ground[0], 
-			ground[1], globalState.data.im);
+			ground[1], info ? info->im : nullptr);
 
 		pthread_mutex_lock(&globalState.renderMutex);
 		if (buttonStates.moveArm) {
@@ -243,7 +297,8 @@ void VxHandler::parameterEventHandler (parameter_listener_t *pl,
 		}
 	} else if (strName == "but4") {
 		//save image
-		int res = image_u32_write_pnm(globalState.data.im, imageFileName.c_str());
+		int res = globalState.data ?
+			image_u32_write_pnm(globalState.data->im, imageFileName.c_str()) : -1;
 		if (res) {
 			std::cout << "did not save image successfully\n";
 		}
@@ -264,6 +319,7 @@ void VxHandler::parameterEventHandler (parameter_listener_t *pl,
 		// blob detect
 		buttonStates.blobDetect = !buttonStates.blobDetect;
 	}
+	requestRedraw();
 	pthread_mutex_unlock(&globalState.renderMutex);
 }
 
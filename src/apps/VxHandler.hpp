@@ -7,9 +7,11 @@
 #include <math.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <memory>
 
 #include "a2/CalibrationHandler.hpp"
 #include "a2/CalibrationInfo.hpp"
+#include "a2/RenderInfo.hpp"
 
 #include "vx/vx.h"
 #include "vx/vx_util.h"
@@ -41,20 +43,12 @@ struct VxButtonStates {
 
 extern VxButtonStates buttonStates;
 
-struct RenderInfo {
-	image_u32_t* im;
-	std::vector<std::array<float, 2>> redBlobs;
-	std::vector<std::array<float, 2>> greenBlobs;
-	std::vector<std::array<float, 2>> blueBlobs;
-
-	RenderInfo();
-	~RenderInfo();
-	void operator=(const RenderInfo& info);
-};
-
 struct VxHandlerState {
 	pthread_mutex_t renderMutex;
-	RenderInfo data;
+	pthread_cond_t renderCond; // signalled when redraw is set
+	std::shared_ptr<const RenderInfo> data;
+	int64_t frame; // bumped every time data changes
+	bool redraw; // something shown changed since the last buffer swap
 };
 
 extern VxHandlerState globalState;
@@ -80,17 +74,32 @@ private:
 	int windowWidth, windowHeight;
 	CalibrationInfo info;
 
+	int64_t minRenderInterval; // us between buffer swaps
+
 public:
 	VxHandler(int width, int height);
 	~VxHandler();
 
-	void changeRenderInfo(const RenderInfo& info);
+	/**
+	 * @brief shows a new snapshot, swapped in without copying it
+	 */
+	void changeRenderInfo(std::shared_ptr<const RenderInfo> info);
+
+	/**
+	 * @brief caps how often the render thread rebuilds and swaps the
+	 * vx buffers, changes that land in between are coalesced
+	 *
+	 * @param hz 0 for no limit
+	 */
+	void setMaxDisplayRate(double hz);
 
 	void launchThreads();
 
 	VxButtonStates getButtonStates();
 
 private:
+	static void requestRedraw();
+
 	static void* renderThread(void* args);
 
 	static void* mainThread(void* args);
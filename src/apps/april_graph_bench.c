@@ -0,0 +1,462 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "common/getopt.h"
+#include "common/timestamp.h"
+#include "common/zarray.h"
+#include "math/matd.h"
+#include "math/smatd.h"
+#include "math/april_graph.h"
+
+// compares the node orderings available to april_graph_cholesky
+// (exact and approximate minimum degree) on synthetic Manhattan-world
+// pose graphs: a robot drives along a grid, turning at random, with
+// odometry factors between consecutive poses and loop closures
+// whenever it comes back next to an earlier pose.
+//
+// for each graph size, prints the time to compute each ordering and
+// the fill-in it produces (non-zero node blocks in the Cholesky
+// factor), along with a full Gauss-Newton iteration for context.
+//
+// with -i, checks april_graph_incremental against batch instead, on
+// the same graphs (see check_incremental), and exits non-zero if they
+// disagree; e.g. eecs467_april_graph_bench -i 25 -s 300,1500.
+//
+// usage: eecs467_april_graph_bench [-s sizes] [-l closure probability] [-i interval]
+
+static double randn(void)
+{
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+
+    return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+static april_graph_t *make_manhattan_graph(int nnodes, double pclosure)
+{
+    april_graph_t *graph = april_graph_create();
+
+    // true poses, used to find loop closures
+    double *tx = calloc(nnodes, sizeof(double));
+    double *ty = calloc(nnodes, sizeof(double));
+    double *tt = calloc(nnodes, sizeof(double));
+
+    // keep the robot on a roughly square patch of the grid. last[]
+    // holds the most recent pose to visit each cell, or -1.
+    double extent = sqrt(nnodes) / 2;
+    int side = 2 * (int) ceil(extent) + 3;
+    int *last = malloc(side * side * sizeof(int));
+    for (int i = 0; i < side * side; i++)
+        last[i] = -1;
+
+    matd_t *W = matd_create_data(3, 3, (double[]) { 100, 0, 0,
+                                                    0, 100, 0,
+                                                    0, 0, 1000 });
+
+    double x = 0, y = 0, t = 0;
+    double odom[3] = { 0, 0, 0 };
+
+    for (int i = 0; i < nnodes; i++) {
+        if (i > 0) {
+            if (rand() % 5 == 0)
+                t += (rand() % 2 ? 1 : -1) * M_PI / 2;
+            if (fabs(x + cos(t)) > extent || fabs(y + sin(t)) > extent)
+                t += M_PI;
+
+            double nx = x + round(cos(t)), ny = y + round(sin(t));
+            double c = cos(tt[i-1]), s = sin(tt[i-1]);
+            double z[3] = { c*(nx - x) + s*(ny - y), -s*(nx - x) + c*(ny - y), t - tt[i-1] };
+            double zn[3] = { z[0] + 0.1*randn(), z[1] + 0.1*randn(), z[2] + 0.03*randn() };
+
+            april_graph_factor_t *factor = april_graph_factor_xyt_create(i - 1, i, zn, z, W);
+            zarray_add(graph->factors, &factor);
+
+            // initialize by dead-reckoning the noisy odometry
+            c = cos(odom[2]);
+            s = sin(odom[2]);
+            odom[0] += c*zn[0] - s*zn[1];
+            odom[1] += s*zn[0] + c*zn[1];
+            odom[2] += zn[2];
+
+            x = nx;
+            y = ny;
+        }
+
+        tx[i] = x;
+        ty[i] = y;
+        tt[i] = t;
+
+        double truth[3] = { x, y, t };
+        april_graph_node_t *node = april_graph_node_xyt_create(odom, odom, truth);
+        zarray_add(graph->nodes, &node);
+
+        int cx = (int) x + side / 2, cy = (int) y + side / 2;
+
+        // close a loop with an earlier pose in this cell or a neighboring one
+        if (rand() < pclosure * RAND_MAX) {
+            int dir = rand() % 5;
+            int nx = cx + (int[]) { 0, 1, -1, 0, 0 }[dir];
+            int ny = cy + (int[]) { 0, 0, 0, 1, -1 }[dir];
+            int j = last[ny * side + nx];
+
+            if (j >= 0 && j < i - 10) {
+                double c = cos(tt[j]), s = sin(tt[j]);
+                double z[3] = { c*(x - tx[j]) + s*(y - ty[j]), -s*(x - tx[j]) + c*(y - ty[j]), t - tt[j] };
+                double zn[3] = { z[0] + 0.1*randn(), z[1] + 0.1*randn(), z[2] + 0.03*randn() };
+
+                april_graph_factor_t *factor = april_graph_factor_xyt_create(j, i, zn, z, W);
+                zarray_add(graph->factors, &factor);
+            }
+        }
+
+        last[cy * side + cx] = i;
+    }
+
+    matd_t *P = matd_identity(3);
+    april_graph_factor_t *prior = april_graph_factor_xytpos_create(0, (double[]) { 0, 0, 0 }, NULL, P);
+    zarray_add(graph->factors, &prior);
+    matd_destroy(P);
+
+    matd_destroy(W);
+    free(tx);
+    free(ty);
+    free(tt);
+    free(last);
+
+    return graph;
+}
+
+// symbolic node adjacency, as april_graph_cholesky builds it for ordering
+static smatd_t *make_symbolic(april_graph_t *graph)
+{
+    int nnodes = zarray_size(graph->nodes);
+    smatd_t *Asym = smatd_create(nnodes, nnodes);
+
+    for (int fidx = 0; fidx < zarray_size(graph->factors); fidx++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, fidx, &factor);
+
+        for (int i = 0; i < factor->nnodes; i++)
+            for (int j = 0; j < factor->nnodes; j++)
+                smatd_set(Asym, factor->nodes[i], factor->nodes[j], 1);
+    }
+
+    return Asym;
+}
+
+// number of non-zero node blocks in the Cholesky factor under 'ordering'
+static long factor_blocks(smatd_t *Asym, const int *ordering)
+{
+    int n = Asym->nrows;
+    int *rank = malloc(n * sizeof(int));
+    for (int i = 0; i < n; i++)
+        rank[ordering[i]] = i;
+
+    smatd_t *P = smatd_create(n, n);
+    for (int i = 0; i < n; i++) {
+        svecd_t *row = &Asym->rows[i];
+        for (int pos = 0; pos < row->nz; pos++) {
+            int ri = rank[i], rj = rank[row->indices[pos]];
+            if (ri <= rj)
+                smatd_set(P, ri, rj, 1);
+        }
+    }
+
+    smatd_chol_symbolic_t *sym = smatd_chol_symbolic(P);
+
+    long nz = 0;
+    for (int s = 0; s < sym->nsuper; s++) {
+        long nrows = sym->rowptr[s+1] - sym->rowptr[s];
+        long ncols = sym->super[s+1] - sym->super[s];
+        nz += nrows * ncols - ncols * (ncols - 1) / 2;
+    }
+
+    smatd_chol_symbolic_destroy(sym);
+    smatd_destroy(P);
+    free(rank);
+
+    return nz;
+}
+
+// how far april_graph_incremental may be from batch, for -i: chi2
+// (relative) and relative poses. While poses are being added, the two
+// take different Gauss-Newton steps from different points, so the
+// STALE tolerances only catch a solver that has run away. Once both
+// have been relinearized CONVERGE_ITERATIONS times, they must agree.
+#define STALE_CHI2_TOLERANCE 100
+#define STALE_POSE_TOLERANCE 0.5
+#define CONVERGE_ITERATIONS 10
+#define CHI2_TOLERANCE 0.01
+#define POSE_TOLERANCE 0.005
+
+static int max_node(april_graph_factor_t *factor)
+{
+    int m = 0;
+    for (int i = 0; i < factor->nnodes; i++)
+        if (factor->nodes[i] > m)
+            m = factor->nodes[i];
+    return m;
+}
+
+// pose of b in the frame of a
+static void relative_xyt(const double *a, const double *b, double *rel)
+{
+    double dx = b[0] - a[0], dy = b[1] - a[1];
+    double c = cos(a[2]), s = sin(a[2]);
+
+    rel[0] = c*dx + s*dy;
+    rel[1] = -s*dx + c*dy;
+    rel[2] = b[2] - a[2];
+}
+
+// append pose i of 'src' to 'graph', initialized by applying its
+// odometry to the current estimate of pose i-1, as a robot would
+static void add_pose(april_graph_t *src, april_graph_t *graph, int i)
+{
+    april_graph_node_t *node;
+    zarray_get(src->nodes, i, &node);
+
+    double state[3];
+    memcpy(state, node->state, sizeof(state));
+
+    if (i > 0) {
+        april_graph_node_t *sprev, *prev;
+        zarray_get(src->nodes, i - 1, &sprev);
+        zarray_get(graph->nodes, i - 1, &prev);
+
+        double odom[3];
+        relative_xyt(sprev->state, node->state, odom);
+
+        double c = cos(prev->state[2]), s = sin(prev->state[2]);
+        state[0] = prev->state[0] + c*odom[0] - s*odom[1];
+        state[1] = prev->state[1] + s*odom[0] + c*odom[1];
+        state[2] = prev->state[2] + odom[2];
+    }
+
+    april_graph_node_t *n = april_graph_node_xyt_create(state, state, node->truth);
+    zarray_add(graph->nodes, &n);
+}
+
+// largest difference between two estimates of the same graph, in the
+// relative pose of consecutive nodes. Weakly constrained directions
+// (bending of long chains) converge slowly under Gauss-Newton, so
+// absolute poses can differ by far more than the local structure.
+static double max_relative_error(april_graph_t *a, april_graph_t *b)
+{
+    double err = 0;
+
+    for (int i = 1; i < zarray_size(a->nodes); i++) {
+        april_graph_node_t *a0, *a1, *b0, *b1;
+        zarray_get(a->nodes, i - 1, &a0);
+        zarray_get(a->nodes, i, &a1);
+        zarray_get(b->nodes, i - 1, &b0);
+        zarray_get(b->nodes, i, &b1);
+
+        double ra[3], rb[3];
+        relative_xyt(a0->state, a1->state, ra);
+        relative_xyt(b0->state, b1->state, rb);
+
+        for (int k = 0; k < 3; k++)
+            err = fmax(err, fabs(ra[k] - rb[k]));
+    }
+
+    return err;
+}
+
+// replays a Manhattan graph one pose at a time into
+// april_graph_incremental, and in lockstep into a batch graph that gets
+// one april_graph_cholesky iteration per pose: the result incremental
+// updates approximate. Checks chi2 and the relative poses after every
+// update, which crosses a batch step every 'interval' incremental
+// updates. Then forces CONVERGE_ITERATIONS batch steps
+// (april_graph_incremental_relinearize) against as many batch
+// iterations, and checks that the two agree. returns the number of
+// failed checks.
+static int check_incremental(april_graph_t *src, int interval, int verbose)
+{
+    int nnodes = zarray_size(src->nodes);
+    int nfactors = zarray_size(src->factors);
+
+    // the prior has to come first, so that the first pose isn't free
+    april_graph_factor_t *prior;
+    zarray_get(src->factors, nfactors - 1, &prior);
+    zarray_remove_index(src->factors, nfactors - 1, 0);
+    zarray_insert(src->factors, 0, &prior);
+
+    april_graph_incremental_param_t param;
+    april_graph_incremental_param_init(&param);
+    param.relinearize_interval = interval;
+    april_graph_incremental_t *inc = april_graph_incremental_create(&param);
+
+    april_graph_cholesky_solver_t *solver = april_graph_cholesky_solver_create();
+
+    // both share the factors of src
+    april_graph_t *graph = april_graph_create();
+    april_graph_t *batch = april_graph_create();
+
+    int fidx = 0;
+    int failed = 0;
+
+    for (int i = 0; i < nnodes + CONVERGE_ITERATIONS && failed < 10; i++) {
+        // update i is a batch step when i % (interval + 1) == 0
+        int batch_step = (i >= nnodes) || (i % (interval + 1) == 0);
+        int converged = (i == nnodes + CONVERGE_ITERATIONS - 1);
+
+        if (i < nnodes) {
+            add_pose(src, graph, i);
+            add_pose(src, batch, i);
+
+            for (; fidx < nfactors; fidx++) {
+                april_graph_factor_t *factor;
+                zarray_get(src->factors, fidx, &factor);
+                if (max_node(factor) > i)
+                    break;
+                zarray_add(graph->factors, &factor);
+                zarray_add(batch->factors, &factor);
+            }
+
+            april_graph_incremental_update(inc, graph);
+        } else {
+            april_graph_incremental_relinearize(inc, graph);
+        }
+
+        april_graph_cholesky_solver_iterate(solver, batch, NULL);
+
+        double chi2 = april_graph_chi2(graph), batch_chi2 = april_graph_chi2(batch);
+        double err = max_relative_error(graph, batch);
+
+        // chi2 can't be compared relatively while it is near zero
+        int ok = converged ?
+            chi2 <= (batch_chi2 + 1) * (1 + CHI2_TOLERANCE) && err <= POSE_TOLERANCE :
+            chi2 <= (batch_chi2 + 1) * (1 + STALE_CHI2_TOLERANCE) && err <= STALE_POSE_TOLERANCE;
+
+        if ((verbose && batch_step) || converged || !ok)
+            printf("%8d %8d   %-6s %12.4f %12.4f %12.2e %s\n",
+                   zarray_size(graph->nodes), zarray_size(graph->factors),
+                   converged ? "final" : (batch_step ? "batch" : "inc"),
+                   chi2, batch_chi2, err, ok ? "" : "FAILED");
+
+        if (!ok)
+            failed++;
+    }
+
+    april_graph_cholesky_solver_destroy(solver);
+    april_graph_incremental_destroy(inc);
+
+    zarray_clear(graph->factors);
+    april_graph_destroy(graph);
+    zarray_clear(batch->factors);
+    april_graph_destroy(batch);
+
+    return failed;
+}
+
+int *exact_minimum_degree_ordering(smatd_t *mat);
+int *approximate_minimum_degree_ordering(smatd_t *mat);
+
+int main(int argc, char *argv[])
+{
+    getopt_t *gopt = getopt_create();
+    getopt_add_bool(gopt, 'h', "help", 0, "Show this help");
+    getopt_add_string(gopt, 's', "sizes", "1000,5000,10000,20000,50000", "Comma-separated node counts");
+    getopt_add_double(gopt, 'l', "closures", "0.5", "Probability of trying a loop closure at each pose");
+    getopt_add_int(gopt, 'x', "max-exact", "50000", "Skip exact minimum degree above this many nodes");
+    getopt_add_int(gopt, 'r', "seed", "1", "Random seed");
+    getopt_add_int(gopt, 'i', "incremental", "0", "Check april_graph_incremental against batch instead, with this relinearize interval");
+    getopt_add_bool(gopt, 'v', "verbose", 0, "With -i, print every check");
+
+    if (!getopt_parse(gopt, argc, argv, 1) || getopt_get_bool(gopt, "help")) {
+        printf("Usage: %s [options]\n", argv[0]);
+        getopt_do_usage(gopt);
+        exit(1);
+    }
+
+    double pclosure = getopt_get_double(gopt, "closures");
+    int max_exact = getopt_get_int(gopt, "max-exact");
+    int interval = getopt_get_int(gopt, "incremental");
+    srand(getopt_get_int(gopt, "seed"));
+
+    if (interval > 0) {
+        printf("%8s %8s   %-6s %12s %12s %12s\n",
+               "nodes", "factors", "update", "chi2", "batch chi2", "pose error");
+
+        int failed = 0;
+        char *sizes = strdup(getopt_get_string(gopt, "sizes"));
+        for (char *tok = strtok(sizes, ","); tok != NULL; tok = strtok(NULL, ",")) {
+            april_graph_t *graph = make_manhattan_graph(atoi(tok), pclosure);
+            failed += check_incremental(graph, interval, getopt_get_bool(gopt, "verbose"));
+            april_graph_destroy(graph);
+        }
+        free(sizes);
+        getopt_destroy(gopt);
+
+        printf("april_graph_incremental: %s\n", failed ? "FAILED" : "ok");
+        return failed != 0;
+    }
+
+    printf("%8s %8s   %-6s %12s %12s %14s\n",
+           "nodes", "factors", "method", "order ms", "fill blocks", "iteration ms");
+
+    char *sizes = strdup(getopt_get_string(gopt, "sizes"));
+    for (char *tok = strtok(sizes, ","); tok != NULL; tok = strtok(NULL, ",")) {
+        int nnodes = atoi(tok);
+        if (nnodes <= 10)
+            continue;
+
+        april_graph_t *graph = make_manhattan_graph(nnodes, pclosure);
+        smatd_t *Asym = make_symbolic(graph);
+
+        for (int method = 0; method < 2; method++) {
+            if (method == APRIL_GRAPH_ORDERING_EXACT_MIN_DEGREE && nnodes > max_exact)
+                continue;
+
+            int64_t start = utime_now();
+            int *ordering = (method == APRIL_GRAPH_ORDERING_AMD) ?
+                approximate_minimum_degree_ordering(Asym) :
+                exact_minimum_degree_ordering(Asym);
+            double order_ms = (utime_now() - start) / 1000.0;
+
+            long fill = factor_blocks(Asym, ordering);
+
+            // one iteration with this ordering, restoring the state
+            // afterwards so that every method starts from the same place.
+            april_graph_cholesky_param_t param;
+            april_graph_cholesky_param_init(&param);
+            param.ordering = ordering;
+
+            double *saved = malloc(3 * nnodes * sizeof(double));
+            for (int i = 0; i < nnodes; i++) {
+                april_graph_node_t *node;
+                zarray_get(graph->nodes, i, &node);
+                memcpy(&saved[3*i], node->state, 3 * sizeof(double));
+            }
+
+            start = utime_now();
+            april_graph_cholesky(graph, &param);
+            double iter_ms = (utime_now() - start) / 1000.0;
+
+            for (int i = 0; i < nnodes; i++) {
+                april_graph_node_t *node;
+                zarray_get(graph->nodes, i, &node);
+                memcpy(node->state, &saved[3*i], 3 * sizeof(double));
+            }
+            free(saved);
+
+            printf("%8d %8d   %-6s %12.2f %12ld %14.2f\n",
+                   nnodes, zarray_size(graph->factors),
+                   method == APRIL_GRAPH_ORDERING_AMD ? "amd" : "exact",
+                   order_ms, fill, iter_ms);
+
+            free(ordering);
+        }
+
+        smatd_destroy(Asym);
+        april_graph_destroy(graph);
+    }
+
+    free(sizes);
+    getopt_destroy(gopt);
+    return 0;
+}
@@ -45,10 +45,10 @@ using namespace BlobDetector;
 using namespace eecs467;
 
 
-void printMatrix(Matrix<BlobCell>& mat) {
-	for (int row = 0; row < mat.rows(); ++row) {
-		for (int col = 0; col < mat.cols(); ++col) {
-			std::cout << mat(row, col).type << "\t";
+void printLabels(const LabelImage& labels) {
+	for (int row = 0; row < labels.height; ++row) {
+		for (int col = 0; col < labels.width; ++col) {
+			std::cout << (int)labels.row(row)[col] << "\t";
 		}
 		std::cout << "\n";
 	}
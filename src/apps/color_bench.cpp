@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include "a2/ColorRecognizer.hpp"
+#include "a2/ColorTable.hpp"
+#include "a2/CalibrationHandler.hpp"
+
+#include "common/getopt.h"
+#include "common/timestamp.h"
+#include "imagesource/image_u32.h"
+
+// compares the pixel classification paths on recorded frames
+// (e.g. the ones saved with the "Save Image" button):
+// scalar rgbToHsv + determineObjectHSV, the SIMD labelRowHSV kernel
+// and the ColorTable lookup
+//
+// usage: eecs467_color_bench [-i iterations] frame.ppm ...
+
+typedef void (*LabelFunc)(const image_u32_t* im, uint8_t* labels,
+	const CalibrationInfo& calib, const ColorTable& table);
+
+static void labelScalar(const image_u32_t* im, uint8_t* labels,
+	const CalibrationInfo& calib, const ColorTable& table) {
+	for (int row = 0; row < im->height; ++row) {
+		labelRowHSVScalar(&im->buf[row * im->stride],
+			&labels[row * im->width], im->width, calib);
+	}
+}
+
+static void labelSimd(const image_u32_t* im, uint8_t* labels,
+	const CalibrationInfo& calib, const ColorTable& table) {
+	for (int row = 0; row < im->height; ++row) {
+		labelRowHSV(&im->buf[row * im->stride],
+			&labels[row * im->width], im->width, calib);
+	}
+}
+
+static void labelTable(const image_u32_t* im, uint8_t* labels,
+	const CalibrationInfo& calib, const ColorTable& table) {
+	for (int row = 0; row < im->height; ++row) {
+		table.labelRow(&im->buf[row * im->stride],
+			&labels[row * im->width], im->width);
+	}
+}
+
+static double benchmark(LabelFunc func, const std::vector<image_u32_t*>& frames,
+	std::vector<std::vector<uint8_t>>& labels, const CalibrationInfo& calib,
+	const ColorTable& table, int iterations) {
+	int64_t pixels = 0;
+	int64_t start = utime_now();
+	for (int it = 0; it < iterations; ++it) {
+		for (size_t i = 0; i < frames.size(); ++i) {
+			func(frames[i], labels[i].data(), calib, table);
+			pixels += frames[i]->width * frames[i]->height;
+		}
+	}
+	int64_t elapsed = utime_now() - start;
+	// megapixels per second
+	return (double) pixels / std::max(elapsed, (int64_t) 1);
+}
+
+static int64_t countMismatches(const std::vector<std::vector<uint8_t>>& a,
+	const std::vector<std::vector<uint8_t>>& b) {
+	int64_t ret = 0;
+	for (size_t i = 0; i < a.size(); ++i) {
+		for (size_t j = 0; j < a[i].size(); ++j) {
+			ret += a[i][j] != b[i][j];
+		}
+	}
+	return ret;
+}
+
+int main(int argc, char** argv) {
+	getopt_t* gopt = getopt_create();
+	getopt_add_int(gopt, 'i', "iterations", "20", "Passes over all frames per method");
+	if (!getopt_parse(gopt, argc, argv, 1) ||
+		zarray_size(getopt_get_extra_args(gopt)) == 0) {
+		printf("Usage: %s [options] frame.ppm ...\n", argv[0]);
+		getopt_do_usage(gopt);
+		exit(1);
+	}
+	int iterations = getopt_get_int(gopt, "iterations");
+
+	std::vector<image_u32_t*> frames;
+	const zarray_t* files = getopt_get_extra_args(gopt);
+	for (int i = 0; i < zarray_size(files); ++i) {
+		char* file;
+		zarray_get(files, i, &file);
+		image_u32_t* im = image_u32_create_from_pnm(file);
+		if (im == NULL) {
+			printf("couldn't read %s\n", file);
+			exit(1);
+		}
+		frames.push_back(im);
+	}
+
+	CalibrationInfo calib = CalibrationHandler::instance()->getCalibration();
+	int64_t start = utime_now();
+	ColorTable table(calib);
+	printf("table build: %.2f ms\n", (utime_now() - start) / 1000.0);
+
+	std::vector<std::vector<uint8_t>> scalarLabels, simdLabels, tableLabels;
+	int64_t total = 0;
+	for (auto im : frames) {
+		scalarLabels.push_back(std::vector<uint8_t>(im->width * im->height));
+		total += im->width * im->height;
+	}
+	simdLabels = tableLabels = scalarLabels;
+
+	printf("scalar: %8.1f Mpix/s\n",
+		benchmark(labelScalar, frames, scalarLabels, calib, table, iterations));
+	printf("simd:   %8.1f Mpix/s\n",
+		benchmark(labelSimd, frames, simdLabels, calib, table, iterations));
+	printf("table:  %8.1f Mpix/s\n",
+		benchmark(labelTable, frames, tableLabels, calib, table, iterations));
+
+	printf("simd mismatches:  %lld / %lld\n",
+		(long long) countMismatches(scalarLabels, simdLabels), (long long) total);
+	printf("table mismatches: %lld / %lld (quantization)\n",
+		(long long) countMismatches(scalarLabels, tableLabels), (long long) total);
+
+	for (auto im : frames) {
+		image_u32_destroy(im);
+	}
+	getopt_destroy(gopt);
+	return 0;
+}
@@ -6,8 +6,11 @@
 #include <pthread.h>
 
 #include <iostream>
+#include <vector>
 
 #include "VxHandler.hpp"
+#include "CameraHandler.hpp"
+#include "Pipeline.hpp"
 #include "a2/ColorRecognizer.hpp"
 #include "a2/CoordinateConverter.hpp"
 #include "a2/BlobDetector.hpp"
@@ -26,6 +29,7 @@
 #include "vx/vxo_drawables.h"
 
 #include "common/getopt.h"
+#include "common/timestamp.h"
 #include "imagesource/image_u32.h"
 #include "imagesource/image_util.h"
 
@@ -40,126 +44,149 @@
 #include "imagesource/image_source.h"
 #include "imagesource/image_convert.h"
 
-class CameraHandler {
-private:
-	image_source_t* _isrc;
-	image_u32_t* _im;
-	pthread_t _captureThreadPid;
-	mutable pthread_mutex_t _dataMutex;
-	bool _running;
-	bool _staticImage;
-
-public:
-	CameraHandler() {
-		zarray_t* urls = image_source_enumerate();
-
-		bool gotCamera = false;
-		for (int i = 0; i < zarray_size(urls); ++i) {
-			char* url;
-			zarray_get(urls, i, &url);
-			_isrc = image_source_open(url);
-			if (_isrc != NULL) {
-				printf("connected to camera %s\n", url);
-				gotCamera = true;
-				free(url);
-				break;
-			}
-		}
-		zarray_destroy(urls);
-		if (!gotCamera) {
-			printf("couldn't find a camera\n");
-			exit(1);
-		}
+// the camera -> display path runs as four stages on their own threads:
+// capture, detect (blobs, from the raw frame when it's YUYV), convert (to
+// rgba, clipped to the mask or drawn as the color mask) and render (hand
+// off to vx, on the main thread). jobs move between them through
+// one-deep queues that drop the oldest frame, so a slow stage costs
+// frames instead of latency
+struct FrameJob {
+	CameraFrame frame;
+	int64_t queued; // when the job entered its current queue
+	std::vector<BlobDetector::Blob> blobs;
+};
+
+// at most one job per queue and one per stage, plus a spare so
+// capture never waits for a free one
+static const int numJobs = 8;
+
+struct Pipeline {
+	CameraHandler* camera;
+	VxHandler* vx;
 
-		if (pthread_mutex_init(&_dataMutex, NULL)) {
-			printf("dataMutex not initialized\n");
-			exit(1);
+	// vx redraws at most this often, us, 0 for no limit
+	int64_t minDisplayInterval;
+
+	FrameQueue<FrameJob*> freeJobs;
+	FrameQueue<FrameJob*> toDetect;
+	FrameQueue<FrameJob*> toConvert;
+	FrameQueue<FrameJob*> toRender;
+
+	StageStats captureStats;
+	StageStats detectStats;
+	StageStats convertStats; // only frames which are shown
+	StageStats renderStats;
+	StageStats totalStats; // capture to hand off
+
+	Pipeline(CameraHandler* camera, VxHandler* vx, double displayRate) :
+		camera(camera), vx(vx),
+		minDisplayInterval(displayRate > 0 ? (int64_t) (1e6 / displayRate) : 0),
+		freeJobs(numJobs), toDetect(1), toConvert(1), toRender(1),
+		captureStats("capture"), detectStats("detect"),
+		convertStats("convert"), renderStats("render"), totalStats("total") {}
+
+	// passes job on to the next stage, recycling whatever it pushes out
+	void forward(FrameQueue<FrameJob*>& queue, FrameJob* job) {
+		FrameJob* dropped;
+		job->queued = utime_now();
+		if (queue.push(job, dropped)) {
+			recycle(dropped);
 		}
+	}
 
-		_im = nullptr;
-		_running = false;
-		_staticImage = false;
-		_isrc->start(_isrc);
+	void recycle(FrameJob* job) {
+		// never full, there are only numJobs jobs
+		FrameJob* unused;
+		freeJobs.push(job, unused);
 	}
 
-	~CameraHandler() {
-		if (_im != nullptr) {
-			image_u32_destroy(_im);
-		}
-		_isrc->close(_isrc);
-		pthread_mutex_destroy(&_dataMutex);
+	void printStats() {
+		captureStats.print(0);
+		detectStats.print(toDetect.getDropped());
+		convertStats.print(toConvert.getDropped());
+		renderStats.print(toRender.getDropped());
+		totalStats.print(0);
 	}
+};
 
-	image_u32_t* getImage() {
-		if (_staticImage) {
-			image_u32_t* ret = image_u32_copy(_im);
-			return ret;
-		}
-		if (!_running) {
-			image_source_data_t isData;
-			int res = _isrc->get_frame(_isrc,
-				&isData);
-			if (!res) {
-				pthread_mutex_lock(&_dataMutex);
-				image_u32_destroy(_im);
-				_im = image_convert_u32(&isData);
-				pthread_mutex_unlock(&_dataMutex);
-			}
-			_isrc->release_frame(_isrc,
-				&isData);
+static void* captureThread(void* args) {
+	Pipeline* p = (Pipeline*) args;
+	while (1) {
+		FrameJob* job = p->freeJobs.pop();
+		int64_t start = utime_now();
+		if (!p->camera->grabFrame(job->frame)) {
+			p->recycle(job);
+			continue;
 		}
+		// the camera wait is most of this, count it as work
+		p->captureStats.record(0, utime_now() - start);
+		p->forward(p->toDetect, job);
+	}
+	return NULL;
+}
 
-		image_u32_t* ret;
-		pthread_mutex_lock(&_dataMutex);
-		if (_im == nullptr) {
-			ret = image_u32_create(1, 1);
-			int size = ret->height * ret->stride;
-			for (int i = 0; i < size; ++i) {
-				ret->buf[i] = 0;
-			}
-		} else {
-			ret = image_u32_create(_im->width, _im->height);
-			int size = ret->height * ret->stride;
-			for (int i = 0; i < size; ++i) {
-				ret->buf[i] = _im->buf[i];
-			}
+static void* detectThread(void* args) {
+	Pipeline* p = (Pipeline*) args;
+	while (1) {
+		FrameJob* job = p->toDetect.pop();
+		int64_t start = utime_now();
+
+		job->blobs.clear();
+		if (p->vx->getButtonStates().blobDetect) {
+			CalibrationInfo calibrationInfo =
+				CalibrationHandler::instance()->getCalibration();
+			std::shared_ptr<const ColorTable> colorTable =
+				CalibrationHandler::instance()->getColorTable();
+
+			// YUYV frames are classified as they came from the camera.
+			// only the mask is labeled, so the image needn't be clipped
+			job->blobs = BlobDetector::canLabelFrame(&job->frame.raw) ?
+				BlobDetector::findBlobs(&job->frame.raw, calibrationInfo,
+					*colorTable, blobMinPixels) :
+				BlobDetector::findBlobs(job->frame.image(), calibrationInfo,
+					*colorTable, blobMinPixels);
 		}
-		pthread_mutex_unlock(&_dataMutex);
-		return ret;
-	}
 
-	void setStaticImage(const char* fileName) {
-		pthread_mutex_lock(&_dataMutex);
-		_staticImage = true;
-		_im = image_u32_create_from_pnm(fileName);
-		pthread_mutex_unlock(&_dataMutex);
+		p->detectStats.record(start - job->queued, utime_now() - start);
+		p->forward(p->toConvert, job);
 	}
+	return NULL;
+}
 
-	void launchThreads() {
-		pthread_create(&_captureThreadPid, NULL, 
-			&CameraHandler::captureThread, this);
-		_running = true;
-	}
+static void* convertThread(void* args) {
+	Pipeline* p = (Pipeline*) args;
+	int64_t lastShown = 0, lastSeen = 0;
+	while (1) {
+		FrameJob* job = p->toConvert.pop();
+		int64_t start = utime_now();
 
-private:
-	static void* captureThread(void* args) {
-		CameraHandler* state = (CameraHandler*) args;
-		while (1) {
-			image_source_data_t isData;
-			int res = state->_isrc->get_frame(state->_isrc,
-				&isData);
-			if (!res) {
-				pthread_mutex_lock(&state->_dataMutex);
-				image_u32_destroy(state->_im);
-				state->_im = image_convert_u32(&isData);
-				pthread_mutex_unlock(&state->_dataMutex);
-			}
-			state->_isrc->release_frame(state->_isrc,
-				&isData);
-					}
-		return NULL;
+		// vx only shows the newest frame, at most every minDisplayInterval,
+		// so the rest aren't worth converting. a frame is skipped if the
+		// next one, a frame period later, will still be in time
+		int64_t utime = job->frame.utime;
+		bool show = (utime - lastShown) + (utime - lastSeen) >= p->minDisplayInterval;
+		lastSeen = utime;
+		if (!show) {
+			p->recycle(job);
+			continue;
+		}
+		lastShown = utime;
+
+		if (p->vx->getButtonStates().colorMask) {
+			CalibrationInfo calibrationInfo =
+				CalibrationHandler::instance()->getCalibration();
+			std::shared_ptr<const ColorTable> colorTable =
+				CalibrationHandler::instance()->getColorTable();
+			maskWithColors(job->frame.image(), calibrationInfo, *colorTable);
+		} else {
+			CalibrationHandler::instance()->clipImage(job->frame.image());
+		}
+
+		p->convertStats.record(start - job->queued, utime_now() - start);
+		p->forward(p->toRender, job);
 	}
-};
+	return NULL;
+}
 
 int main(int argc, char** argv)
 {
@@ -169,6 +196,9 @@ int main(int argc, char** argv)
 	// getopt
 	getopt_t* gopt = getopt_create();
 	getopt_add_string(gopt, 'f', "file", "", "Use static camera image");
+	getopt_add_int(gopt, 'w', "workers", "4", "Threads used for blob detection");
+	getopt_add_bool(gopt, 's', "stats", 0, "Print pipeline latencies every 5 seconds");
+	getopt_add_double(gopt, 'r', "display-rate", "30", "Max display redraws per second, 0 for no limit");
 	if (!getopt_parse(gopt, argc, argv, 1)) {
 		getopt_do_usage(gopt);
 		exit(1);
@@ -178,63 +208,74 @@ int main(int argc, char** argv)
 		// if fileName is not empty
 		camera.setStaticImage(fileName);
 	}
+	BlobDetector::setNumWorkers(getopt_get_int(gopt, "workers"));
+	bool printStats = getopt_get_bool(gopt, "stats");
+	double displayRate = getopt_get_double(gopt, "display-rate");
 	getopt_destroy(gopt);
 
 	// initialize with first image
-	image_u32_t* tempIm = camera.getImage();
-	CalibrationHandler::instance()->calibrateImageSize(tempIm->height, tempIm->width, true);
-	image_u32_destroy(tempIm);
+	CameraFrame firstFrame;
+	while (!camera.grabFrame(firstFrame)) {}
+	image_u32_t* firstImage = firstFrame.image();
+	CalibrationHandler::instance()->calibrateImageSize(firstImage->height,
+		firstImage->width, true);
 
 	// lcm
 	LcmHandler::instance()->launchThreads();
 
 	// vx
 	VxHandler vx(1024, 768);
+	vx.setMaxDisplayRate(displayRate);
 	vx.launchThreads();
+
+	Pipeline pipeline(&camera, &vx, displayRate);
+	std::vector<FrameJob> jobs(numJobs);
+	for (auto& job : jobs) {
+		pipeline.recycle(&job);
+	}
+	pthread_t captureThreadPid, detectThreadPid, convertThreadPid;
+	pthread_create(&captureThreadPid, NULL, captureThread, &pipeline);
+	pthread_create(&detectThreadPid, NULL, detectThread, &pipeline);
+	pthread_create(&convertThreadPid, NULL, convertThread, &pipeline);
+
+	// render stage
+	int64_t lastStats = utime_now();
 	while (1) {
-		CalibrationInfo calibrationInfo = 
-			CalibrationHandler::instance()->getCalibration();
-		RenderInfo render;
-		render.im = camera.getImage();
-		CalibrationHandler::instance()->clipImage(render.im);
-
-		// std::array<float, 2> pos;
-		// if (Arm::instance()->forwardKinematics(pos)) {
-		// 	printf("pos: %f, %f\n", pos[0], pos[1]);			
-		// }
-
-		if (buttonStates.blobDetect) {
-			std::vector<BlobDetector::Blob> blobs = 
-				BlobDetector::findBlobs(render.im, calibrationInfo, blobMinPixels);
-			for (const auto& blob : blobs) {
-				std::array<int, 2> imageCoords{{blob.x, blob.y}};
-				std::array<float, 2> screenCoords = 
-					CoordinateConverter::imageToScreen(imageCoords);
-				switch (blob.type) {
-					case REDBALL:
-						render.redBlobs.push_back(screenCoords);
-						break;
-					case GREENBALL:
-						render.greenBlobs.push_back(screenCoords);
-						break;
-					case BLUESQUARE:
-						render.blueBlobs.push_back(screenCoords);
-						break;
-					default:
-						break;
-				}
-			}
-		}
+		FrameJob* job = pipeline.toRender.pop();
+		int64_t start = utime_now();
 
-		VxButtonStates buttonStates = vx.getButtonStates();
-		if (buttonStates.colorMask) {
-			maskWithColors(render.im, calibrationInfo);
+		std::shared_ptr<RenderInfo> render(new RenderInfo);
+		render->im = job->frame.releaseImage();
+		for (const auto& blob : job->blobs) {
+			std::array<int, 2> imageCoords{{blob.x, blob.y}};
+			std::array<float, 2> screenCoords = 
+				CoordinateConverter::imageToScreen(imageCoords);
+			switch (blob.type) {
+				case REDBALL:
+					render->redBlobs.push_back(screenCoords);
+					break;
+				case GREENBALL:
+					render->greenBlobs.push_back(screenCoords);
+					break;
+				case BLUESQUARE:
+					render->blueBlobs.push_back(screenCoords);
+					break;
+				default:
+					break;
+			}
 		}
 
 		vx.changeRenderInfo(render);
-		
-		usleep(1e3);
+
+		int64_t end = utime_now();
+		pipeline.renderStats.record(start - job->queued, end - start);
+		pipeline.totalStats.record(0, end - job->frame.utime);
+		pipeline.recycle(job);
+
+		if (printStats && end - lastStats > 5000000) {
+			pipeline.printStats();
+			lastStats = end;
+		}
 	}
 
 }
-
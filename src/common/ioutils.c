@@ -90,6 +90,36 @@ write_fully (int fd, const void *b, int len)
     return cnt;
 }
 
+int
+writev_fully (int fd, struct iovec *iov, int iovcnt)
+{
+    int cnt = 0;
+    int thiscnt;
+
+    while (iovcnt > 0)
+    {
+        thiscnt = writev (fd, iov, iovcnt);
+        if (thiscnt < 0) {
+            perror ("writev");
+            return -1;
+        }
+        cnt += thiscnt;
+
+        // skip past the buffers which were written completely
+        while (iovcnt > 0 && thiscnt >= (int) iov->iov_len) {
+            thiscnt -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *) iov->iov_base + thiscnt;
+            iov->iov_len -= thiscnt;
+        }
+    }
+
+    return cnt;
+}
+
 int
 read_fully (int fd, void *b, int len)
 {
@@ -3,6 +3,7 @@
 
 #include <stdio.h>
 #include <inttypes.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -34,6 +35,10 @@ get_unique_filename (const char *path, const char *basename,
 
 int
 write_fully (int fd, const void *b, int len);
+/* like write_fully, but gathers the data from iovcnt buffers. iov is
+   modified as the data is written */
+int
+writev_fully (int fd, struct iovec *iov, int iovcnt);
 int
 read_fully (int fd, void *b, int len);
 int
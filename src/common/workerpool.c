@@ -0,0 +1,172 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "zarray.h"
+#include "workerpool.h"
+
+struct task
+{
+    void (*f)(void *p);
+    void *p;
+};
+
+struct workerpool
+{
+    int nthreads;
+    pthread_t *threads;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t start_cond; // signalled when a batch is ready, or on destroy
+    pthread_cond_t end_cond;   // signalled when the last task of a batch finishes
+
+    zarray_t *tasks;    // struct task
+    int taskspos;       // next task to hand out
+    int tasksdone;      // tasks of the current batch that have finished
+    int generation;     // bumped once per batch so workers don't rerun one
+    int batch_active;   // set while workerpool_run is handing out tasks
+    int running;
+};
+
+// Pulls tasks until the batch is exhausted. Called with wp->mutex held,
+// returns with it held. A worker that wakes up late may find that its
+// batch has already finished and that the next one is being added, so
+// it only takes tasks while 'generation' is still running.
+static void
+run_tasks_locked (workerpool_t *wp, int generation)
+{
+    while (wp->batch_active && wp->generation == generation &&
+           wp->taskspos < zarray_size (wp->tasks)) {
+        struct task task;
+        zarray_get (wp->tasks, wp->taskspos, &task);
+        wp->taskspos++;
+
+        pthread_mutex_unlock (&wp->mutex);
+        task.f (task.p);
+        pthread_mutex_lock (&wp->mutex);
+
+        wp->tasksdone++;
+        if (wp->tasksdone == zarray_size (wp->tasks))
+            pthread_cond_broadcast (&wp->end_cond);
+    }
+}
+
+static void *
+worker_thread (void *arg)
+{
+    workerpool_t *wp = arg;
+    int generation = 0;
+
+    pthread_mutex_lock (&wp->mutex);
+    while (1) {
+        while (wp->running && wp->generation == generation)
+            pthread_cond_wait (&wp->start_cond, &wp->mutex);
+
+        if (!wp->running)
+            break;
+
+        generation = wp->generation;
+        run_tasks_locked (wp, generation);
+    }
+    pthread_mutex_unlock (&wp->mutex);
+
+    return NULL;
+}
+
+workerpool_t *
+workerpool_create (int nthreads)
+{
+    assert (nthreads > 0);
+
+    workerpool_t *wp = calloc (1, sizeof(*wp));
+    wp->nthreads = nthreads;
+    wp->tasks = zarray_create (sizeof(struct task));
+    wp->running = 1;
+
+    pthread_mutex_init (&wp->mutex, NULL);
+    pthread_cond_init (&wp->start_cond, NULL);
+    pthread_cond_init (&wp->end_cond, NULL);
+
+    // the thread calling workerpool_run() is the last worker
+    wp->threads = calloc (nthreads - 1, sizeof(pthread_t));
+    for (int i = 0; i < nthreads - 1; i++)
+        pthread_create (&wp->threads[i], NULL, worker_thread, wp);
+
+    return wp;
+}
+
+void
+workerpool_destroy (workerpool_t *wp)
+{
+    if (wp == NULL)
+        return;
+
+    pthread_mutex_lock (&wp->mutex);
+    wp->running = 0;
+    pthread_cond_broadcast (&wp->start_cond);
+    pthread_mutex_unlock (&wp->mutex);
+
+    for (int i = 0; i < wp->nthreads - 1; i++)
+        pthread_join (wp->threads[i], NULL);
+
+    pthread_cond_destroy (&wp->end_cond);
+    pthread_cond_destroy (&wp->start_cond);
+    pthread_mutex_destroy (&wp->mutex);
+
+    zarray_destroy (wp->tasks);
+    free (wp->threads);
+    free (wp);
+}
+
+int
+workerpool_get_nthreads (workerpool_t *wp)
+{
+    return wp->nthreads;
+}
+
+void
+workerpool_add_task (workerpool_t *wp, void (*f)(void *p), void *p)
+{
+    struct task task = { .f = f, .p = p };
+
+    pthread_mutex_lock (&wp->mutex);
+    zarray_add (wp->tasks, &task);
+    pthread_mutex_unlock (&wp->mutex);
+}
+
+void
+workerpool_run_single (workerpool_t *wp)
+{
+    for (int i = 0; i < zarray_size (wp->tasks); i++) {
+        struct task task;
+        zarray_get (wp->tasks, i, &task);
+        task.f (task.p);
+    }
+
+    zarray_clear (wp->tasks);
+}
+
+void
+workerpool_run (workerpool_t *wp)
+{
+    if (wp->nthreads == 1 || zarray_size (wp->tasks) <= 1) {
+        workerpool_run_single (wp);
+        return;
+    }
+
+    pthread_mutex_lock (&wp->mutex);
+    wp->taskspos = 0;
+    wp->tasksdone = 0;
+    wp->generation++;
+    wp->batch_active = 1;
+    pthread_cond_broadcast (&wp->start_cond);
+
+    run_tasks_locked (wp, wp->generation);
+
+    while (wp->tasksdone < zarray_size (wp->tasks))
+        pthread_cond_wait (&wp->end_cond, &wp->mutex);
+
+    wp->batch_active = 0;
+    zarray_clear (wp->tasks);
+    pthread_mutex_unlock (&wp->mutex);
+}
@@ -0,0 +1,43 @@
+#ifndef __WORKERPOOL_H__
+#define __WORKERPOOL_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// A fixed set of threads that run batches of independent tasks.
+//
+// Usage: add any number of tasks with workerpool_add_task(), then call
+// workerpool_run(), which hands the tasks out to the threads (the
+// calling thread included) and returns once all of them have finished.
+// The task list is cleared afterwards, so the pool can be reused for
+// the next batch. A pool must only be driven by one thread at a time.
+typedef struct workerpool workerpool_t;
+
+// nthreads counts the calling thread, so nthreads = 1 creates no
+// threads and runs everything inline.
+workerpool_t *
+workerpool_create (int nthreads);
+
+void
+workerpool_destroy (workerpool_t *wp);
+
+int
+workerpool_get_nthreads (workerpool_t *wp);
+
+void
+workerpool_add_task (workerpool_t *wp, void (*f)(void *p), void *p);
+
+// Runs all added tasks and blocks until they are done.
+void
+workerpool_run (workerpool_t *wp);
+
+// Runs all added tasks on the calling thread only.
+void
+workerpool_run_single (workerpool_t *wp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__WORKERPOOL_H__
@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "workerpool.h"
+
+// Stress test for workerpool: runs many small batches of varying size
+// back to back and checks that every task of every batch ran exactly
+// once, and that workerpool_run only returned after all of them had
+// finished. Back-to-back batches of different sizes are what let a
+// worker that wakes up late for one batch see the next one's tasks.
+//
+// usage: workerpool_test [nthreads [nbatches]]
+
+#define MAX_TASKS 64
+
+struct task_arg
+{
+    int *count;
+    int spin;
+};
+
+static void
+task (void *p)
+{
+    struct task_arg *arg = p;
+
+    // vary the task length so workers finish in different orders
+    volatile int x = 0;
+    for (int i = 0; i < arg->spin; i++)
+        x += i;
+
+    __sync_fetch_and_add (arg->count, 1);
+}
+
+int
+main (int argc, char *argv[])
+{
+    int nthreads = 4, nbatches = 200000;
+    if (argc > 1)
+        nthreads = atoi (argv[1]);
+    if (argc > 2)
+        nbatches = atoi (argv[2]);
+
+    workerpool_t *wp = workerpool_create (nthreads);
+
+    int count[MAX_TASKS];
+    struct task_arg args[MAX_TASKS];
+    int failed = 0;
+
+    srand (1);
+
+    for (int batch = 0; batch < nbatches && failed < 10; batch++) {
+        int ntasks = 1 + rand () % MAX_TASKS;
+
+        for (int i = 0; i < ntasks; i++) {
+            count[i] = 0;
+            args[i].count = &count[i];
+            args[i].spin = rand () % 64;
+            workerpool_add_task (wp, task, &args[i]);
+        }
+
+        workerpool_run (wp);
+
+        for (int i = 0; i < ntasks; i++) {
+            int c = __sync_fetch_and_add (&count[i], 0);
+            if (c != 1) {
+                printf ("batch %d: task %d of %d ran %d times\n", batch, i, ntasks, c);
+                failed++;
+            }
+        }
+    }
+
+    workerpool_destroy (wp);
+
+    printf ("workerpool: %s\n", failed ? "FAILED" : "ok");
+    return failed != 0;
+}
@@ -7,6 +7,10 @@
 #include "image_u8x3.h"
 #include "image_convert.h"
 
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
 ////////////////////////////////////////////
 // Guide to interpreting pixel formats
 //
@@ -30,12 +34,9 @@ clamp (int v)
 }
 
 // byte-order B, G, R, A ==> R, G, B, A
-static image_u32_t *
-convert_bgra_to_u32 (image_source_data_t *frmd)
+static void
+convert_bgra_to_u32 (image_source_data_t *frmd, image_u32_t *im)
 {
-    image_u32_t *im = image_u32_create (frmd->ifmt.width,
-                                        frmd->ifmt.height);
-
     int width = im->width;
     int height = im->height;
     int stride = im->stride;
@@ -57,17 +58,12 @@ convert_bgra_to_u32 (image_source_data_t *frmd)
             out[4*(y*stride+x) + 3] = a;
         }
     }
-
-    return im;
 }
 
 // byte-order R, G, B, A ==> R, G, B, A... i.e., a copy.
-static image_u32_t *
-convert_rgba_to_u32 (image_source_data_t *frmd)
+static void
+convert_rgba_to_u32 (image_source_data_t *frmd, image_u32_t *im)
 {
-    image_u32_t *im = image_u32_create (frmd->ifmt.width,
-                                        frmd->ifmt.height);
-
     int width = im->width;
     int height = im->height;
     int stride = im->stride;
@@ -77,17 +73,12 @@ convert_rgba_to_u32 (image_source_data_t *frmd)
 
     for (int y = 0; y < height; y++)
         memcpy (&out[y*stride], &in[y*width], 4*width);
-
-    return im;
 }
 
 // byte-order R, G, B, ==> R, G, B, 0xff
-static image_u32_t *
-convert_rgb24_to_u32 (image_source_data_t *frmd)
+static void
+convert_rgb24_to_u32 (image_source_data_t *frmd, image_u32_t *im)
 {
-    image_u32_t *im = image_u32_create (frmd->ifmt.width,
-                                        frmd->ifmt.height);
-
     int width = im->width;
     int height = im->height;
     int stride = im->stride;
@@ -108,16 +99,11 @@ convert_rgb24_to_u32 (image_source_data_t *frmd)
             out[4*(y*stride+x) + 3] = 0xff;
         }
     }
-
-    return im;
 }
 
-static image_u32_t *
-convert_yu12_to_u32 (image_source_data_t *frmd)
+static void
+convert_yu12_to_u32 (image_source_data_t *frmd, image_u32_t *im)
 {
-    image_u32_t *im = image_u32_create (frmd->ifmt.width,
-                                        frmd->ifmt.height);
-
     int width = im->width;
     int height = im->height;
     int stride = im->stride;
@@ -151,15 +137,11 @@ convert_yu12_to_u32 (image_source_data_t *frmd)
             out[4*(y*stride+x) + 3] = 0xff;
         }
     }
-    return im;
 }
 
-static image_u32_t *
-convert_yuyv_to_u32 (image_source_data_t *frmd)
+static void
+convert_yuyv_to_u32 (image_source_data_t *frmd, image_u32_t *im)
 {
-    image_u32_t *im = image_u32_create (frmd->ifmt.width,
-                                        frmd->ifmt.height);
-
     int width = im->width;
     int height = im->height;
     int stride = im->stride;
@@ -200,7 +182,6 @@ convert_yuyv_to_u32 (image_source_data_t *frmd)
             out[4*(y*stride+2*x+1) + 3] = 0xff;
         }
     }
-    return im;
 }
 
 static image_u8x3_t *
@@ -250,12 +231,88 @@ convert_yuyv_to_u8x3 (image_source_data_t *frmd)
     return im;
 }
 
-static image_u32_t *
-debayer_rggb_to_u32 (image_source_data_t *frmd)
+static inline void
+debayer_rggb_block (const uint8_t *in, uint8_t *out, int width, int height, int stride,
+                    int x, int y)
 {
-    image_u32_t *im = image_u32_create (frmd->ifmt.width,
-                                        frmd->ifmt.height);
+    int r = 0, g = 0, b = 0;
+
+    // compute indices into bayer pattern for the nine 2x2 blocks we'll use.
+    int X00 = (y-2)*width+(x-2);
+    int X01 = (y-2)*width+(x+0);
+    int X02 = (y-2)*width+(x+2);
+    int X10 = (y+0)*width+(x-2);
+    int X11 = (y+0)*width+(x+0);
+    int X12 = (y+0)*width+(x+2);
+    int X20 = (y+2)*width+(x-2);
+    int X21 = (y+2)*width+(x+0);
+    int X22 = (y+2)*width+(x+2);
+
+    // handle the edges of the screen.
+    if (y < 2) {
+        X00 += 2*width;
+        X01 += 2*width;
+        X02 += 2*width;
+    }
+    if (y+2 >= height) {
+        X20 -= 2*width;
+        X21 -= 2*width;
+        X22 -= 2*width;
+    }
+    if (x < 2) {
+        X00 += 2;
+        X10 += 2;
+        X20 += 2;
+    }
+    if (x+2 >= width) {
+        X02 -= 2;
+        X12 -= 2;
+        X22 -= 2;
+    }
 
+    int idx = 4 * (y*stride + x);
+
+    // top left pixel (R)
+    r = (in[X11]);
+    g = ((in[X01+width])+(in[X10+1])+(in[X11+1])+(in[X11+width])) / 4;
+    b = ((in[X00+width+1])+(in[X10+width+1])+(in[X10+width+1])+(in[X11+width+1])) / 4;
+    out[idx+0] = r;
+    out[idx+1] = g;
+    out[idx+2] = b;
+    out[idx+3] = 0xff;
+
+    // top right pixel (G)
+    r = ((in[X11])+(in[X12])) / 2;
+    g = (in[X11+1]);
+    b = ((in[X01+width+1])+(in[X11+width+1])) / 2;
+    out[idx+4] = r;
+    out[idx+5] = g;
+    out[idx+6] = b;
+    out[idx+7] = 0xff;
+
+    // bottom left pixel (G)
+    r = ((in[X11])+(in[X21])) / 2;
+    g = (in[X11+width]);
+    b = ((in[X10+width+1])+(in[X11+width+1])) / 2;
+    idx += 4*stride;
+    out[idx+0] = r;
+    out[idx+1] = g;
+    out[idx+2] = b;
+    out[idx+3] = 0xff;
+
+    // bottom right pixel (B)
+    r = ((in[X11])+(in[X12])+(in[X21])+(in[X22])) / 4;
+    g = ((in[X11+1])+(in[X11+width])+(in[X12+width])+(in[X21+1]))/ 4;
+    b = (in[X11+width+1]);
+    out[idx+4] = r;
+    out[idx+5] = g;
+    out[idx+6] = b;
+    out[idx+7] = 0xff;
+}
+
+static void
+debayer_rggb_to_u32 (image_source_data_t *frmd, image_u32_t *im)
+{
     uint8_t *in = (uint8_t*) frmd->data;
     uint8_t *out = (uint8_t*) im->buf;
 
@@ -265,93 +322,14 @@ debayer_rggb_to_u32 (image_source_data_t *frmd)
 
     // loop over each 2x2 bayer block and compute the pixel values for each element.
     for (int y = 0; y < height; y+=2) {
-        for (int x = 0; x < width; x+=2) {
-
-            int r = 0, g = 0, b = 0;
-
-            // compute indices into bayer pattern for the nine 2x2 blocks we'll use.
-            int X00 = (y-2)*width+(x-2);
-            int X01 = (y-2)*width+(x+0);
-            int X02 = (y-2)*width+(x+2);
-            int X10 = (y+0)*width+(x-2);
-            int X11 = (y+0)*width+(x+0);
-            int X12 = (y+0)*width+(x+2);
-            int X20 = (y+2)*width+(x-2);
-            int X21 = (y+2)*width+(x+0);
-            int X22 = (y+2)*width+(x+2);
-
-            // handle the edges of the screen.
-            if (y < 2) {
-                X00 += 2*width;
-                X01 += 2*width;
-                X02 += 2*width;
-            }
-            if (y+2 >= height) {
-                X20 -= 2*width;
-                X21 -= 2*width;
-                X22 -= 2*width;
-            }
-            if (x < 2) {
-                X00 += 2;
-                X10 += 2;
-                X20 += 2;
-            }
-            if (x+2 >= width) {
-                X02 -= 2;
-                X12 -= 2;
-                X22 -= 2;
-            }
-
-            int idx = 4 * (y*stride + x);
-
-            // top left pixel (R)
-            r = (in[X11]);
-            g = ((in[X01+width])+(in[X10+1])+(in[X11+1])+(in[X11+width])) / 4;
-            b = ((in[X00+width+1])+(in[X10+width+1])+(in[X10+width+1])+(in[X11+width+1])) / 4;
-            out[idx+0] = r;
-            out[idx+1] = g;
-            out[idx+2] = b;
-            out[idx+3] = 0xff;
-
-            // top right pixel (G)
-            r = ((in[X11])+(in[X12])) / 2;
-            g = (in[X11+1]);
-            b = ((in[X01+width+1])+(in[X11+width+1])) / 2;
-            out[idx+4] = r;
-            out[idx+5] = g;
-            out[idx+6] = b;
-            out[idx+7] = 0xff;
-
-            // bottom left pixel (G)
-            r = ((in[X11])+(in[X21])) / 2;
-            g = (in[X11+width]);
-            b = ((in[X10+width+1])+(in[X11+width+1])) / 2;
-            idx += 4*stride;
-            out[idx+0] = r;
-            out[idx+1] = g;
-            out[idx+2] = b;
-            out[idx+3] = 0xff;
-
-            // bottom right pixel (B)
-            r = ((in[X11])+(in[X12])+(in[X21])+(in[X22])) / 4;
-            g = ((in[X11+1])+(in[X11+width])+(in[X12+width])+(in[X21+1]))/ 4;
-            b = (in[X11+width+1]);
-            out[idx+4] = r;
-            out[idx+5] = g;
-            out[idx+6] = b;
-            out[idx+7] = 0xff;
-        }
+        for (int x = 0; x < width; x+=2)
+            debayer_rggb_block (in, out, width, height, stride, x, y);
     }
-
-    return im;
 }
 
-static image_u32_t *
-debayer_rggb16_to_u32 (image_source_data_t *frmd)
+static void
+debayer_rggb16_to_u32 (image_source_data_t *frmd, image_u32_t *im)
 {
-    image_u32_t *im = image_u32_create (frmd->ifmt.width,
-                                        frmd->ifmt.height);
-
     uint8_t *in = (uint8_t*) frmd->data;
     uint8_t *out = (uint8_t*) im->buf;
 
@@ -438,16 +416,91 @@ debayer_rggb16_to_u32 (image_source_data_t *frmd)
             out[idx+7] = 0xff;
         }
     }
-
-    return im;
 }
 
-static image_u32_t *
-debayer_gbrg_to_u32 (image_source_data_t *frmd)
+static inline void
+debayer_gbrg_block (const uint8_t *in, uint8_t *out, int width, int height, int stride,
+                    int x, int y)
 {
-    image_u32_t *im = image_u32_create (frmd->ifmt.width,
-                                        frmd->ifmt.height);
+    int r = 0, g = 0, b = 0;
+
+    // compute indices into bayer pattern for the nine 2x2 blocks we'll use.
+    int X00 = (y-2)*width+(x-2);
+    int X01 = (y-2)*width+(x+0);
+    int X02 = (y-2)*width+(x+2);
+    int X10 = (y+0)*width+(x-2);
+    int X11 = (y+0)*width+(x+0);
+    int X12 = (y+0)*width+(x+2);
+    int X20 = (y+2)*width+(x-2);
+    int X21 = (y+2)*width+(x+0);
+    int X22 = (y+2)*width+(x+2);
+
+    // handle the edges of the screen.
+    if (y < 2) {
+        X00 += 2*width;
+        X01 += 2*width;
+        X02 += 2*width;
+    }
+    if (y+2 >= height) {
+        X20 -= 2*width;
+        X21 -= 2*width;
+        X22 -= 2*width;
+    }
+    if (x < 2) {
+        X00 += 2;
+        X10 += 2;
+        X20 += 2;
+    }
+    if (x+2 >= width) {
+        X02 -= 2;
+        X12 -= 2;
+        X22 -= 2;
+    }
 
+    int idx = 4*(y*stride+x);
+
+    // top left pixel (G)
+    r = ((in[X01+width]) + (in[X11+width])) / 2;
+    g = in[X11];
+    b = ((in[X10+1]) + (in[X11+1])) / 2;
+    out[idx+0] = r;
+    out[idx+1] = g;
+    out[idx+2] = b;
+    out[idx+3] = 0xff;
+
+    // top right pixel (B)
+    r = ((in[X01+width])+(in[X02+width])+(in[X01+width]) + (in[X12+width])) / 4;
+    g = ((in[X01+width+1])+(in[X11])+(in[X12])+(in[X11+width+1])) / 4;
+    b = (in[X11+1]);
+    out[idx+4] = r;
+    out[idx+5] = g;
+    out[idx+6] = b;
+    out[idx+7] = 0xff;
+
+    // bottom left pixel (R)
+    r = (in[X11+width]);
+    g = ((in[X11])+(in[X10+width+1])+(in[X11+width+1])+(in[X21])) / 4;
+    b = ((in[X10+1])+(in[X11+1])+(in[X20+1])+(in[X21+1])) / 4;
+
+    idx += 4*stride;
+    out[idx+0] = r;
+    out[idx+1] = g;
+    out[idx+2] = b;
+    out[idx+3] = 0xff;
+
+    // bottom right pixel (G)
+    r = ((in[X11+width])+(in[X12+width])) / 2;
+    g = (in[X11+width+1]);
+    b = ((in[X11+1])+(in[X21+1])) / 2;
+    out[idx+4] = r;
+    out[idx+5] = g;
+    out[idx+6] = b;
+    out[idx+7] = 0xff;
+}
+
+static void
+debayer_gbrg_to_u32 (image_source_data_t *frmd, image_u32_t *im)
+{
     uint8_t *in = (uint8_t*) frmd->data;
     uint8_t *out = (uint8_t*) im->buf;
 
@@ -458,94 +511,15 @@ debayer_gbrg_to_u32 (image_source_data_t *frmd)
     // Loop over each 2x2 bayer block and compute the pixel values for
     // each element
     for (int y = 0; y < height; y+=2) {
-        for (int x = 0; x < width; x+=2) {
-            int r = 0, g = 0, b = 0;
-
-             // compute indices into bayer pattern for the nine 2x2 blocks we'll use.
-            int X00 = (y-2)*width+(x-2);
-            int X01 = (y-2)*width+(x+0);
-            int X02 = (y-2)*width+(x+2);
-            int X10 = (y+0)*width+(x-2);
-            int X11 = (y+0)*width+(x+0);
-            int X12 = (y+0)*width+(x+2);
-            int X20 = (y+2)*width+(x-2);
-            int X21 = (y+2)*width+(x+0);
-            int X22 = (y+2)*width+(x+2);
-
-             // handle the edges of the screen.
-            if (y < 2) {
-                X00 += 2*width;
-                X01 += 2*width;
-                X02 += 2*width;
-            }
-            if (y+2 >= height) {
-                X20 -= 2*width;
-                X21 -= 2*width;
-                X22 -= 2*width;
-            }
-            if (x < 2) {
-                X00 += 2;
-                X10 += 2;
-                X20 += 2;
-            }
-            if (x+2 >= width) {
-                X02 -= 2;
-                X12 -= 2;
-                X22 -= 2;
-            }
-
-            int idx = 4*(y*stride+x);
-
-            // top left pixel (G)
-            r = ((in[X01+width]) + (in[X11+width])) / 2;
-            g = in[X11];
-            b = ((in[X10+1]) + (in[X11+1])) / 2;
-            out[idx+0] = r;
-            out[idx+1] = g;
-            out[idx+2] = b;
-            out[idx+3] = 0xff;
-
-            // top right pixel (B)
-            r = ((in[X01+width])+(in[X02+width])+(in[X01+width]) + (in[X12+width])) / 4;
-            g = ((in[X01+width+1])+(in[X11])+(in[X12])+(in[X11+width+1])) / 4;
-            b = (in[X11+1]);
-            out[idx+4] = r;
-            out[idx+5] = g;
-            out[idx+6] = b;
-            out[idx+7] = 0xff;
-
-            // bottom left pixel (R)
-            r = (in[X11+width]);
-            g = ((in[X11])+(in[X10+width+1])+(in[X11+width+1])+(in[X21])) / 4;
-            b = ((in[X10+1])+(in[X11+1])+(in[X20+1])+(in[X21+1])) / 4;
-
-            idx += 4*stride;
-            out[idx+0] = r;
-            out[idx+1] = g;
-            out[idx+2] = b;
-            out[idx+3] = 0xff;
-
-            // bottom right pixel (G)
-            r = ((in[X11+width])+(in[X12+width])) / 2;
-            g = (in[X11+width+1]);
-            b = ((in[X11+1])+(in[X21+1])) / 2;
-            out[idx+4] = r;
-            out[idx+5] = g;
-            out[idx+6] = b;
-            out[idx+7] = 0xff;
-        }
+        for (int x = 0; x < width; x+=2)
+            debayer_gbrg_block (in, out, width, height, stride, x, y);
     }
-
-    return im;
 }
 
 // assumes MSB, LSB byte ordering
-static image_u32_t *
-debayer_gbrg16_to_u32 (image_source_data_t *frmd)
+static void
+debayer_gbrg16_to_u32 (image_source_data_t *frmd, image_u32_t *im)
 {
-    image_u32_t *im = image_u32_create (frmd->ifmt.width,
-                                        frmd->ifmt.height);
-
     uint8_t *in = (uint8_t*) frmd->data;
     uint8_t *out = (uint8_t*) im->buf;
 
@@ -633,8 +607,6 @@ debayer_gbrg16_to_u32 (image_source_data_t *frmd)
             out[idx+7] = 0xff;
         }
     }
-
-    return im;
 }
 
 static image_u8x3_t *
@@ -730,11 +702,9 @@ debayer_gbrg_to_u8x3 (image_source_data_t *frmd)
     return im;
 }
 
-static image_u32_t *
-gray8_to_u32 (image_source_data_t *frmd)
+static void
+gray8_to_u32 (image_source_data_t *frmd, image_u32_t *im)
 {
-    image_u32_t *im = image_u32_create (frmd->ifmt.width,
-                                        frmd->ifmt.height);
     uint8_t *buf = (uint8_t*)(frmd->data);
     for (int y = 0; y < im->height; y++) {
         for (int x = 0; x < im->width; x++) {
@@ -743,16 +713,12 @@ gray8_to_u32 (image_source_data_t *frmd)
             im->buf[y*im->stride+x] = (0xff000000) | gray << 16 | gray << 8 | gray;
         }
     }
-
-    return im;
 }
 
 // byte-order MSB, LSB
-static image_u32_t *
-gray16_to_u32 (image_source_data_t *frmd)
+static void
+gray16_to_u32 (image_source_data_t *frmd, image_u32_t *im)
 {
-    image_u32_t *im = image_u32_create (frmd->ifmt.width,
-                                        frmd->ifmt.height);
     uint8_t *buf = (uint8_t*)(frmd->data);
 
     for (int y = 0; y < im->height; y++) {
@@ -762,31 +728,491 @@ gray16_to_u32 (image_source_data_t *frmd)
             im->buf[y*im->stride+x] = (0xff000000) | gray << 16 | gray << 8 | gray;
         }
     }
+}
 
-    return im;
+////////////////////////////////////////////
+// SIMD kernels
+//
+// Each kernel gives exactly the same output as the scalar converter
+// it stands in for (image_convert_test checks this), and falls back
+// to the scalar code for whatever doesn't fill a whole vector.
+// find_u32_converter picks them at runtime.
+
+#if defined(__SSE2__)
+
+// stores 16 pixels given as 16 bytes each of r, g, b
+static inline void
+store_rgb_as_u32_sse2 (uint8_t *out, __m128i r, __m128i g, __m128i b)
+{
+    __m128i a = _mm_set1_epi8((char) 0xff);
+    __m128i rg_lo = _mm_unpacklo_epi8(r, g);
+    __m128i rg_hi = _mm_unpackhi_epi8(r, g);
+    __m128i ba_lo = _mm_unpacklo_epi8(b, a);
+    __m128i ba_hi = _mm_unpackhi_epi8(b, a);
+
+    _mm_storeu_si128((__m128i*) &out[0],  _mm_unpacklo_epi16(rg_lo, ba_lo));
+    _mm_storeu_si128((__m128i*) &out[16], _mm_unpackhi_epi16(rg_lo, ba_lo));
+    _mm_storeu_si128((__m128i*) &out[32], _mm_unpacklo_epi16(rg_hi, ba_hi));
+    _mm_storeu_si128((__m128i*) &out[48], _mm_unpackhi_epi16(rg_hi, ba_hi));
 }
 
-// convert to ABGR format (MSB to LSB, host byte ordering.)
-image_u32_t *
-image_convert_u32 (image_source_data_t *isdata)
+// 8 pixels per iteration. The chroma terms are computed in 32 bits
+// (as in the scalar code) and the final sums saturate to [0, 255]
+// exactly like clamp().
+static void
+convert_yuyv_to_u32_sse2 (image_source_data_t *frmd, image_u32_t *im)
+{
+    int width = im->width;
+    int height = im->height;
+    int stride = im->stride;
+
+    int sstride = width*2;
+    uint8_t *yuyv = (uint8_t*)(frmd->data);
+    uint8_t *out = (uint8_t*) im->buf;
+
+    const __m128i lo_byte = _mm_set1_epi16(0x00ff);
+    const __m128i bias = _mm_set1_epi16(128);
+    const __m128i kb = _mm_setr_epi16(454, 0, 454, 0, 454, 0, 454, 0);
+    const __m128i kr = _mm_setr_epi16(0, 359, 0, 359, 0, 359, 0, 359);
+    const __m128i kg = _mm_setr_epi16(88, 183, 88, 183, 88, 183, 88, 183);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (int y = 0; y < height; y++) {
+        uint8_t *in = &yuyv[y*sstride];
+        uint8_t *o = &out[4*y*stride];
+
+        int x = 0;
+        for (; x + 8 <= width; x += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i*) &in[2*x]);
+
+            __m128i ys = _mm_and_si128(v, lo_byte);
+            // u0, v0, u1, v1, ... minus 128
+            __m128i uv = _mm_sub_epi16(_mm_srli_epi16(v, 8), bias);
+
+            __m128i cb = _mm_srai_epi32(_mm_madd_epi16(uv, kb), 8);
+            __m128i cr = _mm_srai_epi32(_mm_madd_epi16(uv, kr), 8);
+            __m128i cg = _mm_srai_epi32(_mm_madd_epi16(uv, kg), 8);
+
+            // one value per pixel pair, widened to one per pixel
+            __m128i cbcr = _mm_packs_epi32(cb, cr);
+            cg = _mm_packs_epi32(cg, cg);
+            cb = _mm_unpacklo_epi16(cbcr, cbcr);
+            cr = _mm_unpackhi_epi16(cbcr, cbcr);
+            cg = _mm_unpacklo_epi16(cg, cg);
+
+            __m128i r = _mm_packus_epi16(_mm_add_epi16(ys, cr), zero);
+            __m128i g = _mm_packus_epi16(_mm_sub_epi16(ys, cg), zero);
+            __m128i b = _mm_packus_epi16(_mm_add_epi16(ys, cb), zero);
+
+            __m128i rg = _mm_unpacklo_epi8(r, g);
+            __m128i ba = _mm_unpacklo_epi8(b, _mm_set1_epi8((char) 0xff));
+            _mm_storeu_si128((__m128i*) &o[4*x],    _mm_unpacklo_epi16(rg, ba));
+            _mm_storeu_si128((__m128i*) &o[4*x+16], _mm_unpackhi_epi16(rg, ba));
+        }
+
+        for (; x + 2 <= width; x += 2) {
+            int y1 = in[2*x+0];
+            int u  = in[2*x+1];
+            int y2 = in[2*x+2];
+            int v  = in[2*x+3];
+
+            int cb = ((u-128) * 454)>>8;
+            int cr = ((v-128) * 359)>>8;
+            int cg = ((v-128) * 183 + (u-128) * 88)>>8;
+
+            o[4*x+0] = clamp(y1 + cr);
+            o[4*x+1] = clamp(y1 - cg);
+            o[4*x+2] = clamp(y1 + cb);
+            o[4*x+3] = 0xff;
+
+            o[4*x+4] = clamp(y2 + cr);
+            o[4*x+5] = clamp(y2 - cg);
+            o[4*x+6] = clamp(y2 + cb);
+            o[4*x+7] = 0xff;
+        }
+    }
+}
+
+// The scalar code works in doubles and truncates twice, so this does
+// the same double operations two pixels at a time rather than switch
+// to fixed point, which would round differently.
+static void
+convert_yu12_to_u32_sse2 (image_source_data_t *frmd, image_u32_t *im)
+{
+    int width = im->width;
+    int height = im->height;
+    int stride = im->stride;
+    uint8_t *out = (uint8_t*) im->buf;
+    uint8_t *in = (uint8_t*) frmd->data;
+
+    assert (frmd->datalen == width*height + width*height / 4 + width*height / 4);
+
+    uint8_t *ys  = &in[0];
+    uint8_t *cbs = &in[width*height];
+    uint8_t *crs = &in[width*height + width*height/4];
+
+    const __m128d ky = _mm_set1_pd(298.082);
+    const __m128d krv = _mm_set1_pd(408.583);
+    const __m128d kgu = _mm_set1_pd(100.291);
+    const __m128d kgv = _mm_set1_pd(208.120);
+    const __m128d kbu = _mm_set1_pd(516.412);
+    const __m128d scale = _mm_set1_pd(1.0 / 256);  // exact, same as / 256
+    const __m128d offr = _mm_set1_pd(222.921);
+    const __m128d offg = _mm_set1_pd(135.576);
+    const __m128d offb = _mm_set1_pd(276.836);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (int y = 0; y < height; y++) {
+        uint8_t *yrow = &ys[y*width];
+        uint8_t *cbrow = &cbs[(y/2)*(width/2)];
+        uint8_t *crrow = &crs[(y/2)*(width/2)];
+        uint8_t *o = &out[4*y*stride];
+
+        int x = 0;
+        for (; x + 4 <= width; x += 4) {
+            // the two pixels of a pair share their chroma
+            __m128d yy[2], cb[2], cr[2];
+            for (int i = 0; i < 2; i++) {
+                yy[i] = _mm_setr_pd(yrow[x+2*i], yrow[x+2*i+1]);
+                cb[i] = _mm_set1_pd(cbrow[x/2+i]);
+                cr[i] = _mm_set1_pd(crrow[x/2+i]);
+            }
+
+            __m128i r[2], g[2], b[2];
+            for (int i = 0; i < 2; i++) {
+                __m128d yt = _mm_mul_pd(ky, yy[i]);
+
+                __m128d t = _mm_mul_pd(_mm_add_pd(yt, _mm_mul_pd(krv, cr[i])), scale);
+                t = _mm_sub_pd(_mm_cvtepi32_pd(_mm_cvttpd_epi32(t)), offr);
+                r[i] = _mm_cvttpd_epi32(t);
+
+                t = _mm_sub_pd(_mm_sub_pd(yt, _mm_mul_pd(kgu, cb[i])), _mm_mul_pd(kgv, cr[i]));
+                t = _mm_add_pd(_mm_cvtepi32_pd(_mm_cvttpd_epi32(_mm_mul_pd(t, scale))), offg);
+                g[i] = _mm_cvttpd_epi32(t);
+
+                t = _mm_mul_pd(_mm_add_pd(yt, _mm_mul_pd(kbu, cb[i])), scale);
+                t = _mm_sub_pd(_mm_cvtepi32_pd(_mm_cvttpd_epi32(t)), offb);
+                b[i] = _mm_cvttpd_epi32(t);
+            }
+
+            // each result holds two int32s; gather four per channel
+            // and saturate to bytes, which is clamp()
+            __m128i rr = _mm_unpacklo_epi64(r[0], r[1]);
+            __m128i gg = _mm_unpacklo_epi64(g[0], g[1]);
+            __m128i bb = _mm_unpacklo_epi64(b[0], b[1]);
+            __m128i rg = _mm_packs_epi32(rr, gg);
+            __m128i ba = _mm_packs_epi32(bb, _mm_set1_epi32(0xff));
+            __m128i rgba = _mm_packus_epi16(rg, ba);
+            // r0..r3 g0..g3 b0..b3 a0..a3 -> r0 g0 b0 a0 ...
+            __m128i t0 = _mm_unpacklo_epi8(rgba, _mm_srli_si128(rgba, 8));
+            __m128i t1 = _mm_unpackhi_epi8(t0, zero);
+            t0 = _mm_unpacklo_epi8(t0, zero);
+            t0 = _mm_packus_epi16(_mm_unpacklo_epi16(t0, t1), _mm_unpackhi_epi16(t0, t1));
+            _mm_storeu_si128((__m128i*) &o[4*x], t0);
+        }
+
+        for (; x < width; x++) {
+            int yy = yrow[x];
+            int cr = crrow[x/2];
+            int cb = cbrow[x/2];
+
+            o[4*x+0] = clamp((int) ((298.082*yy + 408.583*cr) / 256) - 222.921);
+            o[4*x+1] = clamp((int) ((298.082*yy - 100.291*cb - 208.120*cr) / 256) + 135.576);
+            o[4*x+2] = clamp((int) ((298.082*yy + 516.412*cb) / 256) - 276.836);
+            o[4*x+3] = 0xff;
+        }
+    }
+}
+
+// Bilinear demosaic of the interior of a bayer image, eight 2x2 blocks
+// at a time. Each vector lane holds one block; the terms are the same
+// as in debayer_rggb_block/debayer_gbrg_block once the edge handling
+// drops out. Blocks within 2 pixels of the border go through the
+// scalar code.
+
+// 16-bit lanes holding the pixel at column x+2k+off (even) and the one
+// right after it (odd), for the row starting at p
+#define BAYER_EVEN(p, off) _mm_and_si128(_mm_loadu_si128((const __m128i*) &(p)[x+(off)]), lo_byte)
+#define BAYER_ODD(p, off)  _mm_srli_epi16(_mm_loadu_si128((const __m128i*) &(p)[x+(off)]), 8)
+
+// interleaves 16-bit lanes holding left and right pixels back into 16 bytes
+#define BAYER_PAIR(left, right) _mm_or_si128(left, _mm_slli_epi16(right, 8))
+
+static void
+debayer_rggb_to_u32_sse2 (image_source_data_t *frmd, image_u32_t *im)
+{
+    uint8_t *in = (uint8_t*) frmd->data;
+    uint8_t *out = (uint8_t*) im->buf;
+
+    int width = im->width;
+    int height = im->height;
+    int stride = im->stride;
+
+    const __m128i lo_byte = _mm_set1_epi16(0x00ff);
+
+    for (int y = 0; y < height; y+=2) {
+        int x = 0;
+
+        if (y >= 2 && y+2 < height) {
+            const uint8_t *rm = &in[(y-1)*width];
+            const uint8_t *r0 = &in[y*width];
+            const uint8_t *r1 = &in[(y+1)*width];
+            const uint8_t *r2 = &in[(y+2)*width];
+
+            for (x = 0; x < 2; x+=2)
+                debayer_rggb_block (in, out, width, height, stride, x, y);
+
+            for (; x + 18 <= width; x += 16) {
+                __m128i r0m = BAYER_ODD(r0, -2);    // column x-1
+                __m128i r0c = BAYER_EVEN(r0, 0);    // column x
+                __m128i r0n = BAYER_ODD(r0, 0);     // column x+1
+                __m128i r0p = BAYER_EVEN(r0, 2);    // column x+2
+                __m128i r1m = BAYER_ODD(r1, -2);
+                __m128i r1c = BAYER_EVEN(r1, 0);
+                __m128i r1n = BAYER_ODD(r1, 0);
+                __m128i r1p = BAYER_EVEN(r1, 2);
+                __m128i rmm = BAYER_ODD(rm, -2);
+                __m128i rmc = BAYER_EVEN(rm, 0);
+                __m128i rmn = BAYER_ODD(rm, 0);
+                __m128i r2c = BAYER_EVEN(r2, 0);
+                __m128i r2n = BAYER_ODD(r2, 0);
+                __m128i r2p = BAYER_EVEN(r2, 2);
+
+                // top left (R), top right (G)
+                __m128i tl_r = r0c;
+                __m128i tl_g = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(rmc, r0m), _mm_add_epi16(r0n, r1c)), 2);
+                __m128i tl_b = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(rmm, r1m), _mm_add_epi16(r1m, r1n)), 2);
+                __m128i tr_r = _mm_srli_epi16(_mm_add_epi16(r0c, r0p), 1);
+                __m128i tr_g = r0n;
+                __m128i tr_b = _mm_srli_epi16(_mm_add_epi16(rmn, r1n), 1);
+
+                // bottom left (G), bottom right (B)
+                __m128i bl_r = _mm_srli_epi16(_mm_add_epi16(r0c, r2c), 1);
+                __m128i bl_g = r1c;
+                __m128i bl_b = _mm_srli_epi16(_mm_add_epi16(r1m, r1n), 1);
+                __m128i br_r = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(r0c, r0p), _mm_add_epi16(r2c, r2p)), 2);
+                __m128i br_g = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(r0n, r1c), _mm_add_epi16(r1p, r2n)), 2);
+                __m128i br_b = r1n;
+
+                store_rgb_as_u32_sse2 (&out[4*(y*stride+x)],
+                                       BAYER_PAIR(tl_r, tr_r), BAYER_PAIR(tl_g, tr_g), BAYER_PAIR(tl_b, tr_b));
+                store_rgb_as_u32_sse2 (&out[4*((y+1)*stride+x)],
+                                       BAYER_PAIR(bl_r, br_r), BAYER_PAIR(bl_g, br_g), BAYER_PAIR(bl_b, br_b));
+            }
+        }
+
+        for (; x < width; x+=2)
+            debayer_rggb_block (in, out, width, height, stride, x, y);
+    }
+}
+
+static void
+debayer_gbrg_to_u32_sse2 (image_source_data_t *frmd, image_u32_t *im)
+{
+    uint8_t *in = (uint8_t*) frmd->data;
+    uint8_t *out = (uint8_t*) im->buf;
+
+    int width = im->width;
+    int height = im->height;
+    int stride = im->stride;
+
+    const __m128i lo_byte = _mm_set1_epi16(0x00ff);
+
+    for (int y = 0; y < height; y+=2) {
+        int x = 0;
+
+        if (y >= 2 && y+2 < height) {
+            const uint8_t *rm = &in[(y-1)*width];
+            const uint8_t *r0 = &in[y*width];
+            const uint8_t *r1 = &in[(y+1)*width];
+            const uint8_t *r2 = &in[(y+2)*width];
+
+            for (x = 0; x < 2; x+=2)
+                debayer_gbrg_block (in, out, width, height, stride, x, y);
+
+            for (; x + 18 <= width; x += 16) {
+                __m128i r0m = BAYER_ODD(r0, -2);    // column x-1
+                __m128i r0c = BAYER_EVEN(r0, 0);    // column x
+                __m128i r0n = BAYER_ODD(r0, 0);     // column x+1
+                __m128i r0p = BAYER_EVEN(r0, 2);    // column x+2
+                __m128i r1m = BAYER_ODD(r1, -2);
+                __m128i r1c = BAYER_EVEN(r1, 0);
+                __m128i r1n = BAYER_ODD(r1, 0);
+                __m128i r1p = BAYER_EVEN(r1, 2);
+                __m128i rmc = BAYER_EVEN(rm, 0);
+                __m128i rmn = BAYER_ODD(rm, 0);
+                __m128i rmp = BAYER_EVEN(rm, 2);
+                __m128i r2m = BAYER_ODD(r2, -2);
+                __m128i r2c = BAYER_EVEN(r2, 0);
+                __m128i r2n = BAYER_ODD(r2, 0);
+
+                // top left (G), top right (B)
+                __m128i tl_r = _mm_srli_epi16(_mm_add_epi16(rmc, r1c), 1);
+                __m128i tl_g = r0c;
+                __m128i tl_b = _mm_srli_epi16(_mm_add_epi16(r0m, r0n), 1);
+                __m128i tr_r = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(rmc, rmp), _mm_add_epi16(rmc, r1p)), 2);
+                __m128i tr_g = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(rmn, r0c), _mm_add_epi16(r0p, r1n)), 2);
+                __m128i tr_b = r0n;
+
+                // bottom left (R), bottom right (G)
+                __m128i bl_r = r1c;
+                __m128i bl_g = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(r0c, r1m), _mm_add_epi16(r1n, r2c)), 2);
+                __m128i bl_b = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(r0m, r0n), _mm_add_epi16(r2m, r2n)), 2);
+                __m128i br_r = _mm_srli_epi16(_mm_add_epi16(r1c, r1p), 1);
+                __m128i br_g = r1n;
+                __m128i br_b = _mm_srli_epi16(_mm_add_epi16(r0n, r2n), 1);
+
+                store_rgb_as_u32_sse2 (&out[4*(y*stride+x)],
+                                       BAYER_PAIR(tl_r, tr_r), BAYER_PAIR(tl_g, tr_g), BAYER_PAIR(tl_b, tr_b));
+                store_rgb_as_u32_sse2 (&out[4*((y+1)*stride+x)],
+                                       BAYER_PAIR(bl_r, br_r), BAYER_PAIR(bl_g, br_g), BAYER_PAIR(bl_b, br_b));
+            }
+        }
+
+        for (; x < width; x+=2)
+            debayer_gbrg_block (in, out, width, height, stride, x, y);
+    }
+}
+
+#undef BAYER_EVEN
+#undef BAYER_ODD
+#undef BAYER_PAIR
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_SSSE3_KERNELS
+
+__attribute__((target("ssse3")))
+static void
+convert_bgra_to_u32_ssse3 (image_source_data_t *frmd, image_u32_t *im)
+{
+    int width = im->width;
+    int height = im->height;
+    int stride = im->stride;
+
+    uint8_t *out = (uint8_t*) im->buf;
+    uint8_t *in  = (uint8_t*) frmd->data;
+
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                          10, 9, 8, 11, 14, 13, 12, 15);
+
+    for (int y = 0; y < height; y++) {
+        uint8_t *i = &in[4*y*width];
+        uint8_t *o = &out[4*y*stride];
+
+        int x = 0;
+        for (; x + 4 <= width; x += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i*) &i[4*x]);
+            _mm_storeu_si128((__m128i*) &o[4*x], _mm_shuffle_epi8(v, shuffle));
+        }
+
+        for (; x < width; x++) {
+            o[4*x+0] = i[4*x+2];
+            o[4*x+1] = i[4*x+1];
+            o[4*x+2] = i[4*x+0];
+            o[4*x+3] = i[4*x+3];
+        }
+    }
+}
+
+__attribute__((target("ssse3")))
+static void
+convert_rgb24_to_u32_ssse3 (image_source_data_t *frmd, image_u32_t *im)
+{
+    int width = im->width;
+    int height = im->height;
+    int stride = im->stride;
+
+    uint8_t *out = (uint8_t*) im->buf;
+    uint8_t *in  = (uint8_t*) frmd->data;
+
+    // 4 pixels from the low 12 bytes of each load, zeros for alpha
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                          6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+
+    for (int y = 0; y < height; y++) {
+        uint8_t *i = &in[3*y*width];
+        uint8_t *o = &out[4*y*stride];
+
+        // each load reads 4 bytes past the pixels it uses, so stop
+        // early enough to stay inside the row
+        int x = 0;
+        for (; x + 6 <= width; x += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i*) &i[3*x]);
+            v = _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha);
+            _mm_storeu_si128((__m128i*) &o[4*x], v);
+        }
+
+        for (; x < width; x++) {
+            o[4*x+0] = i[3*x+0];
+            o[4*x+1] = i[3*x+1];
+            o[4*x+2] = i[3*x+2];
+            o[4*x+3] = 0xff;
+        }
+    }
+}
+#endif /* x86 */
+#endif /* __SSE2__ */
+
+static int simd_enabled = 1;
+
+void
+image_convert_set_simd (int enable)
+{
+    simd_enabled = enable;
+}
+
+typedef void (*convert_u32_func_t)(image_source_data_t *frmd, image_u32_t *im);
+
+#if defined(__SSE2__)
+#define SSE2_KERNEL(f) f
+#else
+#define SSE2_KERNEL(f) NULL
+#endif
+
+#if defined(HAVE_SSSE3_KERNELS)
+#define SSSE3_KERNEL(f) f
+#else
+#define SSSE3_KERNEL(f) NULL
+#endif
+
+// the fastest of the given kernels this cpu can run
+static convert_u32_func_t
+pick_kernel (convert_u32_func_t scalar, convert_u32_func_t sse2, convert_u32_func_t ssse3)
+{
+    if (!simd_enabled)
+        return scalar;
+
+#if defined(HAVE_SSSE3_KERNELS)
+    if (ssse3 != NULL && __builtin_cpu_supports("ssse3"))
+        return ssse3;
+#endif
+
+    if (sse2 != NULL)
+        return sse2;
+    return scalar;
+}
+
+static convert_u32_func_t
+find_u32_converter (image_source_data_t *isdata)
 {
     if (0==strcmp ("BAYER_GBRG", isdata->ifmt.format))
-        return debayer_gbrg_to_u32 (isdata);
+        return pick_kernel (debayer_gbrg_to_u32, SSE2_KERNEL(debayer_gbrg_to_u32_sse2), NULL);
 
     else if (0==strcmp ("BAYER_GBRG16", isdata->ifmt.format))
-        return debayer_gbrg16_to_u32 (isdata);
+        return debayer_gbrg16_to_u32;
 
     else if (0==strcmp ("BAYER_RGGB", isdata->ifmt.format))
-        return debayer_rggb_to_u32 (isdata);
+        return pick_kernel (debayer_rggb_to_u32, SSE2_KERNEL(debayer_rggb_to_u32_sse2), NULL);
 
     else if (0==strcmp ("BAYER_RGGB16", isdata->ifmt.format))
-        return debayer_rggb16_to_u32 (isdata);
+        return debayer_rggb16_to_u32;
 
     else if (0==strcmp ("GRAY8", isdata->ifmt.format) ||  0==strcmp ("GRAY", isdata->ifmt.format))
-        return gray8_to_u32 (isdata);
+        return gray8_to_u32;
 
     else if (0==strcmp ("GRAY16", isdata->ifmt.format))
-        return gray16_to_u32 (isdata);
+        return gray16_to_u32;
 
 
 //    } else if (!strcmp("BAYER_GRBG", isdata->ifmt.format)) {
@@ -794,19 +1220,19 @@ image_convert_u32 (image_source_data_t *isdata)
 //    } else if (!strcmp("GRAY16", isdata->ifmt->format)) {
 
     else if (0==strcmp ("RGB", isdata->ifmt.format))
-        return convert_rgb24_to_u32 (isdata);
+        return pick_kernel (convert_rgb24_to_u32, NULL, SSSE3_KERNEL(convert_rgb24_to_u32_ssse3));
 
     else if (0==strcmp ("BGRA", isdata->ifmt.format))
-        return convert_bgra_to_u32 (isdata);
+        return pick_kernel (convert_bgra_to_u32, NULL, SSSE3_KERNEL(convert_bgra_to_u32_ssse3));
 
     else if (0==strcmp ("RGBA", isdata->ifmt.format))
-        return convert_rgba_to_u32 (isdata);
+        return convert_rgba_to_u32;
 
     else if (0==strcmp ("YUYV", isdata->ifmt.format))
-        return convert_yuyv_to_u32 (isdata);
+        return pick_kernel (convert_yuyv_to_u32, SSE2_KERNEL(convert_yuyv_to_u32_sse2), NULL);
 
     else if (0==strcmp ("YU12", isdata->ifmt.format))
-        return convert_yu12_to_u32 (isdata);
+        return pick_kernel (convert_yu12_to_u32, SSE2_KERNEL(convert_yu12_to_u32_sse2), NULL);
 
     else {
         printf ("ERR: Format %s not supported. (width %d, height %d, datalen %d)\n",
@@ -816,6 +1242,34 @@ image_convert_u32 (image_source_data_t *isdata)
     return NULL;
 }
 
+// convert to ABGR format (MSB to LSB, host byte ordering.)
+image_u32_t *
+image_convert_u32 (image_source_data_t *isdata)
+{
+    convert_u32_func_t convert = find_u32_converter (isdata);
+    if (convert == NULL)
+        return NULL;
+
+    image_u32_t *im = image_u32_create (isdata->ifmt.width,
+                                        isdata->ifmt.height);
+    convert (isdata, im);
+    return im;
+}
+
+int
+image_convert_u32_into (image_source_data_t *isdata, image_u32_t *im)
+{
+    if (im->width != isdata->ifmt.width || im->height != isdata->ifmt.height)
+        return -1;
+
+    convert_u32_func_t convert = find_u32_converter (isdata);
+    if (convert == NULL)
+        return -1;
+
+    convert (isdata, im);
+    return 0;
+}
+
 static int image_convert_u8x3_slow_warned = 0;
 
 image_u8x3_t *
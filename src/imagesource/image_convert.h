@@ -16,6 +16,18 @@ extern "C" {
 image_u32_t *
 image_convert_u32 (image_source_data_t *frmd);
 
+// Same as image_convert_u32, but writes into an existing image so
+// callers can reuse frame buffers. im must have the frame's width and
+// height. Returns non-zero if it doesn't or the format isn't supported.
+int
+image_convert_u32_into (image_source_data_t *frmd, image_u32_t *im);
+
+// The u32 conversions use SIMD kernels where the cpu supports them.
+// They give the same output as the scalar code; turning them off is only
+// useful for testing and benchmarking.
+void
+image_convert_set_simd (int enable);
+
 // r, g, b, r, g, b,...
 image_u8x3_t *
 image_convert_u8x3 (image_source_data_t *isdata);
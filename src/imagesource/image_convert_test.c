@@ -0,0 +1,137 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "common/timeprofile.h"
+
+#include "image_convert.h"
+
+// Checks that the SIMD image_convert_u32 kernels give exactly the same
+// output as the scalar code on random frames of awkward sizes, then
+// reports the throughput of both for each format.
+//
+// usage: image_convert_test [width height iterations]
+
+typedef struct format_info format_info_t;
+struct format_info {
+    const char *name;
+    int num, den;  // bytes per pixel = num / den
+};
+
+static const format_info_t formats[] = {
+    { "RGB", 3, 1 },
+    { "BGRA", 4, 1 },
+    { "YUYV", 2, 1 },
+    { "YU12", 3, 2 },
+    { "BAYER_RGGB", 1, 1 },
+    { "BAYER_GBRG", 1, 1 },
+};
+
+#define NFORMATS ((int) (sizeof(formats) / sizeof(formats[0])))
+
+static void
+make_frame (image_source_data_t *frmd, const format_info_t *fmt, int width, int height)
+{
+    memset(frmd, 0, sizeof(*frmd));
+    strncpy(frmd->ifmt.format, fmt->name, sizeof(frmd->ifmt.format) - 1);
+    frmd->ifmt.width = width;
+    frmd->ifmt.height = height;
+    frmd->datalen = width*height*fmt->num / fmt->den;
+
+    uint8_t *data = malloc(frmd->datalen);
+    for (int i = 0; i < frmd->datalen; i++)
+        data[i] = rand() & 0xff;
+    frmd->data = data;
+}
+
+// returns the number of differing pixels
+static int
+compare (const format_info_t *fmt, int width, int height)
+{
+    image_source_data_t frmd;
+    make_frame(&frmd, fmt, width, height);
+
+    image_convert_set_simd(0);
+    image_u32_t *expected = image_convert_u32(&frmd);
+    image_convert_set_simd(1);
+    image_u32_t *actual = image_convert_u32(&frmd);
+
+    int bad = 0;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            uint32_t e = expected->buf[y*expected->stride + x];
+            uint32_t a = actual->buf[y*actual->stride + x];
+            if (e != a) {
+                if (bad == 0)
+                    printf("  %s %dx%d: first mismatch at (%d, %d): %08x != %08x\n",
+                           fmt->name, width, height, x, y, a, e);
+                bad++;
+            }
+        }
+    }
+
+    image_u32_destroy(expected);
+    image_u32_destroy(actual);
+    free(frmd.data);
+    return bad;
+}
+
+// megapixels per second
+static double
+benchmark (const format_info_t *fmt, int width, int height, int iterations, int simd)
+{
+    image_source_data_t frmd;
+    make_frame(&frmd, fmt, width, height);
+    image_u32_t *im = image_u32_create(width, height);
+
+    image_convert_set_simd(simd);
+    int64_t start = utime_now();
+    for (int i = 0; i < iterations; i++)
+        image_convert_u32_into(&frmd, im);
+    int64_t elapsed = utime_now() - start;
+    image_convert_set_simd(1);
+
+    image_u32_destroy(im);
+    free(frmd.data);
+
+    if (elapsed < 1)
+        elapsed = 1;
+    return (double) width * height * iterations / elapsed;
+}
+
+int
+main (int argc, char *argv[])
+{
+    int width = 1280, height = 960, iterations = 50;
+    if (argc == 4) {
+        width = atoi(argv[1]);
+        height = atoi(argv[2]);
+        iterations = atoi(argv[3]);
+    } else if (argc != 1) {
+        printf("usage: %s [width height iterations]\n", argv[0]);
+        return 1;
+    }
+
+    // odd multiples of the vector widths and frames smaller than a
+    // vector, so every tail and border path gets used
+    const int sizes[][2] = { { 640, 480 }, { 646, 482 }, { 38, 6 }, { 4, 4 }, { 2, 2 } };
+    int failed = 0;
+
+    for (int f = 0; f < NFORMATS; f++) {
+        for (int s = 0; s < (int) (sizeof(sizes) / sizeof(sizes[0])); s++) {
+            if (compare(&formats[f], sizes[s][0], sizes[s][1]) != 0)
+                failed = 1;
+        }
+    }
+    printf("correctness: %s\n", failed ? "FAILED" : "ok");
+
+    printf("%-12s %10s %10s   (Mpix/s, %dx%d)\n", "format", "scalar", "simd", width, height);
+    for (int f = 0; f < NFORMATS; f++) {
+        double scalar = benchmark(&formats[f], width, height, iterations, 0);
+        double simd = benchmark(&formats[f], width, height, iterations, 1);
+        printf("%-12s %10.1f %10.1f   %.1fx\n", formats[f].name, scalar, simd, simd / scalar);
+    }
+
+    return failed;
+}
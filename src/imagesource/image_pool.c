@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "image_pool.h"
+
+#define PAGE_SIZE 4096
+
+typedef struct bucket bucket_t;
+struct bucket {
+    size_t size;        // 0 while the bucket is unclaimed
+    int nbufs;
+    void *bufs[IMAGE_POOL_DEPTH];
+    uint64_t last_use;
+};
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static bucket_t buckets[IMAGE_POOL_BUCKETS];
+static image_pool_stats_t stats;
+static uint64_t use_counter;
+
+static size_t
+round_size (size_t size)
+{
+    return (size + PAGE_SIZE - 1) & ~((size_t) PAGE_SIZE - 1);
+}
+
+// must hold mutex
+static bucket_t *
+find_bucket (size_t size)
+{
+    for (int i = 0; i < IMAGE_POOL_BUCKETS; i++) {
+        if (buckets[i].size == size)
+            return &buckets[i];
+    }
+    return NULL;
+}
+
+// must hold mutex. Claims an empty bucket, preferring the one that was
+// used least recently, so the pool follows changes in image size.
+static bucket_t *
+claim_bucket (size_t size)
+{
+    bucket_t *best = NULL;
+    for (int i = 0; i < IMAGE_POOL_BUCKETS; i++) {
+        if (buckets[i].nbufs != 0)
+            continue;
+        if (best == NULL || buckets[i].last_use < best->last_use)
+            best = &buckets[i];
+    }
+
+    if (best != NULL)
+        best->size = size;
+    return best;
+}
+
+void *
+image_pool_alloc (size_t size, int zero)
+{
+    if (size < IMAGE_POOL_MIN_SIZE) {
+        pthread_mutex_lock(&mutex);
+        stats.small++;
+        pthread_mutex_unlock(&mutex);
+        return zero ? calloc(1, size) : malloc(size);
+    }
+
+    size = round_size(size);
+    void *buf = NULL;
+
+    pthread_mutex_lock(&mutex);
+    bucket_t *b = find_bucket(size);
+    if (b != NULL && b->nbufs > 0) {
+        buf = b->bufs[--b->nbufs];
+        b->last_use = ++use_counter;
+        stats.hits++;
+        stats.cached_bytes -= size;
+    } else {
+        stats.misses++;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    if (buf == NULL && posix_memalign(&buf, PAGE_SIZE, size) != 0)
+        return NULL;
+
+    if (zero)
+        memset(buf, 0, size);
+    return buf;
+}
+
+void
+image_pool_free (void *buf, size_t size)
+{
+    if (buf == NULL)
+        return;
+
+    if (size < IMAGE_POOL_MIN_SIZE) {
+        free(buf);
+        return;
+    }
+
+    size = round_size(size);
+
+    pthread_mutex_lock(&mutex);
+    bucket_t *b = find_bucket(size);
+    if (b == NULL)
+        b = claim_bucket(size);
+
+    if (b == NULL || b->nbufs == IMAGE_POOL_DEPTH) {
+        stats.dropped++;
+        pthread_mutex_unlock(&mutex);
+        free(buf);
+        return;
+    }
+
+    b->bufs[b->nbufs++] = buf;
+    b->last_use = ++use_counter;
+    stats.returned++;
+    stats.cached_bytes += size;
+    pthread_mutex_unlock(&mutex);
+}
+
+void
+image_pool_clear (void)
+{
+    pthread_mutex_lock(&mutex);
+    for (int i = 0; i < IMAGE_POOL_BUCKETS; i++) {
+        for (int j = 0; j < buckets[i].nbufs; j++)
+            free(buckets[i].bufs[j]);
+        buckets[i].nbufs = 0;
+        buckets[i].size = 0;
+    }
+    stats.cached_bytes = 0;
+    pthread_mutex_unlock(&mutex);
+}
+
+void
+image_pool_get_stats (image_pool_stats_t *out)
+{
+    pthread_mutex_lock(&mutex);
+    *out = stats;
+    pthread_mutex_unlock(&mutex);
+}
+
+double
+image_pool_hit_rate (void)
+{
+    image_pool_stats_t s;
+    image_pool_get_stats(&s);
+
+    if (s.hits + s.misses == 0)
+        return 0;
+    return (double) s.hits / (s.hits + s.misses);
+}
+
+void
+image_pool_print_stats (void)
+{
+    image_pool_stats_t s;
+    image_pool_get_stats(&s);
+
+    printf("image pool: %.1f%% hit rate (%llu hits, %llu misses), %llu small, "
+           "%llu returned, %llu dropped, %.1f MB cached\n",
+           100.0 * image_pool_hit_rate(),
+           (unsigned long long) s.hits, (unsigned long long) s.misses,
+           (unsigned long long) s.small, (unsigned long long) s.returned,
+           (unsigned long long) s.dropped, s.cached_bytes / (1024.0 * 1024.0));
+}
@@ -0,0 +1,62 @@
+#ifndef __IMAGE_POOL_H__
+#define __IMAGE_POOL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Recycles image buffers so that creating and destroying a frame-sized
+// image every frame doesn't go through mmap/munmap (and fault in fresh
+// pages) each time. image_u8, image_u8x3 and image_u32 allocate their
+// pixel buffers here.
+//
+// Buffers of at least IMAGE_POOL_MIN_SIZE bytes are kept in buckets by
+// size (rounded up to a page), at most IMAGE_POOL_DEPTH per bucket.
+// Those buffers are page aligned, which covers any stride alignment
+// passed to the *_create_alignment functions. Smaller buffers go
+// straight to malloc. Thread safe.
+
+#define IMAGE_POOL_MIN_SIZE (64*1024)
+#define IMAGE_POOL_BUCKETS  16
+#define IMAGE_POOL_DEPTH    4
+
+typedef struct image_pool_stats image_pool_stats_t;
+struct image_pool_stats {
+    uint64_t hits;      // allocations served from the pool
+    uint64_t misses;    // pooled-size allocations that needed a new buffer
+    uint64_t small;     // allocations below IMAGE_POOL_MIN_SIZE
+    uint64_t returned;  // buffers put back in the pool
+    uint64_t dropped;   // buffers freed because their bucket was full
+    uint64_t cached_bytes;
+};
+
+// Returns a buffer of at least size bytes, cleared to zero if zero is
+// non-zero. Release it with image_pool_free and the same size.
+void *
+image_pool_alloc (size_t size, int zero);
+
+void
+image_pool_free (void *buf, size_t size);
+
+// Frees every cached buffer. Statistics are kept.
+void
+image_pool_clear (void);
+
+void
+image_pool_get_stats (image_pool_stats_t *stats);
+
+// hits / (hits + misses), or 0 if nothing pooled was allocated yet
+double
+image_pool_hit_rate (void);
+
+void
+image_pool_print_stats (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //__IMAGE_POOL_H__
@@ -5,6 +5,7 @@
 
 #include "image_u32.h"
 #include "pnm.h"
+#include "image_pool.h"
 
 #define DEFAULT_ALIGNMENT 8
 
@@ -14,9 +15,8 @@ image_u32_create (int width, int height)
     return image_u32_create_alignment(width, height, DEFAULT_ALIGNMENT);
 }
 
-// alignment specified in units of uint32
-image_u32_t *
-image_u32_create_alignment (int width, int height, int alignment)
+static image_u32_t *
+image_u32_alloc (int width, int height, int alignment, int zero)
 {
     image_u32_t *im = calloc (1, sizeof(*im));
 
@@ -27,16 +27,31 @@ image_u32_create_alignment (int width, int height, int alignment)
     if ((im->stride % alignment) != 0)
         im->stride += alignment - (im->stride % alignment);
 
-    im->buf = (uint32_t*) calloc(1, im->height*im->stride*sizeof(uint32_t));
+    im->buf = (uint32_t*) image_pool_alloc(im->height*im->stride*sizeof(uint32_t), zero);
 
     return im;
 }
 
+// alignment specified in units of uint32
+image_u32_t *
+image_u32_create_alignment (int width, int height, int alignment)
+{
+    return image_u32_alloc(width, height, alignment, 1);
+}
+
 
 image_u32_t *
 image_u32_copy (const image_u32_t *im)
 {
-    image_u32_t *out = image_u32_create (im->width, im->height);
+    // keep the source stride, so the copy is one memcpy, and the buffer
+    // doesn't need clearing first
+    image_u32_t *out = calloc (1, sizeof(*out));
+
+    out->width  = im->width;
+    out->height = im->height;
+    out->stride = im->stride;
+
+    out->buf = (uint32_t*) image_pool_alloc(out->height*out->stride*sizeof(uint32_t), 0);
     memcpy (out->buf, im->buf, im->height*im->stride*sizeof(uint32_t));
     return out;
 }
@@ -47,7 +62,7 @@ image_u32_destroy (image_u32_t *im)
     if (im == NULL)
         return;
 
-    free(im->buf);
+    image_pool_free(im->buf, im->height*im->stride*sizeof(uint32_t));
     free(im);
 }
 
@@ -5,6 +5,7 @@
 
 #include "image_u8.h"
 #include "pnm.h"
+#include "image_pool.h"
 
 #define DEFAULT_ALIGNMENT 24
 
@@ -26,7 +27,7 @@ image_u8_create_alignment (int width, int height, int alignment)
     if ((im->stride % alignment) != 0)
         im->stride += alignment - (im->stride % alignment);
 
-    im->buf = (uint8_t*) calloc(1, im->height*im->stride);
+    im->buf = (uint8_t*) image_pool_alloc(im->height*im->stride, 1);
 
     return im;
 }
@@ -37,7 +38,7 @@ image_u8_destroy (image_u8_t *im)
     if (!im)
         return;
 
-    free(im->buf);
+    image_pool_free(im->buf, im->height*im->stride);
     free(im);
 }
 
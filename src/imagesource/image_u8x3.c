@@ -4,6 +4,7 @@
 #include <string.h>
 
 #include "image_u8x3.h"
+#include "image_pool.h"
 
 // least common multiple of 32 (cache line) and 24 (stride needed for
 // 8byte-wide RGB processing). (It's possible that 24 would be enough).
@@ -30,7 +31,7 @@ image_u8x3_create_alignment (int width, int height, int alignment)
     if ((im->stride % alignment) != 0)
         im->stride += alignment - (im->stride % alignment);
 
-    im->buf = (uint8_t*) calloc(1, im->height*im->stride);
+    im->buf = (uint8_t*) image_pool_alloc(im->height*im->stride, 1);
     return im;
 }
 
@@ -40,7 +41,7 @@ image_u8x3_destroy (image_u8x3_t *im)
     if (!im)
         return;
 
-    free(im->buf);
+    image_pool_free(im->buf, im->height*im->stride);
     free(im);
 }
 
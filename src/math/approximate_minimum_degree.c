@@ -0,0 +1,394 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+#include "smatd.h"
+
+// Approximate minimum degree ordering, after Amestoy, Davis and Duff.
+//
+// Unlike exact_minimum_degree_ordering, eliminating a node does not
+// connect all of its neighbors to each other. Instead, the
+// eliminated node becomes an "element" that stands for the clique of
+// its remaining neighbors (a quotient graph), so the graph never
+// grows. Each node's degree is then only bounded, not computed
+// exactly: the bound is the size of the new element plus, for every
+// other element the node touches, the part of that element outside
+// the new one. Elements that turn out to be entirely inside the new
+// element are absorbed, and nodes with identical adjacency are
+// merged into "supervariables" that are ordered together.
+
+#define AMD_VARIABLE 0
+#define AMD_ELEMENT  1
+#define AMD_DEAD     2
+
+struct amd_node
+{
+    int state;
+
+    // for variables: adjacent elements and adjacent variables.
+    // for elements: the variables of the element (in 'vars').
+    int *elems;
+    int nelems, elems_alloc;
+    int *vars;
+    int nvars, vars_alloc;
+
+    // number of original nodes this supervariable stands for (0 once
+    // merged into another).
+    int nv;
+
+    // variables: approximate degree, not counting the variable's
+    // own nodes. elements: total nv of the element's variables.
+    int degree;
+
+    // next node merged into the same supervariable, or -1
+    int merged;
+
+    // degree bucket links
+    int prev, next;
+
+    unsigned int hash;
+};
+
+static void amd_add(int **list, int *n, int *alloc, int v)
+{
+    if (*n + 1 > *alloc) {
+        *alloc = *alloc * 2 + 8;
+        *list = realloc(*list, *alloc * sizeof(int));
+    }
+
+    (*list)[(*n)++] = v;
+}
+
+static void amd_free_lists(struct amd_node *node)
+{
+    free(node->elems);
+    node->elems = NULL;
+    node->nelems = node->elems_alloc = 0;
+
+    free(node->vars);
+    node->vars = NULL;
+    node->nvars = node->vars_alloc = 0;
+}
+
+static void degree_insert(struct amd_node *nodes, int *head, int i)
+{
+    int d = nodes[i].degree;
+
+    nodes[i].prev = -1;
+    nodes[i].next = head[d];
+    if (head[d] >= 0)
+        nodes[head[d]].prev = i;
+    head[d] = i;
+}
+
+static void degree_remove(struct amd_node *nodes, int *head, int i)
+{
+    if (nodes[i].prev >= 0)
+        nodes[nodes[i].prev].next = nodes[i].next;
+    else
+        head[nodes[i].degree] = nodes[i].next;
+
+    if (nodes[i].next >= 0)
+        nodes[nodes[i].next].prev = nodes[i].prev;
+}
+
+// append supervariable i (i and everything merged into it) to the ordering.
+static void output_chain(struct amd_node *nodes, int i, int *ordering, int *npos)
+{
+    for (int j = i; j >= 0; j = nodes[j].merged)
+        ordering[(*npos)++] = j;
+}
+
+// keys are (hash << 32) | node, so sorting groups equal hashes.
+static int key_compare(const void *_a, const void *_b)
+{
+    uint64_t a = *(const uint64_t*) _a, b = *(const uint64_t*) _b;
+
+    return (a > b) - (a < b);
+}
+
+int *approximate_minimum_degree_ordering(smatd_t *mat)
+{
+    int n = mat->nrows;
+    struct amd_node *nodes = calloc(n, sizeof(struct amd_node));
+
+    // degree buckets: head[d] is the first variable with degree d.
+    int *head = malloc((n + 1) * sizeof(int));
+    for (int d = 0; d <= n; d++)
+        head[d] = -1;
+
+    for (int i = 0; i < n; i++) {
+        svecd_t *vec = &mat->rows[i];
+        struct amd_node *node = &nodes[i];
+
+        node->state = AMD_VARIABLE;
+        node->nv = 1;
+        node->merged = -1;
+
+        node->vars_alloc = vec->nz;
+        node->vars = malloc(node->vars_alloc * sizeof(int));
+        for (int pos = 0; pos < vec->nz; pos++) {
+            if (vec->indices[pos] != i)
+                node->vars[node->nvars++] = vec->indices[pos];
+        }
+
+        node->degree = node->nvars;
+        degree_insert(nodes, head, i);
+    }
+
+    int *ordering = calloc(n, sizeof(int));
+    int npos = 0;
+
+    // 'flag' marks membership in the current pivot's element, 'mark'
+    // is scratch for comparing supervariables, and w[e] (valid when
+    // wflag[e] == token) is the part of element e outside the pivot's
+    // element. Incrementing the token clears a set for free.
+    int *flag = calloc(n, sizeof(int));
+    int *mark = calloc(n, sizeof(int));
+    int *wflag = calloc(n, sizeof(int));
+    int *w = calloc(n, sizeof(int));
+    int token = 0, marktoken = 0;
+
+    // provisional degree (adjacent variables plus outside parts of
+    // elements) of each variable of the pivot's element.
+    int *degext = calloc(n, sizeof(int));
+    int *cands = malloc(n * sizeof(int));
+    uint64_t *keys = malloc(n * sizeof(uint64_t));
+
+    int k = 0; // number of original nodes eliminated so far
+    int mindeg = 0;
+
+    while (k < n) {
+        while (head[mindeg] < 0)
+            mindeg++;
+
+        int p = head[mindeg];
+        struct amd_node *np = &nodes[p];
+        degree_remove(nodes, head, p);
+
+        output_chain(nodes, p, ordering, &npos);
+        k += np->nv;
+
+        // form the new element: p's adjacent variables plus the
+        // variables of every element p touches, which are absorbed.
+        token++;
+        flag[p] = token;
+
+        int *lp = NULL, nlp = 0, lp_alloc = 0;
+
+        for (int pos = 0; pos < np->nvars; pos++) {
+            int j = np->vars[pos];
+            if (nodes[j].state != AMD_VARIABLE || nodes[j].nv == 0 || flag[j] == token)
+                continue;
+            flag[j] = token;
+            amd_add(&lp, &nlp, &lp_alloc, j);
+        }
+
+        for (int pos = 0; pos < np->nelems; pos++) {
+            int e = np->elems[pos];
+            if (nodes[e].state != AMD_ELEMENT)
+                continue;
+
+            for (int epos = 0; epos < nodes[e].nvars; epos++) {
+                int j = nodes[e].vars[epos];
+                if (nodes[j].state != AMD_VARIABLE || nodes[j].nv == 0 || flag[j] == token)
+                    continue;
+                flag[j] = token;
+                amd_add(&lp, &nlp, &lp_alloc, j);
+            }
+
+            nodes[e].state = AMD_DEAD;
+            amd_free_lists(&nodes[e]);
+        }
+
+        amd_free_lists(np);
+        np->state = AMD_ELEMENT;
+        np->vars = lp;
+        np->nvars = nlp;
+        np->vars_alloc = lp_alloc;
+
+        int degme = 0;
+        for (int pos = 0; pos < nlp; pos++) {
+            degme += nodes[lp[pos]].nv;
+            degree_remove(nodes, head, lp[pos]);
+        }
+
+        // w[e] = |L_e \ L_p|, weighted, for every element adjacent to L_p.
+        for (int pos = 0; pos < nlp; pos++) {
+            struct amd_node *ni = &nodes[lp[pos]];
+
+            for (int epos = 0; epos < ni->nelems; epos++) {
+                int e = ni->elems[epos];
+                if (nodes[e].state != AMD_ELEMENT)
+                    continue;
+
+                if (wflag[e] != token) {
+                    wflag[e] = token;
+                    w[e] = nodes[e].degree;
+                }
+                w[e] -= ni->nv;
+            }
+        }
+
+        // prune each variable's lists, absorbing elements that lie
+        // inside L_p, and eliminate right away any variable that is
+        // adjacent to nothing but p.
+        int ncands = 0;
+
+        for (int pos = 0; pos < nlp; pos++) {
+            int i = lp[pos];
+            struct amd_node *ni = &nodes[i];
+            unsigned int hash = 0;
+            int ext = 0;
+
+            int nelems = 0;
+            for (int epos = 0; epos < ni->nelems; epos++) {
+                int e = ni->elems[epos];
+                if (nodes[e].state != AMD_ELEMENT)
+                    continue;
+
+                if (w[e] == 0) {
+                    nodes[e].state = AMD_DEAD;
+                    amd_free_lists(&nodes[e]);
+                    continue;
+                }
+
+                ext += w[e];
+                hash += e;
+                ni->elems[nelems++] = e;
+            }
+            ni->nelems = nelems;
+            amd_add(&ni->elems, &ni->nelems, &ni->elems_alloc, p);
+            hash += p;
+
+            int nvars = 0;
+            for (int vpos = 0; vpos < ni->nvars; vpos++) {
+                int j = ni->vars[vpos];
+                if (nodes[j].state != AMD_VARIABLE || nodes[j].nv == 0 || flag[j] == token)
+                    continue;
+
+                ext += nodes[j].nv;
+                hash += j;
+                ni->vars[nvars++] = j;
+            }
+            ni->nvars = nvars;
+
+            if (ni->nelems == 1 && ni->nvars == 0) {
+                output_chain(nodes, i, ordering, &npos);
+                k += ni->nv;
+                degme -= ni->nv;
+                ni->state = AMD_DEAD;
+                amd_free_lists(ni);
+                continue;
+            }
+
+            ni->hash = hash;
+            degext[i] = ext;
+            cands[ncands++] = i;
+        }
+
+        np->degree = degme;
+
+        for (int pos = 0; pos < ncands; pos++) {
+            int i = cands[pos];
+            struct amd_node *ni = &nodes[i];
+            int lpext = degme - ni->nv;
+
+            int d = ni->degree + lpext;
+            if (degext[i] + lpext < d)
+                d = degext[i] + lpext;
+            if (n - k - ni->nv < d)
+                d = n - k - ni->nv;
+
+            ni->degree = d < 0 ? 0 : d;
+        }
+
+        // find supervariables: variables of L_p with identical
+        // element and variable lists. Only variables with equal
+        // hashes need to be compared.
+        for (int pos = 0; pos < ncands; pos++)
+            keys[pos] = ((uint64_t) nodes[cands[pos]].hash << 32) | cands[pos];
+        qsort(keys, ncands, sizeof(uint64_t), key_compare);
+        for (int pos = 0; pos < ncands; pos++)
+            cands[pos] = (int) (keys[pos] & 0xffffffff);
+
+        for (int a = 0; a < ncands; a++) {
+            int i = cands[a];
+            struct amd_node *ni = &nodes[i];
+            if (ni->nv == 0)
+                continue;
+
+            int marked = 0;
+
+            for (int b = a + 1; b < ncands && nodes[cands[b]].hash == ni->hash; b++) {
+                int j = cands[b];
+                struct amd_node *nj = &nodes[j];
+
+                if (nj->nv == 0 || nj->nelems != ni->nelems || nj->nvars != ni->nvars)
+                    continue;
+
+                if (!marked) {
+                    marktoken++;
+                    for (int epos = 0; epos < ni->nelems; epos++)
+                        mark[ni->elems[epos]] = marktoken;
+                    for (int vpos = 0; vpos < ni->nvars; vpos++)
+                        mark[ni->vars[vpos]] = marktoken;
+                    marked = 1;
+                }
+
+                int same = 1;
+                for (int epos = 0; same && epos < nj->nelems; epos++)
+                    same = (mark[nj->elems[epos]] == marktoken);
+                for (int vpos = 0; same && vpos < nj->nvars; vpos++)
+                    same = (mark[nj->vars[vpos]] == marktoken);
+
+                if (!same)
+                    continue;
+
+                // merge j into i.
+                int last = i;
+                while (nodes[last].merged >= 0)
+                    last = nodes[last].merged;
+                nodes[last].merged = j;
+
+                ni->nv += nj->nv;
+                ni->degree -= nj->nv;
+                if (ni->degree < 0)
+                    ni->degree = 0;
+
+                nj->nv = 0;
+                nj->state = AMD_DEAD;
+                amd_free_lists(nj);
+            }
+        }
+
+        for (int pos = 0; pos < ncands; pos++) {
+            int i = cands[pos];
+            if (nodes[i].nv == 0)
+                continue;
+
+            degree_insert(nodes, head, i);
+            if (nodes[i].degree < mindeg)
+                mindeg = nodes[i].degree;
+        }
+    }
+
+    assert(npos == n);
+
+    for (int i = 0; i < n; i++)
+        amd_free_lists(&nodes[i]);
+
+    free(nodes);
+    free(head);
+    free(flag);
+    free(mark);
+    free(wflag);
+    free(w);
+    free(degext);
+    free(cands);
+    free(keys);
+
+    return ordering;
+}
@@ -7,9 +7,11 @@
 
 #include "math_util.h"
 #include "smatd.h"
+#include "bsmatd.h"
 #include "april_graph.h"
 
 int *exact_minimum_degree_ordering(smatd_t *mat);
+int *approximate_minimum_degree_ordering(smatd_t *mat);
 
 double alt_mod2pi(double v)
 {
@@ -186,7 +188,7 @@ void april_graph_postscript(april_graph_t *graph, const char *path)
 
     fprintf(f, "0 setlinewidth\n");
 
-    double x0 = HUGE, x1 = -HUGE, y0 = HUGE, y1 = -HUGE;
+    double x0 = HUGE_VAL, x1 = -HUGE_VAL, y0 = HUGE_VAL, y1 = -HUGE_VAL;
 
     double page_width = 612, page_height = 792;
 
@@ -504,30 +506,234 @@ void april_graph_cholesky_param_init(april_graph_cholesky_param_t *param)
     memset(param, 0, sizeof(april_graph_cholesky_param_t));
 
     param->ordering = NULL;
+    param->ordering_method = APRIL_GRAPH_ORDERING_AMD;
     param->max_cond = 1e16;
     param->show_timing = 0;
 }
 
-// Compute a Gauss-Newton update on the graph, using the specified
-// node ordering. NULL can be passed in for parameters.
-void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_param)
+// Tikhonov regularization added to the diagonal of the normal
+// equations when max_cond > 0.
+#define TIKHONOV_LAMBDA .001
+
+// Dense kernels for the normal equations. J is a factor's jacobian
+// with respect to one node (flen x n), W is the factor's information
+// matrix (flen x flen), and X = J'*W (n x flen) is computed once per
+// node and reused for every block in that node's row. The 3x3
+// versions cover XYT nodes and factors; their fixed bounds let the
+// compiler unroll them completely.
+static inline void jtw_3x3(const double *J, const double *W, double *X)
 {
-    april_graph_cholesky_param_t param;
-    april_graph_cholesky_param_init(&param);
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            X[i*3+j] = J[0*3+i]*W[0*3+j] + J[1*3+i]*W[1*3+j] + J[2*3+i]*W[2*3+j];
+}
 
-    if (_param) {
-        memcpy(&param, _param, sizeof(april_graph_cholesky_param_t));
+// block += X*J
+static inline void add_xj_3x3(const double *X, const double *J, double *block)
+{
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            block[i*3+j] += X[i*3+0]*J[0*3+j] + X[i*3+1]*J[1*3+j] + X[i*3+2]*J[2*3+j];
+}
+
+// b += X*r
+static inline void add_xr_3x3(const double *X, const double *r, double *b)
+{
+    for (int i = 0; i < 3; i++)
+        b[i] += X[i*3+0]*r[0] + X[i*3+1]*r[1] + X[i*3+2]*r[2];
+}
+
+static void jtw_generic(const matd_t *J, const matd_t *W, double *X)
+{
+    int flen = J->nrows;
+
+    for (int i = 0; i < J->ncols; i++) {
+        for (int j = 0; j < flen; j++) {
+            double acc = 0;
+            for (int k = 0; k < flen; k++)
+                acc += MATD_EL(J, k, i) * MATD_EL(W, k, j);
+            X[i*flen+j] = acc;
+        }
     }
+}
 
-    timeprofile_t *tp = timeprofile_create();
-    timeprofile_stamp(tp, "begin");
+static void add_xj_generic(const double *X, int n0, const matd_t *J, double *block)
+{
+    int flen = J->nrows, n1 = J->ncols;
+
+    for (int i = 0; i < n0; i++) {
+        for (int j = 0; j < n1; j++) {
+            double acc = 0;
+            for (int k = 0; k < flen; k++)
+                acc += X[i*flen+k] * MATD_EL(J, k, j);
+            block[i*n1+j] += acc;
+        }
+    }
+}
+
+static void add_xr_generic(const double *X, int n0, int flen, const double *r, double *b)
+{
+    for (int i = 0; i < n0; i++) {
+        double acc = 0;
+        for (int k = 0; k < flen; k++)
+            acc += X[i*flen+k] * r[k];
+        b[i] += acc;
+    }
+}
+
+// Everything april_graph_cholesky computes that depends only on the
+// layout of the graph (which nodes each factor connects, and each
+// node's length), kept so that repeated iterations only redo the
+// numerical work.
+//
+// The normal equations are assembled into a block-sparse matrix whose
+// blocks follow the nodes: the symbolic pass fixes the pattern (upper
+// block triangle, in elimination order) and records, for every
+// factor, which block each of its node pairs lands in. The numeric
+// pass then accumulates J'*W*J directly into those blocks.
+struct april_graph_cholesky_solver
+{
+    // the layout the cached structures below were built for; see
+    // make_layout.
+    int *layout;
+    int layout_len;
+
+    int nnodes, nfactors;
+    int xlen;
+
+    // rank[j]: position of node j in the ordering, i.e., its block row.
+    // idxs[j]: what index in x do the state variables for node j start at?
+    int *rank;
+    int *idxs;
+    int *bsizes;
+
+    bsmatd_t *A;
+
+    // slots[slotpos[f] + z0*nnodes + z1]: block receiving the
+    // (z0, z1) term of factor f, or -1 if that term lies in the lower
+    // triangle (and is covered by its transpose).
+    int *slotpos;
+    int *slots;
+    int *diag; // block index of each diagonal block
+
+    int maxbsize, maxlen;
+
+    smatd_chol_symbolic_t *sym;
+
+    // one eval per factor, recycled across iterations.
+    april_graph_factor_eval_t **evals;
+    int *eval_types;
+
+    timeprofile_t *tp;
+};
+
+april_graph_cholesky_solver_t *april_graph_cholesky_solver_create()
+{
+    april_graph_cholesky_solver_t *solver = calloc(1, sizeof(april_graph_cholesky_solver_t));
+    solver->tp = timeprofile_create();
+
+    return solver;
+}
+
+// release everything derived from the graph's layout.
+static void solver_clear(april_graph_cholesky_solver_t *solver)
+{
+    for (int i = 0; i < solver->nfactors; i++)
+        april_graph_factor_eval_destroy(solver->evals[i]);
+
+    free(solver->layout);
+    free(solver->rank);
+    free(solver->idxs);
+    free(solver->bsizes);
+    bsmatd_destroy(solver->A);
+    free(solver->slotpos);
+    free(solver->slots);
+    free(solver->diag);
+    smatd_chol_symbolic_destroy(solver->sym);
+    free(solver->evals);
+    free(solver->eval_types);
+
+    timeprofile_t *tp = solver->tp;
+    memset(solver, 0, sizeof(april_graph_cholesky_solver_t));
+    solver->tp = tp;
+}
+
+void april_graph_cholesky_solver_destroy(april_graph_cholesky_solver_t *solver)
+{
+    if (solver == NULL)
+        return;
+
+    solver_clear(solver);
+    timeprofile_destroy(solver->tp);
+    free(solver);
+}
 
-    int *ordering = NULL;
+// Flatten everything the cached structures depend on into one array:
+// node count and lengths, then each factor's node list, then the
+// requested ordering (if any) or ordering method.
+static int *make_layout(april_graph_t *graph, const int *ordering, int ordering_method, int *_len)
+{
+    int nnodes = zarray_size(graph->nodes);
+    int nfactors = zarray_size(graph->factors);
+
+    int len = 3 + nnodes + (ordering ? nnodes : 1);
+    for (int i = 0; i < nfactors; i++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, i, &factor);
+        len += 1 + factor->nnodes;
+    }
+
+    int *layout = malloc(len * sizeof(int));
+    int pos = 0;
+
+    layout[pos++] = nnodes;
+    for (int i = 0; i < nnodes; i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, i, &node);
+        layout[pos++] = node->length;
+    }
 
-    if (param.ordering == NULL) {
+    layout[pos++] = nfactors;
+    for (int i = 0; i < nfactors; i++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, i, &factor);
+        layout[pos++] = factor->nnodes;
+        memcpy(&layout[pos], factor->nodes, factor->nnodes * sizeof(int));
+        pos += factor->nnodes;
+    }
+
+    layout[pos++] = ordering != NULL;
+    if (ordering) {
+        memcpy(&layout[pos], ordering, nnodes * sizeof(int));
+        pos += nnodes;
+    } else {
+        layout[pos++] = ordering_method;
+    }
+
+    assert(pos == len);
+    *_len = len;
+    return layout;
+}
+
+// Compute the ordering, the index maps, the block pattern of A and
+// the symbolic factorization for the graph's current layout.
+static void solver_analyze(april_graph_cholesky_solver_t *solver, april_graph_t *graph,
+                           april_graph_cholesky_param_t *param)
+{
+    timeprofile_t *tp = solver->tp;
+
+    int nnodes = zarray_size(graph->nodes);
+    int nfactors = zarray_size(graph->factors);
+
+    solver->nnodes = nnodes;
+    solver->nfactors = nfactors;
+
+    int *ordering = param->ordering;
+
+    if (ordering == NULL) {
         // make symbolic matrix for variable reordering.
-        smatd_t *Asym = smatd_create(zarray_size(graph->nodes), zarray_size(graph->nodes));
-        for (int fidx = 0; fidx < zarray_size(graph->factors); fidx++) {
+        smatd_t *Asym = smatd_create(nnodes, nnodes);
+        for (int fidx = 0; fidx < nfactors; fidx++) {
             april_graph_factor_t *factor;
             zarray_get(graph->factors, fidx, &factor);
 
@@ -540,65 +746,178 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
 
         timeprofile_stamp(tp, "make symbolic");
 
-        ordering = exact_minimum_degree_ordering(Asym);
+        if (param->ordering_method == APRIL_GRAPH_ORDERING_EXACT_MIN_DEGREE)
+            ordering = exact_minimum_degree_ordering(Asym);
+        else
+            ordering = approximate_minimum_degree_ordering(Asym);
         smatd_destroy(Asym);
     }
 
-    // idxs[j]: what index in x do the state variables for node j start at?
-    int *idxs = calloc(zarray_size(graph->nodes), sizeof(int));
-    int xlen = 0;
-    for (int i = 0; i < zarray_size(graph->nodes); i++) {
+    solver->rank = calloc(nnodes, sizeof(int));
+    solver->bsizes = calloc(nnodes, sizeof(int));
+    solver->idxs = calloc(nnodes, sizeof(int));
+    solver->xlen = 0;
+    for (int i = 0; i < nnodes; i++) {
         april_graph_node_t *node;
         zarray_get(graph->nodes, ordering[i], &node);
-        idxs[ordering[i]] = xlen;
-        xlen += node->length;
+        solver->rank[ordering[i]] = i;
+        solver->bsizes[i] = node->length;
+        solver->idxs[ordering[i]] = solver->xlen;
+        solver->xlen += node->length;
     }
 
-    if (_param == NULL || _param->ordering == NULL)
-        free(param.ordering);
+    if (ordering != param->ordering)
+        free(ordering);
 
     timeprofile_stamp(tp, "compute ordering");
 
+    int *rank = solver->rank;
+
+    // block pattern of A. Every node gets a diagonal block so that
+    // regularization has somewhere to go.
+    smatd_t *pattern = smatd_create(nnodes, nnodes);
+    for (int i = 0; i < nnodes; i++)
+        smatd_set(pattern, i, i, 1);
+
+    int nslots = 0;
+    for (int fidx = 0; fidx < nfactors; fidx++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, fidx, &factor);
+
+        nslots += factor->nnodes * factor->nnodes;
+
+        for (int i = 0; i < factor->nnodes; i++) {
+            for (int j = 0; j < factor->nnodes; j++) {
+                int ri = rank[factor->nodes[i]], rj = rank[factor->nodes[j]];
+                if (ri <= rj)
+                    smatd_set(pattern, ri, rj, 1);
+            }
+        }
+    }
+
+    solver->A = bsmatd_create(pattern, solver->bsizes);
+    smatd_destroy(pattern);
+
+    solver->slotpos = calloc(nfactors, sizeof(int));
+    solver->slots = calloc(nslots, sizeof(int));
+    solver->maxlen = 0;
+    for (int fidx = 0, pos = 0; fidx < nfactors; fidx++) {
+        april_graph_factor_t *factor;
+        zarray_get(graph->factors, fidx, &factor);
+
+        solver->slotpos[fidx] = pos;
+        solver->maxlen = imax(solver->maxlen, factor->length);
+
+        for (int z0 = 0; z0 < factor->nnodes; z0++) {
+            for (int z1 = 0; z1 < factor->nnodes; z1++) {
+                int r0 = rank[factor->nodes[z0]], r1 = rank[factor->nodes[z1]];
+                solver->slots[pos++] = (r0 <= r1) ? bsmatd_find(solver->A, r0, r1) : -1;
+            }
+        }
+    }
+
+    solver->diag = calloc(nnodes, sizeof(int));
+    solver->maxbsize = 0;
+    for (int i = 0; i < nnodes; i++) {
+        solver->diag[i] = bsmatd_find(solver->A, i, i);
+        solver->maxbsize = imax(solver->maxbsize, solver->bsizes[i]);
+    }
+
+    solver->evals = calloc(nfactors, sizeof(april_graph_factor_eval_t*));
+    solver->eval_types = calloc(nfactors, sizeof(int));
+
+    timeprofile_stamp(tp, "symbolic A");
+
+    // the expanded A always stores every entry of every block, so
+    // its pattern is the same on every iteration.
+    smatd_t *As = bsmatd_to_smatd(solver->A);
+    solver->sym = smatd_chol_symbolic(As);
+    smatd_destroy(As);
+
+    timeprofile_stamp(tp, "symbolic factor");
+}
+
+// Linearize every factor at the graph's current state, rebuilding the
+// cached structures first if the graph's layout changed. Returns the
+// normal equations A (in elimination order; see solver->idxs) and
+// sets *_B to the right-hand side, both owned by the caller.
+static smatd_t *solver_linearize(april_graph_cholesky_solver_t *solver, april_graph_t *graph,
+                                 april_graph_cholesky_param_t *param, double **_B)
+{
+    timeprofile_t *tp = solver->tp;
+
+    int layout_len;
+    int *layout = make_layout(graph, param->ordering, param->ordering_method, &layout_len);
+
+    if (solver->layout == NULL || layout_len != solver->layout_len ||
+        memcmp(layout, solver->layout, layout_len * sizeof(int))) {
+
+        solver_clear(solver);
+        timeprofile_stamp(tp, "check layout");
+
+        solver_analyze(solver, graph, param);
+        solver->layout = layout;
+        solver->layout_len = layout_len;
+    } else {
+        free(layout);
+        timeprofile_stamp(tp, "check layout");
+    }
+
+    bsmatd_t *A = solver->A;
+    int *idxs = solver->idxs;
+    int *bsizes = solver->bsizes;
+
+    bsmatd_zero(A);
+
     // we'll solve normal equations, Ax = B
-    smatd_t *A = smatd_create(xlen, xlen);
-    double  *B = calloc(xlen, sizeof(double));
+    double *B = calloc(solver->xlen, sizeof(double));
+    *_B = B;
+    double *X = calloc(solver->maxbsize * solver->maxlen, sizeof(double));
 
-    for (int i = 0; i < zarray_size(graph->factors); i++) {
+    for (int fidx = 0; fidx < solver->nfactors; fidx++) {
         april_graph_factor_t *factor;
-        zarray_get(graph->factors, i, &factor);
-        april_graph_factor_eval_t *eval = factor->eval(factor, graph, NULL);
+        zarray_get(graph->factors, fidx, &factor);
+
+        // an eval can only be recycled by a factor of the type that made it.
+        if (solver->evals[fidx] != NULL && solver->eval_types[fidx] != factor->type) {
+            april_graph_factor_eval_destroy(solver->evals[fidx]);
+            solver->evals[fidx] = NULL;
+        }
+
+        april_graph_factor_eval_t *eval = factor->eval(factor, graph, solver->evals[fidx]);
+        solver->evals[fidx] = eval;
+        solver->eval_types[fidx] = factor->type;
+
+        int *fslots = &solver->slots[solver->slotpos[fidx]];
 
         for (int z0 = 0; z0 < factor->nnodes; z0++) {
             int n0 = factor->nodes[z0];
+            matd_t *J0 = eval->jacobians[z0];
+            int is_3x3 = (J0->nrows == 3 && J0->ncols == 3);
 
-            matd_t *JatW = matd_op("M'*M", eval->jacobians[z0], eval->W);
+            if (is_3x3)
+                jtw_3x3(J0->data, eval->W->data, X);
+            else
+                jtw_generic(J0, eval->W, X);
 
             for (int z1 = 0; z1 < factor->nnodes; z1++) {
-                int n1 = factor->nodes[z1];
-
-                matd_t *JatWJb = matd_op("M*M", JatW, eval->jacobians[z1]);
+                int slot = fslots[z0*factor->nnodes + z1];
+                if (slot < 0)
+                    continue;
 
-                for (int row = 0; row < JatWJb->nrows; row++) {
-                    for (int col = 0; col < JatWJb->ncols; col++) {
-                        double v = smatd_get(A, row+idxs[n0], col+idxs[n1]);
-                        smatd_set(A, row+idxs[n0], col+idxs[n1], v + MATD_EL(JatWJb, row, col));
-                    }
-                }
+                matd_t *J1 = eval->jacobians[z1];
 
-                matd_destroy(JatWJb);
+                if (is_3x3 && J1->ncols == 3)
+                    add_xj_3x3(X, J1->data, bsmatd_block(A, slot));
+                else
+                    add_xj_generic(X, J0->ncols, J1, bsmatd_block(A, slot));
             }
 
-            matd_t *R = matd_create_data(eval->length, 1, eval->r);
-            matd_t *JatWr = matd_op("M*M", JatW, R);
-            for (int row = 0; row < JatWr->nrows; row++)
-                B[idxs[n0]+row] += MATD_EL(JatWr, row, 0);
-
-            matd_destroy(R);
-            matd_destroy(JatW);
-            matd_destroy(JatWr);
+            if (is_3x3)
+                add_xr_3x3(X, eval->r, &B[idxs[n0]]);
+            else
+                add_xr_generic(X, J0->ncols, eval->length, eval->r, &B[idxs[n0]]);
         }
-
-        april_graph_factor_eval_destroy(eval);
     }
 
     // tikhanov regularization
@@ -606,12 +925,13 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
     // trace(A) = sum of eigenvalues. worst-case scenario is that
     // we're rank 1 and that one eigenvalue is trace(A). Thus,
     // ensure all other eigenvalues are at least trace(A)/maxcond.
-    if (param.max_cond > 0) {
+    if (param->max_cond > 0) {
 
         double trace = 0;
-        for (int i = 0; i < xlen; i++) {
-            double v = smatd_get(A, i, i);
-            trace += v;
+        for (int i = 0; i < solver->nnodes; i++) {
+            double *block = bsmatd_block(A, solver->diag[i]);
+            for (int j = 0; j < bsizes[i]; j++)
+                trace += block[j*bsizes[i]+j];
         }
 
         if (trace == 0) {
@@ -619,23 +939,54 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
             trace = 1;
         }
 
-        double lambda = trace / param.max_cond;
+        double lambda = trace / param->max_cond;
 
-        lambda = .001;
+        lambda = TIKHONOV_LAMBDA;
 
-        for (int i = 0; i < xlen; i++) {
-            double v = smatd_get(A, i, i);
-            smatd_set(A, i, i, v + lambda);
+        for (int i = 0; i < solver->nnodes; i++) {
+            double *block = bsmatd_block(A, solver->diag[i]);
+            for (int j = 0; j < bsizes[i]; j++)
+                block[j*bsizes[i]+j] += lambda;
         }
     }
 
+    free(X);
+
+    smatd_t *As = bsmatd_to_smatd(A);
+
     timeprofile_stamp(tp, "build A, B");
 
-    smatd_chol_t *chol = smatd_chol(A);
-    double *x = calloc(xlen, sizeof(double));
+    return As;
+}
+
+// Compute a Gauss-Newton update on the graph, using the specified
+// node ordering. NULL can be passed in for parameters.
+void april_graph_cholesky_solver_iterate(april_graph_cholesky_solver_t *solver, april_graph_t *graph,
+                                         april_graph_cholesky_param_t *_param)
+{
+    april_graph_cholesky_param_t param;
+    april_graph_cholesky_param_init(&param);
+
+    if (_param) {
+        memcpy(&param, _param, sizeof(april_graph_cholesky_param_t));
+    }
+
+    timeprofile_t *tp = solver->tp;
+    timeprofile_clear(tp);
+    timeprofile_stamp(tp, "begin");
+
+    double *B;
+    smatd_t *As = solver_linearize(solver, graph, &param, &B);
+    int *idxs = solver->idxs;
+
+    smatd_chol_t *chol = smatd_chol_numeric(solver->sym, As);
+
+    timeprofile_stamp(tp, "factor");
+
+    double *x = calloc(solver->xlen, sizeof(double));
     smatd_chol_solve(chol, B, x);
 
-    for (int i = 0; i < zarray_size(graph->nodes); i++) {
+    for (int i = 0; i < solver->nnodes; i++) {
         april_graph_node_t *node;
         zarray_get(graph->nodes, i, &node);
 
@@ -645,13 +996,587 @@ void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *_p
     timeprofile_stamp(tp, "solve");
 
     smatd_chol_destroy(chol);
-    smatd_destroy(A);
+    smatd_destroy(As);
 
     free(B);
     free(x);
-    free(idxs);
 
     if (param.show_timing)
         timeprofile_display(tp);
-    timeprofile_destroy(tp);
+}
+
+void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *param)
+{
+    april_graph_cholesky_solver_t *solver = april_graph_cholesky_solver_create();
+    april_graph_cholesky_solver_iterate(solver, graph, param);
+    april_graph_cholesky_solver_destroy(solver);
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////
+// Incremental Solver
+void april_graph_incremental_param_init(april_graph_incremental_param_t *param)
+{
+    memset(param, 0, sizeof(april_graph_incremental_param_t));
+
+    april_graph_cholesky_param_init(&param->cholesky);
+    param->relinearize_interval = 100;
+    param->update_threshold = 1e-6;
+}
+
+struct inc_list
+{
+    int *v;
+    int n, alloc;
+};
+
+static void inc_list_add(struct inc_list *list, int v)
+{
+    if (list->n + 1 > list->alloc) {
+        list->alloc = list->alloc * 2 + 4;
+        list->v = realloc(list->v, list->alloc * sizeof(int));
+    }
+
+    list->v[list->n++] = v;
+}
+
+// The incremental solver works on the square-root form of the
+// normal equations: R*delta = d, with R upper triangular (R'R = A)
+// and one row and column per scalar state variable. delta is
+// relative to the linearization point x0, so the estimate is
+// x0 + delta. Every factor (and every regularization term) is
+// one or more rows of a tall least-squares system that has been
+// rotated into R; adding a factor just rotates its rows in too.
+struct april_graph_incremental
+{
+    april_graph_incremental_param_t param;
+
+    // does the batch steps.
+    april_graph_cholesky_solver_t *solver;
+
+    // how much of the graph R covers.
+    int nnodes, nfactors;
+    int xlen;
+
+    int *idxs;     // first column of each node
+    int nalloc;    // capacity of idxs
+
+    // the arrays below have capacity xalloc.
+    int xalloc;
+
+    svecd_t *rows;          // rows of R, diagonal first
+    struct inc_list *cols;  // cols[c]: rows other than c with an entry in column c
+    int *colnode;           // node that each column belongs to
+    double *d;
+    double *x0;
+    double *delta;
+
+    // rows whose delta needs recomputing, as a max-heap.
+    int *heap;
+    int nheap;
+    char *queued;
+
+    // the row being rotated into R, and scratch for the merges.
+    int *vidx, *tidx, *ridx;
+    double *vval, *tval, *rval;
+
+    int updates; // since the last batch step
+};
+
+april_graph_incremental_t *april_graph_incremental_create(april_graph_incremental_param_t *param)
+{
+    april_graph_incremental_t *inc = calloc(1, sizeof(april_graph_incremental_t));
+
+    if (param)
+        memcpy(&inc->param, param, sizeof(april_graph_incremental_param_t));
+    else
+        april_graph_incremental_param_init(&inc->param);
+
+    inc->solver = april_graph_cholesky_solver_create();
+
+    return inc;
+}
+
+static void incremental_ensure_columns(april_graph_incremental_t *inc, int xlen)
+{
+    if (xlen <= inc->xalloc)
+        return;
+
+    int alloc = imax(imax(2 * inc->xalloc, xlen), 64);
+
+    inc->rows = realloc(inc->rows, alloc * sizeof(svecd_t));
+    inc->cols = realloc(inc->cols, alloc * sizeof(struct inc_list));
+    inc->queued = realloc(inc->queued, alloc * sizeof(char));
+
+    int n = alloc - inc->xalloc;
+    memset(&inc->rows[inc->xalloc], 0, n * sizeof(svecd_t));
+    memset(&inc->cols[inc->xalloc], 0, n * sizeof(struct inc_list));
+    memset(&inc->queued[inc->xalloc], 0, n * sizeof(char));
+
+    inc->colnode = realloc(inc->colnode, alloc * sizeof(int));
+    inc->d = realloc(inc->d, alloc * sizeof(double));
+    inc->x0 = realloc(inc->x0, alloc * sizeof(double));
+    inc->delta = realloc(inc->delta, alloc * sizeof(double));
+    inc->heap = realloc(inc->heap, alloc * sizeof(int));
+
+    inc->vidx = realloc(inc->vidx, alloc * sizeof(int));
+    inc->tidx = realloc(inc->tidx, alloc * sizeof(int));
+    inc->ridx = realloc(inc->ridx, alloc * sizeof(int));
+    inc->vval = realloc(inc->vval, alloc * sizeof(double));
+    inc->tval = realloc(inc->tval, alloc * sizeof(double));
+    inc->rval = realloc(inc->rval, alloc * sizeof(double));
+
+    inc->xalloc = alloc;
+}
+
+static void incremental_ensure_nodes(april_graph_incremental_t *inc, int nnodes)
+{
+    if (nnodes <= inc->nalloc)
+        return;
+
+    inc->nalloc = imax(imax(2 * inc->nalloc, nnodes), 64);
+    inc->idxs = realloc(inc->idxs, inc->nalloc * sizeof(int));
+}
+
+// forget R, keeping the allocations.
+static void incremental_clear(april_graph_incremental_t *inc)
+{
+    for (int i = 0; i < inc->xlen; i++) {
+        free(inc->rows[i].indices);
+        free(inc->rows[i].values);
+        memset(&inc->rows[i], 0, sizeof(svecd_t));
+        inc->cols[i].n = 0;
+    }
+
+    inc->nnodes = 0;
+    inc->nfactors = 0;
+    inc->xlen = 0;
+}
+
+void april_graph_incremental_destroy(april_graph_incremental_t *inc)
+{
+    if (inc == NULL)
+        return;
+
+    incremental_clear(inc);
+    for (int i = 0; i < inc->xalloc; i++)
+        free(inc->cols[i].v);
+
+    april_graph_cholesky_solver_destroy(inc->solver);
+
+    free(inc->idxs);
+    free(inc->rows);
+    free(inc->cols);
+    free(inc->colnode);
+    free(inc->d);
+    free(inc->x0);
+    free(inc->delta);
+    free(inc->heap);
+    free(inc->queued);
+    free(inc->vidx);
+    free(inc->tidx);
+    free(inc->ridx);
+    free(inc->vval);
+    free(inc->tval);
+    free(inc->rval);
+    free(inc);
+}
+
+static void incremental_queue(april_graph_incremental_t *inc, int row)
+{
+    if (inc->queued[row])
+        return;
+
+    inc->queued[row] = 1;
+
+    int i = inc->nheap++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (inc->heap[parent] >= row)
+            break;
+        inc->heap[i] = inc->heap[parent];
+        i = parent;
+    }
+    inc->heap[i] = row;
+}
+
+static int incremental_dequeue(april_graph_incremental_t *inc)
+{
+    int *heap = inc->heap;
+    int top = heap[0];
+    int last = heap[--inc->nheap];
+
+    int i = 0;
+    while (1) {
+        int child = 2*i + 1;
+        if (child >= inc->nheap)
+            break;
+        if (child + 1 < inc->nheap && heap[child+1] > heap[child])
+            child++;
+        if (heap[child] <= last)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+
+    inc->queued[top] = 0;
+    return top;
+}
+
+// One Gauss-Newton iteration over the whole graph, keeping the
+// factorization as the new R.
+static void incremental_batch(april_graph_incremental_t *inc, april_graph_t *graph)
+{
+    april_graph_cholesky_solver_t *solver = inc->solver;
+    timeprofile_t *tp = solver->tp;
+
+    incremental_clear(inc);
+
+    if (zarray_size(graph->nodes) == 0)
+        return;
+
+    april_graph_cholesky_param_t param = inc->param.cholesky;
+    param.ordering = NULL;
+
+    double *B;
+    smatd_t *As = solver_linearize(solver, graph, &param, &B);
+    smatd_chol_t *chol = smatd_chol_numeric(solver->sym, As);
+    smatd_t *u = chol->u;
+
+    timeprofile_stamp(tp, "factor");
+
+    int xlen = solver->xlen;
+    incremental_ensure_columns(inc, xlen);
+    incremental_ensure_nodes(inc, solver->nnodes);
+
+    // U'U = A, so R = U, and R'd = B.
+    smatd_ltransposetriangle_solve(u, B, inc->d);
+    smatd_utriangle_solve(u, inc->d, inc->delta);
+
+    for (int i = 0; i < xlen; i++) {
+        inc->rows[i] = u->rows[i];
+
+        svecd_t *row = &inc->rows[i];
+        for (int pos = 1; pos < row->nz; pos++)
+            inc_list_add(&inc->cols[row->indices[pos]], i);
+    }
+
+    // the rows now belong to R.
+    free(u->rows);
+    u->rows = NULL;
+    u->nrows = 0;
+
+    inc->xlen = xlen;
+    inc->nnodes = solver->nnodes;
+    inc->nfactors = solver->nfactors;
+
+    for (int i = 0; i < inc->nnodes; i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, i, &node);
+
+        int idx = solver->idxs[i];
+        inc->idxs[i] = idx;
+
+        for (int j = 0; j < node->length; j++) {
+            inc->colnode[idx + j] = i;
+            inc->x0[idx + j] = node->state[j];
+        }
+
+        node->update(node, &inc->delta[idx]);
+    }
+
+    smatd_chol_destroy(chol);
+    smatd_destroy(As);
+    free(B);
+
+    // the graph will have grown by the next batch step, so nothing
+    // in the cache would be reused.
+    solver_clear(solver);
+
+    inc->updates = 0;
+
+    timeprofile_stamp(tp, "solve");
+}
+
+// Append columns for a new node, linearized at its current state.
+// Regularization (see solver_linearize) adds the row
+// sqrt(lambda)*delta = 0 for each of its variables.
+static void incremental_add_node(april_graph_incremental_t *inc, april_graph_node_t *node, int nodeidx)
+{
+    int idx = inc->xlen;
+
+    incremental_ensure_columns(inc, idx + node->length);
+    incremental_ensure_nodes(inc, nodeidx + 1);
+
+    inc->idxs[nodeidx] = idx;
+
+    for (int i = 0; i < node->length; i++) {
+        int c = idx + i;
+
+        inc->colnode[c] = nodeidx;
+        inc->x0[c] = node->state[i];
+        inc->delta[c] = 0;
+        inc->d[c] = 0;
+
+        if (inc->param.cholesky.max_cond > 0) {
+            svecd_t *row = &inc->rows[c];
+            row->alloc = 4;
+            row->indices = malloc(row->alloc * sizeof(int));
+            row->values = malloc(row->alloc * sizeof(double));
+            row->indices[0] = c;
+            row->values[0] = sqrt(TIKHONOV_LAMBDA);
+            row->nz = 1;
+        }
+    }
+
+    inc->xlen += node->length;
+}
+
+// Rotate the sparse row in vidx/vval (nv entries, sorted by column)
+// with right-hand side rho into R and d. Each Givens rotation pairs
+// the row with the row of R for its first non-zero, zeroing that
+// entry; the rows of R it changes are queued for back-substitution.
+static void incremental_rotate(april_graph_incremental_t *inc, int nv, double rho)
+{
+    while (nv > 0) {
+        int k = inc->vidx[0];
+        svecd_t *row = &inc->rows[k];
+
+        // a column that nothing constrains yet has no diagonal.
+        double rkk = (row->nz > 0 && row->indices[0] == k) ? row->values[0] : 0;
+        double vk = inc->vval[0];
+        double h = sqrt(rkk*rkk + vk*vk);
+        double c = rkk / h, s = vk / h;
+
+        // row' = c*row + s*v, v' = -s*row + c*v (zero at k).
+        int rn = 0, tn = 0;
+        for (int a = 0, b = 0; a < row->nz || b < nv; ) {
+            int ia = (a < row->nz) ? row->indices[a] : inc->xlen;
+            int ib = (b < nv) ? inc->vidx[b] : inc->xlen;
+            int j = imin(ia, ib);
+            double ra = 0, vb = 0;
+
+            if (ia == j)
+                ra = row->values[a++];
+            if (ib == j)
+                vb = inc->vval[b++];
+
+            // fill-in
+            if (ia != j && j != k)
+                inc_list_add(&inc->cols[j], k);
+
+            inc->ridx[rn] = j;
+            inc->rval[rn++] = c*ra + s*vb;
+
+            double t = -s*ra + c*vb;
+            if (j != k && t != 0) {
+                inc->tidx[tn] = j;
+                inc->tval[tn++] = t;
+            }
+        }
+
+        if (row->alloc < rn) {
+            row->alloc = imax(2 * row->alloc, rn);
+            row->indices = realloc(row->indices, row->alloc * sizeof(int));
+            row->values = realloc(row->values, row->alloc * sizeof(double));
+        }
+        memcpy(row->indices, inc->ridx, rn * sizeof(int));
+        memcpy(row->values, inc->rval, rn * sizeof(double));
+        row->nz = rn;
+
+        double dk = inc->d[k];
+        inc->d[k] = c*dk + s*rho;
+        rho = -s*dk + c*rho;
+
+        int *ti = inc->vidx;
+        inc->vidx = inc->tidx;
+        inc->tidx = ti;
+
+        double *tv = inc->vval;
+        inc->vval = inc->tval;
+        inc->tval = tv;
+
+        nv = tn;
+
+        incremental_queue(inc, k);
+    }
+}
+
+// Linearize a new factor at the current estimate and rotate it into
+// R. With J and r evaluated at x = x0 + delta, the factor's
+// linearization about x0 is J*delta' = r + J*delta; each of its rows
+// is whitened by the Cholesky factor of W.
+static void incremental_add_factor(april_graph_incremental_t *inc, april_graph_t *graph,
+                                   april_graph_factor_t *factor)
+{
+    april_graph_factor_eval_t *eval = factor->eval(factor, graph, NULL);
+    int flen = eval->length;
+
+    // U'U = W
+    double U[flen*flen];
+    memset(U, 0, sizeof(U));
+    for (int i = 0; i < flen; i++) {
+        for (int j = i; j < flen; j++) {
+            double acc = MATD_EL(eval->W, i, j);
+            for (int k = 0; k < i; k++)
+                acc -= U[k*flen+i] * U[k*flen+j];
+
+            if (j == i)
+                U[i*flen+i] = sqrt(fmax(acc, 0));
+            else
+                U[i*flen+j] = (U[i*flen+i] > 0) ? acc / U[i*flen+i] : 0;
+        }
+    }
+
+    double e[flen];
+    for (int k = 0; k < flen; k++) {
+        e[k] = eval->r[k];
+        for (int z = 0; z < factor->nnodes; z++) {
+            matd_t *J = eval->jacobians[z];
+            int idx = inc->idxs[factor->nodes[z]];
+            for (int c = 0; c < J->ncols; c++)
+                e[k] += MATD_EL(J, k, c) * inc->delta[idx + c];
+        }
+    }
+
+    for (int i = 0; i < flen; i++) {
+        int nv = 0;
+        double rho = 0;
+
+        for (int k = i; k < flen; k++)
+            rho += U[i*flen+k] * e[k];
+
+        for (int z = 0; z < factor->nnodes; z++) {
+            matd_t *J = eval->jacobians[z];
+            int idx = inc->idxs[factor->nodes[z]];
+
+            for (int c = 0; c < J->ncols; c++) {
+                double acc = 0;
+                for (int k = i; k < flen; k++)
+                    acc += U[i*flen+k] * MATD_EL(J, k, c);
+                if (acc == 0)
+                    continue;
+
+                // insertion sort by column
+                int pos = nv++;
+                while (pos > 0 && inc->vidx[pos-1] > idx + c) {
+                    inc->vidx[pos] = inc->vidx[pos-1];
+                    inc->vval[pos] = inc->vval[pos-1];
+                    pos--;
+                }
+                inc->vidx[pos] = idx + c;
+                inc->vval[pos] = acc;
+            }
+        }
+
+        incremental_rotate(inc, nv, rho);
+    }
+
+    april_graph_factor_eval_destroy(eval);
+}
+
+// Back-substitute the queued rows, highest first. Row i only depends
+// on the columns to its right, so when delta[i] moves by more than
+// update_threshold, every row with an entry in column i is queued too.
+static void incremental_solve(april_graph_incremental_t *inc, april_graph_t *graph)
+{
+    double threshold = inc->param.update_threshold;
+
+    // columns are solved in decreasing order and each node's columns
+    // are contiguous, so the nodes that changed come out contiguous.
+    // (ridx is free once the rotations are done.)
+    int *changed = inc->ridx;
+    int nchanged = 0;
+
+    while (inc->nheap > 0) {
+        int i = incremental_dequeue(inc);
+        svecd_t *row = &inc->rows[i];
+
+        if (row->nz == 0 || row->indices[0] != i)
+            continue;
+
+        double acc = inc->d[i];
+        for (int pos = 1; pos < row->nz; pos++)
+            acc -= row->values[pos] * inc->delta[row->indices[pos]];
+        acc /= row->values[0];
+
+        double change = fabs(acc - inc->delta[i]);
+        inc->delta[i] = acc;
+
+        if (change > threshold) {
+            struct inc_list *col = &inc->cols[i];
+            for (int pos = 0; pos < col->n; pos++)
+                incremental_queue(inc, col->v[pos]);
+        }
+
+        int nodeidx = inc->colnode[i];
+        if (change > 0 && (nchanged == 0 || changed[nchanged-1] != nodeidx))
+            changed[nchanged++] = nodeidx;
+    }
+
+    for (int i = 0; i < nchanged; i++) {
+        april_graph_node_t *node;
+        zarray_get(graph->nodes, changed[i], &node);
+
+        int idx = inc->idxs[changed[i]];
+        double dstate[node->length];
+        for (int j = 0; j < node->length; j++)
+            dstate[j] = inc->x0[idx + j] + inc->delta[idx + j] - node->state[j];
+
+        node->update(node, dstate);
+    }
+}
+
+void april_graph_incremental_update(april_graph_incremental_t *inc, april_graph_t *graph)
+{
+    timeprofile_t *tp = inc->solver->tp;
+    timeprofile_clear(tp);
+    timeprofile_stamp(tp, "begin");
+
+    int nnodes = zarray_size(graph->nodes);
+    int nfactors = zarray_size(graph->factors);
+    int interval = inc->param.relinearize_interval;
+
+    if (inc->xlen == 0 || nnodes < inc->nnodes || nfactors < inc->nfactors ||
+        (interval > 0 && inc->updates >= interval)) {
+        incremental_batch(inc, graph);
+    } else {
+        for (int i = inc->nnodes; i < nnodes; i++) {
+            april_graph_node_t *node;
+            zarray_get(graph->nodes, i, &node);
+            incremental_add_node(inc, node, i);
+        }
+        inc->nnodes = nnodes;
+
+        timeprofile_stamp(tp, "add nodes");
+
+        for (int i = inc->nfactors; i < nfactors; i++) {
+            april_graph_factor_t *factor;
+            zarray_get(graph->factors, i, &factor);
+            incremental_add_factor(inc, graph, factor);
+        }
+        inc->nfactors = nfactors;
+
+        timeprofile_stamp(tp, "update R");
+
+        incremental_solve(inc, graph);
+        inc->updates++;
+
+        timeprofile_stamp(tp, "solve");
+    }
+
+    if (inc->param.cholesky.show_timing)
+        timeprofile_display(tp);
+}
+
+void april_graph_incremental_relinearize(april_graph_incremental_t *inc, april_graph_t *graph)
+{
+    timeprofile_t *tp = inc->solver->tp;
+    timeprofile_clear(tp);
+    timeprofile_stamp(tp, "begin");
+
+    incremental_batch(inc, graph);
+
+    if (inc->param.cholesky.show_timing)
+        timeprofile_display(tp);
 }
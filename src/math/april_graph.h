@@ -100,6 +100,12 @@ void april_graph_destroy(april_graph_t *graph);
 
 void april_graph_factor_eval_destroy(april_graph_factor_eval_t *eval);
 
+// Ordering methods. AMD (approximate minimum degree) gives about the
+// same fill-in as exact minimum degree on pose graphs, but takes
+// near-linear rather than quadratic time.
+#define APRIL_GRAPH_ORDERING_AMD 0
+#define APRIL_GRAPH_ORDERING_EXACT_MIN_DEGREE 1
+
 typedef struct april_graph_cholesky_param april_graph_cholesky_param_t;
 struct april_graph_cholesky_param
 {
@@ -112,6 +118,10 @@ struct april_graph_cholesky_param
     // specified, an ordering is computed automatically.
     int *ordering;
 
+    // How to compute the ordering when none is specified; one of
+    // APRIL_GRAPH_ORDERING_*. Defaults to AMD.
+    int ordering_method;
+
     int show_timing;
 };
 
@@ -124,6 +134,71 @@ void april_graph_cholesky_param_init(april_graph_cholesky_param_t *param);
 // ordering passed in belongs to the caller.
 void april_graph_cholesky(april_graph_t *graph, april_graph_cholesky_param_t *param);
 
+// A solver that keeps everything april_graph_cholesky derives from
+// the graph's structure (ordering, index maps, the pattern of the
+// normal equations and the symbolic factorization) between calls, so
+// that repeated Gauss-Newton iterations on a graph only redo the
+// numerical work. The cache is rebuilt automatically whenever the
+// nodes, the factors' connectivity or the requested ordering change.
+typedef struct april_graph_cholesky_solver april_graph_cholesky_solver_t;
+
+april_graph_cholesky_solver_t *april_graph_cholesky_solver_create();
+void april_graph_cholesky_solver_destroy(april_graph_cholesky_solver_t *solver);
+
+// Same as april_graph_cholesky. With param->show_timing set, the
+// display breaks the time down by phase; the symbolic phases only
+// appear on iterations that had to rebuild the cache.
+void april_graph_cholesky_solver_iterate(april_graph_cholesky_solver_t *solver, april_graph_t *graph,
+                                         april_graph_cholesky_param_t *param);
+
+// Incremental optimization for graphs that grow over time (e.g.,
+// online SLAM, where every scan appends a node and a few factors).
+// Rather than re-solving the whole graph, each update rotates only
+// the newly added factors into a square-root factor R of the
+// information matrix with Givens rotations, then back-substitutes
+// only the variables whose estimate changes by more than
+// update_threshold. Nodes added since the last batch step are ordered
+// last, in the order they were added.
+//
+// Old factors stay linearized at the estimate they had when last
+// relinearized, so every relinearize_interval updates a batch step
+// (one april_graph_cholesky iteration, with a fresh fill-reducing
+// ordering) rebuilds R from scratch.
+typedef struct april_graph_incremental_param april_graph_incremental_param_t;
+struct april_graph_incremental_param
+{
+    // used for batch steps. 'ordering' is ignored, since the
+    // ordering must cover nodes that do not exist yet.
+    april_graph_cholesky_param_t cholesky;
+
+    // updates between batch steps; 0 never relinearizes on its own.
+    int relinearize_interval;
+
+    // smallest change in a variable that is propagated to the
+    // variables that depend on it during back-substitution. 0
+    // always solves exactly.
+    double update_threshold;
+};
+
+// initialize to default values.
+void april_graph_incremental_param_init(april_graph_incremental_param_t *param);
+
+typedef struct april_graph_incremental april_graph_incremental_t;
+
+// NULL can be passed in for parameters.
+april_graph_incremental_t *april_graph_incremental_create(april_graph_incremental_param_t *param);
+void april_graph_incremental_destroy(april_graph_incremental_t *inc);
+
+// Update the graph's estimate with the nodes and factors appended
+// since the last call (the first call does a batch step). Nodes and
+// factors must only ever be appended; if the graph shrinks, the
+// next update is a batch step. Anything else (editing or reordering
+// existing factors) requires april_graph_incremental_relinearize.
+void april_graph_incremental_update(april_graph_incremental_t *inc, april_graph_t *graph);
+
+// Force a batch step now.
+void april_graph_incremental_relinearize(april_graph_incremental_t *inc, april_graph_t *graph);
+
 int april_graph_dof(april_graph_t *graph);
 double april_graph_chi2(april_graph_t *graph);
 
@@ -0,0 +1,125 @@
+/*$LICENSE*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "bsmatd.h"
+
+bsmatd_t *bsmatd_create(smatd_t *pattern, const int *bsizes)
+{
+    assert(pattern->nrows == pattern->ncols);
+
+    bsmatd_t *m = calloc(1, sizeof(bsmatd_t));
+    int n = pattern->nrows;
+
+    m->nbrows = n;
+    m->bsizes = malloc(n * sizeof(int));
+    memcpy(m->bsizes, bsizes, n * sizeof(int));
+
+    m->boffsets = malloc((n + 1) * sizeof(int));
+    m->boffsets[0] = 0;
+    for (int i = 0; i < n; i++)
+        m->boffsets[i+1] = m->boffsets[i] + bsizes[i];
+
+    m->nblocks = smatd_nz(pattern);
+    m->rowptr = malloc((n + 1) * sizeof(int));
+    m->colidx = malloc(m->nblocks * sizeof(int));
+    m->valptr = malloc((m->nblocks + 1) * sizeof(int));
+
+    int idx = 0, nvalues = 0;
+    for (int i = 0; i < n; i++) {
+        svecd_t *row = &pattern->rows[i];
+
+        m->rowptr[i] = idx;
+        for (int pos = 0; pos < row->nz; pos++) {
+            int j = row->indices[pos];
+
+            m->colidx[idx] = j;
+            m->valptr[idx] = nvalues;
+            nvalues += bsizes[i] * bsizes[j];
+            idx++;
+        }
+    }
+    m->rowptr[n] = idx;
+    m->valptr[idx] = nvalues;
+
+    m->values = calloc(nvalues, sizeof(double));
+
+    return m;
+}
+
+void bsmatd_destroy(bsmatd_t *m)
+{
+    if (m == NULL)
+        return;
+
+    free(m->bsizes);
+    free(m->boffsets);
+    free(m->rowptr);
+    free(m->colidx);
+    free(m->valptr);
+    free(m->values);
+    free(m);
+}
+
+void bsmatd_zero(bsmatd_t *m)
+{
+    memset(m->values, 0, m->valptr[m->nblocks] * sizeof(double));
+}
+
+int bsmatd_find(bsmatd_t *m, int brow, int bcol)
+{
+    int lo = m->rowptr[brow], hi = m->rowptr[brow+1] - 1;
+
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int c = m->colidx[mid];
+
+        if (c == bcol)
+            return mid;
+        if (c < bcol)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+
+    return -1;
+}
+
+smatd_t *bsmatd_to_smatd(bsmatd_t *m)
+{
+    smatd_t *x = smatd_create(m->boffsets[m->nbrows], m->boffsets[m->nbrows]);
+
+    for (int bi = 0; bi < m->nbrows; bi++) {
+        int rsz = m->bsizes[bi];
+        int b0 = m->rowptr[bi], b1 = m->rowptr[bi+1];
+
+        int nz = 0;
+        for (int b = b0; b < b1; b++)
+            nz += m->bsizes[m->colidx[b]];
+
+        for (int r = 0; r < rsz; r++) {
+            svecd_t *row = &x->rows[m->boffsets[bi] + r];
+
+            row->alloc = nz;
+            row->nz = nz;
+            row->indices = malloc(nz * sizeof(int));
+            row->values = malloc(nz * sizeof(double));
+
+            int pos = 0;
+            for (int b = b0; b < b1; b++) {
+                int bj = m->colidx[b];
+                int csz = m->bsizes[bj];
+                const double *v = &m->values[m->valptr[b] + r*csz];
+
+                for (int c = 0; c < csz; c++)
+                    row->indices[pos + c] = m->boffsets[bj] + c;
+                memcpy(&row->values[pos], v, csz * sizeof(double));
+                pos += csz;
+            }
+        }
+    }
+
+    return x;
+}
@@ -0,0 +1,52 @@
+/*$LICENSE*/
+
+#ifndef _BSMATD_H
+#define _BSMATD_H
+
+#include "smatd.h"
+
+// block sparse matrix (BSR). The matrix is partitioned into square
+// blocks along the diagonal (block row i and block column i are both
+// bsizes[i] wide); only the blocks named by the pattern are stored,
+// each as a dense row-major array. The pattern is fixed at creation:
+// a typical user builds it once from the structure of a problem, then
+// repeatedly zeros the values and accumulates into blocks located
+// with bsmatd_find, which avoids any per-element searching.
+
+typedef struct
+{
+    int nbrows;    // number of block rows (== number of block columns)
+    int *bsizes;   // size of each block row/column
+    int *boffsets; // scalar offset of each block row/column (nbrows+1)
+
+    int nblocks;
+    int *rowptr;   // blocks of block row i are [rowptr[i], rowptr[i+1])
+    int *colidx;   // block column of each block, sorted within a row
+    int *valptr;   // offset of each block in values (nblocks+1)
+
+    double *values;
+} bsmatd_t;
+
+// Create a matrix with the non-zero blocks given by the non-zero
+// entries of 'pattern', an nbrows x nbrows matrix whose values are
+// ignored. All blocks are initially zero.
+bsmatd_t *bsmatd_create(smatd_t *pattern, const int *bsizes);
+void bsmatd_destroy(bsmatd_t *m);
+
+void bsmatd_zero(bsmatd_t *m);
+
+// index of block (brow, bcol), or -1 if it is not in the pattern.
+int bsmatd_find(bsmatd_t *m, int brow, int bcol);
+
+// the values of block 'idx' (as returned by bsmatd_find), row-major.
+static inline double *bsmatd_block(bsmatd_t *m, int idx)
+{
+    return &m->values[m->valptr[idx]];
+}
+
+// Expand to an equivalent scalar sparse matrix. Each scalar row is
+// written directly in column order; zeros inside stored blocks are
+// kept.
+smatd_t *bsmatd_to_smatd(bsmatd_t *m);
+
+#endif
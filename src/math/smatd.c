@@ -17,6 +17,9 @@
 
 #define SVEC_MIN_CAPACITY 16
 
+// largest merge in svecd_add_i0 done with stack temporaries
+#define SVEC_STACK_MERGE 256
+
 /////////////////////////////////////////////////
 // row operations
 
@@ -220,11 +223,18 @@ void svecd_add_i0(svecd_t *x, svecd_t *a, svecd_t *b, double bscale, int a0, int
 
     int maxsz = a->nz - aidx + b->nz - bidx;
 
-    // XXX beware of stack overflow
-    TYPE tmp_values[maxsz];
-    int tmp_indices[maxsz];
+    // small merges use the stack; large ones would overflow it.
+    TYPE stack_values[SVEC_STACK_MERGE];
+    int stack_indices[SVEC_STACK_MERGE];
+    TYPE *tmp_values = stack_values;
+    int *tmp_indices = stack_indices;
     int tmp_nz = 0;
 
+    if (maxsz > SVEC_STACK_MERGE) {
+        tmp_values = malloc(sizeof(TYPE)*maxsz);
+        tmp_indices = malloc(sizeof(int)*maxsz);
+    }
+
     while (aidx < a->nz || bidx < b->nz) {
         if (ai == bi) {
             // add and increment both.
@@ -255,6 +265,11 @@ void svecd_add_i0(svecd_t *x, svecd_t *a, svecd_t *b, double bscale, int a0, int
     memcpy(x->indices, tmp_indices, sizeof(int)*tmp_nz);
     memcpy(x->values, tmp_values, sizeof(TYPE)*tmp_nz);
     x->nz = tmp_nz;
+
+    if (tmp_values != stack_values) {
+        free(tmp_values);
+        free(tmp_indices);
+    }
 }
 
 /////////////////////////////////////////////////
@@ -458,8 +473,6 @@ smatd_t *smatd_multiply_dpmethod(smatd_t *a, smatd_t *b)
 smatd_t *smatd_transpose(smatd_t *a)
 {
     smatd_t *x = smatd_create(a->ncols, a->nrows);
-    int cursors[x->nrows];
-    memset(cursors, 0, sizeof(cursors));
 
     for (int inrow = 0; inrow < a->nrows; inrow++) {
         svecd_t *arow = &a->rows[inrow];
@@ -468,7 +481,7 @@ smatd_t *smatd_transpose(smatd_t *a)
             int incol = arow->indices[pos];
 
             svecd_t *xrow = &x->rows[incol];
-            svecd_ensure_capacity(xrow, cursors[incol]+1);
+            svecd_ensure_capacity(xrow, xrow->nz+1);
             xrow->indices[xrow->nz] = inrow;
             xrow->values[xrow->nz] = arow->values[pos];
             xrow->nz++;
@@ -518,44 +531,386 @@ smatd_t *smatd_upper_right(smatd_t *a)
 // But these choices for X and Y also contribute terms to the C parts
 // of matrix M (due to the product of Y' and Y). So we subtract these
 // contributions from C and then recursively factor C.
+//
+// The factorization below is supernodal. Working with L = U' (so
+// that column j of L is row j of U), a symbolic phase first computes
+// the elimination tree of A and, from it, the structure of L. Runs
+// of consecutive columns with nested structure (column j's rows are
+// {j} plus column j+1's rows) are grouped into supernodes, which are
+// stored as dense column-major panels sharing one row list. The
+// numeric phase is left-looking: each supernode gathers the updates
+// from the supernodes below it that touch its columns (a dense
+// product per descendant), then factors its own panel densely. For
+// pose graphs, every node's block already forms a supernode, so the
+// inner loops run over contiguous memory rather than merging sparse
+// rows.
+
+// For every row i, list the columns k < i with A(k,i) != 0 in the
+// upper triangle of A (i.e., the lower triangle pattern of row i).
+static void chol_lower_pattern(smatd_t *a, int **_ptr, int **_idx)
+{
+    int n = a->nrows;
+    int *ptr = calloc(n + 1, sizeof(int));
 
-smatd_chol_t *smatd_chol(smatd_t *a)
+    for (int k = 0; k < n; k++) {
+        svecd_t *row = &a->rows[k];
+        for (int pos = 0; pos < row->nz; pos++) {
+            int i = row->indices[pos];
+            if (i > k)
+                ptr[i+1]++;
+        }
+    }
+
+    for (int i = 0; i < n; i++)
+        ptr[i+1] += ptr[i];
+
+    int *idx = malloc(ptr[n] * sizeof(int));
+    int *fill = malloc(n * sizeof(int));
+    memcpy(fill, ptr, n * sizeof(int));
+
+    // k increases, so each list comes out sorted.
+    for (int k = 0; k < n; k++) {
+        svecd_t *row = &a->rows[k];
+        for (int pos = 0; pos < row->nz; pos++) {
+            int i = row->indices[pos];
+            if (i > k)
+                idx[fill[i]++] = k;
+        }
+    }
+
+    free(fill);
+    *_ptr = ptr;
+    *_idx = idx;
+}
+
+void smatd_chol_symbolic_destroy(smatd_chol_symbolic_t *sym)
 {
-    // create a new matrix that is the upper-right of A.
-    smatd_t *u = smatd_upper_right(a);
+    if (sym == NULL)
+        return;
+
+    free(sym->parent);
+    free(sym->super);
+    free(sym->snode);
+    free(sym->rowptr);
+    free(sym->rows);
+    free(sym->valptr);
+    free(sym);
+}
 
-    int is_spd = (a->nrows == a->ncols);
+smatd_chol_symbolic_t *smatd_chol_symbolic(smatd_t *a)
+{
+    assert(a->nrows == a->ncols);
 
-    // recursively factor each "outer" upper-left shell (X,Y,Z),
-    // modifying the internal bits.
-    for (int i = 0; i < a->nrows; i++) {
-        svecd_t *urowi = &u->rows[i];
+    int n = a->nrows;
 
-        double d = svecd_get(urowi, i);
-        is_spd &= (d > 0);
-        d = sqrt(d);
+    int *lptr, *lidx;
+    chol_lower_pattern(a, &lptr, &lidx);
 
-        svecd_scale(urowi, 1.0 / d);
+    smatd_chol_symbolic_t *sym = calloc(1, sizeof(smatd_chol_symbolic_t));
+    sym->n = n;
 
-        // iterate over the non-zero elements... each non-zero element
-        // will contribute something to block C, which we need to subtract.
-        for (int pos = 0; pos < urowi->nz; pos++) {
-            int j = urowi->indices[pos];
-            if (j > i) {
-                double s = urowi->values[pos];
+    // elimination tree (Liu), with path compression through 'ancestor'.
+    int *parent = malloc(n * sizeof(int));
+    int *ancestor = malloc(n * sizeof(int));
 
-                svecd_t *urowj = &u->rows[j];
-                svecd_add_i0(urowj, urowj, urowi, -s, i+1, i+1);
+    for (int i = 0; i < n; i++) {
+        parent[i] = -1;
+        ancestor[i] = -1;
+
+        for (int p = lptr[i]; p < lptr[i+1]; p++) {
+            int j = lidx[p];
+
+            while (j != -1 && j < i) {
+                int next = ancestor[j];
+                ancestor[j] = i;
+                if (next == -1)
+                    parent[j] = i;
+                j = next;
             }
         }
     }
 
+    sym->parent = parent;
+
+    // column counts of L. Row i of L is the union of the etree paths
+    // from each k (with A(k,i) != 0) up to i; 'mark' stops each walk
+    // where an earlier walk for the same row already passed.
+    int *mark = malloc(n * sizeof(int));
+    int *colcount = malloc(n * sizeof(int));
+
+    for (int j = 0; j < n; j++) {
+        mark[j] = -1;
+        colcount[j] = 1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        mark[i] = i;
+        for (int p = lptr[i]; p < lptr[i+1]; p++) {
+            for (int j = lidx[p]; mark[j] != i; j = parent[j]) {
+                mark[j] = i;
+                colcount[j]++;
+            }
+        }
+    }
+
+    // fundamental supernodes: column j+1 joins column j's supernode
+    // when it is j's parent and j's structure is exactly {j} plus
+    // the structure of j+1.
+    sym->super = malloc((n + 1) * sizeof(int));
+    sym->snode = malloc(n * sizeof(int));
+    sym->nsuper = 0;
+
+    for (int j = 0; j < n; j++) {
+        if (j == 0 || parent[j-1] != j || colcount[j-1] != colcount[j] + 1)
+            sym->super[sym->nsuper++] = j;
+        sym->snode[j] = sym->nsuper - 1;
+    }
+    sym->super[sym->nsuper] = n;
+
+    sym->rowptr = malloc((sym->nsuper + 1) * sizeof(int));
+    sym->valptr = malloc((sym->nsuper + 1) * sizeof(int));
+    sym->rowptr[0] = 0;
+    sym->valptr[0] = 0;
+
+    for (int s = 0; s < sym->nsuper; s++) {
+        int f = sym->super[s];
+        int ncols = sym->super[s+1] - f;
+
+        sym->rowptr[s+1] = sym->rowptr[s] + colcount[f];
+        sym->valptr[s+1] = sym->valptr[s] + colcount[f] * ncols;
+    }
+
+    // row structure of each supernode's first column, by the same
+    // walks as above. Rows are visited in increasing order, so each
+    // list is built already sorted.
+    sym->rows = malloc(sym->rowptr[sym->nsuper] * sizeof(int));
+    int *fill = malloc(sym->nsuper * sizeof(int));
+    memcpy(fill, sym->rowptr, sym->nsuper * sizeof(int));
+
+    for (int j = 0; j < n; j++)
+        mark[j] = -1;
+
+    for (int i = 0; i < n; i++) {
+        mark[i] = i;
+
+        int s = sym->snode[i];
+        if (sym->super[s] == i)
+            sym->rows[fill[s]++] = i;
+
+        for (int p = lptr[i]; p < lptr[i+1]; p++) {
+            for (int j = lidx[p]; mark[j] != i; j = parent[j]) {
+                mark[j] = i;
+
+                int sj = sym->snode[j];
+                if (sym->super[sj] == j)
+                    sym->rows[fill[sj]++] = i;
+            }
+        }
+    }
+
+    free(fill);
+    free(mark);
+    free(colcount);
+    free(ancestor);
+    free(lptr);
+    free(lidx);
+
+    return sym;
+}
+
+// Factor the supernodal panels in 'values' (laid out by 'sym') in
+// place. Returns non-zero if every pivot was positive.
+static int chol_numeric(smatd_chol_symbolic_t *sym, smatd_t *a, TYPE *values)
+{
+    int n = sym->n;
+    int nsuper = sym->nsuper;
+    int is_spd = 1;
+
+    memset(values, 0, sym->valptr[nsuper] * sizeof(TYPE));
+
+    // relmap[i]: position of row i in the current supernode's row list
+    int *relmap = malloc(n * sizeof(int));
+
+    // Descendants waiting to update a supernode are kept in linked
+    // lists: head[s] is the first supernode whose next unused row
+    // falls in s, next[d] the one after d, and dpos[d] the position
+    // of that row in d's row list.
+    int *head = malloc(nsuper * sizeof(int));
+    int *next = malloc(nsuper * sizeof(int));
+    int *dpos = malloc(nsuper * sizeof(int));
+
+    int maxrows = 0, maxcols = 0;
+    for (int s = 0; s < nsuper; s++) {
+        head[s] = -1;
+        if (sym->rowptr[s+1] - sym->rowptr[s] > maxrows)
+            maxrows = sym->rowptr[s+1] - sym->rowptr[s];
+        if (sym->super[s+1] - sym->super[s] > maxcols)
+            maxcols = sym->super[s+1] - sym->super[s];
+    }
+
+    TYPE *work = malloc((size_t) maxrows * maxcols * sizeof(TYPE));
+
+    for (int s = 0; s < nsuper; s++) {
+        int f = sym->super[s], l = sym->super[s+1];
+        int ncols = l - f;
+        int *rows = &sym->rows[sym->rowptr[s]];
+        int nrows = sym->rowptr[s+1] - sym->rowptr[s];
+        TYPE *L = &values[sym->valptr[s]];
+
+        for (int p = 0; p < nrows; p++)
+            relmap[rows[p]] = p;
+
+        // scatter the upper triangle of A's rows f..l-1, which are
+        // the lower triangle of columns f..l-1.
+        for (int j = f; j < l; j++) {
+            svecd_t *arow = &a->rows[j];
+            TYPE *Lcol = &L[(j - f) * nrows];
+
+            for (int pos = 0; pos < arow->nz; pos++) {
+                int i = arow->indices[pos];
+                if (i >= j)
+                    Lcol[relmap[i]] += arow->values[pos];
+            }
+        }
+
+        // apply the updates from each descendant d: with D the rows of
+        // d's panel from its first row in s onward, and K the subset
+        // of those rows inside s, subtract D*K'.
+        int d = head[s];
+        head[s] = -1;
+
+        while (d >= 0) {
+            int dnext = next[d];
+            int *drows = &sym->rows[sym->rowptr[d]];
+            int dnrows = sym->rowptr[d+1] - sym->rowptr[d];
+            int dncols = sym->super[d+1] - sym->super[d];
+            TYPE *Ld = &values[sym->valptr[d]];
+
+            int p1 = dpos[d], p2 = p1;
+            while (p2 < dnrows && drows[p2] < l)
+                p2++;
+
+            int m = dnrows - p1, k = p2 - p1;
+
+            memset(work, 0, (size_t) m * k * sizeof(TYPE));
+
+            for (int c = 0; c < dncols; c++) {
+                TYPE *Ldc = &Ld[c * dnrows + p1];
+
+                for (int jj = 0; jj < k; jj++) {
+                    TYPE v = Ldc[jj];
+                    if (v == 0)
+                        continue;
+
+                    TYPE *w = &work[jj * m];
+                    for (int ii = jj; ii < m; ii++)
+                        w[ii] += Ldc[ii] * v;
+                }
+            }
+
+            for (int jj = 0; jj < k; jj++) {
+                TYPE *Lcol = &L[(drows[p1 + jj] - f) * nrows];
+                TYPE *w = &work[jj * m];
+
+                for (int ii = jj; ii < m; ii++)
+                    Lcol[relmap[drows[p1 + ii]]] -= w[ii];
+            }
+
+            // d's next update goes to the supernode owning its next row.
+            dpos[d] = p2;
+            if (p2 < dnrows) {
+                int t = sym->snode[drows[p2]];
+                next[d] = head[t];
+                head[t] = d;
+            }
+
+            d = dnext;
+        }
+
+        // dense left-looking factorization of the panel itself.
+        for (int c = 0; c < ncols; c++) {
+            TYPE *Lc = &L[c * nrows];
+
+            for (int cc = 0; cc < c; cc++) {
+                TYPE *Lcc = &L[cc * nrows];
+                TYPE v = Lcc[c];
+
+                for (int i = c; i < nrows; i++)
+                    Lc[i] -= Lcc[i] * v;
+            }
+
+            TYPE diag = Lc[c];
+            is_spd &= (diag > 0);
+            diag = sqrt(diag);
+
+            Lc[c] = diag;
+            for (int i = c + 1; i < nrows; i++)
+                Lc[i] /= diag;
+        }
+
+        if (ncols < nrows) {
+            int t = sym->snode[rows[ncols]];
+            dpos[s] = ncols;
+            next[s] = head[t];
+            head[t] = s;
+        }
+    }
+
+    free(work);
+    free(relmap);
+    free(head);
+    free(next);
+    free(dpos);
+
+    return is_spd;
+}
+
+smatd_chol_t *smatd_chol_numeric(smatd_chol_symbolic_t *sym, smatd_t *a)
+{
+    assert(a->nrows == sym->n && a->ncols == sym->n);
+
+    TYPE *values = malloc(sym->valptr[sym->nsuper] * sizeof(TYPE));
+
+    int is_spd = chol_numeric(sym, a, values);
+
+    // unpack into U: row j of U is column j of L, which is contiguous
+    // in its supernode's panel.
+    smatd_t *u = smatd_create(a->nrows, a->ncols);
+
+    for (int s = 0; s < sym->nsuper; s++) {
+        int f = sym->super[s], l = sym->super[s+1];
+        int *rows = &sym->rows[sym->rowptr[s]];
+        int nrows = sym->rowptr[s+1] - sym->rowptr[s];
+        TYPE *L = &values[sym->valptr[s]];
+
+        for (int j = f; j < l; j++) {
+            int c = j - f;
+            svecd_t *urow = &u->rows[j];
+
+            svecd_ensure_capacity(urow, nrows - c);
+            urow->nz = nrows - c;
+            memcpy(urow->indices, &rows[c], (nrows - c) * sizeof(int));
+            memcpy(urow->values, &L[c * nrows + c], (nrows - c) * sizeof(TYPE));
+        }
+    }
+
+    free(values);
+
     smatd_chol_t *chol = calloc(1, sizeof(smatd_chol_t));
     chol->is_spd = is_spd;
     chol->u = u;
     return chol;
 }
 
+smatd_chol_t *smatd_chol(smatd_t *a)
+{
+    smatd_chol_symbolic_t *sym = smatd_chol_symbolic(a);
+    smatd_chol_t *chol = smatd_chol_numeric(sym, a);
+    smatd_chol_symbolic_destroy(sym);
+
+    return chol;
+}
+
 void smatd_chol_destroy(smatd_chol_t *chol)
 {
     smatd_destroy(chol->u);
@@ -639,7 +994,7 @@ void smatd_chol_solve(smatd_chol_t *chol, const TYPE *b, TYPE *x)
 
     smatd_t *u = chol->u;
 
-    TYPE y[u->ncols];
+    TYPE *y = malloc(u->ncols * sizeof(TYPE));
 
         // back solve U'y = b
         // smatd_t *l = smatd_transpose(u);
@@ -651,6 +1006,8 @@ void smatd_chol_solve(smatd_chol_t *chol, const TYPE *b, TYPE *x)
 
     // back solve Ux = y
     smatd_utriangle_solve(u, y, x);
+
+    free(y);
 }
 
 // basically the same idea as chol, except we don't assume symmetry.
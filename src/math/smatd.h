@@ -74,6 +74,37 @@ smatd_chol_t *smatd_chol(smatd_t *a);
 void smatd_chol_solve(smatd_chol_t *chol, const TYPE *b, TYPE *x);
 void smatd_chol_destroy(smatd_chol_t *chol);
 
+// Solve U'x = b and Ux = b for an upper triangular U (e.g., the
+// factor from smatd_chol), the two halves of smatd_chol_solve.
+void smatd_ltransposetriangle_solve(smatd_t *u, const TYPE *b, TYPE *x);
+void smatd_utriangle_solve(smatd_t *u, const TYPE *b, TYPE *x);
+
+// The symbolic half of smatd_chol: elimination tree, supernodes and
+// the structure of the factor. It depends only on which entries of
+// the matrix are stored, so it can be computed once and reused to
+// factor any number of matrices with that same pattern.
+typedef struct
+{
+    int n;
+    int *parent;  // elimination tree, -1 at roots
+
+    int nsuper;
+    int *super;   // first column of each supernode (nsuper+1)
+    int *snode;   // supernode of each column
+
+    int *rowptr;  // rows of supernode s are rows[rowptr[s] .. rowptr[s+1]]
+    int *rows;    // sorted; the first ones are the supernode's own columns
+    int *valptr;  // offset of supernode s's panel among all panels
+} smatd_chol_symbolic_t;
+
+smatd_chol_symbolic_t *smatd_chol_symbolic(smatd_t *a);
+void smatd_chol_symbolic_destroy(smatd_chol_symbolic_t *sym);
+
+// The numeric half of smatd_chol. 'a' must not store any entry
+// outside the pattern that 'sym' was computed from (storing fewer is
+// fine).
+smatd_chol_t *smatd_chol_numeric(smatd_chol_symbolic_t *sym, smatd_t *a);
+
 // Compute an LDU factorization. No pivoting is performed
 // (deliberately--- so that we do not undermine an externally-applied
 // sparsity-maximizing variable ordering. The matrix can be any shape,
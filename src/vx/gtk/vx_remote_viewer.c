@@ -45,6 +45,10 @@ typedef struct
 
     int running;
 
+    // VX_TCP_ENC_* bits to ask the application to use for resources
+    uint32_t encodings;
+    vx_tcp_resc_cache_t * resc_cache; // only touched by the listen thread
+
     pthread_t listen_thread;
 } state_t;
 
@@ -189,10 +193,19 @@ void * listen_run(void * usr)
         // printf("RECV code %d len %d\n", code, len);
 
         if (code == VX_TCP_CODES) {
+            vx_tcp_resc_cache_dealloc(state->resc_cache, buf, len);
             state->disp->send_codes(state->disp, buf, len);
-        } else if (code == VX_TCP_ADD_RESOURCES) {
+        } else if (code == VX_TCP_ADD_RESOURCES || code == VX_TCP_ADD_RESOURCES_ENC) {
             vx_code_input_stream_t * cins = vx_code_input_stream_create(buf, len);
-            zhash_t * resources = vx_tcp_util_unpack_resources(cins);
+            zhash_t * resources = NULL;
+            if (code == VX_TCP_ADD_RESOURCES_ENC)
+                resources = vx_tcp_util_unpack_resources_enc(cins, state->resc_cache);
+            else
+                resources = vx_tcp_util_unpack_resources(cins);
+            if (resources == NULL) {
+                printf("ERR: malformed resources from TCP connection. Exiting!\n");
+                exit(1);
+            }
 
             if (0) {
                 printf("DBG: raw tcp recv'd resc: ");
@@ -230,6 +243,8 @@ static void display_finished(vx_application_t * app, vx_display_t * disp)
     printf("exiting joined\n");
 }
 
+static void write_codes(state_t * state, int op_type, vx_code_output_stream_t * couts);
+
 static void display_started(vx_application_t * app, vx_display_t * disp)
 {
     state_t * state = app->impl;
@@ -247,6 +262,16 @@ static void display_started(vx_application_t * app, vx_display_t * disp)
 
     // Add the display listener, which will send on TCP
 
+    // Tell the application which resource encodings we can decode. Sent
+    // even when there are none, so resources arrive as
+    // VX_TCP_ADD_RESOURCES_ENC and carry their versions
+    {
+        vx_code_output_stream_t * couts = vx_code_output_stream_create(4);
+        couts->write_uint32(couts, state->encodings);
+        write_codes(state, VX_TCP_CAPABILITIES, couts);
+        vx_code_output_stream_destroy(couts);
+    }
+
     // start the TCP listen thread.
     pthread_create(&state->listen_thread, NULL, listen_run, state);
 }
@@ -352,6 +377,7 @@ int main(int argc, char ** argv)
     getopt_add_string (gopt, 'a', "ip-address", "localhost", "Hostname to connect to.");
     getopt_add_int    (gopt, 'p', "port", "15151", "Port to connect to");
     getopt_add_bool   (gopt, 'l', "list", 0, "List active remote applications and exit");
+    getopt_add_bool   (gopt, 'u', "uncompressed", 0, "Ask for resources to be sent uncompressed");
 
     // parse and print help
     if (!getopt_parse(gopt, argc, argv, 1) || getopt_get_bool(gopt,"help")) {
@@ -380,6 +406,10 @@ int main(int argc, char ** argv)
     state->ip = getopt_get_string(gopt, "ip-address");
     state->port = getopt_get_int(gopt, "port");
 
+    if (!getopt_get_bool(gopt, "uncompressed"))
+        state->encodings = VX_TCP_ENC_C5 | VX_TCP_ENC_DELTA;
+    state->resc_cache = vx_tcp_resc_cache_create();
+
     if (getopt_get_bool(gopt, "list")) {
 
         printf("Searching for remote applications...");
@@ -421,6 +451,7 @@ int main(int argc, char ** argv)
 
     vx_gtk_display_source_destroy(state->src);
 
+    vx_tcp_resc_cache_destroy(state->resc_cache);
     free(state);
     vx_global_destroy();
     getopt_destroy(gopt);
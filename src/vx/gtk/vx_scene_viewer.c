@@ -8,6 +8,7 @@
 #include "vx/gtk/vx_gtk_display_source.h"
 #include "vx/vx_remote_display_source.h"
 #include "vx/vx_tcp_util.h"
+#include "vx/vx_gl_renderer.h"
 #include "vx/vx_code_input_stream.h"
 
 typedef struct
@@ -22,6 +23,19 @@ static int verbose = 0;
 
 static void parse_scene_codes(vx_code_input_stream_t * cins, vx_display_t * disp)
 {
+    // Older scenes have no header, and start with the layer count
+    uint32_t format = 0;
+    if (vx_code_input_stream_available(cins) >= 8 && cins->read_uint32(cins) == VX_SCENE_MAGIC) {
+        format = cins->read_uint32(cins);
+    } else {
+        cins->reset(cins);
+    }
+    if (verbose) printf("Scene format %u\n", format);
+    if (format > VX_SCENE_FORMAT) {
+        printf("ERR: Scene format %u is newer than this viewer supports (%d)\n", format, VX_SCENE_FORMAT);
+        return;
+    }
+
     int nlayers = cins->read_uint32(cins);
     if (verbose) printf("Reading %d layers\n", nlayers);
     for (int i = 0; i < nlayers; i++) {
@@ -69,7 +83,18 @@ static void parse_scene_codes(vx_code_input_stream_t * cins, vx_display_t * disp
     }
 
     if (verbose) printf("Starting to read resources\n");
-    zhash_t * resources =  vx_tcp_util_unpack_resources(cins);
+    zhash_t * resources = NULL;
+    if (format == 0) {
+        resources = vx_tcp_util_unpack_resources(cins);
+    } else {
+        vx_tcp_resc_cache_t * cache = vx_tcp_resc_cache_create();
+        resources = vx_tcp_util_unpack_resources_enc(cins, cache);
+        vx_tcp_resc_cache_destroy(cache);
+        if (resources == NULL) {
+            printf("ERR: Malformed resources in scene\n");
+            return;
+        }
+    }
     disp->send_resources(disp, resources);
 
     zhash_destroy(resources);
@@ -2,6 +2,10 @@
 precision mediump float;
 #endif
 uniform vec4 color;
+#ifdef VX_INSTANCE_COLORS
+varying vec4 instance_color_varying;
+#define color instance_color_varying
+#endif
 
 varying vec3 color_varying;
 
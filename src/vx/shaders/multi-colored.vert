@@ -4,12 +4,26 @@ uniform float pointSize;
 attribute vec4 position;
 attribute vec4 color;
 
+#ifdef VX_INSTANCED
+attribute mat4 instance_M; // transposed, see vxo_instances
+uniform mat4 instance_inner; // model matrix inside the vxo_instances
+#endif
+
+#ifdef VX_INSTANCE_COLORS
+attribute vec4 instance_color;
+#define color instance_color
+#endif
+
 varying vec4 cls;
 
 void main()
 {
     // Transforming The Vertex
+#ifdef VX_INSTANCED
+    gl_Position = PM*((instance_inner*position)*instance_M);
+#else
     gl_Position = PM*position;
+#endif
     cls = color;
     gl_PointSize = pointSize;
 }
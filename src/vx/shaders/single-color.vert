@@ -3,9 +3,26 @@ uniform float pointSize;
 
 attribute vec4 position;
 
+#ifdef VX_INSTANCED
+attribute mat4 instance_M; // transposed, see vxo_instances
+uniform mat4 instance_inner; // model matrix inside the vxo_instances
+#endif
+
+#ifdef VX_INSTANCE_COLORS
+attribute vec4 instance_color;
+varying vec4 instance_color_varying;
+#endif
+
 void main()
 {
     // Transforming The Vertex
+#ifdef VX_INSTANCED
+    gl_Position = PM*((instance_inner*position)*instance_M);
+#else
     gl_Position = PM*position;
+#endif
+#ifdef VX_INSTANCE_COLORS
+    instance_color_varying = instance_color;
+#endif
     gl_PointSize = pointSize;
 }
@@ -8,6 +8,16 @@ attribute vec3 normal;
 
 attribute vec4 color; // rgb a
 
+#ifdef VX_INSTANCED
+attribute mat4 instance_M; // transposed, see vxo_instances
+uniform mat4 instance_inner; // model matrix inside the vxo_instances
+#endif
+
+#ifdef VX_INSTANCE_COLORS
+attribute vec4 instance_color;
+#define color instance_color
+#endif
+
 varying vec4 color_varying;
 
 
@@ -41,11 +51,18 @@ void applyLights(vec3 L, vec3 out_normal, vec3 lt_amb, vec3 lt_diff)//, vec3 E,
 void main()
 {
     // Transforming the Vertex
-    gl_Position = PM*position;
+#ifdef VX_INSTANCED
+    vec4 pos = (instance_inner*position)*instance_M;
+    vec3 nrm = vec3((instance_inner*vec4(normal, 0.0))*instance_M);
+#else
+    vec4 pos = position;
+    vec3 nrm = normal;
+#endif
+    gl_Position = PM*pos;
 
     gl_PointSize = pointSize;
-    vec3 out_normal = normalize(N*normal);
-    vec3 pos_world = vec3(M*position);
+    vec3 out_normal = normalize(N*nrm);
+    vec3 pos_world = vec3(M*pos);
 
     // Compute per vertex lighting:
     vec3 lt1 = normalize(light1-pos_world);
@@ -22,6 +22,8 @@ extern "C" {
 #define OP_PROJ_POP       12
 #define OP_PROJ_PIXCOORDS 13
 #define OP_PROJ_RELCOORDS 14
+#define OP_INSTANCES_PUSH 15 // count, transforms guid, colors guid (or 0)
+#define OP_INSTANCES_POP  16
 
 // Note: model matrix contains displacement from world origin
 //       proj matrix contains projection + camera displacement
@@ -16,8 +16,34 @@
 #include "common/zhash.h"
 #include "common/zarray.h"
 #include "math/matd.h"
+#include "math/math_util.h"
 #include "vx_util.h"
 
+#define MAX_ATTRIB_COUNT 32
+#define MAX_TEX_COUNT 8
+
+// How a vertex attribute location is pointed at a vbo
+typedef struct gl_attrib gl_attrib_t;
+struct gl_attrib {
+    uint64_t guid; // 0 when disabled
+    int dim, stride, offset;
+    int divisor; // kept when disabled, it is GL state of its own
+};
+
+// GL state set by the draws so far in this frame, so that draws which
+// share a program, vertex attributes or textures with the one before
+// don't set them again
+typedef struct gl_bound gl_bound_t;
+struct gl_bound {
+    GLuint prog_id;
+    GLuint array_vbo, element_vbo;
+    gl_attrib_t attribs[MAX_ATTRIB_COUNT]; // by location
+    uint8_t attrib_used[MAX_ATTRIB_COUNT]; // by the program being drawn
+    int active_tex;
+    GLuint tex_id[MAX_TEX_COUNT];
+    int depth_enabled;
+};
+
 //state
 struct vx_gl_renderer
 {
@@ -28,14 +54,21 @@ struct vx_gl_renderer
     zarray_t * dealloc_ids; // resources that need to be deleted
 
     // holds info about vbo and textures which have been allocated with GL
-    zhash_t * vbo_map;
-    zhash_t * texture_map;
+    zhash_t * vbo_map; // holds gl_vbo_resc_t
+    zhash_t * texture_map; // holds gl_tex_resc_t
 
     zhash_t * layer_map; // <int, vx_layer_info_t>
     zhash_t * world_map; // <int, vx_world_info_t>
 
     int verbose;
     int resc_verbose;
+    int use_pbo; // stage texture updates through a pixel buffer object
+    int sort_draws; // reorder draws to reduce state changes
+
+    zarray_t * draw_list; // <draw_item_t>, rebuilt for each layer
+    zhash_t * bounds_map; // <uint64_t, vbo_bounds_t*>
+    gl_bound_t bound;
+    vx_gl_renderer_stats_t stats; // counts for the current (or last) frame
 };
 
 // Resource management for gl program and associated shaders:
@@ -50,6 +83,46 @@ struct gl_prog_resc {
     GLuint prog_id; // program id
     GLuint vert_id; // associated vertex_shader
     GLuint frag_id; // associated fragment shader
+
+    // Looked up once instead of on every draw
+    zhash_t * uniforms; // <char*, gl_uniform_t*>
+    zhash_t * attribs; // <char*, GLint>
+
+    // The same shaders compiled with VX_INSTANCED defined, for draws
+    // within a vxo_instances ([1] also defines VX_INSTANCE_COLORS).
+    // Created on first use, freed with this one
+    gl_prog_resc_t * instanced[2];
+};
+
+// A uniform of a program, and the value it was last set to. Setting it
+// to the same value again is skipped
+typedef struct gl_uniform gl_uniform_t;
+struct gl_uniform {
+    GLint loc;
+    int size; // in 32 bit words, 0 until first set
+    uint32_t vals[16];
+};
+
+
+// GL texture for a resource guid. For streaming resources, the same
+// texture is reused across versions: as long as the size and format
+// match, new contents are uploaded with glTexSubImage2D
+typedef struct gl_tex_resc gl_tex_resc_t;
+struct gl_tex_resc {
+    GLuint tex_id;
+    GLuint pbo_id; // 0 until the first update through a PBO
+    uint32_t version; // version of the vx_resc_t currently uploaded
+    uint32_t width, height, format, flags;
+};
+
+// GL buffer for a resource guid. Like textures, the buffer of a
+// streaming resource is reused across versions, with glBufferSubData
+// as long as the size matches
+typedef struct gl_vbo_resc gl_vbo_resc_t;
+struct gl_vbo_resc {
+    GLuint vbo_id;
+    uint32_t version; // version of the vx_resc_t currently uploaded
+    int size; // in bytes
 };
 
 
@@ -86,6 +159,58 @@ struct vx_world_info {
     zhash_t * buffer_map; // holds vx_buffer_info_t
 };
 
+// The vxo_instances a draw is within, from OP_INSTANCES_PUSH
+typedef struct instance_info instance_info_t;
+struct instance_info {
+    uint32_t count; // 0 when not instanced
+    uint64_t transforms_id;
+    uint64_t colors_id; // 0 when the styles' colors are used
+    double model[16]; // model matrix at the push
+};
+
+// One OP_PROGRAM from a buffer, along with the matrices and depth state
+// it is drawn with. The programs of a layer are collected into a list
+// of these each frame, which batch_draws() reorders so that draws with
+// the same program, texture and vertex data end up next to each other
+typedef struct draw_item draw_item_t;
+struct draw_item {
+    int run; // draws are only reordered within a run (a buffer)
+    int seq; // order in the layer
+    int batch; // see batch_draws()
+    uint64_t prog_key, tex_key, vbo_key;
+    uint64_t unif_key; // hash of the uniform values in the codes (e.g. color)
+
+    // what is needed to find where on screen the draw lands
+    uint64_t pos_guid; // "position" vertex attribute
+    uint32_t pos_dim;
+    int has_pm;
+    float margin; // line width or point size, in pixels
+    int cells[4]; // x0, y0, x1, y1 (inclusive), see item_cells()
+
+    vx_code_input_stream_t * codes;
+    uint32_t codes_pos; // start of the program's opcodes
+    char * buffer_name;
+
+    double model[16];
+    float proj[16];
+    uint8_t depth_enabled;
+
+    // When instanced, model is the matrix at the vxo_instances and inner
+    // the rest of the model matrix, applied before each instance's own
+    instance_info_t instances;
+    double inner[16];
+};
+
+// Extents of the position data in a vbo
+typedef struct vbo_bounds vbo_bounds_t;
+struct vbo_bounds {
+    float min[3], max[3];
+};
+
+// Resolution of the grid of screen cells used to decide whether two
+// draws may overlap
+#define BATCH_GRID 64
+
 vx_gl_renderer_t * vx_gl_renderer_create()
 {
     vx_gl_renderer_t * state = calloc(1,sizeof(vx_gl_renderer_t));
@@ -93,8 +218,8 @@ vx_gl_renderer_t * vx_gl_renderer_create()
     state->resource_map = zhash_create(sizeof(uint64_t), sizeof(vx_resc_t*), zhash_uint64_hash, zhash_uint64_equals);
 
     state->program_map = zhash_create(sizeof(uint64_t), sizeof(gl_prog_resc_t*), zhash_uint64_hash, zhash_uint64_equals);
-    state->vbo_map = zhash_create(sizeof(uint64_t), sizeof(uint32_t), zhash_uint64_hash,zhash_uint64_equals);
-    state->texture_map = zhash_create(sizeof(uint64_t), sizeof(uint32_t),zhash_uint64_hash,zhash_uint64_equals);
+    state->vbo_map = zhash_create(sizeof(uint64_t), sizeof(gl_vbo_resc_t*), zhash_uint64_hash,zhash_uint64_equals);
+    state->texture_map = zhash_create(sizeof(uint64_t), sizeof(gl_tex_resc_t*),zhash_uint64_hash,zhash_uint64_equals);
 
     state->dealloc_ids = zarray_create(sizeof(uint64_t));
 
@@ -111,6 +236,18 @@ vx_gl_renderer_t * vx_gl_renderer_create()
     if (vx_resc_verbose != NULL)
         state->resc_verbose = atoi(vx_resc_verbose); // returns 0 on error
 
+    const char * vx_pbo = getenv("VX_GL_PBO");
+    if (vx_pbo != NULL)
+        state->use_pbo = atoi(vx_pbo); // returns 0 on error
+
+    state->sort_draws = 1;
+    const char * vx_sort = getenv("VX_GL_SORT");
+    if (vx_sort != NULL)
+        state->sort_draws = atoi(vx_sort); // returns 0 on error
+
+    state->draw_list = zarray_create(sizeof(draw_item_t));
+    state->bounds_map = zhash_create(sizeof(uint64_t), sizeof(vbo_bounds_t*), zhash_uint64_hash, zhash_uint64_equals);
+
     return state;
 }
 
@@ -119,6 +256,11 @@ int vx_gl_renderer_changed_since_last_render(vx_gl_renderer_t * rend)
     return rend->change_since_last_render;
 }
 
+void vx_gl_renderer_get_stats(vx_gl_renderer_t * rend, vx_gl_renderer_stats_t * stats)
+{
+    *stats = rend->stats;
+}
+
 static void vx_buffer_info_destroy(vx_buffer_info_t * binfo)
 {
     free(binfo->name);
@@ -150,6 +292,51 @@ static int layer_info_compare(const void *_a, const void *_b)
     return a->draw_order - b->draw_order;
 }
 
+static int draw_item_compare(const void *_a, const void *_b)
+{
+    const draw_item_t *a = _a;
+    const draw_item_t *b = _b;
+
+    int c = a->batch - b->batch;
+    if (c == 0)
+        c = a->seq - b->seq;
+    return c;
+}
+
+// frees the keys and values of a zhash with strdup'd keys
+static void name_map_destroy(zhash_t * map, int free_values)
+{
+    zhash_iterator_t itr;
+    zhash_iterator_init(map, &itr);
+    char * name = NULL;
+    void * value = NULL;
+    while (zhash_iterator_next(&itr, &name, &value)) {
+        free(name);
+        if (free_values)
+            free(value);
+    }
+    zhash_destroy(map);
+}
+
+static void program_destroy(vx_gl_renderer_t * state, gl_prog_resc_t * prog)
+{
+    for (int i = 0; i < 2; i++) {
+        if (prog->instanced[i] != NULL)
+            program_destroy(state, prog->instanced[i]);
+    }
+
+    glDetachShader(prog->prog_id,prog->vert_id);
+    glDeleteShader(prog->vert_id);
+    glDetachShader(prog->prog_id,prog->frag_id);
+    glDeleteShader(prog->frag_id);
+    glDeleteProgram(prog->prog_id);
+
+    if (state->verbose > 1) printf("  Freed program %d vert %d and frag %d\n",
+                                   prog->prog_id, prog->vert_id, prog->frag_id);
+    name_map_destroy(prog->uniforms, 1);
+    name_map_destroy(prog->attribs, 0);
+    free(prog);
+}
 
 static void process_deallocations(vx_gl_renderer_t * state)
 {
@@ -169,11 +356,12 @@ static void process_deallocations(vx_gl_renderer_t * state)
         assert(vr != NULL);
 
        // There may also be a program, or a vbo or texture for each guid
-        GLuint vbo_id = 0;
-        if (zhash_remove(state->vbo_map, &guid, NULL, &vbo_id)) {
+        gl_vbo_resc_t * vbo = NULL;
+        if (zhash_remove(state->vbo_map, &guid, NULL, &vbo)) {
             // Tell open GL to deallocate this VBO
-            glDeleteBuffers(1, &vbo_id);
-            if (state->verbose > 1) printf(" Deleted VBO %d \n", vbo_id);
+            glDeleteBuffers(1, &vbo->vbo_id);
+            if (state->verbose > 1) printf(" Deleted VBO %d \n", vbo->vbo_id);
+            free(vbo);
         }
 
         // There is always a resource for each guid.
@@ -186,26 +374,24 @@ static void process_deallocations(vx_gl_renderer_t * state)
         }
 
 
-        GLuint tex_id = 0;
-        if (zhash_remove(state->texture_map, &guid, NULL, &tex_id)) {
+        vbo_bounds_t * bounds = NULL;
+        if (zhash_remove(state->bounds_map, &guid, NULL, &bounds))
+            free(bounds);
+
+        gl_tex_resc_t * tex = NULL;
+        if (zhash_remove(state->texture_map, &guid, NULL, &tex)) {
             // Tell open GL to deallocate this texture
-            glDeleteTextures(1, &tex_id);
-            if (state->verbose > 1) printf(" Deleted TEX %d \n", tex_id);
+            glDeleteTextures(1, &tex->tex_id);
+            if (tex->pbo_id != 0)
+                glDeleteBuffers(1, &tex->pbo_id);
+            if (state->verbose > 1) printf(" Deleted TEX %d \n", tex->tex_id);
+            free(tex);
         }
 
         gl_prog_resc_t * prog = NULL;
         zhash_remove(state->program_map, &guid, NULL, &prog);
-        if (prog) {
-            glDetachShader(prog->prog_id,prog->vert_id);
-            glDeleteShader(prog->vert_id);
-            glDetachShader(prog->prog_id,prog->frag_id);
-            glDeleteShader(prog->frag_id);
-            glDeleteProgram(prog->prog_id);
-
-            if (state->verbose > 1) printf("  Freed program %d vert %d and frag %d\n",
-                                prog->prog_id, prog->vert_id, prog->frag_id);
-            free(prog);
-        }
+        if (prog)
+            program_destroy(state, prog);
     }
 
     zarray_clear(state->dealloc_ids);
@@ -417,7 +603,8 @@ void vx_gl_renderer_add_resources(vx_gl_renderer_t * state, zhash_t * resources)
 
         if (old_vr != NULL) {
             // Check to see if this was previously flagged for deletion.
-            // If so, unmark for deletion
+            // If so, unmark for deletion. A newer version of a
+            // streaming resource just replaces the old contents
 
             int found_idx = -1;
             int found = 0;
@@ -430,12 +617,16 @@ void vx_gl_renderer_add_resources(vx_gl_renderer_t * state, zhash_t * resources)
                 }
             }
 
-            if (found == 0)
+            if (found == 0 && old_vr->version == vr->version)
                 printf("WRN: ID collision, 0x%"PRIx64" resource already exists\n", vr->id);
 
-            zarray_remove_index(state->dealloc_ids, found_idx, 0);
+            if (found)
+                zarray_remove_index(state->dealloc_ids, found_idx, 0);
             assert(found <= 1);
 
+            vbo_bounds_t * bounds = NULL;
+            if (zhash_remove(state->bounds_map, &vr->id, NULL, &bounds))
+                free(bounds);
 
             vx_resc_dec_destroy(old_vr);
         }
@@ -481,6 +672,8 @@ void vx_gl_renderer_destroy(vx_gl_renderer_t * state)
 
     zhash_destroy(state->vbo_map);
     zhash_destroy(state->texture_map);
+    zarray_destroy(state->draw_list);
+    zhash_destroy(state->bounds_map);
 
     zhash_vmap_values(state->layer_map, vx_layer_info_destroy);
     zhash_vmap_values(state->world_map, vx_world_info_destroy);
@@ -518,18 +711,134 @@ static void print_shader(const char * shader_source)
 }
 
 // Allocates new VBO, and stores in hash table, results in a bound VBO
-static GLuint vbo_allocate(vx_gl_renderer_t * state, GLenum target, vx_resc_t *vr)
+static gl_vbo_resc_t * vbo_allocate(vx_gl_renderer_t * state, GLenum target, vx_resc_t *vr)
 {
-    GLuint vbo_id;
-    glGenBuffers(1, &vbo_id);
-    glBindBuffer(target, vbo_id);
-    glBufferData(target, vr->count * vr->fieldwidth, vr->res, GL_STATIC_DRAW);
+    gl_vbo_resc_t * vbo = calloc(1, sizeof(gl_vbo_resc_t));
+    vbo->version = vr->version;
+    vbo->size = vr->count * vr->fieldwidth;
+
+    glGenBuffers(1, &vbo->vbo_id);
+    glBindBuffer(target, vbo->vbo_id);
+    glBufferData(target, vbo->size, vr->res, vr->version > 0 ? GL_DYNAMIC_DRAW : GL_STATIC_DRAW);
+    state->stats.buffer_binds++;
     if (state->verbose) printf("      Allocated VBO %d for guid %"PRIu64" of size %d\n",
-                        vbo_id, vr->id, vr->count);
+                        vbo->vbo_id, vr->id, vr->count);
 
-    zhash_put(state->vbo_map, &vr->id, &vbo_id, NULL, NULL);
+    zhash_put(state->vbo_map, &vr->id, &vbo, NULL, NULL);
 
-    return vbo_id;
+    return vbo;
+}
+
+// Replaces the contents of an existing VBO with a newer version of its
+// (streaming) resource, results in a bound VBO
+static void vbo_update(vx_gl_renderer_t * state, GLenum target, gl_vbo_resc_t * vbo, vx_resc_t * vr)
+{
+    int size = vr->count * vr->fieldwidth;
+
+    glBindBuffer(target, vbo->vbo_id);
+    if (size != vbo->size) {
+        // different size, so the storage has to be reallocated
+        glBufferData(target, size, vr->res, GL_DYNAMIC_DRAW);
+        vbo->size = size;
+    } else {
+        glBufferSubData(target, 0, size, vr->res);
+    }
+    state->stats.buffer_binds++;
+
+    if (state->verbose > 1) printf("Updated VBO %d for guid %"PRIu64" to version %u\n",
+                                   vbo->vbo_id, vr->id, vr->version);
+    vbo->version = vr->version;
+}
+
+// Allocates new texture holding vr, and stores in hash table, results in a bound texture
+static gl_tex_resc_t * texture_allocate(vx_gl_renderer_t * state, vx_resc_t * vr,
+                                        uint32_t width, uint32_t height, uint32_t format, uint32_t flags)
+{
+    gl_tex_resc_t * tex = calloc(1, sizeof(gl_tex_resc_t));
+    tex->version = vr->version;
+    tex->width = width;
+    tex->height = height;
+    tex->format = format;
+    tex->flags = flags;
+
+    glEnable(GL_TEXTURE_2D);
+    glGenTextures(1, &tex->tex_id);
+
+    glBindTexture(GL_TEXTURE_2D, tex->tex_id);
+
+    // Note: these are logically reversed from Vis to
+    // match OpenGL: min filter is when image is small,
+    // mag filter is when zoomed into the image
+
+    int min_filter = (flags & VX_TEX_MIN_FILTER) ? 1 : 0; // aka mipmap
+    int mag_filter = (flags & VX_TEX_MAG_FILTER) ? 1 : 0;
+    int repeat     = (flags & VX_TEX_REPEAT) ? 1 : 0;     // or clamp?
+
+
+    if (min_filter)
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    else
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+
+    if (mag_filter) {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    } else {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+
+    if (repeat) {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    } else {
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+
+    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, vr->res);
+
+    if (min_filter)
+        glGenerateMipmap(GL_TEXTURE_2D);
+
+    if (state->verbose) printf("Allocated TEX %d for guid %"PRIu64"\n", tex->tex_id, vr->id);
+    zhash_put(state->texture_map, &vr->id, &tex, NULL, NULL);
+
+    return tex;
+}
+
+// Replaces the contents of an existing texture with a newer version
+// of its (streaming) resource, results in a bound texture
+static void texture_update(vx_gl_renderer_t * state, gl_tex_resc_t * tex, vx_resc_t * vr,
+                           uint32_t width, uint32_t height, uint32_t format)
+{
+    glBindTexture(GL_TEXTURE_2D, tex->tex_id);
+
+    if (width != tex->width || height != tex->height || format != tex->format) {
+        // different size, so the storage has to be reallocated
+        glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, vr->res);
+        tex->width = width;
+        tex->height = height;
+        tex->format = format;
+    } else if (state->use_pbo) {
+        // The copy into the PBO returns right away, the transfer to the
+        // texture then happens without stalling this thread. Respecifying
+        // the buffer's storage each time means we never wait for the
+        // previous frame's transfer to finish
+        if (tex->pbo_id == 0)
+            glGenBuffers(1, &tex->pbo_id);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, tex->pbo_id);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, vr->count * vr->fieldwidth, vr->res, GL_STREAM_DRAW);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, GL_UNSIGNED_BYTE, 0);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    } else {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, GL_UNSIGNED_BYTE, vr->res);
+    }
+
+    if (tex->flags & VX_TEX_MIN_FILTER)
+        glGenerateMipmap(GL_TEXTURE_2D);
+
+    if (state->verbose > 1) printf("Updated TEX %d for guid %"PRIu64" to version %u\n",
+                                   tex->tex_id, vr->id, vr->version);
+    tex->version = vr->version;
 }
 
 static int validate_program(GLint prog_id, char * stage_description)
@@ -698,9 +1007,488 @@ static void multVec33(float A33[], float v3_in[], float v3_out[])
 }
 */
 
+enum { UNIF_MAT4, UNIF_MAT3, UNIF_VEC4, UNIF_VEC3, UNIF_VEC1, UNIF_INT1 };
+
+static gl_uniform_t * get_uniform(gl_prog_resc_t * prog, const char * name)
+{
+    gl_uniform_t * unif = NULL;
+    if (!zhash_get(prog->uniforms, &name, &unif)) {
+        unif = calloc(1, sizeof(gl_uniform_t));
+        unif->loc = glGetUniformLocation(prog->prog_id, name);
+        char * key = strdup(name);
+        zhash_put(prog->uniforms, &key, &unif, NULL, NULL);
+    }
+    return unif;
+}
+
+// Set a uniform of the bound program, unless it already holds 'vals'
+static void set_uniform(vx_gl_renderer_t * state, gl_uniform_t * unif, int type,
+                        const void * vals, int size)
+{
+    assert(size <= 16);
+    if (unif->size == size && memcmp(unif->vals, vals, size*sizeof(uint32_t)) == 0) {
+        state->stats.skipped++;
+        return;
+    }
+    unif->size = size;
+    memcpy(unif->vals, vals, size*sizeof(uint32_t));
+    state->stats.uniform_sets++;
+
+    // GL ES 2 prohibits 'transpose = 1' for the matrices
+    switch (type) {
+        case UNIF_MAT4:
+            glUniformMatrix4fv(unif->loc, 1, 0, (GLfloat *) vals);
+            break;
+        case UNIF_MAT3:
+            glUniformMatrix3fv(unif->loc, 1, 0, (GLfloat *) vals);
+            break;
+        case UNIF_VEC4:
+            glUniform4fv(unif->loc, 1, (GLfloat *) vals);
+            break;
+        case UNIF_VEC3:
+            glUniform3fv(unif->loc, 1, (GLfloat *) vals);
+            break;
+        case UNIF_VEC1:
+            glUniform1fv(unif->loc, 1, (GLfloat *) vals);
+            break;
+        case UNIF_INT1:
+            glUniform1iv(unif->loc, 1, (GLint *) vals);
+            break;
+        default:
+            assert(0);
+    }
+}
+
+static GLint get_attrib_loc(gl_prog_resc_t * prog, const char * name)
+{
+    GLint loc = -1;
+    if (!zhash_get(prog->attribs, &name, &loc)) {
+        loc = glGetAttribLocation(prog->prog_id, name);
+        char * key = strdup(name);
+        zhash_put(prog->attribs, &key, &loc, NULL, NULL);
+    }
+    return loc;
+}
+
+// Disable the vertex attribute arrays the current program didn't set
+// (all of them, if 'all'), so a draw never reads stale arrays
+static void disable_attribs(vx_gl_renderer_t * state, int all)
+{
+    gl_bound_t * bound = &state->bound;
+    for (int loc = 0; loc < MAX_ATTRIB_COUNT; loc++) {
+        if (bound->attribs[loc].guid != 0 && (all || !bound->attrib_used[loc])) {
+            glDisableVertexAttribArray(loc);
+            bound->attribs[loc].guid = 0;
+            state->stats.buffer_binds++;
+        }
+    }
+}
+
+// Point vertex attribute 'loc' at the data of vr (and enable it), unless
+// it already is. A non-zero divisor makes it a per instance attribute
+static void bind_attrib(vx_gl_renderer_t * state, GLint loc, vx_resc_t * vr,
+                        int dim, int stride, int offset, int divisor)
+{
+    gl_bound_t * bound = &state->bound;
+
+    assert(loc < MAX_ATTRIB_COUNT);
+    bound->attrib_used[loc] = 1;
+
+    // A new version goes into the same buffer, so an attribute which
+    // already points at it stays valid
+    gl_vbo_resc_t * vbo = NULL;
+    if (zhash_get(state->vbo_map, &vr->id, &vbo) && vbo->version != vr->version) {
+        vbo_update(state, GL_ARRAY_BUFFER, vbo, vr);
+        bound->array_vbo = vbo->vbo_id;
+    }
+
+    gl_attrib_t * attrib = &bound->attribs[loc];
+    if (attrib->guid == vr->id && attrib->dim == dim && attrib->stride == stride &&
+        attrib->offset == offset && attrib->divisor == divisor) {
+        state->stats.skipped++;
+        return;
+    }
+
+    if (vbo != NULL) {
+        if (bound->array_vbo != vbo->vbo_id) {
+            glBindBuffer(GL_ARRAY_BUFFER, vbo->vbo_id);
+            state->stats.buffer_binds++;
+        }
+    } else {
+        vbo = vbo_allocate(state, GL_ARRAY_BUFFER, vr);
+    }
+    bound->array_vbo = vbo->vbo_id;
+
+    // Attach to attribute
+    if (attrib->guid == 0)
+        glEnableVertexAttribArray(loc);
+    glVertexAttribPointer(loc, dim, vr->type, 0, stride, (void *) (intptr_t) offset);
+    if (attrib->divisor != divisor)
+        glVertexAttribDivisor(loc, divisor);
+
+    attrib->guid = vr->id;
+    attrib->dim = dim;
+    attrib->stride = stride;
+    attrib->offset = offset;
+    attrib->divisor = divisor;
+    state->stats.buffer_binds++;
+}
+
+// Set up the per instance data of a draw within a vxo_instances: the
+// instance_M (a mat4, which takes a location per column) and
+// instance_color attributes, and the instance_inner uniform. Returns the
+// number of instances to draw
+static int bind_instances(vx_gl_renderer_t * state, gl_prog_resc_t * prog, draw_item_t * item)
+{
+    instance_info_t * inst = &item->instances;
+    int count = inst->count;
+
+    float inner[16];
+    for (int i = 0; i < 16; i++)
+        inner[i] = (float) item->inner[i];
+    transpose44(inner);
+    set_uniform(state, get_uniform(prog, "instance_inner"), UNIF_MAT4, inner, 16);
+
+    vx_resc_t * vr = NULL;
+    zhash_get(state->resource_map, &inst->transforms_id, &vr);
+    assert(vr != NULL && vr->type == GL_FLOAT);
+    count = imin(count, vr->count / 16);
+
+    GLint loc = get_attrib_loc(prog, "instance_M");
+    if (loc >= 0) {
+        // The matrices are row-major, so GL reads their transpose. The
+        // shaders multiply by it from the left
+        for (int col = 0; col < 4; col++)
+            bind_attrib(state, loc + col, vr, 4, 16*sizeof(float), 4*col*sizeof(float), 1);
+    } else if (state->verbose) {
+        printf("WRN: program %d has no instance_M, all instances are drawn in the same place\n", prog->prog_id);
+    }
+
+    if (inst->colors_id != 0) {
+        zhash_get(state->resource_map, &inst->colors_id, &vr);
+        assert(vr != NULL && vr->type == GL_FLOAT);
+        count = imin(count, vr->count / 4);
+
+        loc = get_attrib_loc(prog, "instance_color");
+        if (loc >= 0)
+            bind_attrib(state, loc, vr, 4, 0, 0, 1);
+    }
+
+    return count;
+}
+
+// Model matrix relative to the one at a vxo_instances
+static void instance_inner(const double * push_model, const double * model, double * inner)
+{
+    matd_t * push = matd_create_data(4, 4, push_model);
+    matd_t * cur = matd_create_data(4, 4, model);
+    matd_t * push_inv = matd_inverse(push);
+    matd_t * rel = matd_multiply(push_inv, cur);
+
+    memcpy(inner, rel->data, 16*sizeof(double));
+
+    matd_destroy(push);
+    matd_destroy(cur);
+    matd_destroy(push_inv);
+    matd_destroy(rel);
+}
+
+// Reads past the opcodes of one program without drawing anything,
+// noting the resources it uses for sorting. Must understand the same
+// opcodes as render_program()
+static void scan_program(vx_code_input_stream_t * codes, draw_item_t * item)
+{
+    item->prog_key = codes->read_uint64(codes); // vertex shader
+    codes->read_uint64(codes); // fragment shader
+
+    while (codes->pos < codes->len) {
+        uint32_t op = codes->read_uint32(codes);
+        if (op == 0) // end of program opcodes
+            break;
+
+        switch (op) {
+            case OP_VALIDATE_PROGRAM:
+                break;
+
+            case OP_PM_MAT_NAME:
+                codes->read_str(codes);
+                item->has_pm = 1;
+                break;
+
+            case OP_MODEL_MAT_NAME:
+            case OP_NORMAL_MAT_NAME:
+            case OP_CAM_POS_NAME:
+                codes->read_str(codes);
+                break;
+
+            case OP_VERT_ATTRIB: {
+                uint64_t attribId = codes->read_uint64(codes);
+                uint32_t dim = codes->read_uint32(codes);
+                const char * name = codes->read_str(codes);
+                if (item->vbo_key == 0)
+                    item->vbo_key = attribId;
+                if (!strcmp(name, "position")) {
+                    item->pos_guid = attribId;
+                    item->pos_dim = dim;
+                }
+                break;
+            }
+
+            case OP_UNIFORM_VECTOR_IV:
+            case OP_UNIFORM_MATRIX_FV:
+            case OP_UNIFORM_VECTOR_FV: {
+                const char * name = codes->read_str(codes);
+                uint32_t size = codes->read_uint32(codes);
+                for (int j = 0; j < size; j++) {
+                    uint32_t val = codes->read_uint32(codes);
+                    item->unif_key = (item->unif_key ^ val) * 1099511628211ULL;
+                    if (op == OP_UNIFORM_VECTOR_FV && size == 1 && !strcmp(name, "pointSize")) {
+                        float pt_size = 0;
+                        memcpy(&pt_size, &val, sizeof(float));
+                        item->margin = fmaxf(item->margin, pt_size);
+                    }
+                }
+                break;
+            }
+
+            case OP_TEXTURE: {
+                codes->read_str(codes);
+                uint64_t texGuid = codes->read_uint64(codes);
+                for (int j = 0; j < 4; j++)
+                    codes->read_uint32(codes);
+                if (item->tex_key == 0)
+                    item->tex_key = texGuid;
+                break;
+            }
+
+            case OP_LINE_WIDTH:
+                item->margin = fmaxf(item->margin, codes->read_float(codes));
+                break;
+
+            case OP_DRAW_ARRAY:
+                codes->read_uint32(codes);
+                codes->read_uint32(codes);
+                break;
+
+            case OP_ELEMENT_ARRAY:
+                codes->read_uint64(codes);
+                codes->read_uint32(codes);
+                break;
+
+            default:
+                assert(0);
+        }
+    }
+}
+
+static vbo_bounds_t * get_vbo_bounds(vx_gl_renderer_t * state, uint64_t guid, uint32_t dim)
+{
+    vbo_bounds_t * bounds = NULL;
+    if (zhash_get(state->bounds_map, &guid, &bounds))
+        return bounds;
+
+    vx_resc_t * vr = NULL;
+    zhash_get(state->resource_map, &guid, &vr);
+    if (vr == NULL || vr->type != GL_FLOAT || dim < 2 || dim > 3)
+        return NULL;
+
+    // an empty vbo ends up with min > max
+    bounds = calloc(1, sizeof(vbo_bounds_t));
+    for (int k = 0; k < 3; k++) {
+        bounds->min[k] = (k < dim) ? HUGE_VALF : 0;
+        bounds->max[k] = (k < dim) ? -HUGE_VALF : 0;
+    }
+
+    const float * data = vr->res;
+    for (int i = 0; i + dim <= vr->count; i += dim) {
+        for (int k = 0; k < dim; k++) {
+            bounds->min[k] = fminf(bounds->min[k], data[i + k]);
+            bounds->max[k] = fmaxf(bounds->max[k], data[i + k]);
+        }
+    }
+
+    zhash_put(state->bounds_map, &guid, &bounds, NULL, NULL);
+    return bounds;
+}
+
+// Find the cells of the layer's BATCH_GRID the draw may touch, by
+// projecting the corners of its position data's bounding box. vx
+// shaders all compute gl_Position = PM*position. When that isn't
+// enough to tell, the draw covers every cell
+static void item_cells(vx_gl_renderer_t * state, vx_layer_info_t * layer, draw_item_t * item)
+{
+    int * cells = item->cells;
+    cells[0] = cells[1] = 0;
+    cells[2] = cells[3] = BATCH_GRID - 1;
+
+    // instances could be anywhere
+    if (!item->has_pm || item->pos_guid == 0 || item->instances.count > 0)
+        return;
+
+    vbo_bounds_t * bounds = get_vbo_bounds(state, item->pos_guid, item->pos_dim);
+    if (bounds == NULL)
+        return;
+
+    if (bounds->min[0] > bounds->max[0]) { // draws nothing
+        cells[0] = cells[1] = 1;
+        cells[2] = cells[3] = 0;
+        return;
+    }
+
+    double PM[16];
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 4; j++) {
+            PM[i*4 + j] = 0;
+            for (int k = 0; k < 4; k++)
+                PM[i*4 + j] += item->proj[i*4 + k] * item->model[k*4 + j];
+        }
+    }
+
+    double lo[2] = { HUGE_VAL, HUGE_VAL };
+    double hi[2] = { -HUGE_VAL, -HUGE_VAL };
+    for (int corner = 0; corner < 8; corner++) {
+        double p[4] = { (corner & 1) ? bounds->max[0] : bounds->min[0],
+                        (corner & 2) ? bounds->max[1] : bounds->min[1],
+                        (corner & 4) ? bounds->max[2] : bounds->min[2],
+                        1 };
+        double clip[4];
+        for (int i = 0; i < 4; i++)
+            clip[i] = PM[i*4 + 0]*p[0] + PM[i*4 + 1]*p[1] + PM[i*4 + 2]*p[2] + PM[i*4 + 3]*p[3];
+
+        if (clip[3] <= 1e-9) // (partly) behind the camera
+            return;
+
+        for (int i = 0; i < 2; i++) {
+            lo[i] = fmin(lo[i], clip[i] / clip[3]);
+            hi[i] = fmax(hi[i], clip[i] / clip[3]);
+        }
+    }
+
+    // Lines and points extend past their vertices. Then convert from
+    // normalized device coordinates to cells
+    for (int i = 0; i < 2; i++) {
+        double margin = 2.0 * (item->margin + 1) / imax(layer->viewport[2 + i], 1);
+        int c0 = (int) floor((lo[i] - margin + 1) / 2 * BATCH_GRID);
+        int c1 = (int) floor((hi[i] + margin + 1) / 2 * BATCH_GRID);
+        cells[i] = imax(c0, 0);
+        cells[2 + i] = imin(c1, BATCH_GRID - 1);
+    }
+}
+
+// Assigns each draw to a batch. Drawing the batches in order puts draws
+// with the same program, texture, vertex data and uniforms next to each
+// other, so render_program() has little state to change between them.
+// A draw joins the latest batch with the same state, unless that would
+// move it ahead of an earlier draw it may overlap on screen (e.g. points
+// drawn over an image at the same depth), so the image is unchanged
+static void batch_draws(vx_gl_renderer_t * state, vx_layer_info_t * layer)
+{
+    int cell_batch[BATCH_GRID * BATCH_GRID]; // latest batch drawn in each cell
+    for (int i = 0; i < BATCH_GRID * BATCH_GRID; i++)
+        cell_batch[i] = -1;
+
+    zhash_t * last_batch = zhash_create(sizeof(uint64_t), sizeof(int), zhash_uint64_hash, zhash_uint64_equals);
+
+    int nbatches = 0;
+    int run = -1, run_start = 0;
+    for (int i = 0; i < zarray_size(state->draw_list); i++) {
+        draw_item_t * item = NULL;
+        zarray_get_volatile(state->draw_list, i, &item);
+
+        if (item->run != run) {
+            run = item->run;
+            run_start = nbatches;
+        }
+
+        item_cells(state, layer, item);
+        const int * cells = item->cells;
+
+        int earliest = run_start;
+        for (int y = cells[1]; y <= cells[3]; y++)
+            for (int x = cells[0]; x <= cells[2]; x++)
+                earliest = imax(earliest, cell_batch[y*BATCH_GRID + x]);
+
+        uint64_t key = item->prog_key;
+        key = (key ^ item->tex_key) * 1099511628211ULL;
+        key = (key ^ item->vbo_key) * 1099511628211ULL;
+        key = (key ^ item->unif_key) * 1099511628211ULL;
+        key = (key ^ item->instances.transforms_id) * 1099511628211ULL;
+        key = (key ^ item->instances.colors_id) * 1099511628211ULL;
+
+        int batch = -1;
+        if (zhash_get(last_batch, &key, &batch) && batch >= earliest) {
+            item->batch = batch;
+        } else {
+            item->batch = nbatches++;
+            zhash_put(last_batch, &key, &item->batch, NULL, NULL);
+        }
+
+        for (int y = cells[1]; y <= cells[3]; y++)
+            for (int x = cells[0]; x <= cells[2]; x++)
+                cell_batch[y*BATCH_GRID + x] = imax(cell_batch[y*BATCH_GRID + x], item->batch);
+    }
+
+    zhash_destroy(last_batch);
+
+    zarray_sort(state->draw_list, draw_item_compare);
+}
+
+// Compile and link the shaders, with 'defines' inserted ahead of the
+// source of each
+static gl_prog_resc_t * program_create(vx_gl_renderer_t * state, uint64_t vertId, uint64_t fragId,
+                                       const char * defines)
+{
+    gl_prog_resc_t * prog = calloc(1,sizeof(gl_prog_resc_t));
+    prog->vert_id = glCreateShader(GL_VERTEX_SHADER);
+    prog->frag_id = glCreateShader(GL_FRAGMENT_SHADER);
+
+    vx_resc_t * vertResc = NULL;
+    vx_resc_t * fragResc = NULL;
+
+    zhash_get(state->resource_map, &vertId, &vertResc);
+    zhash_get(state->resource_map, &fragId, &fragResc);
+
+    if (state->verbose) {
+        printf("   Vert id %"PRIu64" frag id %"PRIu64" %s\n", vertId, fragId, defines);
+    }
+
+    assert(vertResc != NULL);
+    assert(fragResc != NULL);
+
+    const char * vertSource[2] = { defines, vertResc->res };
+    const char * fragSource[2] = { defines, fragResc->res };
+
+    if (state->verbose > 1) {
+        printf("Vertex source len %zu:\n", strlen(vertSource[1]));
+        print_shader(vertSource[1]);
+        printf("Fragment source len %zu:\n", strlen(fragSource[1]));
+        print_shader(fragSource[1]);
+    }
+
+    glShaderSource(prog->vert_id, 2, vertSource, NULL);
+    glShaderSource(prog->frag_id, 2, fragSource, NULL);
+
+    glCompileShader(prog->vert_id);
+    glCompileShader(prog->frag_id);
+
+    prog->prog_id = glCreateProgram();
+
+    glAttachShader(prog->prog_id, prog->vert_id);
+    glAttachShader(prog->prog_id, prog->frag_id);
+
+    glLinkProgram(prog->prog_id);
+
+    prog->uniforms = zhash_create(sizeof(char*), sizeof(gl_uniform_t*), zhash_str_hash, zhash_str_equals);
+    prog->attribs = zhash_create(sizeof(char*), sizeof(GLint), zhash_str_hash, zhash_str_equals);
+
+    if (state->verbose) printf("  Created gl program %d from guid %"PRIu64" and %"PRIu64" (gl ids %d and %d)\n",
+                               prog->prog_id, vertId, fragId, prog->vert_id, prog->frag_id);
+    return prog;
+}
+
 // This function does the heavy lifting for rendering a data + program pair
 // Which program, and data to use are specified in the codes
-// input_stream
+// input_stream, starting at item->codes_pos
 // This breaks down into the following steps:
 // 1) Find the glProgram. If it doesn't exist, create it from the associated
 //    vertex and fragment shader string resources
@@ -710,15 +1498,18 @@ static void multVec33(float A33[], float v3_in[], float v3_out[])
 // 4) Textures
 // 5) Render using either glDrawArrays or glElementArray
 //
+// Any of these which are already set from the previous draw (see
+// gl_bound_t) are skipped
+//
 // Note: After step 1 and 4, the state of the program is queried,
 //       and debugging information (if an error occurs) is printed to stdout
 static int render_program(vx_gl_renderer_t * state, vx_layer_info_t *layer,
-                          vx_code_input_stream_t * codes,
-                          char * dbg_buffer_name,
-                          vx_matrix_stack_t * proj_stack,
-                          const float * eye3,
-                          vx_matrix_stack_t *model_stack)
+                          draw_item_t * item)
 {
+    vx_code_input_stream_t * codes = item->codes;
+    gl_bound_t * bound = &state->bound;
+
+    codes->pos = item->codes_pos;
     if (codes->pos >= codes->len) // exhausted the stream
         return 1;
     if (state->verbose) printf("  Processing program, codes has %d remaining\n",codes->len-codes->pos);
@@ -726,7 +1517,7 @@ static int render_program(vx_gl_renderer_t * state, vx_layer_info_t *layer,
     if (state->verbose > 2) print_hex(codes->data + codes->pos, codes->len - codes->pos);
 
     // STEP 1: find/allocate the glProgram (using vertex shader and fragment shader)
-    GLuint prog_id = 0;
+    gl_prog_resc_t * prog = NULL;
     uint64_t vert_shad_id = 0;
     uint64_t frag_shad_id = 0;
     {
@@ -737,62 +1528,34 @@ static int render_program(vx_gl_renderer_t * state, vx_layer_info_t *layer,
         frag_shad_id = fragId;
 
         // Programs can be found by the guid of the vertex shader
-        gl_prog_resc_t * prog = NULL;
         zhash_get(state->program_map, &vertId, &prog);
         if (prog == NULL) {
-            prog = calloc(1,sizeof(gl_prog_resc_t));
             // Allocate a program if we haven't made it yet
-            prog->vert_id = glCreateShader(GL_VERTEX_SHADER);
-            prog->frag_id = glCreateShader(GL_FRAGMENT_SHADER);
-
-            vx_resc_t * vertResc = NULL;
-            vx_resc_t * fragResc = NULL;
-
-            zhash_get(state->resource_map, &vertId, &vertResc);
-            zhash_get(state->resource_map, &fragId, &fragResc);
-
-            if (state->verbose) {
-                printf("   Vert id %"PRIu64" frag id %"PRIu64" \n", vertId, fragId);
-            }
-
-            assert(vertResc != NULL);
-            assert(fragResc != NULL);
-
-            const char * vertSource = vertResc->res;
-            const char * fragSource = fragResc->res;
-
-            if (state->verbose > 1) {
-                printf("Vertex source len %zu:\n", strlen(vertSource));
-                print_shader(vertSource);
-                printf("Fragment source len %zu:\n", strlen(fragSource));
-                print_shader(fragSource);
-            }
-
-            glShaderSource(prog->vert_id, 1, &vertSource, NULL);
-            glShaderSource(prog->frag_id, 1, &fragSource, NULL);
-
-            glCompileShader(prog->vert_id);
-            glCompileShader(prog->frag_id);
-
-            prog->prog_id = glCreateProgram();
-
-            glAttachShader(prog->prog_id, prog->vert_id);
-            glAttachShader(prog->prog_id, prog->frag_id);
-
-            glLinkProgram(prog->prog_id);
-
+            prog = program_create(state, vertId, fragId, "");
             zhash_put(state->program_map, &vertId, &prog, NULL, NULL);
+        }
 
-            if (state->verbose) printf("  Created gl program %d from guid %"PRIu64" and %"PRIu64" (gl ids %d and %d)\n",
-                   prog->prog_id, vertId, fragId, prog->vert_id, prog->frag_id);
+        if (item->instances.count > 0) {
+            int colors = item->instances.colors_id != 0;
+            if (prog->instanced[colors] == NULL)
+                prog->instanced[colors] = program_create(state, vertId, fragId,
+                                                         colors ? "#define VX_INSTANCED\n#define VX_INSTANCE_COLORS\n"
+                                                                : "#define VX_INSTANCED\n");
+            prog = prog->instanced[colors];
         }
-        prog_id = prog->prog_id;
-        glUseProgram(prog_id);
-    }
 
-    #define MAX_ATTRIB_COUNT 32
-    uint32_t attribCount = 0;
-    GLint attribLocs[MAX_ATTRIB_COUNT];
+        if (bound->prog_id != prog->prog_id) {
+            // The attributes of the last program may not exist in this one
+            disable_attribs(state, 1);
+            glUseProgram(prog->prog_id);
+            bound->prog_id = prog->prog_id;
+            state->stats.program_binds++;
+        } else {
+            state->stats.skipped++;
+        }
+        memset(bound->attrib_used, 0, sizeof(bound->attrib_used));
+    }
+    GLuint prog_id = prog->prog_id;
 
     uint32_t texCount = 0;
 
@@ -806,10 +1569,6 @@ static int render_program(vx_gl_renderer_t * state, vx_layer_info_t *layer,
 
         switch (op) {
             case OP_VALIDATE_PROGRAM: {
-                gl_prog_resc_t * prog = NULL;
-                zhash_get(state->program_map, &vert_shad_id, &prog);
-                assert(prog != NULL);
-
                 int success = 1;
                 success &= validate_shader(prog->frag_id, "FRAG");
                 success &= validate_shader(prog->vert_id, "VERT");
@@ -840,22 +1599,19 @@ static int render_program(vx_gl_renderer_t * state, vx_layer_info_t *layer,
                 const char * pmName = codes->read_str(codes);
 
                 float model[16];
-                vx_matrix_stack_getf(model_stack, model);
+                for (int i = 0; i < 16; i++)
+                    model[i] = (float) item->model[i];
 
                 float PM[16];
-                vx_matrix_stack_getf(proj_stack, PM);
+                memcpy(PM, item->proj, sizeof(PM));
                 multEqf44(PM, model);
 
-                GLint unif_loc = glGetUniformLocation(prog_id, pmName);
-                if (state->verbose) printf("   uniform %s  loc %d\n", pmName, unif_loc);
-
-                assert(unif_loc >= 0); // Ensure this field exists
-                int transpose = 0;
-                if (!transpose)
-                    transpose44(PM);
+                gl_uniform_t * unif = get_uniform(prog, pmName);
+                if (state->verbose) printf("   uniform %s  loc %d\n", pmName, unif->loc);
 
-                // GL ES 2 prohibits 'transpose = 1' here
-                glUniformMatrix4fv(unif_loc, 1 , transpose, (GLfloat *)PM);
+                assert(unif->loc >= 0); // Ensure this field exists
+                transpose44(PM);
+                set_uniform(state, unif, UNIF_MAT4, PM, 16);
 
                 break;
             }
@@ -864,19 +1620,15 @@ static int render_program(vx_gl_renderer_t * state, vx_layer_info_t *layer,
                 const char * modelName = codes->read_str(codes);
 
                 float model[16];
-                vx_matrix_stack_getf(model_stack, model);
-
-                GLint unif_loc = glGetUniformLocation(prog_id, modelName);
-                if (state->verbose) printf("   uniform %s  loc %d err %d\n", modelName, unif_loc, glGetError());
+                for (int i = 0; i < 16; i++)
+                    model[i] = (float) item->model[i];
 
+                gl_uniform_t * unif = get_uniform(prog, modelName);
+                if (state->verbose) printf("   uniform %s  loc %d err %d\n", modelName, unif->loc, glGetError());
 
-                //XXX assert(unif_loc >= 0); // Ensure this field exists
-                int transpose = 0;
-                if (!transpose)
-                    transpose44(model);
-
-                // GL ES 2 prohibits 'transpose = 1' here
-                glUniformMatrix4fv(unif_loc, 1 , transpose, (GLfloat *)model);
+                //XXX assert(unif->loc >= 0); // Ensure this field exists
+                transpose44(model);
+                set_uniform(state, unif, UNIF_MAT4, model, 16);
 
                 break;
             }
@@ -888,7 +1640,7 @@ static int render_program(vx_gl_renderer_t * state, vx_layer_info_t *layer,
                 // Note: this is usually just the model matrix, except
                 // if any scaling has been done.
                 matd_t * model44 = matd_create(4,4);
-                vx_matrix_stack_get(model_stack, model44->data);
+                memcpy(model44->data, item->model, 16*sizeof(double));
 
                 matd_t * model33 = matd_select(model44, 0,2, 0,2);
 
@@ -900,14 +1652,11 @@ static int render_program(vx_gl_renderer_t * state, vx_layer_info_t *layer,
                 matd_destroy(model33);
                 matd_destroy(normD);
 
+                gl_uniform_t * unif = get_uniform(prog, normName);
+                if (state->verbose) printf("   uniform %s  loc %d\n", normName, unif->loc);
 
-                GLint unif_loc = glGetUniformLocation(prog_id, normName);
-                if (state->verbose) printf("   uniform %s  loc %d\n", normName, unif_loc);
-
-                // XXX assert(unif_loc >= 0); // Ensure this field exists
-                int transpose = 0;
-                if (!transpose)
-                    transpose33(normf);
+                // XXX assert(unif->loc >= 0); // Ensure this field exists
+                transpose33(normf);
 
                 if (state->verbose > 2) {
                     printf("NORMAL MATRIX:\n");
@@ -918,8 +1667,7 @@ static int render_program(vx_gl_renderer_t * state, vx_layer_info_t *layer,
                     }
                 }
 
-                // GL ES 2 prohibits 'transpose = 1' here
-                glUniformMatrix3fv(unif_loc, 1 , transpose, (GLfloat *)normf);
+                set_uniform(state, unif, UNIF_MAT3, normf, 9);
 
                 break;
             }
@@ -927,18 +1675,15 @@ static int render_program(vx_gl_renderer_t * state, vx_layer_info_t *layer,
             case OP_CAM_POS_NAME: {
                 const char * camName = codes->read_str(codes);
 
-                GLint unif_loc = glGetUniformLocation(prog_id, camName);
+                gl_uniform_t * unif = get_uniform(prog, camName);
                 if (state->verbose) printf("   uniform %s  loc %d err %d cam_pos =%.2f %.2f %.2f\n",
-                                         camName, unif_loc, glGetError(), eye3[0],eye3[1],eye3[2]);
+                                           camName, unif->loc, glGetError(), layer->eye3[0],layer->eye3[1],layer->eye3[2]);
 
-                glUniform3fv(unif_loc, 1, (GLfloat *)eye3);
+                set_uniform(state, unif, UNIF_VEC3, layer->eye3, 3);
                 break;
             }
 
             case OP_VERT_ATTRIB: {
-
-                assert (attribCount < MAX_ATTRIB_COUNT);
-
                 uint64_t attribId = codes->read_uint64(codes);
                 uint32_t dim = codes->read_uint32(codes);
                 const char * name = codes->read_str(codes); //Not a copy!
@@ -953,20 +1698,12 @@ static int render_program(vx_gl_renderer_t * state, vx_layer_info_t *layer,
                 assert(vr != NULL);
 
                 if (vr->type != GL_FLOAT) {
-                    printf("ERR: Type on resource %"PRIu64" is wrong: %d. Expected %d. Buffer name %s \n", attribId, vr->type, GL_FLOAT, dbg_buffer_name);
+                    printf("ERR: Type on resource %"PRIu64" is wrong: %d. Expected %d. Buffer name %s \n", attribId, vr->type, GL_FLOAT, item->buffer_name);
                 }
                 assert(vr->type == GL_FLOAT);
 
                 if (state->verbose) printf("   vertex attrib %s %"PRIu64" dim %d count %d\n", name, attribId, dim, vr->count);
 
-                if (zhash_contains(state->vbo_map, &attribId)) {
-                    GLuint vbo_id = 0;
-                    zhash_get(state->vbo_map, &attribId, &vbo_id);
-                    glBindBuffer(GL_ARRAY_BUFFER, vbo_id);
-                } else {
-                    vbo_allocate(state, GL_ARRAY_BUFFER, vr);
-                }
-
                 if (state->verbose > 2) {
                     for (int i = 0; i < vr->count; i++) {
                         printf("%f,",((float*)vr->res)[i]);
@@ -975,16 +1712,11 @@ static int render_program(vx_gl_renderer_t * state, vx_layer_info_t *layer,
                     }
                 }
 
-                // Attach to attribute
-                GLint attr_loc = glGetAttribLocation(prog_id, name);
-                attribLocs[attribCount] = attr_loc;
+                GLint attr_loc = get_attrib_loc(prog, name);
+                if (attr_loc < 0) // not used by the shader
+                    break;
 
-                glEnableVertexAttribArray(attr_loc);
-                glVertexAttribPointer(attr_loc, dim, vr->type, 0, 0, 0);
-
-                assert(vr->type == GL_FLOAT);
-
-                attribCount++;
+                bind_attrib(state, attr_loc, vr, dim, 0, 0, 0);
                 break;
             }
 
@@ -993,7 +1725,7 @@ static int render_program(vx_gl_renderer_t * state, vx_layer_info_t *layer,
             case OP_UNIFORM_VECTOR_FV: {
                 // Functionality common to all uniforms, regardless of type
                 const char * name = codes->read_str(codes);
-                GLint unif_loc = glGetUniformLocation(prog_id, name);
+                gl_uniform_t * unif = get_uniform(prog, name);
                 // size of the data, measured in 32 bit words.
                 uint32_t size = codes->read_uint32(codes);
 
@@ -1005,16 +1737,15 @@ static int render_program(vx_gl_renderer_t * state, vx_layer_info_t *layer,
 
                 // XXX For floats, these are hardcoded to a specific length...
                 if (op == OP_UNIFORM_MATRIX_FV) {
-                    uint32_t transpose = 0; // codes->read_uint32(codes);
-                    glUniformMatrix4fv(unif_loc, 1, transpose, (GLfloat *)vals);
+                    set_uniform(state, unif, UNIF_MAT4, vals, 16);
                 } else if (op == OP_UNIFORM_VECTOR_FV && size == 4) {
-                    glUniform4fv(unif_loc, 1, (GLfloat *) vals);
+                    set_uniform(state, unif, UNIF_VEC4, vals, 4);
                 } else if (op == OP_UNIFORM_VECTOR_FV && size == 3) {
-                    glUniform3fv(unif_loc, 1, (GLfloat *) vals);
+                    set_uniform(state, unif, UNIF_VEC3, vals, 3);
                 } else if (op == OP_UNIFORM_VECTOR_FV && size == 1) {
-                    glUniform1fv(unif_loc, 1, (GLfloat *) vals);
+                    set_uniform(state, unif, UNIF_VEC1, vals, 1);
                 } else if (op == OP_UNIFORM_VECTOR_IV && size == 1) {
-                    glUniform1iv(unif_loc, 1, vals);
+                    set_uniform(state, unif, UNIF_INT1, vals, 1);
                 } else {
                     assert(0);
                 }
@@ -1035,59 +1766,32 @@ static int render_program(vx_gl_renderer_t * state, vx_layer_info_t *layer,
                 uint32_t format = codes->read_uint32(codes);
                 uint32_t flags = codes->read_uint32(codes);
 
-                if (zhash_contains(state->texture_map, &vr->id)) {
-                    GLuint tex_id = 0;
-                    zhash_get(state->texture_map, &vr->id, &tex_id);
-                    glBindTexture(GL_TEXTURE_2D, tex_id);
+                assert(texCount < MAX_TEX_COUNT);
+                if (bound->active_tex != texCount) {
+                    glActiveTexture(GL_TEXTURE0 + texCount);
+                    bound->active_tex = texCount;
                 }
-                else {
-                    GLuint tex_id = 0;
-
-                    glEnable(GL_TEXTURE_2D);
-                    glGenTextures(1, &tex_id);
 
-                    glBindTexture(GL_TEXTURE_2D, tex_id);
-
-                    // Note: these are logically reversed from Vis to
-                    // match OpenGL: min filter is when image is small,
-                    // mag filter is when zoomed into the image
-
-                    int min_filter = (flags & VX_TEX_MIN_FILTER) ? 1 : 0; // aka mipmap
-                    int mag_filter = (flags & VX_TEX_MAG_FILTER) ? 1 : 0;
-                    int repeat     = (flags & VX_TEX_REPEAT) ? 1 : 0;     // or clamp?
-
-
-                    if (min_filter)
-                        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-                    else
-                        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-
-                    if (mag_filter) {
-                        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+                gl_tex_resc_t * tex = NULL;
+                if (zhash_get(state->texture_map, &vr->id, &tex)) {
+                    if (tex->version != vr->version) {
+                        texture_update(state, tex, vr, width, height, format);
+                        state->stats.texture_binds++;
+                    } else if (bound->tex_id[texCount] != tex->tex_id) {
+                        glBindTexture(GL_TEXTURE_2D, tex->tex_id);
+                        state->stats.texture_binds++;
                     } else {
-                        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+                        state->stats.skipped++;
                     }
-
-                    if (repeat) {
-                        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-                        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-                    } else {
-                        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-                        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-                    }
-
-                    glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, vr->res);
-
-                    if (min_filter)
-                        glGenerateMipmap(GL_TEXTURE_2D);
-
-                    if (state->verbose) printf("Allocated TEX %d for guid %"PRIu64"\n", tex_id, vr->id);
-                    zhash_put(state->texture_map, &vr->id, &tex_id, NULL, NULL);
                 }
+                else {
+                    tex = texture_allocate(state, vr, width, height, format, flags);
+                    state->stats.texture_binds++;
+                }
+                bound->tex_id[texCount] = tex->tex_id;
 
-                int attrTexI = glGetUniformLocation(prog_id, name);
-                glActiveTexture(GL_TEXTURE0 + texCount);
-                glUniform1i(attrTexI, texCount); // Bind the uniform to TEXTUREi
+                // Bind the uniform to TEXTUREi
+                set_uniform(state, get_uniform(prog, name), UNIF_INT1, &texCount, 1);
 
                 texCount++;
                 break;
@@ -1097,8 +1801,8 @@ static int render_program(vx_gl_renderer_t * state, vx_layer_info_t *layer,
                 float size = codes->read_float(codes);
                 glLineWidth(size);
                 glEnable(GL_PROGRAM_POINT_SIZE);
-                int unifPtSz = glGetUniformLocation(prog_id, "pointSize");
-                glUniform1f(unifPtSz, size); // Attempt to set the point size, harmless? if pointSize is not in program
+                // Attempt to set the point size, harmless? if pointSize is not in program
+                set_uniform(state, get_uniform(prog, "pointSize"), UNIF_VEC1, &size, 1);
                 break;
             }
 
@@ -1109,7 +1813,15 @@ static int render_program(vx_gl_renderer_t * state, vx_layer_info_t *layer,
                 if (state->verbose) printf("   Rendering DRAW_ARRAY type %d\n",
                                     drawType);
 
-                glDrawArrays(drawType, 0, drawCount);
+                if (item->instances.count > 0) {
+                    int count = bind_instances(state, prog, item);
+                    disable_attribs(state, 0);
+                    glDrawArraysInstanced(drawType, 0, drawCount, count);
+                } else {
+                    disable_attribs(state, 0);
+                    glDrawArrays(drawType, 0, drawCount);
+                }
+                state->stats.draw_calls++;
 
                 break;
             }
@@ -1125,15 +1837,28 @@ static int render_program(vx_gl_renderer_t * state, vx_layer_info_t *layer,
                 zhash_get(state->resource_map, &elementId, &vr);
                 assert(vr != NULL);
 
-                if (zhash_contains(state->vbo_map, &elementId)) {
-                    GLuint vbo_id = 0;
-                    zhash_get(state->vbo_map, &elementId, &vbo_id);
-                    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo_id);
+                gl_vbo_resc_t * vbo = NULL;
+                if (zhash_get(state->vbo_map, &elementId, &vbo)) {
+                    if (vbo->version != vr->version) {
+                        vbo_update(state, GL_ELEMENT_ARRAY_BUFFER, vbo, vr);
+                    } else if (bound->element_vbo != vbo->vbo_id) {
+                        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo->vbo_id);
+                        state->stats.buffer_binds++;
+                    }
                 } else {
-                    vbo_allocate(state, GL_ELEMENT_ARRAY_BUFFER, vr);
+                    vbo = vbo_allocate(state, GL_ELEMENT_ARRAY_BUFFER, vr);
                 }
+                bound->element_vbo = vbo->vbo_id;
 
-                glDrawElements(elementType, vr->count, vr->type, NULL);
+                if (item->instances.count > 0) {
+                    int count = bind_instances(state, prog, item);
+                    disable_attribs(state, 0);
+                    glDrawElementsInstanced(elementType, vr->count, vr->type, NULL, count);
+                } else {
+                    disable_attribs(state, 0);
+                    glDrawElements(elementType, vr->count, vr->type, NULL);
+                }
+                state->stats.draw_calls++;
                 break;
             }
 
@@ -1142,11 +1867,6 @@ static int render_program(vx_gl_renderer_t * state, vx_layer_info_t *layer,
         }
     }
 
-    // Important: Disable all vertex attribute arrays, or we can contaminate the state
-    // for future programs. Might be resolved by switching to VBAs
-    for (int i = 0; i < attribCount; i++)
-        glDisableVertexAttribArray(attribLocs[i]);
-
     return 0;
 }
 
@@ -1190,6 +1910,12 @@ void vx_gl_renderer_draw_frame(vx_gl_renderer_t * state, int width, int height)
     // Deallocate any resources flagged for deletion
     process_deallocations(state);
 
+    // Nothing is known to be bound at the start of a frame (and ids may
+    // have been reused by the deallocations)
+    memset(&state->bound, 0, sizeof(state->bound));
+    memset(&state->stats, 0, sizeof(state->stats));
+    glActiveTexture(GL_TEXTURE0);
+
     // debug: print stats
     if (state->verbose) printf("n layers %d n resc %d, n vbos %d, n programs %d n tex %d w %d h %d\n",
                         zhash_size(state->layer_map),
@@ -1224,10 +1950,8 @@ void vx_gl_renderer_draw_frame(vx_gl_renderer_t * state, int width, int height)
                      layer->bg_color[3]);
 
         uint8_t depthEnabled = 1;
-        if (depthEnabled)
-            glEnable(GL_DEPTH_TEST);
-        else
-            glDisable(GL_DEPTH_TEST);
+        glEnable(GL_DEPTH_TEST);
+        state->bound.depth_enabled = 1;
         glDepthFunc(GL_LEQUAL);
 
         glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
@@ -1244,6 +1968,12 @@ void vx_gl_renderer_draw_frame(vx_gl_renderer_t * state, int width, int height)
         zarray_t * buffers = zhash_values(world->buffer_map);
         zarray_sort(buffers, buffer_compare);
 
+        // Collect the programs of all the buffers, with the matrices
+        // and depth state each is drawn with, then batch them. Draws
+        // aren't moved between buffers
+        zarray_clear(state->draw_list);
+        int run = 0;
+
         for (int i = 0; i < zarray_size(buffers); i++) {
             vx_buffer_info_t * buffer = NULL;
             zarray_get(buffers, i, &buffer);
@@ -1257,9 +1987,11 @@ void vx_gl_renderer_draw_frame(vx_gl_renderer_t * state, int width, int height)
             if (!enabled)
                 continue;
 
-            if (state->verbose) printf("  Rendering buffer: %s with order %d codes->len %d codes->pos %d\n",
+            if (state->verbose) printf("  Collecting buffer: %s with order %d codes->len %d codes->pos %d\n",
                                 buffer->name, buffer->draw_order, buffer->codes->len, buffer->codes->pos);
 
+            run++;
+
             // XXX For doing lighting, we'll need the model and
             // projection matrices separately.
             vx_matrix_stack_t *model_stack = vx_matrix_stack_create();
@@ -1269,13 +2001,36 @@ void vx_gl_renderer_draw_frame(vx_gl_renderer_t * state, int width, int height)
             // store depth enabled T/F as uint8
             zarray_t *depth_stack = zarray_create(sizeof(uint8_t));
 
+            instance_info_t instances;
+            memset(&instances, 0, sizeof(instances));
+            zarray_t *instance_stack = zarray_create(sizeof(instance_info_t));
+
             while (buffer->codes->pos < buffer->codes->len) {
                 uint32_t op = buffer->codes->read_uint32(buffer->codes);
 
                 switch (op) {
-                    case OP_PROGRAM:
-                        render_program(state, layer, buffer->codes, buffer->name, proj_stack, layer->eye3, model_stack);
+                    case OP_PROGRAM: {
+                        draw_item_t item;
+                        memset(&item, 0, sizeof(item));
+                        item.run = run;
+                        item.seq = zarray_size(state->draw_list);
+                        item.codes = buffer->codes;
+                        item.codes_pos = buffer->codes->pos;
+                        item.buffer_name = buffer->name;
+                        vx_matrix_stack_get(model_stack, item.model);
+                        vx_matrix_stack_getf(proj_stack, item.proj);
+                        item.depth_enabled = depthEnabled;
+
+                        if (instances.count > 0) {
+                            item.instances = instances;
+                            instance_inner(instances.model, item.model, item.inner);
+                            memcpy(item.model, instances.model, sizeof(item.model));
+                        }
+
+                        scan_program(buffer->codes, &item);
+                        zarray_add(state->draw_list, &item);
                         break;
+                    }
 
                     case OP_MODEL_PUSH:
                         vx_matrix_stack_push(model_stack);
@@ -1323,13 +2078,11 @@ void vx_gl_renderer_draw_frame(vx_gl_renderer_t * state, int width, int height)
 
                     case OP_DEPTH_ENABLE: {
                         depthEnabled = 1;
-                        glEnable(GL_DEPTH_TEST);
                         break;
                     }
 
                     case OP_DEPTH_DISABLE: {
                         depthEnabled = 0;
-                        glDisable(GL_DEPTH_TEST);
                         break;
                     }
 
@@ -1340,23 +2093,60 @@ void vx_gl_renderer_draw_frame(vx_gl_renderer_t * state, int width, int height)
                     case OP_DEPTH_POP: {
                         zarray_get(depth_stack, 0, &depthEnabled);
                         zarray_remove_index(depth_stack, 0, 0);
-                        if (depthEnabled)
-                            glEnable(GL_DEPTH_TEST);
-                        else
-                            glDisable(GL_DEPTH_TEST);
+                        break;
+                    }
+
+                    case OP_INSTANCES_PUSH: {
+                        zarray_add(instance_stack, &instances);
+                        instances.count = buffer->codes->read_uint32(buffer->codes);
+                        instances.transforms_id = buffer->codes->read_uint64(buffer->codes);
+                        instances.colors_id = buffer->codes->read_uint64(buffer->codes);
+                        vx_matrix_stack_get(model_stack, instances.model);
+                        break;
+                    }
+
+                    case OP_INSTANCES_POP: {
+                        int last = zarray_size(instance_stack) - 1;
+                        zarray_get(instance_stack, last, &instances);
+                        zarray_remove_index(instance_stack, last, 0);
                         break;
                     }
 
                 }
             }
             zarray_destroy(depth_stack);
+            zarray_destroy(instance_stack);
             vx_matrix_stack_destroy(model_stack);
             vx_matrix_stack_destroy(proj_stack);
         }
         zarray_destroy(buffers);
+
+        if (state->sort_draws)
+            batch_draws(state, layer);
+
+        for (int i = 0; i < zarray_size(state->draw_list); i++) {
+            draw_item_t * item = NULL;
+            zarray_get_volatile(state->draw_list, i, &item);
+
+            if (item->depth_enabled != state->bound.depth_enabled) {
+                if (item->depth_enabled)
+                    glEnable(GL_DEPTH_TEST);
+                else
+                    glDisable(GL_DEPTH_TEST);
+                state->bound.depth_enabled = item->depth_enabled;
+            }
+
+            render_program(state, layer, item);
+        }
     }
     zarray_destroy(layers);
 
+    // Leave no vertex arrays enabled, as before batching
+    disable_attribs(state, 1);
+
+    if (state->verbose) printf("frame: %d draws, %d program binds, %d buffer binds, %d texture binds, %d uniform sets, %d skipped\n",
+                               state->stats.draw_calls, state->stats.program_binds, state->stats.buffer_binds,
+                               state->stats.texture_binds, state->stats.uniform_sets, state->stats.skipped);
 
     state->change_since_last_render = 0;
 }
@@ -1365,6 +2155,9 @@ vx_code_output_stream_t * vx_gl_renderer_serialize(vx_gl_renderer_t * rend)
 {
     vx_code_output_stream_t * couts = vx_code_output_stream_create(128);
 
+    couts->write_uint32(couts, VX_SCENE_MAGIC);
+    couts->write_uint32(couts, VX_SCENE_FORMAT);
+
     // Write all the layers
     couts->write_uint32(couts, zhash_size(rend->layer_map));
     {
@@ -1418,8 +2211,10 @@ vx_code_output_stream_t * vx_gl_renderer_serialize(vx_gl_renderer_t * rend)
         }
     }
 
-    // Output resources
-    vx_tcp_util_pack_resources(rend->resource_map, couts);
+    // Output resources, with their versions
+    vx_tcp_resc_cache_t * cache = vx_tcp_resc_cache_create();
+    vx_tcp_util_pack_resources_enc(rend->resource_map, 0, cache, couts);
+    vx_tcp_resc_cache_destroy(cache);
 
     return couts;
 }
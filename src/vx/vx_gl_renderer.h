@@ -36,7 +36,29 @@ void vx_gl_renderer_set_layer_render_details(vx_gl_renderer_t *rend, int layerID
 // returns 1 if underlying state has changed, and another render pass is required
 int vx_gl_renderer_changed_since_last_render(vx_gl_renderer_t * rend);
 
+// GL calls made by the last vx_gl_renderer_draw_frame(). Draws which
+// share a program, texture and vertex data are batched together where
+// that doesn't change the image (disable with VX_GL_SORT=0), and state
+// which is already set is not set again
+typedef struct
+{
+    int draw_calls;
+    int program_binds;
+    int buffer_binds;  // buffer binds, uploads and vertex attribute changes
+    int texture_binds; // including uploads of new versions
+    int uniform_sets;
+    int skipped;       // binds and uniform sets avoided
+} vx_gl_renderer_stats_t;
+
+void vx_gl_renderer_get_stats(vx_gl_renderer_t * rend, vx_gl_renderer_stats_t * stats);
+
 // Returns a network-ordered output stream containing buffer codes, and resources.
+// The stream starts with VX_SCENE_MAGIC and VX_SCENE_FORMAT. Scenes saved
+// before these existed start directly with the layer count, and are format 0:
+//   format 0: resources packed with vx_tcp_util_pack_resources (no versions)
+//   format 1: resources packed with vx_tcp_util_pack_resources_enc, unencoded
+#define VX_SCENE_MAGIC  0x7678730a
+#define VX_SCENE_FORMAT 1
 vx_code_output_stream_t * vx_gl_renderer_serialize(vx_gl_renderer_t * rend);
 
 
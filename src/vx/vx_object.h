@@ -19,6 +19,8 @@ struct vx_object
     // Reference counting:
     uint32_t refcnt; // how many places have a reference to this?
     void (*destroy)(vx_object_t * vo); // Destroy this object, and release all resources.
+
+    uint32_t version; // bumped by vx_object_mark_dirty()
 };
 
 // Note: It is illegal to create a cycle of references with vx_objects. Not only will this
@@ -62,6 +64,16 @@ static inline void vx_object_inc_ref(vx_object_t * obj)
     __sync_add_and_fetch(&obj->refcnt, 1);
 }
 
+// Objects can be retained across buffer swaps: hold a reference, and
+// vx_buffer_add_back() the same object again after each swap. A world
+// only serializes such an object again after it has been changed, so
+// call this after modifying a retained object (the one that was added
+// to the buffer, not a child of it).
+static inline void vx_object_mark_dirty(vx_object_t * obj)
+{
+    __sync_add_and_fetch(&obj->version, 1);
+}
+
 #ifdef __cplusplus
 }
 #endif
@@ -9,6 +9,12 @@
 
 #define MAX_SHD_SZ 65355
 
+struct vx_resc_stream
+{
+    uint64_t id;
+    uint32_t version;
+};
+
 // Free memory for this vr, and for the wrapped data:
 static void vx_resc_destroy_managed(vx_resc_t * r)
 {
@@ -111,3 +117,32 @@ vx_resc_t * vx_resc_copydf(double * data, int count)
 }
 
 
+
+vx_resc_stream_t * vx_resc_stream_create()
+{
+    vx_resc_stream_t * stream = calloc(1, sizeof(vx_resc_stream_t));
+    stream->id = vx_util_alloc_id();
+    return stream;
+}
+
+void vx_resc_stream_destroy(vx_resc_stream_t * stream)
+{
+    free(stream);
+}
+
+static vx_resc_t * vx_resc_stream_next(vx_resc_stream_t * stream, vx_resc_t * vr)
+{
+    vr->id = stream->id;
+    vr->version = __sync_add_and_fetch(&stream->version, 1);
+    return vr;
+}
+
+vx_resc_t * vx_resc_stream_copyui(vx_resc_stream_t * stream, uint32_t * data, int count)
+{
+    return vx_resc_stream_next(stream, vx_resc_copyui(data, count));
+}
+
+vx_resc_t * vx_resc_stream_copyub(vx_resc_stream_t * stream, uint8_t * data, int count)
+{
+    return vx_resc_stream_next(stream, vx_resc_copyub(data, count));
+}
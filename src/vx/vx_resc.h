@@ -31,6 +31,7 @@ struct vx_resc {
     uint32_t fieldwidth; // how many bytes per primitive
 
     uint64_t id; // unique id for this resource
+    uint32_t version; // bumped each time a stream replaces the contents of 'id'
 
     // Reference counting:
     uint32_t refcnt; // how many places have a reference to this?
@@ -81,6 +82,22 @@ vx_resc_t * vx_resc_copydf(double * data, int count); // count, not total byte s
 
 vx_resc_t * vx_resc_create_copy(void * data, int count, int fieldwidth, uint64_t id, int type);
 
+// Streaming resources keep the same id while their contents are
+// replaced, e.g. for camera frames. Each copy makes a new, immutable
+// vx_resc_t which shares the stream's id and has the next version, so
+// displays update the existing texture or vertex buffer in place
+// (glTexSubImage2D, glBufferSubData) instead of allocating a new one
+// and freeing the old one.
+//
+// Hold on to (vx_resc_inc_ref) the last copy and reuse it while the
+// contents haven't changed; re-sending the same version costs nothing.
+typedef struct vx_resc_stream vx_resc_stream_t;
+
+vx_resc_stream_t * vx_resc_stream_create();
+void vx_resc_stream_destroy(vx_resc_stream_t * stream);
+vx_resc_t * vx_resc_stream_copyui(vx_resc_stream_t * stream, uint32_t * data, int count);
+vx_resc_t * vx_resc_stream_copyub(vx_resc_stream_t * stream, uint8_t * data, int count);
+
 // Note:  Please do not add any additional vx_resc_XXX_copy() methods which introduce dependencies to new files
 //        (even to varray, e.g.).  Please put these in dngv_util/dngv_vx_util.h or elsewhere.
 //        this is to ensure that the core vx subset can be built on additional platforms (e.g. android)
@@ -15,7 +15,7 @@ struct vx_resc_manager
     // quasi-reference counting system to track how many users there are of
     // each resource
     zhash_t * allLiveSets; // map< int=worldID, map< char*=buffer_name, map<long=guid, vx_resc_t>>>
-    zhash_t * remoteResc; // map <long=guid, vx_resc_t>
+    zhash_t * remoteResc; // map <long=guid, int=version>
 };
 
 
@@ -24,7 +24,7 @@ vx_resc_manager_t * vx_resc_manager_create(vx_display_t * disp)
     vx_resc_manager_t * mgr = calloc(1, sizeof(vx_resc_manager_t));
     mgr->disp = disp;
     mgr->allLiveSets = zhash_create(sizeof(uint32_t), sizeof(zhash_t*), zhash_uint32_hash, zhash_uint32_equals);
-    mgr->remoteResc = zhash_create(sizeof(uint64_t), sizeof(vx_resc_t*), zhash_uint64_hash, zhash_uint64_equals);
+    mgr->remoteResc = zhash_create(sizeof(uint64_t), sizeof(uint32_t), zhash_uint64_hash, zhash_uint64_equals);
 
     return mgr;
 }
@@ -62,27 +62,27 @@ static void removeAll(zhash_t * A, zhash_t  * B)
 }
 
 
-// Add all elements in B to A
-static void addAll(zhash_t * A, zhash_t  * B)
-{
-    zhash_iterator_t itr;
-    zhash_iterator_init(B, &itr);
-    uint64_t id = -1;
-    void * value;
-    while(zhash_iterator_next(&itr, &id, &value)) {
-        if (!zhash_contains(A, &id))
-            zhash_put(A, &id, &value, NULL, NULL);
-    }
-}
-
 // Pass in a list of resources which are new to some world. Increment user counts, and return a map
-// of guids which actually need to be transmitted (i.e. that are new)
+// of guids which actually need to be transmitted (i.e. that are new, or
+// are a newer version of a streaming resource)
 // Caller is responsible for freeing the map
 zhash_t * vx_resc_manager_dedup_resources(vx_resc_manager_t * mgr, zhash_t * resources)
 {
-    zhash_t * transmit = zhash_copy(resources);
-    removeAll(transmit, mgr->remoteResc); // remove existing
-    addAll(mgr->remoteResc, transmit); // update remote, assuming transmission will be successful
+    zhash_t * transmit = zhash_create(sizeof(uint64_t), sizeof(vx_resc_t*), zhash_uint64_hash, zhash_uint64_equals);
+
+    zhash_iterator_t itr;
+    zhash_iterator_init(resources, &itr);
+    uint64_t id = -1;
+    vx_resc_t * vr = NULL;
+    while (zhash_iterator_next(&itr, &id, &vr)) {
+        uint32_t version = 0;
+        if (zhash_get(mgr->remoteResc, &id, &version) && version == vr->version)
+            continue; // already on the remote
+
+        zhash_put(transmit, &id, &vr, NULL, NULL);
+        // update remote, assuming transmission will be successful
+        zhash_put(mgr->remoteResc, &id, &vr->version, NULL, NULL);
+    }
 
     return transmit;
 }
@@ -121,9 +121,9 @@ static void print_manager(vx_resc_manager_t * mgr)
     zhash_iterator_t res_itr;
     zhash_iterator_init(mgr->remoteResc, &res_itr);
     uint64_t vrid = 0;
-    vx_resc_t * vr = NULL;
-    while (zhash_iterator_next(&res_itr, &vrid, &vr)) {
-        printf("%"PRIu64" ", vrid);
+    uint32_t version = 0;
+    while (zhash_iterator_next(&res_itr, &vrid, &version)) {
+        printf("%"PRIu64"v%u ", vrid, version);
     }
     printf("\n");
 }
@@ -1,6 +1,10 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <endian.h>
+#include <sys/uio.h>
 
 #include "vx_tcp_display.h"
 #include "common/ssocket.h"
@@ -19,6 +23,26 @@
 
 static int verbose = 0;
 
+// Bound on the bytes waiting to be sent. When the viewer falls this far
+// behind, the world's serialization thread blocks (and coalesces swaps)
+// until the sender catches up
+#define MAX_QUEUED_BYTES (4 << 20)
+
+typedef struct tcp_msg tcp_msg_t;
+struct tcp_msg
+{
+    uint32_t header[2]; // op type and length, big endian
+    uint8_t * data;
+    int datalen;
+
+    // For OP_BUFFER_CODES, which buffer they draw. A later set of codes
+    // for the same buffer makes these obsolete
+    uint32_t world_id;
+    char * buffer_name;
+
+    tcp_msg_t * next;
+};
+
 typedef struct
 {
     vx_display_t * disp;
@@ -28,17 +52,36 @@ typedef struct
 
     int max_bandwidth_KBs; // < 0 unlimited, [0,...) limited
 
+    // Set once the viewer sends VX_TCP_CAPABILITIES, along with the
+    // VX_TCP_ENC_* bits it can decode. Viewers which never do get the
+    // legacy VX_TCP_ADD_RESOURCES layout, without resource versions
+    int enc_capable;
+    uint32_t encodings;
+    vx_tcp_resc_cache_t * resc_cache;
+
     // Lock whenever processing codes or resources from display
-    // callbacks. Ensures the "mgr" state is consistent with what is
-    // actually transmitted on the wire. Could make the write mutex
-    // unnecessary
+    // callbacks. Ensures the "mgr" state is consistent with the order
+    // messages are queued, and so with what is actually transmitted on
+    // the wire
     pthread_mutex_t state_mutex;
 
     ssocket_t * cxn;
-    pthread_mutex_t write_mutex;
     pthread_mutex_t read_mutex;
     pthread_t read_thread;
 
+    // Outgoing messages, written by send_thread so callers never wait
+    // on the network
+    pthread_mutex_t queue_mutex;
+    pthread_cond_t queue_cond; // signaled when a message is queued
+    pthread_cond_t space_cond; // signaled when a message is sent
+    tcp_msg_t * queue_head;
+    tcp_msg_t * queue_tail;
+    int queued_bytes;
+    int send_stopped;
+    int send_failed; // after an error, messages are discarded
+    uint64_t coalesced; // buffer codes dropped for newer ones
+    pthread_t send_thread;
+
     pthread_mutex_t list_mutex; // XXX Should probably make this a recursive mutex?
     zarray_t * listeners; // <vx_display_listener_t*>
 
@@ -46,39 +89,170 @@ typedef struct
     void * cpriv;
 } tcp_state_t;
 
-static void write_code_data(tcp_state_t * state, int op_type, const uint8_t * data, int datalen)
+static void tcp_msg_destroy(tcp_msg_t * msg)
+{
+    free(msg->data);
+    free(msg->buffer_name);
+    free(msg);
+}
+
+static int is_dealloc(const tcp_msg_t * msg)
+{
+    if (be32toh(msg->header[0]) != VX_TCP_CODES || msg->datalen < 4)
+        return 0;
+
+    const uint8_t * d = msg->data;
+    uint32_t code = ((uint32_t) d[0] << 24) | (d[1] << 16) | (d[2] << 8) | d[3];
+    return code == OP_DEALLOC_RESOURCES;
+}
+
+// Drop the last queued set of codes for the same buffer as msg, if
+// there is one. The resources they used were queued separately, and
+// still go.
+//
+// The new codes go at the tail, so dropping the old ones moves the
+// buffer's next codes behind everything queued since. If that includes
+// a dealloc, the viewer would free resources the buffer is still
+// drawing with before it gets codes that no longer use them, so those
+// codes are kept.
+static void coalesce_codes(tcp_state_t * state, tcp_msg_t * msg)
+{
+    tcp_msg_t * match = NULL, * match_prev = NULL;
+
+    tcp_msg_t * prev = NULL;
+    for (tcp_msg_t * m = state->queue_head; m != NULL; prev = m, m = m->next) {
+        if (match != NULL && is_dealloc(m)) {
+            match = NULL;
+            continue;
+        }
+
+        if (m->buffer_name == NULL || m->world_id != msg->world_id ||
+            strcmp(m->buffer_name, msg->buffer_name))
+            continue;
+
+        match = m;
+        match_prev = prev;
+    }
+
+    if (match == NULL)
+        return;
+
+    if (match_prev == NULL)
+        state->queue_head = match->next;
+    else
+        match_prev->next = match->next;
+    if (state->queue_tail == match)
+        state->queue_tail = match_prev;
+
+    state->queued_bytes -= match->datalen;
+    state->coalesced++;
+    if (verbose) printf("Coalesced codes for world %d buffer %s\n", match->world_id, match->buffer_name);
+    tcp_msg_destroy(match);
+}
+
+// Queue 'data' to be sent as a message of type op_type. Takes ownership
+// of 'data'. Blocks only while the queue is full
+static void write_code_data(tcp_state_t * state, int op_type, uint8_t * data, int datalen,
+                            uint32_t world_id, const char * buffer_name)
 {
     if (verbose) printf("Sending code %d len %d\n",op_type, datalen);
 
-    int fd = ssocket_get_fd(state->cxn);
+    tcp_msg_t * msg = calloc(1, sizeof(tcp_msg_t));
+    msg->header[0] = htobe32(op_type);
+    msg->header[1] = htobe32(datalen);
+    msg->data = data;
+    msg->datalen = datalen;
+    msg->world_id = world_id;
+    if (buffer_name != NULL)
+        msg->buffer_name = strdup(buffer_name);
+
+    pthread_mutex_lock(&state->queue_mutex);
+    while (1) {
+        if (msg->buffer_name != NULL)
+            coalesce_codes(state, msg);
+
+        // an empty queue takes a message of any size
+        if (state->send_stopped || state->queued_bytes == 0 ||
+            state->queued_bytes + datalen <= MAX_QUEUED_BYTES)
+            break;
+        pthread_cond_wait(&state->space_cond, &state->queue_mutex);
+    }
 
-    vx_code_output_stream_t * combined = vx_code_output_stream_create(datalen + 8);
-    combined->write_uint32(combined, op_type);
-    combined->write_uint32(combined, datalen);
-    combined->write_bytes(combined, data, datalen);
+    if (state->send_stopped) {
+        pthread_mutex_unlock(&state->queue_mutex);
+        tcp_msg_destroy(msg);
+        return;
+    }
 
-    pthread_mutex_lock(&state->write_mutex);
-    uint64_t before_mtime = vx_util_mtime();
+    if (state->queue_tail == NULL)
+        state->queue_head = msg;
+    else
+        state->queue_tail->next = msg;
+    state->queue_tail = msg;
+    state->queued_bytes += datalen;
 
-    write_fully(fd, combined->data, combined->pos);
-    uint64_t after_mtime = vx_util_mtime();
+    pthread_cond_signal(&state->queue_cond);
+    pthread_mutex_unlock(&state->queue_mutex);
+}
 
-    if (state->max_bandwidth_KBs >= 0) {
-        // in seconds:
-        double dt = (after_mtime - before_mtime) / 1e3;
-        double desired_dt = (datalen/1e3) / state->max_bandwidth_KBs;
+static void * send_run(void * ptr)
+{
+    tcp_state_t * state = ptr;
 
-        int64_t sleep_us = (int64_t)((desired_dt - dt) * 1e6);
+    while (1) {
+        pthread_mutex_lock(&state->queue_mutex);
+        while (state->queue_head == NULL && !state->send_stopped)
+            pthread_cond_wait(&state->queue_cond, &state->queue_mutex);
+        if (state->send_stopped) {
+            pthread_mutex_unlock(&state->queue_mutex);
+            break;
+        }
+        tcp_msg_t * msg = state->queue_head;
+        state->queue_head = msg->next;
+        if (state->queue_head == NULL)
+            state->queue_tail = NULL;
+        pthread_mutex_unlock(&state->queue_mutex);
+
+        if (!state->send_failed) {
+            struct iovec iov[2] = { { msg->header, sizeof(msg->header) },
+                                    { msg->data, msg->datalen } };
+
+            uint64_t before_mtime = vx_util_mtime();
+            if (writev_fully(ssocket_get_fd(state->cxn), iov, 2) < 0)
+                state->send_failed = 1; // the read thread notices the closed connection
+            uint64_t after_mtime = vx_util_mtime();
+
+            if (state->max_bandwidth_KBs >= 0) {
+                // in seconds:
+                double dt = (after_mtime - before_mtime) / 1e3;
+                double desired_dt = (msg->datalen/1e3) / state->max_bandwidth_KBs;
+
+                int64_t sleep_us = (int64_t)((desired_dt - dt) * 1e6);
+
+                if (verbose > 1) printf("datalen %d dt %f desired_dt %f usleep %ld\n",
+                                        msg->datalen, dt, desired_dt, sleep_us);
+
+                if (sleep_us > 0) // avoid zero, neg sleeps
+                    usleep(sleep_us);
+            }
+        }
 
-        if (verbose > 1) printf("datalen %d dt %f desired_dt %f usleep %ld\n",
-                            datalen, dt, desired_dt, sleep_us);
+        pthread_mutex_lock(&state->queue_mutex);
+        state->queued_bytes -= msg->datalen;
+        pthread_cond_broadcast(&state->space_cond);
+        pthread_mutex_unlock(&state->queue_mutex);
 
-        if (sleep_us > 0) // avoid zero, neg sleeps
-            usleep(sleep_us);
+        tcp_msg_destroy(msg);
     }
-    pthread_mutex_unlock(&state->write_mutex);
 
-    vx_code_output_stream_destroy(combined);
+    pthread_exit(NULL);
+}
+
+static uint8_t * copy_data(const uint8_t * data, int datalen)
+{
+    uint8_t * copy = malloc(datalen);
+    memcpy(copy, data, datalen);
+    return copy;
 }
 
 static void send_codes(vx_display_t * disp, const uint8_t * data, int datalen)
@@ -94,11 +268,19 @@ static void send_codes(vx_display_t * disp, const uint8_t * data, int datalen)
         case OP_BUFFER_RESOURCES:
             vx_resc_manager_buffer_resources(state->mgr, data, datalen);
             break;
-        case OP_BUFFER_CODES:
-        case OP_LAYER_INFO:
+        case OP_BUFFER_CODES: {
+            uint32_t world_id = cins->read_uint32(cins);
+            const char * name = cins->read_str(cins);
+            write_code_data(state, VX_TCP_CODES, copy_data(data, datalen), datalen, world_id, name);
+            break;
+        }
         case OP_DEALLOC_RESOURCES:
+            vx_tcp_resc_cache_dealloc(state->resc_cache, data, datalen);
+            write_code_data(state, VX_TCP_CODES, copy_data(data, datalen), datalen, 0, NULL);
+            break;
+        case OP_LAYER_INFO:
         default:
-            write_code_data((tcp_state_t *)disp->impl, VX_TCP_CODES, data, datalen);
+            write_code_data(state, VX_TCP_CODES, copy_data(data, datalen), datalen, 0, NULL);
     }
     pthread_mutex_unlock(&state->state_mutex);
 
@@ -139,9 +321,17 @@ static void send_resources(vx_display_t * disp, zhash_t * all_resources)
 
     vx_code_output_stream_t * ocodes = vx_code_output_stream_create(256);
 
-    vx_tcp_util_pack_resources(transmit, ocodes);
+    int op_type = VX_TCP_ADD_RESOURCES;
+    if (state->enc_capable) {
+        vx_tcp_util_pack_resources_enc(transmit, state->encodings, state->resc_cache, ocodes);
+        op_type = VX_TCP_ADD_RESOURCES_ENC;
+    } else {
+        vx_tcp_util_pack_resources(transmit, ocodes);
+    }
 
-    write_code_data((tcp_state_t*) disp->impl, VX_TCP_ADD_RESOURCES, ocodes->data, ocodes->pos);
+    // the queued message takes over the stream's buffer
+    write_code_data(state, op_type, ocodes->data, ocodes->pos, 0, NULL);
+    ocodes->data = NULL;
 
     pthread_mutex_unlock(&state->state_mutex);
 
@@ -280,6 +470,21 @@ static void process_camera(tcp_state_t * state, uint8_t * data, int datalen)
     vx_code_input_stream_destroy(cins);
 }
 
+static void process_capabilities(tcp_state_t * state, uint8_t * data, int datalen)
+{
+    assert(datalen == 4);
+    vx_code_input_stream_t * cins = vx_code_input_stream_create(data, datalen);
+    uint32_t encodings = cins->read_uint32(cins);
+    vx_code_input_stream_destroy(cins);
+
+    if (verbose) printf("Viewer supports encodings 0x%x\n", encodings);
+
+    pthread_mutex_lock(&state->state_mutex);
+    state->enc_capable = 1;
+    state->encodings = encodings & (VX_TCP_ENC_C5 | VX_TCP_ENC_DELTA);
+    pthread_mutex_unlock(&state->state_mutex);
+}
+
 static void * read_run(void * ptr)
 {
     assert(sizeof(read_header_t) == 8); // enforce struct alignment the way we expect
@@ -326,6 +531,9 @@ static void * read_run(void * ptr)
             case VX_TCP_CAMERA_CHANGED:
                 process_camera(state, data, header.datalen);
                 break;
+            case VX_TCP_CAPABILITIES:
+                process_capabilities(state, data, header.datalen);
+                break;
 
             default:
                 printf("Uknown TCP code %d 0x%x datalen %d\n",header.code, header.code, header.datalen);
@@ -348,7 +556,24 @@ static void state_destroy(tcp_state_t * state)
     // pthread_cancel(state->read_thread);
     pthread_join(state->read_thread, NULL);
 
-    pthread_mutex_destroy(&state->write_mutex);
+    pthread_mutex_lock(&state->queue_mutex);
+    state->send_stopped = 1;
+    pthread_cond_broadcast(&state->queue_cond);
+    pthread_cond_broadcast(&state->space_cond);
+    pthread_mutex_unlock(&state->queue_mutex);
+    pthread_join(state->send_thread, NULL);
+
+    if (verbose) printf("Coalesced %"PRIu64" sets of buffer codes\n", state->coalesced);
+
+    while (state->queue_head != NULL) {
+        tcp_msg_t * msg = state->queue_head;
+        state->queue_head = msg->next;
+        tcp_msg_destroy(msg);
+    }
+    pthread_mutex_destroy(&state->queue_mutex);
+    pthread_cond_destroy(&state->queue_cond);
+    pthread_cond_destroy(&state->space_cond);
+
     pthread_mutex_destroy(&state->read_mutex);
 
     pthread_mutex_destroy(&state->state_mutex);
@@ -357,6 +582,7 @@ static void state_destroy(tcp_state_t * state)
 
     zarray_destroy(state->listeners);
     vx_resc_manager_destroy(state->mgr);
+    vx_tcp_resc_cache_destroy(state->resc_cache);
 
     printf("Destroy state 0x%p\n",(void*)state);
 
@@ -411,13 +637,17 @@ static tcp_state_t * state_create(ssocket_t * cxn, void (*cxn_closed_callback)(v
 
 
     state->mgr = vx_resc_manager_create(disp);
+    state->resc_cache = vx_tcp_resc_cache_create();
 
     pthread_mutex_init(&state->list_mutex, NULL);
     state->listeners = zarray_create(sizeof(vx_display_listener_t*));
 
-    pthread_mutex_init(&state->write_mutex, NULL);
     pthread_mutex_init(&state->read_mutex, NULL);
 
+    pthread_mutex_init(&state->queue_mutex, NULL);
+    pthread_cond_init(&state->queue_cond, NULL);
+    pthread_cond_init(&state->space_cond, NULL);
+
 
     pthread_mutexattr_t mutexAttr;
     pthread_mutexattr_init(&mutexAttr);
@@ -425,6 +655,7 @@ static tcp_state_t * state_create(ssocket_t * cxn, void (*cxn_closed_callback)(v
 
     pthread_mutex_init(&state->state_mutex, &mutexAttr);
     pthread_create(&state->read_thread,NULL, read_run, state);
+    pthread_create(&state->send_thread, NULL, send_run, state);
 
     return state;
 }
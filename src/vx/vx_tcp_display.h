@@ -7,12 +7,14 @@
 
 // intentionally incompatible with vx_tcp_renderer
 #define VX_TCP_ADD_RESOURCES  0x111
+#define VX_TCP_ADD_RESOURCES_ENC 0x112
 #define VX_TCP_CODES          0x222
 #define VX_TCP_VIEWPORT_SIZE  0x333
 #define VX_TCP_EVENT_KEY      0x444
 #define VX_TCP_EVENT_MOUSE    0x445
 #define VX_TCP_EVENT_TOUCH    0x446
 #define VX_TCP_CAMERA_CHANGED 0x447
+#define VX_TCP_CAPABILITIES   0x448 // VX_TCP_ENC_* bits the viewer can decode
 
 
 #ifdef __cplusplus
@@ -1,12 +1,38 @@
 #include <stdio.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <limits.h>
+
+#include "common/c5.h"
 
 #include "vx_tcp_util.h"
 #include "vx_resc.h"
+#include "vx_codes.h"
 
 static int verbose = 0;
 
+// don't bother compressing resources smaller than this
+#define C5_MIN_BYTES 512
+
+struct vx_tcp_resc_cache
+{
+    zhash_t * prev; // <uint64_t, wire_data_t*>
+};
+
+// a resource's data, as it is laid out on the wire (big endian)
+typedef struct
+{
+    uint32_t version;
+    int len;
+    uint8_t * data; // C5_PAD bytes longer than len
+} wire_data_t;
+
+static void wire_data_destroy(wire_data_t * wd)
+{
+    free(wd->data);
+    free(wd);
+}
+
 // Free memory for this vr, and for the wrapped data:
 static void vx_resc_destroy_managed(vx_resc_t * r)
 {
@@ -14,6 +40,32 @@ static void vx_resc_destroy_managed(vx_resc_t * r)
     free(r);
 }
 
+// Change the endianness of the data in vr from network to host order
+static void resc_to_host(vx_resc_t * vr)
+{
+    uint8_t * res_end =  ((uint8_t*)vr->res) + vr->count*vr->fieldwidth;
+
+    // declare outside switch:
+    uint32_t h_val32 = 0;
+    uint64_t h_val64 = 0;
+    for (uint8_t * res_ptr = vr->res; res_ptr < res_end; res_ptr += vr->fieldwidth) {
+        switch(vr->fieldwidth) {
+            case 4:
+                h_val32 =be32toh(*(uint32_t*)res_ptr);
+                *(uint32_t*)res_ptr = h_val32;
+                break;
+            case 8:
+                h_val64 = be64toh(*(uint64_t*)res_ptr);
+                *(uint64_t*)res_ptr = h_val64;
+                break;
+            case 1:
+                break;
+            default:
+                assert(1); // other sizes not implemented
+        }
+    }
+}
+
 zhash_t * vx_tcp_util_unpack_resources(vx_code_input_stream_t * cins)
 {
     zhash_t * resources = zhash_create(sizeof(uint64_t),sizeof(vx_resc_t*), zhash_uint64_hash, zhash_uint64_equals);
@@ -40,29 +92,7 @@ zhash_t * vx_tcp_util_unpack_resources(vx_code_input_stream_t * cins)
 
         const uint8_t * data =  cins->read_bytes(cins, vr->count*vr->fieldwidth);
         memcpy(vr->res, data, vr->count*vr->fieldwidth);
-
-        // now need to manually change the endianness of the data:
-        uint8_t * res_end =  ((uint8_t*)vr->res) + vr->count*vr->fieldwidth;
-
-        // declare outside switch:
-        uint32_t h_val32 = 0;
-        uint64_t h_val64 = 0;
-        for (uint8_t * res_ptr = vr->res; res_ptr < res_end; res_ptr += vr->fieldwidth) {
-            switch(vr->fieldwidth) {
-                case 4:
-                    h_val32 =be32toh(*(uint32_t*)res_ptr);
-                    *(uint32_t*)res_ptr = h_val32;
-                    break;
-                case 8:
-                    h_val64 = be64toh(*(uint64_t*)res_ptr);
-                    *(uint64_t*)res_ptr = h_val64;
-                    break;
-                case 1:
-                    break;
-                default:
-                    assert(1); // other sizes not implemented
-            }
-        }
+        resc_to_host(vr);
         if (verbose) printf("  done\n");
 
     }
@@ -105,6 +135,268 @@ void vx_tcp_util_pack_resources(zhash_t * resources, vx_code_output_stream_t * c
 }
 
 
+vx_tcp_resc_cache_t * vx_tcp_resc_cache_create()
+{
+    vx_tcp_resc_cache_t * cache = calloc(1, sizeof(vx_tcp_resc_cache_t));
+    cache->prev = zhash_create(sizeof(uint64_t), sizeof(wire_data_t*), zhash_uint64_hash, zhash_uint64_equals);
+    return cache;
+}
+
+void vx_tcp_resc_cache_destroy(vx_tcp_resc_cache_t * cache)
+{
+    zhash_vmap_values(cache->prev, wire_data_destroy);
+    zhash_destroy(cache->prev);
+    free(cache);
+}
+
+void vx_tcp_resc_cache_dealloc(vx_tcp_resc_cache_t * cache, const uint8_t * data, int datalen)
+{
+    vx_code_input_stream_t * cins = vx_code_input_stream_create(data, datalen);
+    if (cins->read_uint32(cins) == OP_DEALLOC_RESOURCES) {
+        int ct = cins->read_uint32(cins);
+        for (int i = 0; i < ct; i++) {
+            uint64_t id = cins->read_uint64(cins);
+            wire_data_t * wd = NULL;
+            if (zhash_remove(cache->prev, &id, NULL, &wd))
+                wire_data_destroy(wd);
+        }
+    }
+    vx_code_input_stream_destroy(cins);
+}
+
+// Remember the wire data for a streamed resource. Takes ownership of 'data'
+static void cache_update(vx_tcp_resc_cache_t * cache, vx_resc_t * vr, uint8_t * data, int len)
+{
+    if (vr->version == 0) {
+        free(data);
+        return;
+    }
+
+    wire_data_t * wd = NULL;
+    if (!zhash_get(cache->prev, &vr->id, &wd)) {
+        wd = calloc(1, sizeof(wire_data_t));
+        zhash_put(cache->prev, &vr->id, &wd, NULL, NULL);
+    } else {
+        free(wd->data);
+    }
+    wd->version = vr->version;
+    wd->len = len;
+    wd->data = data;
+}
+
+// Serialize the data in vr the way vx_tcp_util_pack_resources() would,
+// into a buffer with C5_PAD bytes to spare
+static uint8_t * resc_to_wire(vx_resc_t * vr, int * len)
+{
+    *len = vr->count*vr->fieldwidth;
+    uint8_t * data = calloc(1, *len + C5_PAD);
+
+    uint8_t * res_end =  ((uint8_t*)vr->res) + *len;
+    uint8_t * out = data;
+    for (uint8_t * res_ptr = vr->res; res_ptr < res_end; res_ptr += vr->fieldwidth, out += vr->fieldwidth) {
+        switch(vr->fieldwidth) {
+            case 1:
+                *out = *res_ptr;
+                break;
+            case 4:
+                *(uint32_t*)out = htobe32(*(uint32_t*)res_ptr);
+                break;
+            case 8:
+                *(uint64_t*)out = htobe64(*(uint64_t*)res_ptr);
+                break;
+            default:
+                assert(1); // other sizes not implemented
+        }
+    }
+    return data;
+}
+
+// Free resources which were unpacked, but never handed to a display
+static void resources_destroy(zhash_t * resources)
+{
+    zhash_iterator_t itr;
+    zhash_iterator_init(resources, &itr);
+    uint64_t id = -1;
+    vx_resc_t * vr = NULL;
+    while (zhash_iterator_next(&itr, &id, &vr))
+        vr->destroy(vr);
+    zhash_destroy(resources);
+}
+
+// id, version, type, count, fieldwidth, encoding, base_version, enclen
+#define ENC_HEADER_BYTES (8 + 7*4)
+
+zhash_t * vx_tcp_util_unpack_resources_enc(vx_code_input_stream_t * cins, vx_tcp_resc_cache_t * cache)
+{
+    zhash_t * resources = zhash_create(sizeof(uint64_t),sizeof(vx_resc_t*), zhash_uint64_hash, zhash_uint64_equals);
+
+    if (vx_code_input_stream_available(cins) < 4)
+        goto fail;
+
+    uint32_t ct = cins->read_uint32(cins);
+    for (uint32_t i = 0; i < ct; i++) {
+        if (vx_code_input_stream_available(cins) < ENC_HEADER_BYTES)
+            goto fail;
+
+        uint64_t id = cins->read_uint64(cins);
+        uint32_t version = cins->read_uint32(cins);
+        uint32_t type = cins->read_uint32(cins);
+        uint32_t count = cins->read_uint32(cins);
+        uint32_t fieldwidth = cins->read_uint32(cins);
+        uint32_t encoding = cins->read_uint32(cins);
+        uint32_t base_version = cins->read_uint32(cins);
+        uint32_t enclen = cins->read_uint32(cins);
+
+        if (fieldwidth != 1 && fieldwidth != 4 && fieldwidth != 8) {
+            printf("ERR: resource %"PRIu64" has field width %u\n", id, fieldwidth);
+            goto fail;
+        }
+        if (count > (INT_MAX - C5_PAD) / fieldwidth ||
+            enclen > (uint32_t) vx_code_input_stream_available(cins)) {
+            printf("ERR: resource %"PRIu64" is truncated\n", id);
+            goto fail;
+        }
+
+        const uint8_t * encdata = cins->read_bytes(cins, enclen);
+
+        int len = count*fieldwidth;
+        uint8_t * data = calloc(1, len + C5_PAD);
+
+        if (encoding & VX_TCP_ENC_C5) {
+            int outlen = -1;
+            if (enclen >= 4 && uc5_length(encdata, enclen) == (uint32_t) len) {
+                uint8_t * cdata = calloc(1, enclen + C5_PAD);
+                memcpy(cdata, encdata, enclen);
+                uc5(cdata, enclen, data, &outlen);
+                free(cdata);
+            }
+            if (outlen != len) {
+                printf("ERR: resource %"PRIu64" does not decompress to %d bytes\n", id, len);
+                free(data);
+                goto fail;
+            }
+        } else {
+            if (enclen != (uint32_t) len) {
+                printf("ERR: resource %"PRIu64" has %u bytes, expected %d\n", id, enclen, len);
+                free(data);
+                goto fail;
+            }
+            memcpy(data, encdata, len);
+        }
+
+        if (verbose) printf("  id %"PRIu64" version %u encoding %u: %u -> %d bytes\n",
+                            id, version, encoding, enclen, len);
+
+        if (encoding & VX_TCP_ENC_DELTA) {
+            wire_data_t * wd = NULL;
+            if (zhash_get(cache->prev, &id, &wd) && wd->version == base_version && wd->len == len) {
+                for (int j = 0; j < len; j++)
+                    data[j] ^= wd->data[j];
+            } else {
+                // Without the base, the data is garbage. Skip this
+                // version, and forget the base so later deltas from
+                // it are skipped too
+                printf("WRN: resource %"PRIu64" version %u is a delta from version %u, which wasn't received\n",
+                       id, version, base_version);
+                if (zhash_remove(cache->prev, &id, NULL, &wd))
+                    wire_data_destroy(wd);
+                free(data);
+                continue;
+            }
+        }
+
+        vx_resc_t * vr = calloc(1, sizeof(vx_resc_t));
+        vr->id = id;
+        vr->version = version;
+        vr->type = type;
+        vr->count = count;
+        vr->fieldwidth = fieldwidth;
+        vr->destroy = vx_resc_destroy_managed;
+
+        vr->res = malloc(len);
+        memcpy(vr->res, data, len);
+        resc_to_host(vr);
+        cache_update(cache, vr, data, len);
+
+        vx_resc_t * old = NULL;
+        if (zhash_put(resources, &vr->id, &vr, NULL, &old))
+            old->destroy(old);
+    }
+    return resources;
+
+  fail:
+    resources_destroy(resources);
+    return NULL;
+}
+
+void vx_tcp_util_pack_resources_enc(zhash_t * resources, uint32_t encodings, vx_tcp_resc_cache_t * cache,
+                                    vx_code_output_stream_t * couts)
+{
+    zhash_iterator_t itr;
+    zhash_iterator_init(resources, &itr);
+    uint64_t id = -1;
+    vx_resc_t *vr = NULL;
+
+    couts->write_uint32(couts, zhash_size(resources));
+
+    while(zhash_iterator_next(&itr, &id, &vr)) {
+        couts->write_uint64(couts, vr->id);
+        couts->write_uint32(couts, vr->version);
+        couts->write_uint32(couts, vr->type);
+        couts->write_uint32(couts, vr->count);
+        couts->write_uint32(couts, vr->fieldwidth);
+
+        int len = 0;
+        uint8_t * data = resc_to_wire(vr, &len);
+
+        uint32_t encoding = 0;
+        uint32_t base_version = 0;
+        const uint8_t * enc = data;
+        int enclen = len;
+        uint8_t * cdata = NULL;
+
+        if ((encodings & VX_TCP_ENC_C5) && len >= C5_MIN_BYTES) {
+            // An unchanged region of a streamed resource xors to zeros,
+            // which c5 then collapses. The delta is only worthwhile compressed
+            wire_data_t * wd = NULL;
+            uint8_t * delta = NULL;
+            if ((encodings & VX_TCP_ENC_DELTA) && vr->version > 0 &&
+                zhash_get(cache->prev, &vr->id, &wd) && wd->len == len) {
+                delta = calloc(1, len + C5_PAD);
+                for (int j = 0; j < len; j++)
+                    delta[j] = data[j] ^ wd->data[j];
+            }
+
+            // worst case c5 expansion, as in vx_make_font
+            cdata = malloc(2*len + 1024);
+            int clen = 0;
+            c5(delta != NULL ? delta : data, len, cdata, &clen);
+            if (clen < enclen) {
+                encoding = VX_TCP_ENC_C5;
+                if (delta != NULL) {
+                    encoding |= VX_TCP_ENC_DELTA;
+                    base_version = wd->version;
+                }
+                enc = cdata;
+                enclen = clen;
+            }
+            free(delta);
+        }
+
+        if (verbose) printf("  id %"PRIu64" version %u encoding %u: %d -> %d bytes\n",
+                            vr->id, vr->version, encoding, len, enclen);
+
+        couts->write_uint32(couts, encoding);
+        couts->write_uint32(couts, base_version);
+        couts->write_uint32(couts, enclen);
+        couts->write_bytes(couts, enc, enclen);
+
+        free(cdata);
+        cache_update(cache, vr, data, len);
+    }
+}
+
+
 
 void vx_tcp_util_pack_camera_pos(const vx_camera_pos_t * pos, vx_code_output_stream_t * couts)
 {
@@ -9,9 +9,37 @@
 // collection of functions related to marshaling over TCP stream. Might
 // eventually rename to vx_remote_util
 
+// The VX_TCP_ADD_RESOURCES layout, which has no resource versions.
+// Unpacked resources all have version 0
 zhash_t * vx_tcp_util_unpack_resources(vx_code_input_stream_t * cins);
 void vx_tcp_util_pack_resources(zhash_t * resources, vx_code_output_stream_t * couts);
 
+// Encodings which can be applied to a resource's data. The viewer
+// advertises the ones it supports, and each resource in a
+// VX_TCP_ADD_RESOURCES_ENC message records which were used
+#define VX_TCP_ENC_C5     0x1 // c5 compressed
+#define VX_TCP_ENC_DELTA  0x2 // xor with the previous version of the resource
+
+// Last data sent (or received) for each streamed resource (version > 0),
+// which delta encodings are relative to. Both ends of a connection keep
+// one, and update it identically as resources and deallocs pass through
+typedef struct vx_tcp_resc_cache vx_tcp_resc_cache_t;
+
+vx_tcp_resc_cache_t * vx_tcp_resc_cache_create();
+void vx_tcp_resc_cache_destroy(vx_tcp_resc_cache_t * cache);
+
+// Forget the resources freed by a code, if it is an OP_DEALLOC_RESOURCES.
+// Must be called in the same order the codes are sent
+void vx_tcp_resc_cache_dealloc(vx_tcp_resc_cache_t * cache, const uint8_t * data, int datalen);
+
+// Like the above, but each resource is encoded with the cheapest of the
+// permitted 'encodings'. Updates 'cache'. Unpacking returns NULL if the
+// message is malformed, after which the connection can't be trusted;
+// a delta whose base version is missing is dropped from the result
+zhash_t * vx_tcp_util_unpack_resources_enc(vx_code_input_stream_t * cins, vx_tcp_resc_cache_t * cache);
+void vx_tcp_util_pack_resources_enc(zhash_t * resources, uint32_t encodings, vx_tcp_resc_cache_t * cache,
+                                    vx_code_output_stream_t * couts);
+
 
 void vx_tcp_util_pack_camera_pos(const vx_camera_pos_t * pos, vx_code_output_stream_t * couts);
 
@@ -2,10 +2,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
 #include <inttypes.h>
 #include "vx_world.h"
 
 #include "common/zarray.h"
+#include "common/workerpool.h"
 
 #include "vx_resc.h"
 #include "vx_codes.h"
@@ -23,9 +26,18 @@
 // In the current implementation, there is a single serialization
 // thread, which pauses completely when a new client connects (to
 // serialize all old buffers) before continuing to process new swap()
-// operations.  Theoretically, this could be divided into N+1 threads,
-// with one thread per listener and a centralized thread to codify all
-// the vx objects. However, this makes it more difficult to handle
+// operations. The thread takes all the buffers swapped since its last
+// pass and serializes them concurrently on a worker pool. A buffer is
+// queued at most once, and isn't picked up again until the whole pass
+// has finished, so swaps of each buffer are still sent in order.
+//
+// swap() doesn't take any world-wide lock: the buffer is pushed onto
+// a lock-free stack, unless it is still waiting there from an earlier
+// swap, in which case the new frame simply replaces the pending one.
+//
+// Theoretically, this could be divided into N+1 threads, with one
+// thread per listener and a centralized thread to codify all the vx
+// objects. However, this makes it more difficult to handle
 // back-pressure from a remote listener though, so for now we aren't
 // going to do it that way
 
@@ -39,20 +51,28 @@ struct vx_world
     zarray_t * listeners; // <vx_world_listener_t>
     pthread_mutex_t listener_mutex;
 
-    // notify here when new work is available,
-    // protect access to the queues below:
-    pthread_mutex_t queue_mutex;
-    pthread_cond_t queue_cond;
+    // posted once for each buffer or listener queued below
+    sem_t queue_sem;
 
-    // append a buffer name if it needs to be re-serialized
-    zarray_t * buffer_queue; // < char*>
+    // buffers which need to be re-serialized, most recent first, linked
+    // through vx_buffer.queue_next. Pushed to with a CAS by swap(), and
+    // emptied all at once by the serialization thread
+    vx_buffer_t * swap_stack;
 
     // Append a listener here if all buffers need to be flushed
+    pthread_mutex_t queue_mutex; // protects listener_queue
     zarray_t * listener_queue; // <vx_world_listener_t>
 
+    // see vx_world_stats_t, updated atomically
+    uint64_t swaps;
+    uint64_t coalesced;
+    uint64_t dropped_objs;
+
 
     pthread_t process_thread;
     int process_running;
+
+    workerpool_t * pool; // used by process_thread to serialize buffers
 };
 
 
@@ -69,15 +89,46 @@ struct vx_buffer
 
     pthread_mutex_t mutex; // lock to add objects to back
 
+    // set (with mutex held) while the buffer is on world->swap_stack
+    int queued;
+    vx_buffer_t * queue_next;
+
+    // set while delayed_swap() runs on this buffer. Each pass hands a
+    // buffer to exactly one worker, so finding it set is a bug
+    int serializing;
+
     // cache the list of resources currently in use by this buffer
     // can only be accessed by the serialization thread.
     zhash_t * front_resc; // <guid, vx_resc_t *>
     vx_code_output_stream_t * front_codes;
 
+    // serialized form of each object in front_objs, so objects which are
+    // added again after the swap can be copied instead of re-serialized.
+    // also only accessed by the serialization thread
+    zhash_t * obj_cache; // <vx_object_t *, obj_codes_t *>
+};
+
+// Codes and resources appended by one object
+typedef struct obj_codes obj_codes_t;
+struct obj_codes
+{
+    vx_object_t * obj; // holds a reference
+    uint32_t version; // obj->version when it was serialized
+    uint8_t * codes;
+    int codes_len;
+    zhash_t * resources; // <guid, vx_resc_t *>
 };
 
 static int atomicWorldID = 1; // XXXX need to actually make these atomic
 
+static void obj_codes_destroy(obj_codes_t * oc)
+{
+    vx_object_dec_destroy(oc->obj);
+    free(oc->codes);
+    zhash_destroy(oc->resources);
+    free(oc);
+}
+
 static int verbose = 0;
 
 // Pull swap operations off the stack, and process them.
@@ -87,39 +138,66 @@ static void delayed_swap(vx_buffer_t * buffer);
 static vx_code_output_stream_t * make_buffer_resource_codes(vx_buffer_t * buffer, zhash_t * resources);
 
 
+// Takes all the buffers queued for serialization, in the order they
+// were swapped
+static vx_buffer_t * take_swapped_buffers(vx_world_t * world)
+{
+    vx_buffer_t * stack = __sync_lock_test_and_set(&world->swap_stack, NULL);
+
+    vx_buffer_t * fifo = NULL;
+    while (stack != NULL) {
+        vx_buffer_t * next = stack->queue_next;
+        stack->queue_next = fifo;
+        fifo = stack;
+        stack = next;
+    }
+    return fifo;
+}
+
+static void delayed_swap_task(void * p)
+{
+    delayed_swap(p);
+}
+
+// Threads serializing a world's buffers: VX_WORLD_THREADS if set, else
+// one per cpu, up to 4
+static int serialization_threads()
+{
+    const char * env = getenv("VX_WORLD_THREADS");
+    if (env != NULL && atoi(env) > 0)
+        return atoi(env);
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu < 1)
+        return 1;
+    return ncpu < 4 ? ncpu : 4;
+}
+
 static void * run_process(void * data)
 {
     vx_world_t * world = data;
 
 
     while (world->process_running) {
-        vx_world_listener_t * listener = NULL;
-        char * buffer_name = NULL;
-
         // 1) Wait until there's data
-        pthread_mutex_lock(&world->queue_mutex);
-        while (zarray_size(world->buffer_queue) == 0 && zarray_size(world->listener_queue) == 0 && world->process_running) {
-            pthread_cond_wait(&world->queue_cond, &world->queue_mutex);
-        }
+        sem_wait(&world->queue_sem);
 
-        if (!world->process_running) { // XXX cleaning out the queue?
-            pthread_mutex_unlock(&world->queue_mutex);
+        if (!world->process_running) // XXX cleaning out the queue?
             break;
-        }
 
-        // Processing new listeners takes priority
-        if ( zarray_size(world->listener_queue) > 0) {
-            zarray_get(world->listener_queue, 0, &listener);
-            zarray_remove_index(world->listener_queue, 0, 0);
-        } else {
-            assert(zarray_size(world->buffer_queue) > 0);
-            zarray_get(world->buffer_queue, 0, &buffer_name);
-            zarray_remove_index(world->buffer_queue, 0, 0);
-        }
-        pthread_mutex_unlock(&world->queue_mutex);
+        // Operation A: New listeners, which take priority
+        while (1) {
+            vx_world_listener_t * listener = NULL;
+            pthread_mutex_lock(&world->queue_mutex);
+            if (zarray_size(world->listener_queue) > 0) {
+                zarray_get(world->listener_queue, 0, &listener);
+                zarray_remove_index(world->listener_queue, 0, 0);
+            }
+            pthread_mutex_unlock(&world->queue_mutex);
+
+            if (listener == NULL)
+                break;
 
-        // Operation A: New listener
-        if (listener != NULL) {
             // re-transmit each buffer that has already been serialized
             pthread_mutex_lock(&world->buffer_mutex);
             zhash_iterator_t itr;
@@ -144,16 +222,19 @@ static void * run_process(void * data)
             pthread_mutex_unlock(&world->buffer_mutex);
         }
 
-        // Operation B: buffer swap
-        if (buffer_name != NULL) {
-            vx_buffer_t * buffer = NULL;
-            pthread_mutex_lock(&world->buffer_mutex);
-            zhash_get(world->buffer_map, &buffer_name, &buffer);
-            pthread_mutex_unlock(&world->buffer_mutex);
-
+        // Operation B: buffer swaps. A buffer may be queued again as
+        // soon as delayed_swap() takes its pending objects, so read
+        // the links before any of them runs
+        vx_buffer_t * buffer = take_swapped_buffers(world);
+        if (buffer != NULL && buffer->queue_next == NULL) {
             delayed_swap(buffer);
+        } else if (buffer != NULL) {
+            while (buffer != NULL) {
+                workerpool_add_task(world->pool, delayed_swap_task, buffer);
+                buffer = buffer->queue_next;
+            }
+            workerpool_run(world->pool);
         }
-
     }
 
     pthread_exit(NULL);
@@ -168,11 +249,14 @@ vx_world_t * vx_world_create()
     pthread_mutex_init(&world->buffer_mutex, NULL);
     pthread_mutex_init(&world->listener_mutex, NULL);
 
-    pthread_mutex_init(&world->queue_mutex, NULL);
-    pthread_cond_init(&world->queue_cond, NULL);
+    sem_init(&world->queue_sem, 0, 0);
+    world->swap_stack = NULL;
+    world->swaps = world->coalesced = world->dropped_objs = 0;
 
+    pthread_mutex_init(&world->queue_mutex, NULL);
     world->listener_queue = zarray_create(sizeof(vx_world_listener_t*));
-    world->buffer_queue = zarray_create(sizeof(char*));
+
+    world->pool = workerpool_create(serialization_threads());
 
     world->process_running = 1;
     pthread_create(&world->process_thread, NULL, run_process, world);
@@ -200,6 +284,9 @@ static void vx_world_buffer_destroy(vx_buffer_t * buffer)
 
     vx_code_output_stream_destroy(buffer->front_codes);
 
+    zhash_vmap_values(buffer->obj_cache, obj_codes_destroy);
+    zhash_destroy(buffer->obj_cache);
+
     pthread_mutex_destroy(&buffer->mutex);
     free(buffer);
 
@@ -208,6 +295,14 @@ static void vx_world_buffer_destroy(vx_buffer_t * buffer)
 
 void vx_world_destroy(vx_world_t * world)
 {
+    // Tell the processing thread to quit, before the buffers it may
+    // be serializing are destroyed
+    world->process_running = 0;
+    sem_post(&world->queue_sem);
+
+    pthread_join(world->process_thread, NULL);
+    workerpool_destroy(world->pool);
+
     zhash_vmap_values(world->buffer_map, vx_world_buffer_destroy); // keys are stored in buffer struct
     zhash_destroy(world->buffer_map);
     assert(zarray_size(world->listeners) == 0 && "Destroy layers referencing worlds before worlds"); // we can't release these resources properly
@@ -216,25 +311,23 @@ void vx_world_destroy(vx_world_t * world)
     pthread_mutex_destroy(&world->buffer_mutex);
     pthread_mutex_destroy(&world->listener_mutex);
 
-    // Tell the processing thread to quit
-    world->process_running = 0;
-    pthread_mutex_lock(&world->queue_mutex);
-    pthread_cond_signal(&world->queue_cond);
-    pthread_mutex_unlock(&world->queue_mutex);
-
-    pthread_join(world->process_thread, NULL);
-
     pthread_mutex_destroy(&world->queue_mutex);
-    pthread_cond_destroy(&world->queue_cond);
+    sem_destroy(&world->queue_sem);
 
     // These are pointers to data stored elsewhere, just delete the
     // data structure
     zarray_destroy(world->listener_queue);
-    zarray_destroy(world->buffer_queue);
 
     free(world);
 }
 
+void vx_world_get_stats(vx_world_t * world, vx_world_stats_t * stats)
+{
+    stats->swaps = __sync_add_and_fetch(&world->swaps, 0);
+    stats->coalesced = __sync_add_and_fetch(&world->coalesced, 0);
+    stats->dropped_objs = __sync_add_and_fetch(&world->dropped_objs, 0);
+}
+
 int vx_world_get_id(vx_world_t * world)
 {
     // Don't need to sync
@@ -286,6 +379,7 @@ vx_buffer_t * vx_world_get_buffer(vx_world_t * world, const char * name)
 
         buffer->front_resc = zhash_create(sizeof(uint64_t), sizeof(vx_resc_t*), zhash_uint64_hash, zhash_uint64_equals);
         buffer->front_codes = vx_code_output_stream_create(128);
+        buffer->obj_cache = zhash_create(sizeof(vx_object_t*), sizeof(obj_codes_t*), zhash_ptr_hash, zhash_ptr_equals);
 
         pthread_mutex_init(&buffer->mutex, NULL);
 
@@ -333,9 +427,9 @@ void vx_world_add_listener(vx_world_t * world, vx_world_listener_t * listener)
     pthread_mutex_lock(&world->queue_mutex);
     {
         zarray_add(world->listener_queue, &listener);
-        pthread_cond_signal(&world->queue_cond);
     }
     pthread_mutex_unlock(&world->queue_mutex);
+    sem_post(&world->queue_sem);
 
 }
 
@@ -412,6 +506,9 @@ static void addAll(zhash_t * A, zhash_t  * B)
 // Do a quick swap:
 void vx_buffer_swap(vx_buffer_t * buffer)
 {
+    vx_world_t * world = buffer->world;
+    int enqueue = 0;
+
     pthread_mutex_lock(&buffer->mutex);
     {
         // It's possible that the serialization is running behind,
@@ -419,6 +516,8 @@ void vx_buffer_swap(vx_buffer_t * buffer)
         // In that case, they are discarded here, momentarily blocking
         // the calling thread.
         if (zarray_size(buffer->pending_objs) > 0) {
+            __sync_add_and_fetch(&world->dropped_objs, zarray_size(buffer->pending_objs));
+
             // *+*+ corresponding decrement (if falling behind)
             zarray_vmap(buffer->pending_objs, vx_object_dec_destroy);
             zarray_clear(buffer->pending_objs);
@@ -433,31 +532,32 @@ void vx_buffer_swap(vx_buffer_t * buffer)
         zarray_t * tmp = buffer->pending_objs;
         buffer->pending_objs = buffer->back_objs;
         buffer->back_objs = tmp;
+
+        // If the buffer is still queued, the serialization thread will
+        // pick up the frame we just swapped in. delayed_swap() clears
+        // the flag with this mutex held, when it takes pending_objs
+        if (!buffer->queued) {
+            buffer->queued = 1;
+            enqueue = 1;
+        }
     }
     pthread_mutex_unlock(&buffer->mutex);
 
-    // Now flag a swap on the serialization thread
-    pthread_mutex_lock(&buffer->world->queue_mutex);
-    {
-        // Ensure that the string is already in the queue, or add it if
-        // it isn't. Duplicates are prohibited
-        int index = -1;
-        for (int i = 0, sz = zarray_size(buffer->world->buffer_queue); i < sz; i++) {
-            char * test = NULL;
-            zarray_get(buffer->world->buffer_queue, i, &test);
-
-            if (strcmp(test, buffer->name) == 0) {
-                index = i;
-                break;
-            }
-        }
-        if (index < 0) {
-            zarray_add(buffer->world->buffer_queue, &buffer->name);
-            pthread_cond_signal(&buffer->world->queue_cond);
-        }
+    __sync_add_and_fetch(&world->swaps, 1);
+
+    if (!enqueue) {
+        __sync_add_and_fetch(&world->coalesced, 1);
+        return;
     }
-    pthread_mutex_unlock(&buffer->world->queue_mutex);
 
+    // Now flag a swap on the serialization thread
+    vx_buffer_t * head;
+    do {
+        head = world->swap_stack;
+        buffer->queue_next = head;
+    } while (!__sync_bool_compare_and_swap(&world->swap_stack, head, buffer));
+
+    sem_post(&world->queue_sem);
 }
 
 static void _print_id(vx_resc_t * vr)
@@ -473,6 +573,10 @@ static void delayed_swap(vx_buffer_t * buffer)
         return; // buffer has not yet finished initialization
     if (verbose) printf("DBG: swap %s\n", buffer->name);
 
+    int busy = __sync_lock_test_and_set(&buffer->serializing, 1);
+    assert(!busy && "buffer serialized twice at once");
+    (void) busy;
+
     pthread_mutex_lock(&buffer->mutex);
     {
         // clear existing front
@@ -487,6 +591,9 @@ static void delayed_swap(vx_buffer_t * buffer)
         zarray_t * tmp = buffer->front_objs;
         buffer->front_objs = buffer->pending_objs;
         buffer->pending_objs = tmp; // empty
+
+        // any later swap has to be queued again
+        buffer->queued = 0;
     }
     pthread_mutex_unlock(&buffer->mutex);
 
@@ -503,12 +610,53 @@ static void delayed_swap(vx_buffer_t * buffer)
 
     zhash_t * resources = zhash_create(sizeof(uint64_t),sizeof(vx_resc_t*), zhash_uint64_hash, zhash_uint64_equals);
 
+    // Objects which were already in the last frame, and haven't been
+    // marked dirty since, are copied from the cache
+    zhash_t * old_cache = buffer->obj_cache;
+    zhash_t * obj_cache = zhash_create(sizeof(vx_object_t*), sizeof(obj_codes_t*), zhash_ptr_hash, zhash_ptr_equals);
+    int reused = 0;
+
     for (int i = 0; i < zarray_size(buffer->front_objs); i++) {
         vx_object_t * obj = NULL;
         zarray_get(buffer->front_objs, i, &obj);
-        obj->append(obj, resources, codes);
+
+        obj_codes_t * oc = NULL;
+        if (!zhash_get(obj_cache, &obj, &oc))
+            zhash_remove(old_cache, &obj, NULL, &oc);
+
+        if (oc != NULL && oc->version != obj->version) {
+            zhash_remove(obj_cache, &obj, NULL, NULL);
+            obj_codes_destroy(oc);
+            oc = NULL;
+        }
+
+        if (oc != NULL) {
+            codes->write_bytes(codes, oc->codes, oc->codes_len);
+            reused++;
+        } else {
+            oc = calloc(1, sizeof(obj_codes_t));
+            oc->obj = obj;
+            vx_object_inc_ref(obj);
+            oc->version = obj->version; // read before append, so a concurrent change isn't lost
+            oc->resources = zhash_create(sizeof(uint64_t),sizeof(vx_resc_t*), zhash_uint64_hash, zhash_uint64_equals);
+
+            int start = codes->pos;
+            obj->append(obj, oc->resources, codes);
+            oc->codes_len = codes->pos - start;
+            oc->codes = malloc(oc->codes_len);
+            memcpy(oc->codes, codes->data + start, oc->codes_len);
+        }
+
+        zhash_put(obj_cache, &obj, &oc, NULL, NULL);
+        addAll(resources, oc->resources);
     }
 
+    zhash_vmap_values(old_cache, obj_codes_destroy);
+    zhash_destroy(old_cache);
+    buffer->obj_cache = obj_cache;
+
+    if (verbose) printf("DBG: %d of %d objects reused\n", reused, zarray_size(buffer->front_objs));
+
     // *&&* we will hold on to these until next swap() call
     zhash_vmap_values(resources, vx_resc_inc_ref);
 
@@ -557,4 +705,5 @@ static void delayed_swap(vx_buffer_t * buffer)
     zhash_vmap_values(old_resources, vx_resc_dec_destroy);
     zhash_destroy(old_resources);
 
+    __sync_lock_release(&buffer->serializing);
 }
@@ -48,6 +48,17 @@ void vx_buffer_set_draw_order(vx_buffer_t*, int draw_order);
 void vx_buffer_add_back(vx_buffer_t * buffer, vx_object_t * obj);
 void vx_buffer_swap(vx_buffer_t * buffer);
 
+// Counters since the world was created
+typedef struct vx_world_stats vx_world_stats_t;
+struct vx_world_stats
+{
+    uint64_t swaps; // vx_buffer_swap() calls
+    uint64_t coalesced; // swaps made while the buffer still waited to be serialized
+    uint64_t dropped_objs; // objects discarded because of those swaps
+};
+
+void vx_world_get_stats(vx_world_t * world, vx_world_stats_t * stats);
+
 #ifdef __cplusplus
 }
 #endif
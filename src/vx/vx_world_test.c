@@ -0,0 +1,289 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "common/timestamp.h"
+#include "vx_world.h"
+#include "vx_resc.h"
+#include "vx_codes.h"
+#include "vx_code_input_stream.h"
+
+// Stress test for vx_world's buffer swaps: several threads swap many
+// buffers as fast as they can, while the world serializes them on its
+// worker pool. A listener checks what comes out, per buffer:
+//
+//  - every swap sends the three messages in order: the claim of the
+//    old and new resources, the render codes, then the reduced claim;
+//  - frames arrive in the order they were swapped (frames may be
+//    skipped when the world coalesces swaps, never repeated);
+//  - every resource the codes use was claimed first;
+//  - the last frame of every buffer eventually arrives.
+//
+// Each frame holds a new object and one retained object, so both the
+// serialize and the cached-codes paths run.
+//
+// usage: vx_world_test [nbuffers [nswaps [nthreads]]]
+
+#define TEST_MARKER 0x5eed
+#define MAX_CLAIMED 16
+
+typedef struct test_obj test_obj_t;
+struct test_obj
+{
+    uint32_t frame;
+    vx_resc_t * resc; // holds a reference
+};
+
+typedef struct buffer_state buffer_state_t;
+struct buffer_state
+{
+    int phase; // next message expected: 0 claim, 1 codes, 2 reduced claim
+    int64_t last_frame;
+
+    uint64_t claimed[MAX_CLAIMED];
+    int nclaimed;
+};
+
+static int nbuffers = 16, nswaps = 20000, nthreads = 8;
+
+static buffer_state_t * states;
+static pthread_mutex_t states_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int errors;
+
+static vx_world_t * world;
+
+static void error(int b, const char * msg, int64_t frame)
+{
+    if (errors++ < 10)
+        printf("buffer %d: %s (frame %" PRId64 ")\n", b, msg, frame);
+}
+
+static void test_obj_append(vx_object_t * obj, zhash_t * resources, vx_code_output_stream_t * codes)
+{
+    test_obj_t * to = obj->impl;
+
+    codes->write_uint32(codes, TEST_MARKER);
+    codes->write_uint32(codes, to->frame);
+    codes->write_uint64(codes, to->resc->id);
+
+    zhash_put(resources, &to->resc->id, &to->resc, NULL, NULL);
+}
+
+static void test_obj_destroy(vx_object_t * obj)
+{
+    test_obj_t * to = obj->impl;
+
+    vx_resc_dec_destroy(to->resc);
+    free(to);
+    free(obj);
+}
+
+static vx_object_t * test_obj_create(uint32_t frame)
+{
+    test_obj_t * to = calloc(1, sizeof(test_obj_t));
+    to->frame = frame;
+    to->resc = vx_resc_copyui(&frame, 1);
+    vx_resc_inc_ref(to->resc);
+
+    vx_object_t * obj = calloc(1, sizeof(vx_object_t));
+    obj->append = test_obj_append;
+    obj->destroy = test_obj_destroy;
+    obj->impl = to;
+    return obj;
+}
+
+static int buffer_index(const char * name)
+{
+    int b = -1;
+    if (sscanf(name, "buffer%d", &b) != 1 || b < 0 || b >= nbuffers)
+        return -1;
+    return b;
+}
+
+static int is_claimed(buffer_state_t * state, uint64_t id)
+{
+    for (int i = 0; i < state->nclaimed; i++)
+        if (state->claimed[i] == id)
+            return 1;
+    return 0;
+}
+
+static void check_codes(buffer_state_t * state, int b, vx_code_input_stream_t * cins)
+{
+    int64_t frame = -1;
+
+    while (vx_code_input_stream_available(cins) > 0) {
+        if (cins->read_uint32(cins) != TEST_MARKER) {
+            error(b, "corrupt codes", state->last_frame);
+            return;
+        }
+
+        uint32_t f = cins->read_uint32(cins);
+        uint64_t id = cins->read_uint64(cins);
+
+        if (!is_claimed(state, id))
+            error(b, "resource used before it was claimed", f);
+
+        // the retained object has frame 0
+        if (f > 0)
+            frame = f;
+    }
+
+    if (frame <= state->last_frame)
+        error(b, "frame out of order", frame);
+    state->last_frame = frame;
+}
+
+static void listener_send_codes(vx_world_listener_t * listener, const uint8_t * data, int datalen)
+{
+    vx_code_input_stream_t * cins = vx_code_input_stream_create(data, datalen);
+
+    uint32_t op = cins->read_uint32(cins);
+    cins->read_uint32(cins); // world
+    int b = buffer_index(cins->read_str(cins));
+
+    pthread_mutex_lock(&states_mutex);
+
+    if (b < 0) {
+        error(b, "unknown buffer", -1);
+    } else if (op == OP_BUFFER_RESOURCES) {
+        buffer_state_t * state = &states[b];
+
+        if (state->phase == 1)
+            error(b, "claim instead of codes", state->last_frame);
+
+        int count = cins->read_uint32(cins);
+        if (count > MAX_CLAIMED) {
+            error(b, "too many resources claimed", state->last_frame);
+            count = MAX_CLAIMED;
+        }
+
+        state->nclaimed = count;
+        for (int i = 0; i < count; i++)
+            state->claimed[i] = cins->read_uint64(cins);
+
+        state->phase = (state->phase + 1) % 3;
+    } else if (op == OP_BUFFER_CODES) {
+        buffer_state_t * state = &states[b];
+
+        if (state->phase != 1)
+            error(b, "codes without a claim", state->last_frame);
+
+        cins->read_uint32(cins); // draw order
+        check_codes(state, b, cins);
+
+        state->phase = 2;
+    }
+
+    pthread_mutex_unlock(&states_mutex);
+
+    vx_code_input_stream_destroy(cins);
+}
+
+static void listener_send_resources(vx_world_listener_t * listener, zhash_t * resources)
+{
+}
+
+static void * swap_thread(void * arg)
+{
+    int t = (int) (intptr_t) arg;
+
+    vx_buffer_t ** buffers = calloc(nbuffers, sizeof(vx_buffer_t *));
+    vx_object_t ** retained = calloc(nbuffers, sizeof(vx_object_t *));
+
+    for (int b = t; b < nbuffers; b += nthreads) {
+        char name[32];
+        snprintf(name, sizeof(name), "buffer%d", b);
+        buffers[b] = vx_world_get_buffer(world, name);
+
+        retained[b] = test_obj_create(0);
+        vx_object_inc_ref(retained[b]);
+    }
+
+    unsigned int seed = t;
+
+    for (int f = 1; f <= nswaps; f++) {
+        for (int b = t; b < nbuffers; b += nthreads) {
+            vx_buffer_add_back(buffers[b], retained[b]);
+            vx_buffer_add_back(buffers[b], test_obj_create(f));
+            vx_buffer_swap(buffers[b]);
+        }
+
+        // pause now and then, so that the world's passes pick up
+        // varying numbers of buffers instead of coalescing everything
+        if (rand_r(&seed) % 4 == 0)
+            usleep(rand_r(&seed) % 200);
+    }
+
+    for (int b = t; b < nbuffers; b += nthreads)
+        vx_object_dec_destroy(retained[b]);
+
+    free(buffers);
+    free(retained);
+    return NULL;
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc > 1)
+        nbuffers = atoi(argv[1]);
+    if (argc > 2)
+        nswaps = atoi(argv[2]);
+    if (argc > 3)
+        nthreads = atoi(argv[3]);
+
+    // make sure the world serializes on a pool, even on one cpu
+    setenv("VX_WORLD_THREADS", "4", 0);
+
+    states = calloc(nbuffers, sizeof(buffer_state_t));
+
+    world = vx_world_create();
+
+    vx_world_listener_t listener = {
+        .impl = NULL,
+        .send_codes = listener_send_codes,
+        .send_resources = listener_send_resources,
+    };
+    vx_world_add_listener(world, &listener);
+
+    pthread_t threads[nthreads];
+    for (int t = 0; t < nthreads; t++)
+        pthread_create(&threads[t], NULL, swap_thread, (void *) (intptr_t) t);
+    for (int t = 0; t < nthreads; t++)
+        pthread_join(threads[t], NULL);
+
+    // wait for the last frame of every buffer
+    int64_t deadline = utime_now() + 30 * 1000000;
+    int pending = nbuffers;
+    while (pending > 0 && utime_now() < deadline) {
+        pending = 0;
+        pthread_mutex_lock(&states_mutex);
+        for (int b = 0; b < nbuffers; b++)
+            if (states[b].last_frame != nswaps || states[b].phase != 0)
+                pending++;
+        pthread_mutex_unlock(&states_mutex);
+
+        if (pending > 0)
+            usleep(1000);
+    }
+
+    if (pending > 0) {
+        printf("%d buffers never sent their last frame\n", pending);
+        errors++;
+    }
+
+    vx_world_stats_t stats;
+    vx_world_get_stats(world, &stats);
+    printf("%" PRIu64 " swaps, %" PRIu64 " coalesced\n", stats.swaps, stats.coalesced);
+
+    vx_world_remove_listener(world, &listener);
+    vx_world_destroy(world);
+    free(states);
+
+    printf("vx_world: %s\n", errors ? "FAILED" : "ok");
+    return errors != 0;
+}
@@ -7,6 +7,7 @@
 #include "vxo_mat.h"
 #include "vxo_depth_test.h"
 #include "vxo_pix_coords.h"
+#include "vxo_instances.h"
 
 #include "vxo_lines.h"
 #include "vxo_points.h"
@@ -0,0 +1,73 @@
+#include "vxo_instances.h"
+#include "vx_codes.h"
+#include <stdlib.h>
+
+// Like vxo_depth_test, the instancing state wraps the codes of obj
+
+typedef struct vxo_instances vxo_instances_t;
+struct vxo_instances
+{
+    vx_object_t * super;
+    int count;
+    vx_resc_t * transforms;
+    vx_resc_t * colors; // may be NULL
+    vx_object_t * obj;
+};
+
+static void vxo_instances_append(vx_object_t * obj, zhash_t * resources, vx_code_output_stream_t * codes)
+{
+    vxo_instances_t * vinst = obj->impl;
+
+    codes->write_uint32(codes, OP_INSTANCES_PUSH);
+    codes->write_uint32(codes, vinst->count);
+    codes->write_uint64(codes, vinst->transforms->id);
+    codes->write_uint64(codes, vinst->colors != NULL ? vinst->colors->id : 0);
+
+    zhash_put(resources, &vinst->transforms->id, &vinst->transforms, NULL, NULL);
+    if (vinst->colors != NULL)
+        zhash_put(resources, &vinst->colors->id, &vinst->colors, NULL, NULL);
+
+    // recurse
+    vinst->obj->append(vinst->obj, resources, codes);
+
+    codes->write_uint32(codes, OP_INSTANCES_POP);
+}
+
+static void vxo_instances_destroy(vx_object_t * vo)
+{
+    vxo_instances_t * vinst = vo->impl;
+
+    vx_object_dec_destroy(vinst->obj);
+    vx_resc_dec_destroy(vinst->transforms);
+    if (vinst->colors != NULL)
+        vx_resc_dec_destroy(vinst->colors);
+
+    free(vo);
+    free(vinst);
+}
+
+vx_object_t * vxo_instances(vx_object_t * obj, int count, vx_resc_t * transforms,
+                            vx_resc_t * colors)
+{
+    assert(transforms->type == GL_FLOAT && transforms->count >= 16*count);
+    assert(colors == NULL || (colors->type == GL_FLOAT && colors->count >= 4*count));
+
+    vxo_instances_t * vinst = calloc(1, sizeof(vxo_instances_t));
+    vinst->super = calloc(1, sizeof(vx_object_t));
+    vinst->super->impl = vinst;
+    vinst->super->destroy = vxo_instances_destroy;
+    vinst->super->append = vxo_instances_append;
+
+    // data
+    vinst->count = count;
+    vinst->transforms = transforms;
+    vinst->colors = colors;
+    vinst->obj = obj;
+
+    vx_object_inc_ref(vinst->obj);
+    vx_resc_inc_ref(vinst->transforms);
+    if (vinst->colors != NULL)
+        vx_resc_inc_ref(vinst->colors);
+
+    return vinst->super;
+}
@@ -0,0 +1,31 @@
+#ifndef VXO_INSTANCES_H
+#define VXO_INSTANCES_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "vx_object.h"
+#include "vx_resc.h"
+
+// Draw 'count' copies of 'obj' (e.g. a vxo_box), with one draw call for
+// each of its programs instead of one per copy.
+//
+// transforms: 16*count floats, a row-major 4x4 matrix per instance. Each
+//     is applied in place of the vxo_instances, i.e. the model matrix of
+//     instance i is model*transforms[i]*(obj's own matrices)
+// colors: 4*count floats (rgba) replacing the colors of obj's styles
+//     for each instance, or NULL to use obj's colors
+//
+// Supported by the points, lines and mesh styles, except
+// vxo_mesh_style_fancy() and textured objects. Lighting assumes the
+// transforms are rigid, up to a uniform scale. vxo_instances may not be
+// nested.
+vx_object_t * vxo_instances(vx_object_t * obj, int count, vx_resc_t * transforms,
+                            vx_resc_t * colors);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif